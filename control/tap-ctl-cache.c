@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+int
+tap_ctl_set_cache(pid_t pid, int minor, unsigned int bitmap_cache_mb)
+{
+	tapdisk_message_t message;
+	int err;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_SET_CACHE;
+	message.cookie = minor;
+	message.u.cache.bitmap_cache_mb = bitmap_cache_mb;
+
+	err = tap_ctl_connect_send_and_receive(pid, &message, NULL);
+	if (err)
+		return err;
+
+	if (message.type == TAPDISK_MESSAGE_SET_CACHE_RSP)
+		err = 0;
+	else if (message.type == TAPDISK_MESSAGE_ERROR)
+		err = -message.u.response.error;
+	else
+		err = -EINVAL;
+
+	if (err)
+		EPRINTF("failed to set the cache of %d: %s\n", minor,
+			strerror(-err));
+
+	return err;
+}
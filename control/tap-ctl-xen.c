@@ -38,10 +38,11 @@
 #include "compiler.h"
 
 int
-tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid, int poll_duration,
-		int poll_idle_threshold,
+tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
+		int queue, int nr_queues, int poll_duration, int poll_idle_threshold,
 		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
-		int proto, const char *pool, const int minor)
+		int proto, int persistent, int max_indirect_segments,
+		const char *pool, const int minor)
 {
     tapdisk_message_t message;
     int i, err;
@@ -52,6 +53,8 @@ tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
 
     message.u.blkif.domid = domid;
     message.u.blkif.devid = devid;
+    message.u.blkif.queue = queue;
+    message.u.blkif.nr_queues = nr_queues;
     for (i = 0; i < 1 << order; i++)
         message.u.blkif.gref[i] = grefs[i];
     message.u.blkif.order = order;
@@ -59,6 +62,8 @@ tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
     message.u.blkif.proto = proto;
     message.u.blkif.poll_duration = poll_duration;
     message.u.blkif.poll_idle_threshold = poll_idle_threshold;
+    message.u.blkif.persistent = persistent;
+    message.u.blkif.max_indirect_segments = max_indirect_segments;
     if (pool)
         strncpy(message.u.blkif.pool, pool, sizeof(message.u.blkif.pool));
     else
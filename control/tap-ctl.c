@@ -859,6 +859,55 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_cache_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cache <-p pid> <-m minor> <-b bitmap cache MB>\n"
+			"\n"
+			"Sets the memory the VBD's images share for cached VHD "
+			"bitmaps\n");
+}
+
+static int
+tap_cli_cache(int argc, char **argv)
+{
+	pid_t pid;
+	int c, minor, bitmap_mb;
+
+	pid       = -1;
+	minor     = -1;
+	bitmap_mb = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:b:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'b':
+			bitmap_mb = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cache_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || bitmap_mb < 0)
+		goto usage;
+
+	return tap_ctl_set_cache(pid, minor, bitmap_mb);
+
+usage:
+	tap_cli_cache_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_check_usage(FILE *stream)
 {
@@ -899,6 +948,7 @@ struct command commands[] = {
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "stats",        .func = tap_cli_stats         },
+	{ .name = "cache",        .func = tap_cli_cache         },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
 };
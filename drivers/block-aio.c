@@ -142,6 +142,7 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
         prv->fd = fd;
+	td_register_fd(driver, fd);
 
 done:
 	return ret;	
@@ -216,6 +217,7 @@ int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	td_unregister_fd(driver, prv->fd);
 	close(prv->fd);
 
 	return 0;
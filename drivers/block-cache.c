@@ -31,6 +31,7 @@
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 #include "timeout-math.h"
+#include "tapdisk-slab.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -126,6 +127,10 @@ struct block_cache {
 
 	radix_tree_t                    tree;
 
+	/* cached sectors, and the pages tracking them */
+	td_arena_t                      bufs;
+	td_slab_t                       pages;
+
 	block_cache_stats_t             stats;
 };
 
@@ -219,10 +224,11 @@ radix_tree_allocate_page(radix_tree_t *tree,
 {
 	radix_tree_page_t *page;
 
-	page = calloc(1, sizeof(radix_tree_page_t));
+	page = td_slab_alloc(&tree->cache->pages);
 	if (!page)
 		return NULL;
 
+	memset(page, 0, sizeof(radix_tree_page_t));
 	page->buf   = buf;
 	page->sec   = sec;
 	page->size  = size;
@@ -242,8 +248,9 @@ radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
 
 	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
 	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	if (page->buf)
+		td_arena_free(&tree->cache->bufs, page->buf, page->size);
+	td_slab_free(&tree->cache->pages, page);
 }
 
 /*
@@ -493,6 +500,8 @@ block_cache_prune_event(event_id_t id, char mode, void *private)
 	tree  = &cache->tree;
 
 	radix_tree_prune(tree);
+	td_arena_shrink(&cache->bufs);
+	td_slab_shrink(&cache->pages, 0);
 }
 
 static inline block_cache_request_t *
@@ -531,6 +540,17 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
+	/* no huge pages: mlockall() below would pin all of them */
+	err = td_arena_init(&cache->bufs, "block-cache", RADIX_TREE_NODE_SHIFT,
+			    RADIX_TREE_PAGE_SHIFT, 0);
+	if (err)
+		goto fail_name;
+
+	err = td_slab_init(&cache->pages, "block-cache-pages",
+			   sizeof(radix_tree_page_t), sizeof(void *), 0, 0);
+	if (err)
+		goto fail_bufs;
+
 	tree = &cache->tree;
 	err  = radix_tree_initialize(tree, cache->sectors);
 	if (err)
@@ -559,8 +579,12 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	return 0;
 
 fail:
-	free(cache->name);
 	radix_tree_free(&cache->tree);
+	td_slab_destroy(&cache->pages);
+fail_bufs:
+	td_arena_destroy(&cache->bufs);
+fail_name:
+	free(cache->name);
 	return err;
 }
 
@@ -577,6 +601,8 @@ block_cache_close(td_driver_t *driver)
 
 	tapdisk_server_unregister_event(cache->timeout_id);
 	radix_tree_free(tree);
+	td_slab_destroy(&cache->pages);
+	td_arena_destroy(&cache->bufs);
 	free(cache->name);
 
 	return 0;
@@ -637,7 +663,8 @@ block_cache_populate_cache(td_request_t clone, int err)
 		return;
 
 	if (breq->err) {
-		free(breq->buf);
+		td_arena_free(&cache->bufs, breq->buf,
+			      breq->treq.secs << RADIX_TREE_NODE_SHIFT);
 		goto out;
 	}
 
@@ -651,7 +678,8 @@ block_cache_populate_cache(td_request_t clone, int err)
 
 	if (radix_tree_add_leaves(tree, breq->buf,
 				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+		td_arena_free(&cache->bufs, breq->buf,
+			      breq->treq.secs << RADIX_TREE_NODE_SHIFT);
 
 out:
 	td_complete_request(breq->treq, breq->err);
@@ -682,7 +710,8 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	if (!breq)
 		goto out;
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
+	buf = td_arena_alloc(&cache->bufs, size);
+	if (!buf) {
 		block_cache_put_request(cache, breq);
 		goto out;
 	}
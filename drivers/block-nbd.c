@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -51,10 +52,37 @@
 #define MAX_NBD_REQS TAPDISK_DATA_REQUESTS
 #define NBD_TIMEOUT 30
 
+/*
+ * A dropped connection is re-established with exponential backoff. I/O
+ * only fails when the server stays unreachable for
+ * TDNBD_RECONNECT_TIMEOUT seconds.
+ */
+#define TDNBD_RECONNECT_MIN_MS 100
+#define TDNBD_RECONNECT_MAX_MS 10000
+#define TDNBD_RECONNECT_TIMEOUT 120
+#define TDNBD_CONNECT_TIMEOUT 5
+
+/*
+ * Old-style handshake: "NBDMAGIC", the negotiation magic, the export
+ * size, flags and 124 bytes of padding.
+ */
+#define TDNBD_NEGOTIATION_SIZE 152
+
+/*
+ * Requests on the wire. A healthy connection may use all MAX_NBD_REQS.
+ * A dropped one halves the window, and each reply then grows it by one,
+ * so a server that just came back doesn't take the whole backlog at
+ * once. Requests past the window wait in pending_reqs, drawn from a
+ * pool which grows TDNBD_POOL_REQS at a time.
+ */
+#define TDNBD_WINDOW_MIN 8
+#define TDNBD_POOL_REQS 32
+
 /*
  * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's 
  * just store it here globally. We'll also keep track of the passed fds here
- * too.
+ * too. Fds are passed on the main thread but taken by VBDs on any worker,
+ * so the list is locked.
  */
 
 struct td_fdreceiver *fdreceiver = NULL;
@@ -65,6 +93,8 @@ struct tdnbd_passed_fd {
 	int                     fd;
 } passed_fds[N_PASSED_FDS];
 
+static pthread_mutex_t passed_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct nbd_queued_io {
 	char                   *buffer;
 	int                     len;
@@ -82,15 +112,39 @@ struct td_nbd_request {
 	struct list_head        queue;
 };
 
+struct tdnbd_req_pool {
+	struct list_head        entry;
+	struct td_nbd_request   reqs[TDNBD_POOL_REQS];
+};
+
 struct tdnbd_data
 {
+	td_driver_t            *driver;
+
 	int                     writer_event_id;
 	struct list_head        sent_reqs;
 	struct list_head        pending_reqs;
 	struct list_head        free_reqs;
-	struct td_nbd_request   requests[MAX_NBD_REQS];
+	struct list_head        pools;
 	int                     nr_free_count;
 
+	int                     window;
+	int                     nr_sent;
+
+	/*
+	 * While the connection is down, the requests it did not answer
+	 * wait in pending_reqs, in order, to be replayed. Reconnecting
+	 * runs off the event loop: a non-blocking connect on the
+	 * connecting socket, then the handshake read into nego_buf.
+	 */
+	int                     reconnect_event_id;
+	int                     reconnect_attempts;
+	struct timeval          reconnect_start;
+	int                     connecting;
+	int                     connect_event_id;
+	char                    nego_buf[TDNBD_NEGOTIATION_SIZE];
+	struct nbd_queued_io    nego_qio;
+
 	int                     reader_event_id;
 	struct nbd_reply        current_reply;
 	struct nbd_queued_io    cur_reply_qio;
@@ -114,6 +168,11 @@ struct tdnbd_data
 int global_id = 0;
 
 static void disable_write_queue(struct tdnbd_data *prv);
+static int enable_write_queue(struct tdnbd_data *prv);
+static void tdnbd_reader_cb(event_id_t eb, char mode, void *data);
+static int tdnbd_read_some(int fd, struct nbd_queued_io *data);
+static int tdnbd_parse_negotiation(const char *buffer, uint64_t *size);
+static int tdnbd_open_socket(struct tdnbd_data *prv);
 
 
 /* -- fdreceiver bits and pieces -- */
@@ -123,6 +182,9 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 {
 	int free_index = -1;
 	int i;
+
+	pthread_mutex_lock(&passed_fds_lock);
+
 	for (i = 0; i < N_PASSED_FDS; i++)
 		if (passed_fds[i].fd == -1) {
 			free_index = i;
@@ -130,6 +192,7 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 		}
 
 	if (free_index == -1) {
+		pthread_mutex_unlock(&passed_fds_lock);
 		ERROR("Error - more than %d fds passed! cannot stash another",
 				N_PASSED_FDS);
 		close(fd);
@@ -141,6 +204,7 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 			sizeof(passed_fds[free_index].id));
 	gettimeofday(&passed_fds[free_index].t, NULL);
 
+	pthread_mutex_unlock(&passed_fds_lock);
 }
 
 static int
@@ -148,15 +212,20 @@ tdnbd_retreive_passed_fd(const char *name)
 {
 	int fd, i;
 
+	pthread_mutex_lock(&passed_fds_lock);
+
 	for (i = 0; i < N_PASSED_FDS; i++) {
 		if (strncmp(name, passed_fds[i].id,
 					sizeof(passed_fds[i].id)) == 0) {
 			fd = passed_fds[i].fd;
 			passed_fds[i].fd = -1;
+			pthread_mutex_unlock(&passed_fds_lock);
 			return fd;
 		}
 	}
 
+	pthread_mutex_unlock(&passed_fds_lock);
+
 	ERROR("Couldn't find the fd named: %s", name);
 
 	return -1;
@@ -204,6 +273,23 @@ __cancel_req(int i, struct td_nbd_request *pos, int e)
 	td_complete_request(pos->treq, e);
 }
 
+/*
+ * Drops a connection attempt in progress, if any.
+ */
+static void
+tdnbd_reconnect_abort(struct tdnbd_data *prv)
+{
+	if (prv->connect_event_id >= 0) {
+		tapdisk_server_unregister_event(prv->connect_event_id);
+		prv->connect_event_id = -1;
+	}
+
+	if (prv->connecting >= 0) {
+		close(prv->connecting);
+		prv->connecting = -1;
+	}
+}
+
 static void
 tdnbd_disable(struct tdnbd_data *prv, int e)
 {
@@ -212,38 +298,369 @@ tdnbd_disable(struct tdnbd_data *prv, int e)
 
 	INFO("NBD client full-disable");
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
-	tapdisk_server_unregister_event(prv->reader_event_id);
+	if (prv->reconnect_event_id >= 0) {
+		tapdisk_server_unregister_event(prv->reconnect_event_id);
+		prv->reconnect_event_id = -1;
+	}
+
+	tdnbd_reconnect_abort(prv);
+
+	disable_write_queue(prv);
 
-	list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue)
+	if (prv->reader_event_id >= 0) {
+		tapdisk_server_unregister_event(prv->reader_event_id);
+		prv->reader_event_id = -1;
+	}
+
+	list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue) {
 		__cancel_req(i++, pos, e);
+		list_move(&pos->queue, &prv->free_reqs);
+		prv->nr_free_count++;
+	}
 
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue)
+	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
 		__cancel_req(i++, pos, e);
+		list_move(&pos->queue, &prv->free_reqs);
+		prv->nr_free_count++;
+	}
+
+	prv->nr_sent = 0;
 
 	INFO("Setting closed");
 	prv->closed = 3;
 }
 
-/* NBD writer queue */
+/* -- reconnection -- */
 
-/* Return code: how much is left to write, or a negative error code */
 static int
-tdnbd_write_some(int fd, struct nbd_queued_io *data) 
+tdnbd_can_reconnect(struct tdnbd_data *prv)
 {
-	int left = data->len - data->so_far;
+	return prv->peer_ip || prv->remote_un.sun_path[0];
+}
+
+static void tdnbd_reconnect_cb(event_id_t eb, char mode, void *data);
+
+static void
+tdnbd_schedule_reconnect(struct tdnbd_data *prv)
+{
+	long ms;
+
+	ms = TDNBD_RECONNECT_MAX_MS;
+	if (prv->reconnect_attempts < 16)
+		ms = (long)TDNBD_RECONNECT_MIN_MS << prv->reconnect_attempts;
+	if (ms > TDNBD_RECONNECT_MAX_MS)
+		ms = TDNBD_RECONNECT_MAX_MS;
+
+	prv->reconnect_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+				-1, /* dummy */
+				TV_USECS(ms * 1000),
+				tdnbd_reconnect_cb,
+				prv);
+	if (prv->reconnect_event_id < 0) {
+		ERROR("Failed to schedule reconnection: %d",
+				prv->reconnect_event_id);
+		tdnbd_disable(prv, EIO);
+	}
+}
+
+/*
+ * A connection attempt failed: retry later, unless the export changed
+ * (-ESTALE) or the server has been gone for too long.
+ */
+static void
+tdnbd_reconnect_failed(struct tdnbd_data *prv, int err)
+{
+	struct timeval now;
+
+	tdnbd_reconnect_abort(prv);
+
+	gettimeofday(&now, NULL);
+	if (err == -ESTALE ||
+	    now.tv_sec - prv->reconnect_start.tv_sec >=
+	    TDNBD_RECONNECT_TIMEOUT) {
+		ERROR("Giving up reconnecting after %d attempt(s)",
+				prv->reconnect_attempts);
+		tdnbd_disable(prv, EIO);
+		return;
+	}
+
+	tdnbd_schedule_reconnect(prv);
+}
+
+static void
+tdnbd_reconnected(struct tdnbd_data *prv)
+{
+	int id;
+
+	tapdisk_server_unregister_event(prv->connect_event_id);
+	prv->connect_event_id = -1;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+			prv->connecting, TV_ZERO,
+			tdnbd_reader_cb,
+			prv);
+	if (id < 0) {
+		tdnbd_reconnect_failed(prv, id);
+		return;
+	}
+
+	prv->reader_event_id = id;
+	prv->socket          = prv->connecting;
+	prv->connecting      = -1;
+
+	if (!list_empty(&prv->pending_reqs))
+		enable_write_queue(prv);
+
+	INFO("Reconnected after %d attempt(s)", prv->reconnect_attempts);
+	prv->reconnect_attempts = 0;
+}
+
+static void
+tdnbd_negotiate_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	uint64_t size;
 	int rc;
+
+	if (!(mode & SCHEDULER_POLL_READ_FD)) {
+		ERROR("Timeout in nbd_negotiate");
+		tdnbd_reconnect_failed(prv, -ETIMEDOUT);
+		return;
+	}
+
+	rc = tdnbd_read_some(prv->connecting, &prv->nego_qio);
+	if (rc < 0) {
+		tdnbd_reconnect_failed(prv, -ECONNRESET);
+		return;
+	}
+
+	if (rc > 0)
+		return; /* need more data */
+
+	rc = tdnbd_parse_negotiation(prv->nego_buf, &size);
+	if (rc) {
+		tdnbd_reconnect_failed(prv, rc);
+		return;
+	}
+
+	if (size >> SECTOR_SHIFT != prv->driver->info.size) {
+		ERROR("Export size changed from %"PRIu64" to %"PRIu64
+				" sectors", prv->driver->info.size,
+				size >> SECTOR_SHIFT);
+		tdnbd_reconnect_failed(prv, -ESTALE);
+		return;
+	}
+
+	tdnbd_reconnected(prv);
+}
+
+/*
+ * Reads the handshake as it arrives, giving up if the server goes
+ * quiet for TDNBD_CONNECT_TIMEOUT seconds.
+ */
+static void
+tdnbd_start_negotiation(struct tdnbd_data *prv)
+{
+	if (prv->connect_event_id >= 0) {
+		tapdisk_server_unregister_event(prv->connect_event_id);
+		prv->connect_event_id = -1;
+	}
+
+	prv->nego_qio.buffer = prv->nego_buf;
+	prv->nego_qio.len    = sizeof(prv->nego_buf);
+	prv->nego_qio.so_far = 0;
+
+	prv->connect_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD |
+				SCHEDULER_POLL_TIMEOUT,
+				prv->connecting,
+				TV_SECS(TDNBD_CONNECT_TIMEOUT),
+				tdnbd_negotiate_cb,
+				prv);
+	if (prv->connect_event_id < 0)
+		tdnbd_reconnect_failed(prv, prv->connect_event_id);
+}
+
+static void
+tdnbd_connect_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (!(mode & SCHEDULER_POLL_WRITE_FD)) {
+		ERROR("Timeout connecting to the NBD server");
+		tdnbd_reconnect_failed(prv, -ETIMEDOUT);
+		return;
+	}
+
+	if (getsockopt(prv->connecting, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+	if (err) {
+		ERROR("Could not connect to the NBD server: %s",
+				strerror(err));
+		tdnbd_reconnect_failed(prv, -err);
+		return;
+	}
+
+	tdnbd_start_negotiation(prv);
+}
+
+static void
+tdnbd_reconnect_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	const struct sockaddr *addr;
+	socklen_t len;
+	int sock, rc;
+
+	tapdisk_server_unregister_event(prv->reconnect_event_id);
+	prv->reconnect_event_id = -1;
+	prv->reconnect_attempts++;
+
+	if (prv->peer_ip) {
+		addr = (struct sockaddr *)prv->remote;
+		len  = sizeof(struct sockaddr_in);
+	} else {
+		addr = (struct sockaddr *)&prv->remote_un;
+		len  = strlen(prv->remote_un.sun_path) +
+			sizeof(prv->remote_un.sun_family);
+	}
+
+	sock = tdnbd_open_socket(prv);
+	if (sock < 0) {
+		tdnbd_reconnect_failed(prv, -ECONNREFUSED);
+		return;
+	}
+
+	prv->connecting = sock;
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	rc = connect(sock, addr, len);
+	if (!rc) {
+		tdnbd_start_negotiation(prv);
+		return;
+	}
+
+	if (errno != EINPROGRESS) {
+		rc = -errno;
+		ERROR("Could not connect to the NBD server: %s",
+				strerror(-rc));
+		tdnbd_reconnect_failed(prv, rc);
+		return;
+	}
+
+	prv->connect_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD |
+				SCHEDULER_POLL_TIMEOUT,
+				sock,
+				TV_SECS(TDNBD_CONNECT_TIMEOUT),
+				tdnbd_connect_cb,
+				prv);
+	if (prv->connect_event_id < 0)
+		tdnbd_reconnect_failed(prv, prv->connect_event_id);
+}
+
+/*
+ * The connection broke: requeue what the server did not answer, in the
+ * order it was sent, and reconnect. I/O is failed only if reconnecting
+ * is not possible.
+ */
+static void
+tdnbd_connection_lost(struct tdnbd_data *prv, int e)
+{
+	struct td_nbd_request *pos;
+
+	if (prv->closed == 3 || prv->socket < 0)
+		return;
+
+	if (prv->closed || !tdnbd_can_reconnect(prv)) {
+		tdnbd_disable(prv, e);
+		return;
+	}
+
+	ERROR("Connection lost (%s), reconnecting", strerror(e));
+
+	disable_write_queue(prv);
+
+	if (prv->reader_event_id >= 0) {
+		tapdisk_server_unregister_event(prv->reader_event_id);
+		prv->reader_event_id = -1;
+	}
+
+	close(prv->socket);
+	prv->socket = -1;
+
+	list_splice(&prv->sent_reqs, &prv->pending_reqs);
+	INIT_LIST_HEAD(&prv->sent_reqs);
+
+	list_for_each_entry(pos, &prv->pending_reqs, queue) {
+		if (pos->timeout_event >= 0) {
+			tapdisk_server_unregister_event(pos->timeout_event);
+			pos->timeout_event = -1;
+		}
+		pos->header.so_far = 0;
+		pos->body.so_far   = 0;
+	}
+
+	prv->curr_reply_req       = NULL;
+	prv->cur_reply_qio.so_far = 0;
+	prv->nr_sent              = 0;
+	prv->window               = prv->window / 2;
+	if (prv->window < TDNBD_WINDOW_MIN)
+		prv->window = TDNBD_WINDOW_MIN;
+
+	prv->reconnect_attempts = 0;
+	gettimeofday(&prv->reconnect_start, NULL);
+	tdnbd_schedule_reconnect(prv);
+}
+
+/* NBD writer queue */
+
+/*
+ * Sends what is left of a request, the header and the payload of a write
+ * gathered into one sendmsg.
+ * Return code: how much is left to write, or a negative error code
+ */
+static int
+tdnbd_write_req(int fd, struct td_nbd_request *req)
+{
+	struct nbd_queued_io *qio[2] = { &req->header, &req->body };
+	int n = ntohl(req->nreq.type) == NBD_CMD_WRITE ? 2 : 1;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int i, cnt, left, k;
+	ssize_t rc;
 	char *code;
 
-	while (left > 0) {
-		rc = send(fd, data->buffer + data->so_far, left, 0);
+	for (;;) {
+		left = cnt = 0;
+		for (i = 0; i < n; i++) {
+			k = qio[i]->len - qio[i]->so_far;
+			if (!k)
+				continue;
+			iov[cnt].iov_base = qio[i]->buffer + qio[i]->so_far;
+			iov[cnt].iov_len  = k;
+			left += k;
+			cnt++;
+		}
+
+		if (!left)
+			return 0;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = cnt;
+
+		rc = sendmsg(fd, &msg, 0);
 
 		if (rc == -1) {
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 				return left;
 
 			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc, 
+			ERROR("Bad return code %zd from send (%s)", rc,
 					(code == 0 ? "unknown" : code));
 			return rc;
 		}
@@ -253,11 +670,14 @@ tdnbd_write_some(int fd, struct nbd_queued_io *data)
 			return -1;
 		}
 
-		left -= rc;
-		data->so_far += rc;
+		for (i = 0; i < n && rc; i++) {
+			k = qio[i]->len - qio[i]->so_far;
+			if (k > rc)
+				k = rc;
+			qio[i]->so_far += k;
+			rc -= k;
+		}
 	}
-
-	return left;
 }
 
 static int
@@ -298,7 +718,7 @@ tdnbd_timeout_cb(event_id_t eb, char mode, void *data)
 {
 	struct tdnbd_data *prv = data;
 	ERROR("Timeout!: %d", eb);
-	tdnbd_disable(prv, ETIMEDOUT);
+	tdnbd_connection_lost(prv, ETIMEDOUT);
 }
 
 static void
@@ -308,15 +728,23 @@ tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 	struct tdnbd_data *prv = data;
 
 	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
-		if (tdnbd_write_some(prv->socket, &pos->header) > 0)
+		int type = ntohl(pos->nreq.type);
+		int rc;
+
+		/* Only the head can be part-written, and it fit the window */
+		if (prv->nr_sent >= prv->window && !prv->closed)
+			break;
+
+		rc = tdnbd_write_req(prv->socket, pos);
+		if (rc > 0)
 			return;
 
-		if (ntohl(pos->nreq.type) == NBD_CMD_WRITE) {
-			if (tdnbd_write_some(prv->socket, &pos->body) > 0)
-				return;
+		if (rc < 0) {
+			tdnbd_connection_lost(prv, EIO);
+			return;
 		}
 
-		if (ntohl(pos->nreq.type) == NBD_CMD_DISC) {
+		if (type == NBD_CMD_DISC) {
 			INFO("sent close request");
 			/*
 			 * We don't expect a response from a DISC, so move the
@@ -326,11 +754,19 @@ tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 			prv->nr_free_count++;
 			prv->closed = 2;
 		} else {
-			list_move(&pos->queue, &prv->sent_reqs);
+			list_move_tail(&pos->queue, &prv->sent_reqs);
+			prv->nr_sent++;
+
+			pos->timeout_event = tapdisk_server_register_event(
+					SCHEDULER_POLL_TIMEOUT,
+					-1, /* dummy */
+					TV_SECS(NBD_TIMEOUT),
+					tdnbd_timeout_cb,
+					prv);
 		}
 	}
 
-	/* If we're here, we've written everything */
+	/* If we're here, we've written everything the window allows */
 
 	disable_write_queue(prv);
 
@@ -367,12 +803,50 @@ disable_write_queue(struct tdnbd_data *prv)
 	prv->writer_event_id = -1;
 }
 
+static int
+tdnbd_grow_pool(struct tdnbd_data *prv)
+{
+	struct tdnbd_req_pool *pool;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	for (i = 0; i < TDNBD_POOL_REQS; i++) {
+		pool->reqs[i].timeout_event = -1;
+		list_add_tail(&pool->reqs[i].queue, &prv->free_reqs);
+	}
+
+	list_add_tail(&pool->entry, &prv->pools);
+	prv->nr_free_count += TDNBD_POOL_REQS;
+
+	return 0;
+}
+
+static void
+tdnbd_free_pools(struct tdnbd_data *prv)
+{
+	struct tdnbd_req_pool *pool, *next;
+
+	list_for_each_entry_safe(pool, next, &prv->pools, entry) {
+		list_del(&pool->entry);
+		free(pool);
+	}
+
+	INIT_LIST_HEAD(&prv->free_reqs);
+	prv->nr_free_count = 0;
+}
+
 static int
 tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 		char *buffer, uint32_t length, td_request_t treq, int fake)
 {
-	if (prv->nr_free_count == 0) 
+	if (prv->nr_free_count == 0 && tdnbd_grow_pool(prv)) {
+		if (type != NBD_CMD_DISC)
+			td_complete_request(treq, -EBUSY);
 		return -EBUSY;
+	}
 
 	if (prv->closed == 3) {
 		td_complete_request(treq, -ETIMEDOUT);
@@ -385,20 +859,12 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	/* fill in the request */
 
 	req->treq = treq;
-	int id = global_id++;
+	/* VBDs on different workers draw handles from the same counter */
+	int id = __atomic_fetch_add(&global_id, 1, __ATOMIC_RELAXED);
 	snprintf(req->nreq.handle, 8, "td%05x", id % 0xffff);
 
-	/* No response from a disconnect, so no need for a timeout */
-	if (type != NBD_CMD_DISC) { 
-		req->timeout_event = tapdisk_server_register_event(
-				SCHEDULER_POLL_TIMEOUT, 
-				-1, /* dummy */
-				TV_SECS(NBD_TIMEOUT),
-				tdnbd_timeout_cb,
-				prv);
-	} else {
-		req->timeout_event = -1;
-	}
+	/* The timeout is armed once the request is on the wire */
+	req->timeout_event = -1;
 
 	req->nreq.magic = htonl(NBD_REQUEST_MAGIC);
 	req->nreq.type = htonl(type);
@@ -415,7 +881,8 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	list_move_tail(&req->queue, &prv->pending_reqs);
 	prv->nr_free_count--;
 
-	if (prv->writer_event_id < 0)
+	/* Replayed once reconnected */
+	if (prv->socket >= 0)
 		enable_write_queue(prv);
 
 	return 0;
@@ -435,7 +902,7 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 
 	if (rc < 0) {
 		ERROR("Error reading reply header: %d", rc);
-		tdnbd_disable(prv, EIO);
+		tdnbd_connection_lost(prv, EIO);
 		return;
 	}
 
@@ -478,7 +945,7 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 
 		if (rc < 0) {
 			ERROR("Error reading body of request: %d", rc);
-			tdnbd_disable(prv, EIO);
+			tdnbd_connection_lost(prv, EIO);
 			return;
 		}
 
@@ -507,10 +974,18 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 	if (prv->curr_reply_req->timeout_event >= 0) {
 		tapdisk_server_unregister_event(
 				prv->curr_reply_req->timeout_event);
+		prv->curr_reply_req->timeout_event = -1;
 	}
 
 	prv->curr_reply_req = NULL;
 
+	prv->nr_sent--;
+	if (prv->window < MAX_NBD_REQS)
+		prv->window++;
+
+	if (!list_empty(&prv->pending_reqs))
+		enable_write_queue(prv);
+
 	/*
 	 * NB: do this here otherwise we cancel the request that has just been 
 	 * moved
@@ -534,135 +1009,144 @@ tdnbd_wait_read(int fd)
 	return rc;
 }
 
+/*
+ * Checks the old-style handshake and returns the export size in bytes.
+ */
 static int
-tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+tdnbd_parse_negotiation(const char *buffer, uint64_t *size)
 {
-#define RECV_BUFFER_SIZE 256
-	int rc;
-	char buffer[RECV_BUFFER_SIZE];
+	char name[9];
 	uint64_t magic;
-	uint64_t size;
 	uint32_t flags;
-	int padbytes = 124;
-	int sock = prv->socket;
-
-	/*
-	 * NBD negotiation protocol: 
-	 *
-	 * Server sends 'NBDMAGIC'
-	 * then it sends 0x00420281861253L
-	 * then it sends a 64 bit bigendian size
-	 * then it sends a 32 bit bigendian flags
-	 * then it sends 124 bytes of nothing
-	 */
-
-	/*
-	 * We need to limit the time we spend in this function as we're still
-	 * using blocking IO at this point
-	 */
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
-
-	rc = recv(sock, buffer, 8, 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(1) (%d)\n", rc);
-		close(sock);
-		return -1;
-	}
 
 	if (memcmp(buffer, "NBDMAGIC", 8) != 0) {
-		buffer[8] = 0;
-		ERROR("Error in NBD negotiation: got '%s'", buffer);
-		close(sock);
-		return -1;
-	}
-
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
-
-	rc = recv(sock, &magic, sizeof(magic), 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(2) (%d)\n", rc);
-
-		return -1;
+		memcpy(name, buffer, 8);
+		name[8] = 0;
+		ERROR("Error in NBD negotiation: got '%s'", name);
+		return -EPROTO;
 	}
 
+	memcpy(&magic, buffer + 8, sizeof(magic));
 	if (ntohll(magic) != NBD_NEGOTIATION_MAGIC) {
-		ERROR("Not enough magic in negotiation(2) (%"PRIu64")\n",
+		ERROR("Not enough magic in negotiation (%"PRIu64")\n",
 				ntohll(magic));
-		close(sock);
-		return -1;
-	}
-
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
-
-	rc = recv(sock, &size, sizeof(size), 0);
-	if (rc < sizeof(size)) {
-		ERROR("Short read in negotiation(3) (%d)\n", rc);
-		close(sock);
-		return -1;
+		return -EPROTO;
 	}
 
-	INFO("Got size: %"PRIu64"", ntohll(size));
+	memcpy(size, buffer + 16, sizeof(*size));
+	*size = ntohll(*size);
+	INFO("Got size: %"PRIu64"", *size);
 
-	driver->info.size = ntohll(size) >> SECTOR_SHIFT;
-	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
-	driver->info.info = 0;
+	memcpy(&flags, buffer + 24, sizeof(flags));
+	INFO("Got flags: %"PRIu32"", ntohl(flags));
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+	return 0;
+}
 
-	rc = recv(sock, &flags, sizeof(flags), 0);
-	if (rc < sizeof(flags)) {
-		ERROR("Short read in negotiation(4) (%d)\n", rc);
-		close(sock);
-		return -1;
-	}
+/*
+ * Only used at open, which may block; reconnecting reads the handshake
+ * from the event loop instead (tdnbd_negotiate_cb).
+ */
+static int
+tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+{
+	char buffer[TDNBD_NEGOTIATION_SIZE];
+	struct nbd_queued_io qio;
+	int sock = prv->socket;
+	uint64_t size;
+	int rc;
 
-	INFO("Got flags: %"PRIu32"", ntohl(flags));
+	qio.buffer = buffer;
+	qio.len    = sizeof(buffer);
+	qio.so_far = 0;
 
-	while (padbytes > 0) {
+	do {
 		if (tdnbd_wait_read(sock) <= 0) {
 			ERROR("Timeout in nbd_negotiate");
-			close(sock);
-			return -1;
+			goto fail;
 		}
 
-		rc = recv(sock, buffer, padbytes, 0);
+		rc = tdnbd_read_some(sock, &qio);
 		if (rc < 0) {
-			ERROR("Bad read in negotiation(5) (%d)\n", rc);
-			close(sock);
-			return -1;
+			ERROR("Short read in negotiation (%d of %d bytes)",
+					qio.so_far, qio.len);
+			goto fail;
 		}
-		padbytes -= rc;
-	}
+	} while (rc > 0);
+
+	if (tdnbd_parse_negotiation(buffer, &size))
+		goto fail;
+
+	driver->info.size = size >> SECTOR_SHIFT;
+	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	driver->info.info = 0;
 
 	INFO("Successfully connected to NBD server");
 
 	fcntl(sock, F_SETFL, O_NONBLOCK);
 
 	return 0;
+
+fail:
+	close(sock);
+	return -1;
 }
 
+/*
+ * connect() bounded by TDNBD_CONNECT_TIMEOUT, for open.
+ */
 static int
-tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
+tdnbd_connect(int sock, const struct sockaddr *addr, socklen_t len)
+{
+	struct timeval tv = TV_SECS(TDNBD_CONNECT_TIMEOUT);
+	socklen_t errlen = sizeof(int);
+	int flags, rc, err;
+	fd_set socks;
+
+	flags = fcntl(sock, F_GETFL);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+	rc = connect(sock, addr, len);
+	if (rc < 0 && errno == EINPROGRESS) {
+		FD_ZERO(&socks);
+		FD_SET(sock, &socks);
+
+		rc = select(sock + 1, NULL, &socks, NULL, &tv);
+		if (rc == 0) {
+			errno = ETIMEDOUT;
+			rc = -1;
+		} else if (rc > 0) {
+			rc = getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen);
+			if (!rc && err) {
+				errno = err;
+				rc = -1;
+			}
+		}
+	}
+
+	err = errno;
+	fcntl(sock, F_SETFL, flags);
+	errno = err;
+
+	return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Returns a new socket for the export's address family, or -1.
+ */
+static int
+tdnbd_open_socket(struct tdnbd_data *prv)
 {
 	int sock;
 	int opt = 1;
-	int rc;
+
+	if (!prv->peer_ip) {
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0)
+			ERROR("failed to create UNIX domain socket: %s\n",
+					strerror(errno));
+		return sock;
+	}
 
 	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sock < 0) {
@@ -670,15 +1154,31 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 		return -1;
 	}
 
-	rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt,
-			sizeof(opt));
-	if (rc < 0) {
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt,
+				sizeof(opt)) < 0) {
 		ERROR("Could not set TCP_NODELAY: %s\n", strerror(errno));
+		close(sock);
 		return -1;
 	}
 
+	return sock;
+}
+
+static int
+tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
+{
+	int sock;
+	int rc;
+
+	sock = tdnbd_open_socket(prv);
+	if (sock < 0)
+		return -1;
+
+	if (prv->remote)
+		goto connect;
+
 	prv->remote = (struct sockaddr_in *)malloc(
-			sizeof(struct sockaddr_in *));
+			sizeof(struct sockaddr_in));
 	if (!prv->remote) {
 		ERROR("struct sockaddr_in malloc failure\n");
 		close(sock);
@@ -702,8 +1202,9 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 	}
 	prv->remote->sin_port = htons(prv->port);
 
-	if (connect(sock, (struct sockaddr *)prv->remote,
-				sizeof(struct sockaddr)) < 0) {
+connect:
+	if (tdnbd_connect(sock, (struct sockaddr *)prv->remote,
+				sizeof(struct sockaddr_in)) < 0) {
 		ERROR("Could not connect to peer: %s\n", strerror(errno));
 		close(sock);
 		return -1;
@@ -714,6 +1215,35 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 	return tdnbd_nbd_negotiate(prv, driver);
 }
 
+static int
+tdnbd_connect_unix(struct tdnbd_data *prv, td_driver_t *driver)
+{
+	int len;
+
+	prv->socket = tdnbd_open_socket(prv);
+	if (prv->socket == -1)
+		return -1;
+
+	len = strlen(prv->remote_un.sun_path)
+		+ sizeof(prv->remote_un.sun_family);
+	if (tdnbd_connect(prv->socket, (struct sockaddr *)&prv->remote_un,
+				len) == -1) {
+		ERROR("failed to connect to %s: %s\n",
+				prv->remote_un.sun_path, strerror(errno));
+		close(prv->socket);
+		prv->socket = -1;
+		return -1;
+	}
+
+	if (tdnbd_nbd_negotiate(prv, driver)) {
+		ERROR("failed to negotiate with the NBD server\n");
+		prv->socket = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
 /* -- interface -- */
 
 static int tdnbd_close(td_driver_t*);
@@ -725,7 +1255,6 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 	char peer_ip[256];
 	int port;
 	int rc;
-	int i;
 	struct stat buf;
 
 	driver->info.sector_size = 512;
@@ -736,62 +1265,56 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 
 	INFO("Opening nbd export to %s (flags=%x)\n", name, flags);
 
+	prv->driver = driver;
+	prv->socket = -1;
 	prv->writer_event_id = -1;
+	prv->reader_event_id = -1;
+	prv->reconnect_event_id = -1;
+	prv->connecting = -1;
+	prv->connect_event_id = -1;
+	prv->window = MAX_NBD_REQS;
 	INIT_LIST_HEAD(&prv->sent_reqs);
 	INIT_LIST_HEAD(&prv->pending_reqs);
 	INIT_LIST_HEAD(&prv->free_reqs);
-	for (i = 0; i < MAX_NBD_REQS; i++) {
-		INIT_LIST_HEAD(&prv->requests[i].queue);
-		prv->requests[i].timeout_event = -1;
-		list_add(&prv->requests[i].queue, &prv->free_reqs);
+	INIT_LIST_HEAD(&prv->pools);
+	if (tdnbd_grow_pool(prv)) {
+		ERROR("Failed to allocate requests");
+		goto fail;
 	}
-	prv->nr_free_count = MAX_NBD_REQS;
 	prv->cur_reply_qio.buffer = (char *)&prv->current_reply;
 	prv->cur_reply_qio.len = sizeof(struct nbd_reply);
 
 	bzero(&buf, sizeof(buf));
 	rc = stat(name, &buf);
 	if (!rc && S_ISSOCK(buf.st_mode)) {
-		int len = 0;
-		if ((prv->socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-			ERROR("failed to create UNIX domain socket: %s\n",
-					strerror(errno));
-			return -1;
+		if (strlen(name) >= sizeof(prv->remote_un.sun_path)) {
+			ERROR("socket path too long: %s\n", name);
+			goto fail;
 		}
 		prv->remote_un.sun_family = AF_UNIX;
 		strcpy(prv->remote_un.sun_path, name);
-		len = strlen(prv->remote_un.sun_path)
-			+ sizeof(prv->remote_un.sun_family);
-		if ((rc = connect(prv->socket, (struct sockaddr*)&prv->remote_un, len)
-					== -1)) {
-			ERROR("failed to connect to %s: %s\n", name, strerror(errno));
-			return -1;
-		}
-		rc = tdnbd_nbd_negotiate(prv, driver);
-		if (rc) {
-			ERROR("failed to negotiate with the NBD server\n");
-			return -1;
-		}
+		if (tdnbd_connect_unix(prv, driver))
+			goto fail;
 	} else {
 		rc = sscanf(name, "%255[^:]:%d", peer_ip, &port);
 		if (rc == 2) {
 			prv->peer_ip = malloc(strlen(peer_ip) + 1);
 			if (!prv->peer_ip) {
 				ERROR("Failure to malloc for NBD destination");
-				return -1;
+				goto fail;
 			}
 			strcpy(prv->peer_ip, peer_ip);
 			prv->port = port;
 			prv->name = NULL;
 			INFO("Export peer=%s port=%d\n", prv->peer_ip, prv->port);
 			if (tdnbd_connect_import_session(prv, driver) < 0)
-				return -1;
+				goto fail;
 
 		} else {
 			prv->socket = tdnbd_retreive_passed_fd(name);
 			if (prv->socket < 0) {
 				ERROR("Couldn't find fd named: %s", name);
-				return -1;
+				goto fail;
 			}
 			INFO("Found passed fd. Connecting...");
 			prv->remote = NULL;
@@ -800,7 +1323,7 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 			prv->port = -1;
 			if (tdnbd_nbd_negotiate(prv, driver) < 0) {
 				ERROR("Failed to negotiate");
-				return -1;
+				goto fail;
 			}
 		}
 	}
@@ -820,6 +1343,11 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 
 	return 0;
 
+fail:
+	tdnbd_free_pools(prv);
+	free(prv->peer_ip);
+	prv->peer_ip = NULL;
+	return -1;
 }
 
 static int
@@ -830,15 +1358,23 @@ tdnbd_close(td_driver_t* driver)
 
 	bzero(&treq, sizeof(treq));
 
+	if (prv->socket < 0 && prv->closed != 3) {
+		INFO("NBD close: still reconnecting, giving up.");
+		tdnbd_disable(prv, EIO);
+	}
+
 	if (prv->closed == 3) {
 		INFO("NBD close: already decided that the connection is dead.");
 		if (prv->socket >= 0)
 			close(prv->socket);
 		prv->socket = -1;
+		tdnbd_free_pools(prv);
 		return 0;
 	}
 
-	/* Send a close packet */
+	/* Send a close packet, flushing pending requests past the window */
+
+	prv->closed = 1;
 
 	INFO("Sending disconnect request");
 	tdnbd_queue_request(prv, NBD_CMD_DISC, 0, 0, 0, treq, 0);
@@ -865,6 +1401,8 @@ tdnbd_close(td_driver_t* driver)
 		prv->socket = -1;
 	}
 
+	tdnbd_free_pools(prv);
+
 	return 0;
 }
 
@@ -594,6 +594,7 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 		goto forward;
 
 	case TD_OP_WRITE:
+	case TD_OP_WRITE_ZEROES:
 		if (valve->flags & TD_VALVE_WRLIMIT)
 			break;
 
@@ -53,6 +53,7 @@
 #include <libaio.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <time.h>
 #include "debug.h"
@@ -62,6 +63,8 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-server.h"
+#include "timeout-math.h"
 
 #include "payload.h"
 
@@ -76,10 +79,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, BBLKS: %d\n",					\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.pbw_count);					\
 	} while(0)
 
 #if (DEBUGGING == 1)
@@ -97,7 +100,19 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32        /* min. bitmaps cached */
+#define VHD_CACHE_BUDGET             (4 << 20) /* cache size, bytes, with
+						* no VBD budget */
+#define VHD_CACHE_HASH_SIZE          64        /* initial hash buckets */
+
+#define VHD_BAT_BATCH_SIZE           32        /* max blocks per BAT write */
+#define VHD_BAT_ENTRIES_PER_SEC      (VHD_SECTOR_SIZE / sizeof(uint32_t))
+
+#define VHD_PREFETCH_BUFS            4         /* read-ahead extents */
+#define VHD_PREFETCH_SIZE            (512 << 10) /* default extent size */
+#define VHD_PREFETCH_SIZE_ENV        "TAPDISK_VHD_PREFETCH_KB"
+#define VHD_PREFETCH_TRIGGER         (256 << 10) /* sequential bytes read
+						  * before prefetching */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -110,6 +125,8 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_PREFETCH              7
+#define VHD_OP_BITMAP_WAIT           8 /* block status, see wait_for_bitmap */
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -130,6 +147,11 @@ unsigned int SPB;
 
 #define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_BAT_COMMIT          4
+#define VHD_FLAG_BAT_WRITE_DONE      8
+
+#define VHD_FLAG_ALLOC_FAILED        1
+#define VHD_FLAG_ALLOC_TX_WAIT       2
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
@@ -140,10 +162,15 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_CLEAR_BITMAP    16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
 
+#define VHD_FLAG_PF_PENDING          1
+#define VHD_FLAG_PF_VALID            2
+#define VHD_FLAG_PF_STALE            4
+
 /*******THIN PARAMETERS******/
 #define THIN_RESIZE_MIN_INCREMENT   16777216L /* 16 MBs incremets */
 #define THIN_RESIZE_MAX_INCREMENT 1073741824L /* 1024 MBs incremets */
@@ -179,21 +206,39 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+/* a block allocation waiting for the batched bat write */
+struct vhd_bat_alloc {
+	uint32_t                  blk;
+	uint64_t                  offset;      /* sector offset of new block */
+	vhd_flag_t                status;
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+};
+
+/*
+ * Block allocations are group-committed: while the bat is locked,
+ * allocations of further blocks covered by the same bat sector join
+ * the pending batch, until the batch is committed at the end of the
+ * current scheduler pass. The bat sector is written once all zero
+ * bitmap writes in the batch completed.
+ */
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       pbw_count;   /* blocks in pending batch */
+	int                       pbw_zeroing; /* zero bitmap writes in flight */
+	uint64_t                  pbw_end;     /* end of last reserved block */
+	struct vhd_bat_alloc      pbw[VHD_BAT_BATCH_SIZE];
+	event_id_t                commit_id;   /* end of batch event */
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
 };
 
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct list_head          lru;         /* position in bm_lru */
+	struct vhd_bitmap        *hash_next;   /* bm_hash chain, or bm_free */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -212,6 +257,38 @@ struct vhd_bitmap {
 	struct vhd_request        req;
 };
 
+/* one read-ahead extent, never crossing a block boundary */
+struct vhd_prefetch {
+	uint64_t                  sec;         /* first virtual sector */
+	uint32_t                  secs;
+	vhd_flag_t                status;
+	char                     *buf;
+	struct vhd_req_list       waiting;     /* reads of a pending extent */
+	struct vhd_request        req;
+};
+
+/*
+ * Sequential read detection: a read starting where the previous one
+ * ended extends the current run. Once the run reaches
+ * VHD_PREFETCH_TRIGGER, up to VHD_PREFETCH_BUFS extents past its end
+ * are read ahead, and reads of those sectors are served from memory.
+ * Writes invalidate overlapping extents, and no extent is read while
+ * data writes are in flight.
+ */
+struct vhd_prefetch_state {
+	uint32_t                  secs;        /* extent size, 0: disabled */
+	uint64_t                  next_sec;    /* end of the last read */
+	uint64_t                  run;         /* sequential sectors read */
+	uint64_t                  ahead;       /* end of prefetched range */
+	int                       pending;     /* extent reads in flight */
+	int                       writes;      /* data writes in flight */
+	struct vhd_prefetch      *pf[VHD_PREFETCH_BUFS];
+
+	uint64_t                  issued;
+	uint64_t                  hits;        /* sectors served */
+	uint64_t                  invalidated;
+};
+
 struct vhd_state {
 	vhd_flag_t                flags;
 
@@ -229,13 +306,26 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
 
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	/* bitmap cache: cached bitmaps are hashed by block number and
+	 * kept on bm_lru, least recently used first. Bitmaps are allocated
+	 * on demand until bm_max, or until the VBD's bm_budget runs out,
+	 * after which the lru one is recycled. */
+	struct vhd_bitmap       **bm_hash;
+	uint32_t                  bm_hash_size; /* power of two */
+	uint32_t                  bm_cached;   /* bitmaps in bm_hash */
+	uint32_t                  bm_count;    /* bitmaps allocated */
+	uint32_t                  bm_max;      /* allocation limit */
+	td_cache_budget_t        *bm_budget;   /* shared by the VBD's images */
+	struct list_head          bm_lru;
+	struct vhd_bitmap        *bm_free;     /* allocated, not cached */
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
+
+	struct vhd_prefetch_state pf;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -285,73 +375,47 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void finish_data_write(struct vhd_request *);
 static int vhd_thin_prepare(struct vhd_state *);
 
-static struct vhd_state  *_vhd_master;
+/*
+ * Zeros for bitmap padding and preallocation, shared by every image on
+ * every worker thread. Mapped once and kept for the life of the process:
+ * a private read-only anonymous mapping only ever references the zero
+ * page, so it costs no memory even once mlockall() has faulted it in.
+ */
 static unsigned long      _vhd_zsize;
-static char              *_vhd_zeros = NULL;
-int                       _dev_zero = -1;
+static char              *_vhd_zeros;
+static int                _vhd_zeros_err;
+static pthread_once_t     _vhd_zeros_once = PTHREAD_ONCE_INIT;
 
-static int
-vhd_initialize(struct vhd_state *s)
+static void
+vhd_map_zeros(void)
 {
-	int err;
-
-	if (_vhd_zeros)
-		return 0;
-
-	_vhd_zsize = 2 * getpagesize();
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-		_vhd_zsize += VHD_BLOCK_SIZE;
-
-	_dev_zero = open("/dev/zero", O_RDONLY);
-	if (unlikely(_dev_zero == -1)) {
-		err = errno;
-		EPRINTF("failed to open /dev/zero: %s\n", strerror(err));
-		return -err;
-	}
-
+	_vhd_zsize = 2 * getpagesize() + VHD_BLOCK_SIZE;
 	_vhd_zeros = mmap(NULL, _vhd_zsize, PROT_READ,
-			  MAP_SHARED, _dev_zero, 0);
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (_vhd_zeros == MAP_FAILED) {
-		int _err;
-		err = errno;
-		EPRINTF("vhd_initialize failed: %s\n", strerror(err));
+		_vhd_zeros_err = -errno;
+		EPRINTF("vhd_initialize failed: %s\n",
+			strerror(-_vhd_zeros_err));
 		_vhd_zeros = NULL;
 		_vhd_zsize = 0;
-		_err = close(_dev_zero);
-		if (unlikely(_err == -1))
-			EPRINTF("failed to close /dev/zero: %s (error ignored)\n",
-					strerror(errno));
-		else
-			_dev_zero = -1;
-
-		return -err;
 	}
+}
 
-	_vhd_master = s;
-	return 0;
+static int
+vhd_initialize(struct vhd_state *s)
+{
+	pthread_once(&_vhd_zeros_once, vhd_map_zeros);
+	return _vhd_zeros_err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
-		return;
-
 	free(s->padbm_buf);
-	munmap(_vhd_zeros, _vhd_zsize);
-	_vhd_zsize  = 0;
-	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
-	if (_dev_zero != -1) {
-		int _err = close(_dev_zero);
-		if (unlikely(_err == -1))
-			EPRINTF("failed to close /dev/zero: %s (error ignored)\n",
-					strerror(errno));
-		else
-			_dev_zero = -1;
-	}
+	s->padbm_buf = NULL;
 }
 
 static char *
@@ -466,6 +530,8 @@ vhd_free_bat(struct vhd_state *s)
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
+	if (s->bat.commit_id)
+		tapdisk_server_unregister_event(s->bat.commit_id);
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 }
 
@@ -522,60 +588,233 @@ fail:
 	return err;
 }
 
+/* memory taken by one cached bitmap */
+static inline uint64_t
+vhd_bitmap_bytes(struct vhd_state *s)
+{
+	return sizeof(struct vhd_bitmap) + 2 * vhd_sectors_to_bytes(s->bm_secs);
+}
+
+static struct vhd_bitmap *
+vhd_alloc_bitmap(struct vhd_state *s)
+{
+	int err, map_size;
+	struct vhd_bitmap *bm;
+	void *map, *shadow;
+
+	bm = calloc(1, sizeof(struct vhd_bitmap));
+	if (!bm)
+		return NULL;
+
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+
+	err = posix_memalign(&map, 512, map_size);
+	if (err)
+		goto fail;
+
+	bm->map = map;
+
+	err = posix_memalign(&shadow, 512, map_size);
+	if (err)
+		goto fail;
+
+	bm->shadow = shadow;
+
+	memset(bm->map, 0, map_size);
+	memset(bm->shadow, 0, map_size);
+	INIT_LIST_HEAD(&bm->lru);
+	s->bm_count++;
+	if (s->bm_budget)
+		s->bm_budget->used += vhd_bitmap_bytes(s);
+
+	return bm;
+
+fail:
+	free(bm->map);
+	free(bm);
+	return NULL;
+}
+
+static void
+vhd_release_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	free(bm->map);
+	free(bm->shadow);
+	free(bm);
+
+	s->bm_count--;
+	if (s->bm_budget)
+		s->bm_budget->used -= vhd_bitmap_bytes(s);
+}
+
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
-	int i;
-	struct vhd_bitmap *bm;
+	uint32_t i;
+	struct vhd_bitmap *bm, *next;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	if (!s->bm_hash)
+		return;
+
+	for (i = 0; i < s->bm_hash_size; i++)
+		for (bm = s->bm_hash[i]; bm; bm = next) {
+			next = bm->hash_next;
+			vhd_release_bitmap(s, bm);
+		}
+
+	for (bm = s->bm_free; bm; bm = next) {
+		next = bm->hash_next;
+		vhd_release_bitmap(s, bm);
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bm_hash);
+	s->bm_hash      = NULL;
+	s->bm_hash_size = 0;
+	s->bm_free      = NULL;
+	s->bm_cached    = 0;
+	s->bm_count     = 0;
+	INIT_LIST_HEAD(&s->bm_lru);
+}
+
+/*
+ * One bitmap per BAT entry is all the cache can use, and VHD_CACHE_SIZE
+ * bitmaps are always allowed. In between, the cache is limited by memory:
+ * see vhd_bitmap_cache_may_grow.
+ */
+static uint32_t
+vhd_bitmap_cache_limit(struct vhd_state *s)
+{
+	uint32_t max;
+
+	max = s->bat.bat.entries;
+	if (max < VHD_CACHE_SIZE)
+		max = VHD_CACHE_SIZE;
+
+	return max;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int i;
 	struct vhd_bitmap *bm;
-	void *map, *shadow;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	INIT_LIST_HEAD(&s->bm_lru);
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_free      = NULL;
+	s->bm_cached    = 0;
+	s->bm_count     = 0;
+	s->bm_max       = vhd_bitmap_cache_limit(s);
+	s->bm_hash_size = VHD_CACHE_HASH_SIZE;
+	s->bm_hash      = calloc(s->bm_hash_size, sizeof(struct vhd_bitmap *));
+	if (!s->bm_hash)
+		return -ENOMEM;
 
+	/* the minimum cache size is allocated up front; anything
+	 * beyond that is allocated as misses demand it */
 	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-
-		err = posix_memalign(&map, 512, map_size);
-		if (err)
+		bm = vhd_alloc_bitmap(s);
+		if (!bm)
 			goto fail;
 
-		bm->map = map;
+		bm->hash_next = s->bm_free;
+		s->bm_free    = bm;
+	}
 
-		err = posix_memalign(&shadow, 512, map_size);
-		if (err)
-			goto fail;
+	DBG(TLOG_INFO, "%s: bitmap cache: max %u bitmaps\n",
+	    s->vhd.file, s->bm_max);
 
-		bm->shadow = shadow;
+	return 0;
+
+fail:
+	vhd_free_bitmap_cache(s);
+	return -ENOMEM;
+}
+
+/*
+ * Extents still being read are orphaned rather than freed: vhd_complete
+ * frees them once the read is done.
+ */
+static void
+vhd_free_prefetch(struct vhd_state *s)
+{
+	int i;
+	struct vhd_prefetch *p;
+
+	for (i = 0; i < VHD_PREFETCH_BUFS; i++) {
+		p = s->pf.pf[i];
+		s->pf.pf[i] = NULL;
+
+		if (!p)
+			continue;
+
+		if (test_vhd_flag(p->status, VHD_FLAG_PF_PENDING)) {
+			ASSERT(!p->waiting.head);
+			p->req.state = NULL;
+			continue;
+		}
+
+		free(p->buf);
+		free(p);
+	}
+
+	s->pf.pending = 0;
+}
+
+/* extent buffers are only allocated once a sequential reader shows up */
+static int
+vhd_alloc_prefetch(struct vhd_state *s)
+{
+	int i, err;
+	struct vhd_prefetch *p;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+	for (i = 0; i < VHD_PREFETCH_BUFS; i++) {
+		err = ENOMEM;
+		p   = calloc(1, sizeof(*p));
+		if (p)
+			err = posix_memalign((void **)&p->buf, getpagesize(),
+					     vhd_sectors_to_bytes(s->pf.secs));
+		if (err) {
+			EPRINTF("%s: disabling prefetch: %d\n",
+				s->vhd.file, -err);
+			free(p);
+			vhd_free_prefetch(s);
+			s->pf.secs = 0;
+			return -err;
+		}
+
+		s->pf.pf[i] = p;
 	}
 
 	return 0;
+}
 
-fail:
-	vhd_free_bitmap_cache(s);
-	return err;
+/*
+ * Extents are VHD_PREFETCH_SIZE bytes, or $TAPDISK_VHD_PREFETCH_KB if
+ * set (0 disables prefetching), but never larger than a block.
+ */
+static void
+vhd_initialize_prefetch(struct vhd_state *s)
+{
+	uint64_t size;
+	const char *env;
+	char *end;
+
+	size = VHD_PREFETCH_SIZE;
+
+	env = getenv(VHD_PREFETCH_SIZE_ENV);
+	if (env) {
+		unsigned long kb = strtoul(env, &end, 10);
+		if (*env && !*end)
+			size = (uint64_t)kb << 10;
+		else
+			EPRINTF("ignoring invalid %s: '%s'\n",
+				VHD_PREFETCH_SIZE_ENV, env);
+	}
+
+	s->pf.secs = size >> VHD_SECTOR_SHIFT;
+	if (vhd_type_dynamic(&s->vhd) && s->pf.secs > s->spb)
+		s->pf.secs = s->spb;
 }
 
 static int
@@ -714,6 +953,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	s->flags  = flags;
 	s->driver = driver;
+	INIT_LIST_HEAD(&s->bm_lru);
 
 	err = vhd_initialize(s);
 	if (err)
@@ -751,6 +991,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 			goto fail;
 	}
 
+	vhd_initialize_prefetch(s);
 	vhd_log_open(s);
 
 	if(!test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
@@ -784,6 +1025,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_fd(driver, s->vhd.fd);
+
         return 0;
 
  fail:
@@ -904,6 +1147,8 @@ _vhd_close(td_driver_t *driver)
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	vhd_free_prefetch(s);
+	td_unregister_fd(driver, s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -1070,12 +1315,18 @@ transaction_completed(struct vhd_transaction *tx)
 static inline void
 init_bat(struct vhd_state *s)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
+	if (s->bat.commit_id) {
+		tapdisk_server_unregister_event(s->bat.commit_id);
+		s->bat.commit_id = 0;
+	}
+
+	s->bat.req.tx      = NULL;
+	s->bat.req.next    = NULL;
+	s->bat.req.error   = 0;
+	s->bat.pbw_count   = 0;
+	s->bat.pbw_zeroing = 0;
+	s->bat.pbw_end     = 0;
+	s->bat.status      = 0;
 }
 
 static inline void
@@ -1096,11 +1347,40 @@ bat_locked(struct vhd_state *s)
 	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
 }
 
+static inline struct vhd_bat_alloc *
+bat_pending(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+
+	for (i = 0; i < s->bat.pbw_count; i++)
+		if (s->bat.pbw[i].blk == blk)
+			return &s->bat.pbw[i];
+
+	return NULL;
+}
+
+/* may an allocation of @blk join the pending batch? */
+static inline int
+bat_batch_open(struct vhd_state *s, uint32_t blk)
+{
+	if (!bat_locked(s))
+		return 1;
+
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_COMMIT))
+		return 0;
+
+	if (s->bat.pbw_count >= VHD_BAT_BATCH_SIZE)
+		return 0;
+
+	/* the batch is committed with a single bat sector write */
+	return (s->bat.pbw[0].blk / VHD_BAT_ENTRIES_PER_SEC ==
+		blk / VHD_BAT_ENTRIES_PER_SEC);
+}
+
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -1110,17 +1390,23 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & (s->bm_hash_size - 1)];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (unlikely(!s->bm_hash))
+		return NULL;
+
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1172,40 +1458,107 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pprev;
+
+	for (pprev = bitmap_bucket(s, bm->blk); *pprev;
+	     pprev = &(*pprev)->hash_next)
+		if (*pprev == bm)
+			break;
+
+	ASSERT(*pprev == bm);
+
+	*pprev        = bm->hash_next;
+	bm->hash_next = NULL;
+	list_del_init(&bm->lru);
+	s->bm_cached--;
+}
+
+static void
+grow_bitmap_hash(struct vhd_state *s)
+{
+	uint32_t i, size;
+	struct vhd_bitmap **hash, **old, *bm, *next;
+
+	size = s->bm_hash_size << 1;
+	hash = calloc(size, sizeof(struct vhd_bitmap *));
+	if (!hash)
+		return; /* keep going with longer chains */
+
+	old             = s->bm_hash;
+	s->bm_hash      = hash;
+	s->bm_hash_size = size;
+
+	for (i = 0; i < size >> 1; i++)
+		for (bm = old[i]; bm; bm = next) {
+			next = bm->hash_next;
+			bm->hash_next = *bitmap_bucket(s, bm->blk);
+			*bitmap_bucket(s, bm->blk) = bm;
+		}
+
+	free(old);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
+
+		ASSERT(!bitmap_in_use(bm));
+		unhash_bitmap(s, bm);
+		s->bm_evictions++;
+		return bm;
 	}
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+	return NULL;
+}
+
+/*
+ * Beyond VHD_CACHE_SIZE, bitmaps come out of the budget the VBD shares
+ * between its images, or out of VHD_CACHE_BUDGET until the image has one.
+ */
+static int
+vhd_bitmap_cache_may_grow(struct vhd_state *s)
+{
+	uint64_t used, limit;
+
+	if (s->bm_count >= s->bm_max)
+		return 0;
+
+	if (s->bm_count < VHD_CACHE_SIZE)
+		return 1;
+
+	if (s->bm_budget) {
+		used  = s->bm_budget->used;
+		limit = s->bm_budget->limit;
+	} else {
+		used  = s->bm_count * vhd_bitmap_bytes(s);
+		limit = VHD_CACHE_BUDGET;
 	}
 
-	return  lru;
+	return used + vhd_bitmap_bytes(s) <= limit;
 }
 
 static int
 alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 {
-	struct vhd_bitmap *bm;
+	struct vhd_bitmap *bm = NULL;
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
-	} else {
+	if (s->bm_free) {
+		bm         = s->bm_free;
+		s->bm_free = bm->hash_next;
+	} else if (vhd_bitmap_cache_may_grow(s))
+		bm = vhd_alloc_bitmap(s);
+
+	if (!bm) {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
 			return -EBUSY;
@@ -1218,63 +1571,53 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_move_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket;
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	bucket        = bitmap_bucket(s, bm->blk);
+	bm->hash_next = *bucket;
+	*bucket       = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
+
+	if (++s->bm_cached > s->bm_hash_size)
+		grow_bitmap_hash(s);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	unhash_bitmap(s, bm);
+	bm->hash_next = s->bm_free;
+	s->bm_free    = bm;
+}
+
+/* apply a completed data write, or bitmap clear, to the shadow bitmap */
+static inline void
+update_shadow(struct vhd_state *s, struct vhd_bitmap *bm,
+	      struct vhd_request *req)
+{
+	uint32_t i, sec;
+
+	sec = req->treq.sec % s->spb;
+
+	for (i = 0; i < req->treq.secs; i++)
+		if (test_vhd_flag(req->flags, VHD_FLAG_REQ_CLEAR_BITMAP))
+			vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+		else
+			vhd_bitmap_set(&s->vhd, bm->shadow, sec + i);
 }
 
 static int
@@ -1282,6 +1625,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 {
 	uint32_t blk, sec;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 
 	/* in fixed disks, every block is present */
 	if (s->vhd.footer.type == HD_TYPE_FIXED) 
@@ -1300,9 +1644,14 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
-			return VHD_BM_BAT_LOCKED;
+		if (op == VHD_OP_DATA_WRITE && bat_locked(s)) {
+			alloc = bat_pending(s, blk);
+			if (!alloc && !bat_batch_open(s, blk))
+				return VHD_BM_BAT_LOCKED;
+			if (alloc &&
+			    test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_FAILED))
+				return VHD_BM_BAT_LOCKED;
+		}
 
 		return VHD_BM_BAT_CLEAR;
 	}
@@ -1313,10 +1662,13 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
-	/* bump lru count */
+	/* bump lru position */
+	s->bm_hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1330,8 +1682,7 @@ static int
 read_bitmap_cache_span(struct vhd_state *s, 
 		       uint64_t sector, int nr_secs, int value)
 {
-	int ret;
-	uint32_t blk, sec;
+	uint32_t blk, sec, end;
 	struct vhd_bitmap *bm;
 
 	/* in fixed disks, every block is present */
@@ -1348,11 +1699,12 @@ read_bitmap_cache_span(struct vhd_state *s,
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
-			break;
+	end = MIN(s->spb, sec + nr_secs);
 
-	return ret;
+	if (value)
+		return vhd_bitmap_find_clear(&s->vhd, bm->map, sec, end) - sec;
+
+	return vhd_bitmap_find_set(&s->vhd, bm->map, sec, end) - sec;
 }
 
 static inline struct vhd_request *
@@ -1526,39 +1878,97 @@ thin_provisioning_checks(struct vhd_state *s, uint64_t needed_sectors)
 	return ret;
 }
 
-/**
- * Reserves a new extent.
- *
- * @returns a 64-bit unsigned integer where the error code is stored in the
- * upper 32 bits and the reserved block number is stored in the lower 32 bits.
- * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
- * are undefined.
- */
-static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
-{
-	int gap = 0;
-	int ret;
+static void commit_bat_batch(struct vhd_state *);
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+static void
+vhd_bat_commit_event(event_id_t id, char mode, void *private)
+{
+	struct vhd_state *s = (struct vhd_state *)private;
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp)
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
+	tapdisk_server_unregister_event(id);
+	s->bat.commit_id = 0;
 
-	if (s->next_db + gap > UINT_MAX)
-		return (uint64_t)ENOSPC << 32;
+	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_COMMIT);
+	commit_bat_batch(s);
+}
 
-	if ((s->flags & VHD_FLAG_OPEN_THIN)) {
-		ret = thin_provisioning_checks(s, s->next_db + gap + s->spb + s->bm_secs);
+/* first sector past the blocks allocated so far, including pending ones */
+static inline uint64_t
+bat_next_db(struct vhd_state *s)
+{
+	return bat_locked(s) ? s->bat.pbw_end : s->next_db;
+}
+
+static struct vhd_bat_alloc *
+add_bat_alloc(struct vhd_state *s, uint32_t blk, uint64_t offset)
+{
+	struct vhd_bat_alloc *alloc;
+
+	ASSERT(bat_batch_open(s, blk));
+
+	if (!bat_locked(s)) {
+		lock_bat(s);
+
+		/* collect allocations until the end of this scheduler pass */
+		s->bat.commit_id =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						      -1, TV_ZERO,
+						      vhd_bat_commit_event, s);
+		if (s->bat.commit_id < 0) {
+			s->bat.commit_id = 0;
+			set_vhd_flag(s->bat.status, VHD_FLAG_BAT_COMMIT);
+		}
+	}
+
+	alloc         = &s->bat.pbw[s->bat.pbw_count++];
+	alloc->blk    = blk;
+	alloc->offset = offset;
+	alloc->status = 0;
+
+	s->bat.pbw_end = offset + s->spb + s->bm_secs;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64", batch: %d\n",
+	    blk, offset, s->bat.pbw_count);
+
+	return alloc;
+}
+
+/**
+ * Reserves a new extent and adds it to the pending bat batch.
+ *
+ * @returns a 64-bit unsigned integer where the error code is stored in the
+ * upper 32 bits and the first sector of the reserved extent (including the
+ * alignment gap) is stored in the lower 32 bits.
+ * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
+ * are undefined.
+ */
+static inline uint64_t
+reserve_new_block(struct vhd_state *s, uint32_t blk)
+{
+	int gap = 0;
+	int ret;
+	uint64_t next_db;
+
+	ASSERT(bat_batch_open(s, blk));
+
+	next_db = bat_next_db(s);
+
+	/* data region of segment should begin on page boundary */
+	if ((next_db + s->bm_secs) % s->spp)
+		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
+
+	if (next_db + gap > UINT_MAX)
+		return (uint64_t)ENOSPC << 32;
+
+	if ((s->flags & VHD_FLAG_OPEN_THIN)) {
+		ret = thin_provisioning_checks(s, next_db + gap + s->spb + s->bm_secs);
 		if (ret < 0)
 			return (uint64_t)ENOSPC << 32;
 	}
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	add_bat_alloc(s, blk, next_db + gap);
 
-	return s->next_db;
+	return next_db;
 }
 
 static int
@@ -1569,22 +1979,32 @@ schedule_bat_write(struct vhd_state *s)
 	char *buf;
 	uint64_t offset;
 	struct vhd_request *req;
+	struct vhd_bat_alloc *alloc;
 
 	ASSERT(bat_locked(s));
+	ASSERT(!s->bat.pbw_zeroing);
 
 	req = &s->bat.req;
 	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	blk = s->bat.pbw[0].blk;
+	blk -= blk % VHD_BAT_ENTRIES_PER_SEC;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, blk), VHD_SECTOR_SIZE);
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0; i < s->bat.pbw_count; i++) {
+		alloc = &s->bat.pbw[i];
+		if (test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_FAILED))
+			continue;
 
-	for (i = 0; i < 128; i++)
+		((uint32_t *)buf)[alloc->blk % VHD_BAT_ENTRIES_PER_SEC] =
+			alloc->offset;
+	}
+
+	for (i = 0; i < VHD_BAT_ENTRIES_PER_SEC; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + blk * 4;
 	req->treq.secs = 1;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
@@ -1593,33 +2013,60 @@ schedule_bat_write(struct vhd_state *s)
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "blk: 0x%04x, blks: %d, "
+	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_count, offset);
 
 	return 0;
 }
 
+/*
+ * Write the bat sector once the batch is closed and all of its bitmaps
+ * are zeroed on disk. Drop the batch if no allocation survived.
+ */
 static void
-schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+commit_bat_batch(struct vhd_state *s)
+{
+	int i;
+
+	if (!bat_locked(s) ||
+	    !test_vhd_flag(s->bat.status, VHD_FLAG_BAT_COMMIT) ||
+	    test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED) ||
+	    s->bat.pbw_zeroing)
+		return;
+
+	for (i = 0; i < s->bat.pbw_count; i++)
+		if (!test_vhd_flag(s->bat.pbw[i].status, VHD_FLAG_ALLOC_FAILED)) {
+			schedule_bat_write(s);
+			return;
+		}
+
+	DBG(TLOG_DBG, "all %d allocations failed\n", s->bat.pbw_count);
+	unlock_bat(s);
+	init_bat(s);
+}
+
+static void
+schedule_zero_bm_write(struct vhd_state *s, struct vhd_bitmap *bm,
+		       struct vhd_bat_alloc *alloc, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &alloc->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = alloc->blk * s->spb;
+	req->treq.secs = (alloc->offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    alloc->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
+	s->bat.pbw_zeroing++;
 	aio_write(s, req, offset);
 }
 
@@ -1678,12 +2125,11 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	int err;
 	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+	if (bat_pending(s, blk))
 		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1697,13 +2143,12 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
 	lb_end = reserve_new_block(s, blk);
-	if (lb_end >> 32) {
-		unlock_bat(s);
+	if (lb_end >> 32)
 		return -(lb_end >> 32);
-	}
-	schedule_zero_bm_write(s, bm, lb_end);
+
+	alloc = bat_pending(s, blk);
+	schedule_zero_bm_write(s, bm, alloc, lb_end);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 	return 0;
 }
@@ -1719,16 +2164,15 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+	if (bat_pending(s, blk)) {
 		if (s->bat.req.error)
 			return -EBUSY;
 		return 0;
 	}
 
 	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
+	next_db = bat_next_db(s);
+	offset  = vhd_sectors_to_bytes(next_db);
 
 	/* data region of segment should begin on page boundary */
 	if ((next_db + s->bm_secs) % s->spp) {
@@ -1739,13 +2183,8 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 	if (next_db > UINT_MAX)
 		return -ENOSPC;
 
-	update_next_db(s,next_db);
-
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
-
 	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	    blk, next_db);
 
 	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
 		ERR(s, -errno, "lseek failed\n");
@@ -1773,10 +2212,12 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	/* the block is zeroed already, so the bat and bitmap
+	 * writes need not be ordered against each other */
+	add_bat_alloc(s, blk, next_db);
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	commit_bat_batch(s);
 
 	return 0;
 }
@@ -1825,6 +2266,223 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 }
 
+static struct vhd_prefetch *
+find_prefetch(struct vhd_state *s, uint64_t sec)
+{
+	int i;
+	struct vhd_prefetch *p;
+
+	for (i = 0; i < VHD_PREFETCH_BUFS; i++) {
+		p = s->pf.pf[i];
+
+		if (!test_vhd_flag(p->status,
+				   VHD_FLAG_PF_PENDING | VHD_FLAG_PF_VALID) ||
+		    test_vhd_flag(p->status, VHD_FLAG_PF_STALE))
+			continue;
+
+		if (sec >= p->sec && sec < p->sec + p->secs)
+			return p;
+	}
+
+	return NULL;
+}
+
+static inline void
+copy_prefetch(struct vhd_prefetch *p, td_request_t treq)
+{
+	memcpy(treq.buf, p->buf + vhd_sectors_to_bytes(treq.sec - p->sec),
+	       vhd_sectors_to_bytes(treq.secs));
+	td_complete_request(treq, 0);
+}
+
+/*
+ * serve the head of a read whose sectors are present in this image
+ * from a prefetched extent. returns the number of sectors taken,
+ * or 0 if the read has to go to disk.
+ */
+static int
+prefetch_read(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_prefetch *p;
+	struct vhd_request *req;
+
+	if (!s->pf.pf[0])
+		return 0;
+
+	p = find_prefetch(s, treq.sec);
+	if (!p)
+		return 0;
+
+	treq.secs = MIN(treq.secs, p->sec + p->secs - treq.sec);
+
+	if (test_vhd_flag(p->status, VHD_FLAG_PF_PENDING)) {
+		req = alloc_vhd_request(s);
+		if (!req)
+			return 0;
+
+		req->treq = treq;
+		req->op   = VHD_OP_DATA_READ;
+		req->next = NULL;
+		add_to_tail(&p->waiting, req);
+	} else
+		copy_prefetch(p, treq);
+
+	s->pf.hits += treq.secs;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", nr_secs: 0x%04x, "
+	    "extent: 0x%08"PRIx64", status: 0x%x\n", s->vhd.file,
+	    treq.sec, treq.secs, p->sec, p->status);
+
+	return treq.secs;
+}
+
+static void
+invalidate_prefetch(struct vhd_state *s, uint64_t sec, uint32_t secs)
+{
+	int i;
+	struct vhd_prefetch *p;
+
+	if (!s->pf.pf[0])
+		return;
+
+	for (i = 0; i < VHD_PREFETCH_BUFS; i++) {
+		p = s->pf.pf[i];
+
+		if (!p->status ||
+		    sec >= p->sec + p->secs || sec + secs <= p->sec)
+			continue;
+
+		if (test_vhd_flag(p->status, VHD_FLAG_PF_PENDING))
+			set_vhd_flag(p->status, VHD_FLAG_PF_STALE);
+		else
+			p->status = 0;
+
+		s->pf.invalidated++;
+	}
+}
+
+/*
+ * only prefetch sectors known to be present in this image: the
+ * block must be allocated and either full or have its bitmap cached.
+ * anything else is up to the parent's own prefetcher.
+ */
+static int
+schedule_prefetch(struct vhd_state *s, struct vhd_prefetch *p, uint64_t sec)
+{
+	uint64_t offset;
+	uint32_t blk, secs;
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+
+	secs = MIN(s->pf.secs, s->driver->info.size - sec);
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		offset = sec;
+		goto make_request;
+	}
+
+	blk    = sec / s->spb;
+	secs   = MIN(secs, s->spb - (sec % s->spb));
+	offset = bat_entry(s, blk);
+
+	if (offset == DD_BLK_UNUSED)
+		return -ENOENT;
+
+	if (!test_batmap(s, blk)) {
+		bm = get_bitmap(s, blk);
+		if (!bm || !bitmap_valid(bm))
+			return -ENOENT;
+
+		if (vhd_bitmap_all_clear(&s->vhd, bm->map, sec % s->spb,
+					 sec % s->spb + secs))
+			return -ENOENT;
+	}
+
+	offset += s->bm_secs + (sec % s->spb);
+
+ make_request:
+	p->sec    = sec;
+	p->secs   = secs;
+	p->status = VHD_FLAG_PF_PENDING;
+
+	req = &p->req;
+	init_vhd_request(s, req);
+
+	req->treq.sec  = sec;
+	req->treq.secs = secs;
+	req->treq.buf  = p->buf;
+	req->treq.cb   = NULL;
+	req->op        = VHD_OP_PREFETCH;
+	req->next      = NULL;
+
+	aio_read(s, req, vhd_sectors_to_bytes(offset));
+
+	s->pf.ahead = sec + secs;
+	s->pf.pending++;
+	s->pf.issued++;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", nr_secs: 0x%04x, "
+	    "offset: 0x%08"PRIx64"\n", s->vhd.file, sec, secs, offset);
+
+	return 0;
+}
+
+static void
+vhd_prefetch(struct vhd_state *s)
+{
+	int i;
+	struct vhd_prefetch *p;
+	struct vhd_prefetch_state *pf = &s->pf;
+
+	if (!pf->secs || pf->writes ||
+	    vhd_sectors_to_bytes(pf->run) < VHD_PREFETCH_TRIGGER)
+		return;
+
+	if (!pf->pf[0] && vhd_alloc_prefetch(s))
+		return;
+
+	if (pf->ahead < pf->next_sec)
+		pf->ahead = pf->next_sec;
+
+	for (i = 0; i < VHD_PREFETCH_BUFS; i++) {
+		p = pf->pf[i];
+
+		if (pf->ahead >= s->driver->info.size ||
+		    pf->ahead >= pf->next_sec +
+				 (uint64_t)VHD_PREFETCH_BUFS * pf->secs)
+			break;
+
+		if (test_vhd_flag(p->status, VHD_FLAG_PF_PENDING))
+			continue;
+
+		/* keep extents the reader has yet to get to */
+		if (test_vhd_flag(p->status, VHD_FLAG_PF_VALID) &&
+		    p->sec < pf->ahead && p->sec + p->secs > pf->next_sec)
+			continue;
+
+		if (schedule_prefetch(s, p, pf->ahead))
+			break;
+	}
+}
+
+static inline void
+track_sequential_read(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_prefetch_state *pf = &s->pf;
+
+	if (!pf->secs)
+		return;
+
+	if (treq.sec == pf->next_sec)
+		pf->run += treq.secs;
+	else {
+		pf->run   = treq.secs;
+		pf->ahead = 0;
+	}
+
+	pf->next_sec = treq.sec + treq.secs;
+}
+
 static int
 schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 {
@@ -1852,7 +2510,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = bat_pending(s, blk)->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1885,6 +2543,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		schedule_redundant_bm_write(s, blk);
 
 	aio_write(s, req, offset);
+	s->pf.writes++;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
 	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
@@ -1893,6 +2552,43 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 }
 
+/*
+ * Zeroes sectors present in a block by clearing their bitmap bits, for
+ * zero-writes with nothing beneath us: they then read as zeroes. The
+ * request joins the bitmap transaction as a data write which needs no
+ * I/O.
+ */
+static int
+schedule_bitmap_clear(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->flags = VHD_FLAG_REQ_UPDATE_BITMAP | VHD_FLAG_REQ_CLEAR_BITMAP;
+	req->op    = VHD_OP_DATA_WRITE;
+	req->next  = NULL;
+
+	bm = get_bitmap(s, treq.sec / s->spb);
+	ASSERT(bm && bitmap_valid(bm));
+	lock_bitmap(bm);
+
+	if (bm->tx.closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+	} else
+		add_to_transaction(&bm->tx, req);
+
+	s->pf.writes++;
+	finish_data_write(req);
+
+	return 0;
+}
+
 static int 
 schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 {
@@ -1951,8 +2647,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bat_locked(s) && bat_pending(s, blk));
+		offset = bat_pending(s, blk)->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1969,7 +2665,7 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 
 	aio_write(s, req, offset);
 	lock_bitmap(bm);
-	touch_bitmap(s, bm);     /* bump lru count */
+	touch_bitmap(s, bm);     /* bump lru position */
 	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
 
 	DBG(TLOG_DBG, "%s: blk: 0x%04x, sec: 0x%08"PRIx64", nr_secs: 0x%04x, "
@@ -2013,14 +2709,57 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * Parks a block status query until the bitmap of @blk is read in,
+ * starting the read unless a data request already did. Waits are not
+ * taken from the request pool, which is sized for data requests.
+ */
+static int
+wait_for_bitmap(struct vhd_state *s, uint32_t blk, td_request_t *wait)
+{
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+	int err;
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+
+	init_vhd_request(s, req);
+	req->treq = *wait;
+	req->op   = VHD_OP_BITMAP_WAIT;
+	req->next = NULL;
+
+	bm = get_bitmap(s, blk);
+	if (!bm) {
+		err = schedule_bitmap_read(s, blk);
+		if (err) {
+			free(req);
+			return err;
+		}
+		bm = get_bitmap(s, blk);
+	}
+
+	ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
+
+	add_to_tail(&bm->waiting, req);
+	lock_bitmap(bm);
+
+	return 0;
+}
+
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+finish_bitmap_wait(struct vhd_request *req, int err)
 {
-	struct vhd_state *s = (struct vhd_state *)driver->data;
+	td_request_t treq = req->treq;
 
-	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
-	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
+	free(req);
+	treq.cb(treq, err);
+}
 
+static void
+__vhd_queue_read(struct vhd_state *s, td_request_t treq)
+{
 	while (treq.secs) {
 		int err;
 		td_request_t clone;
@@ -2045,6 +2784,12 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
+			err = prefetch_read(s, clone);
+			if (err > 0) {
+				clone.secs = err;
+				break;
+			}
+
 			err = schedule_data_read(s, clone, 0);
 			if (err)
 				goto fail;
@@ -2086,14 +2831,33 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
+	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
+
+	track_sequential_read(s, treq);
+	__vhd_queue_read(s, treq);
+	vhd_prefetch(s);
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
+	int zero;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	invalidate_prefetch(s, treq.sec, treq.secs);
+
+	/* the vbd only sends these when nothing beneath us holds data */
+	zero = treq.op == TD_OP_WRITE_ZEROES && vhd_type_dynamic(&s->vhd);
+
 	while (treq.secs) {
 		int err;
 		uint8_t flags;
@@ -2116,6 +2880,10 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (zero) {
+				td_complete_request(clone, 0);
+				break;
+			}
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -2124,6 +2892,10 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		case VHD_BM_BIT_CLEAR:
 			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (zero) {
+				td_complete_request(clone, 0);
+				break;
+			}
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -2131,7 +2903,10 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_write(s, clone, 0);
+			if (zero && !test_batmap(s, clone.sec / s->spb))
+				err = schedule_bitmap_clear(s, clone);
+			else
+				err = schedule_data_write(s, clone, 0);
 			if (err)
 				goto fail;
 			break;
@@ -2188,6 +2963,13 @@ signal_completion(struct vhd_request *list, int error)
 
 		err  = (error ? error : r->error);
 		next = r->next;
+
+		if (r->op == VHD_OP_BITMAP_WAIT) {
+			finish_bitmap_wait(r, err);
+			r = next;
+			continue;
+		}
+
 		td_complete_request(r->treq, err);
 		DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
 		    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
@@ -2204,7 +2986,6 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx;
 	struct vhd_request *r, *next;
-	int i;
 
 	if (!bm->queue.head)
 		return;
@@ -2226,12 +3007,8 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		add_to_transaction(tx, r);
 		if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
 			tx->finished++;
-			if (!r->error) {
-				uint32_t sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
-			}
+			if (!r->error)
+				update_shadow(s, bm, r);
 		}
 		r = next;
 	}
@@ -2242,27 +3019,38 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 }
 
 static void
-finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
+finish_bat_transaction(struct vhd_state *s)
 {
-	struct vhd_transaction *tx = &bm->tx;
+	int i, busy;
+	struct vhd_bitmap *bm;
 
 	if (!bat_locked(s))
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	if (!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_DONE))
 		return;
 
 	if (!s->bat.req.error)
 		goto release;
 
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
+	/* hold the bat until the failed transactions are done */
+	busy = 0;
+	for (i = 0; i < s->bat.pbw_count; i++) {
+		if (test_vhd_flag(s->bat.pbw[i].status, VHD_FLAG_ALLOC_FAILED))
+			continue;
 
-	tx->closed = 1;
-	return;
+		bm = get_bitmap(s, s->bat.pbw[i].blk);
+		if (bm && test_vhd_flag(bm->tx.status, VHD_FLAG_TX_LIVE)) {
+			bm->tx.closed = 1;
+			busy = 1;
+		}
+	}
+
+	if (busy)
+		return;
 
  release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
+	DBG(TLOG_DBG, "blks: %d\n", s->bat.pbw_count);
 	unlock_bat(s);
 	init_bat(s);
 }
@@ -2278,15 +3066,12 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		struct vhd_bat_alloc *alloc = bat_pending(s, bm->blk);
+		ASSERT(alloc && bat_locked(s));
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_TX_WAIT);
+		return;
 	}
 
 	if (tx->error) {
@@ -2307,7 +3092,7 @@ finish_bitmap_transaction(struct vhd_state *s,
 	if (!bitmap_in_use(bm))
 		unlock_bitmap(bm);
 
-	finish_bat_transaction(s, bm);
+	finish_bat_transaction(s);
 }
 
 static void
@@ -2328,42 +3113,55 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
+	int i, n;
+	struct vhd_bitmap *bm, *waiting[VHD_BAT_BATCH_SIZE];
+	struct vhd_bat_alloc *alloc;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
-
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
+	DBG(TLOG_DBG, "blks: %d, pbw_end: 0x%08"PRIx64", err %d\n",
+	    s->bat.pbw_count, s->bat.pbw_end, req->error);
 	ASSERT(bat_locked(s) &&
 	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_DONE);
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		update_next_db(s, s->bat.pbw_offset + s->spb + s->bm_secs);
-	} else
-		tx->error = req->error;
+	if (!req->error)
+		update_next_db(s, s->bat.pbw_end);
+
+	for (i = n = 0; i < s->bat.pbw_count; i++) {
+		alloc = &s->bat.pbw[i];
+		if (test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_FAILED))
+			continue;
+
+		bm = get_bitmap(s, alloc->blk);
+		ASSERT(bm && bitmap_valid(bm));
+
+		tx = &bm->tx;
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
+
+		if (!req->error)
+			bat_entry(s, alloc->blk) = alloc->offset;
+		else
+			tx->error = req->error;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+
+		if (test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_TX_WAIT))
+			waiting[n++] = bm;
+		else if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	/* release the batch first on success, so that the waiting
+	 * transactions see neither the batch nor the bat lock */
+	finish_bat_transaction(s);
+
+	for (i = 0; i < n; i++)
+		finish_bitmap_transaction(s, waiting[i], req->error);
 }
 
 static void
@@ -2371,30 +3169,33 @@ finish_zero_bm_write(struct vhd_request *req)
 {
 	uint32_t blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	blk = req->treq.sec / s->spb;
-	bm  = get_bitmap(s, blk);
+	alloc = containerof(req, struct vhd_bat_alloc, zero_req);
+	blk   = alloc->blk;
+	bm    = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
 	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(bat_pending(s, blk) == alloc);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
+	s->bat.pbw_zeroing--;
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_FAILED);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
-		schedule_bat_write(s);
+	}
+
+	commit_bat_batch(s);
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2447,15 +3248,21 @@ finish_bitmap_read(struct vhd_request *req)
 		while (r) {
 			struct vhd_request tmp;
 
-			tmp  = *r;
 			next =  r->next;
+			if (r->op == VHD_OP_BITMAP_WAIT) {
+				finish_bitmap_wait(r, 0);
+				r = next;
+				continue;
+			}
+
+			tmp  = *r;
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
 			       tmp.op == VHD_OP_DATA_WRITE);
 
 			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
+				__vhd_queue_read(s, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
 
@@ -2508,21 +3315,60 @@ finish_data_read(struct vhd_request *req)
 	signal_completion(req, 0);
 }
 
+static void
+finish_prefetch(struct vhd_request *req)
+{
+	struct vhd_prefetch *p;
+	struct vhd_request *r, *next;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	s->pf.pending--;
+	TRACE(s);
+
+	p = containerof(req, struct vhd_prefetch, req);
+	r = p->waiting.head;
+	clear_req_list(&p->waiting);
+
+	if (req->error || test_vhd_flag(p->status, VHD_FLAG_PF_STALE))
+		p->status = 0;
+	else
+		p->status = VHD_FLAG_PF_VALID;
+
+	DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", nr_secs: 0x%04x, status: 0x%x\n",
+	    p->sec, p->secs, p->status);
+
+	/* readers of a failed or overwritten extent go to disk */
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		if (p->status)
+			copy_prefetch(p, tmp.treq);
+		else
+			__vhd_queue_read(s, tmp.treq);
+
+		r = next;
+	}
+}
+
 static void
 finish_data_write(struct vhd_request *req)
 {
-	int i;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = (struct vhd_state *)req->state;
 
+	s->pf.writes--;
 	set_vhd_flag(req->flags, VHD_FLAG_REQ_FINISHED);
 
 	if (tx) {
-		uint32_t blk, sec;
+		uint32_t blk;
 		struct vhd_bitmap *bm;
 
 		blk = req->treq.sec / s->spb;
-		sec = req->treq.sec % s->spb;
 		bm  = get_bitmap(s, blk);
 
 		ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
@@ -2534,8 +3380,7 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			update_shadow(s, bm, req);
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -2555,6 +3400,17 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 	struct vhd_state *s = req->state;
 	struct iocb *io = &tiocb->iocb;
 
+	if (unlikely(!s)) {
+		/* a prefetch outliving its image, see vhd_free_prefetch */
+		struct vhd_prefetch *p;
+
+		ASSERT(req->op == VHD_OP_PREFETCH);
+		p = containerof(req, struct vhd_prefetch, req);
+		free(p->buf);
+		free(p);
+		return;
+	}
+
 	s->completed++;
 	TRACE(s);
 
@@ -2596,6 +3452,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_PREFETCH:
+		finish_prefetch(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2606,6 +3466,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2628,16 +3489,17 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: cached: %u, allocated: %u, max: %u, "
+	    "hits: %"PRIu64", misses: %"PRIu64", evictions: %"PRIu64"\n",
+	    s->bm_cached, s->bm_count, s->bm_max,
+	    s->bm_hits, s->bm_misses, s->bm_evictions);
+
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2663,11 +3525,27 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
-	}
-
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+		i++;
+	}
+
+	DBG(TLOG_WARN, "PREFETCH: secs: %u, run: 0x%08"PRIx64", next: 0x%08"
+	    PRIx64", ahead: 0x%08"PRIx64", pending: %d, writes: %d, "
+	    "issued: %"PRIu64", hits: %"PRIu64", invalidated: %"PRIu64"\n",
+	    s->pf.secs, s->pf.run, s->pf.next_sec, s->pf.ahead,
+	    s->pf.pending, s->pf.writes, s->pf.issued, s->pf.hits,
+	    s->pf.invalidated);
+	for (i = 0; i < VHD_PREFETCH_BUFS && s->pf.pf[i]; i++)
+		DBG(TLOG_WARN, "%d: lsec: 0x%08"PRIx64", secs: 0x%04x, "
+		    "status: 0x%x\n", i, s->pf.pf[i]->sec, s->pf.pf[i]->secs,
+		    s->pf.pf[i]->status);
+
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_count: %d, pbw_zeroing: %d, "
+	    "pbw_end: 0x%08"PRIx64"\n", s->bat.status, s->bat.pbw_count,
+	    s->bat.pbw_zeroing, s->bat.pbw_end);
+	for (i = 0; i < s->bat.pbw_count; i++)
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, off: 0x%08"PRIx64", "
+		    "status: 0x%x\n", i, s->bat.pbw[i].blk,
+		    s->bat.pbw[i].offset, s->bat.pbw[i].status);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2675,6 +3553,110 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "bitmap_cache", "{");
+	tapdisk_stats_field(st, "cached", "u", s->bm_cached);
+	tapdisk_stats_field(st, "allocated", "u", s->bm_count);
+	tapdisk_stats_field(st, "max", "u", s->bm_max);
+	if (s->bm_budget) {
+		tapdisk_stats_field(st, "budget", "llu", s->bm_budget->limit);
+		tapdisk_stats_field(st, "budget_used", "llu",
+				    s->bm_budget->used);
+	}
+	tapdisk_stats_field(st, "hits", "llu", s->bm_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->bm_misses);
+	tapdisk_stats_field(st, "evictions", "llu", s->bm_evictions);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "prefetch", "{");
+	tapdisk_stats_field(st, "issued", "llu", s->pf.issued);
+	tapdisk_stats_field(st, "hit_sectors", "llu", s->pf.hits);
+	tapdisk_stats_field(st, "invalidated", "llu", s->pf.invalidated);
+	tapdisk_stats_leave(st, '}');
+}
+
+static int
+vhd_get_block_map(td_driver_t *driver, uint32_t *block_secs,
+		  uint64_t *nr_blocks, uint8_t **map)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint32_t i, entries;
+	uint8_t *bits;
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return -EOPNOTSUPP;
+
+	entries = s->bat.bat.entries;
+	bits    = calloc((entries + 7) / 8, 1);
+	if (!bits)
+		return -ENOMEM;
+
+	for (i = 0; i < entries; i++)
+		if (bat_entry(s, i) != DD_BLK_UNUSED)
+			bits[i >> 3] |= 1 << (i & 7);
+
+	*block_secs = s->spb;
+	*nr_blocks  = entries;
+	*map        = bits;
+
+	return 0;
+}
+
+static int
+vhd_get_block_status(td_driver_t *driver, td_sector_t sector, uint32_t *secs,
+		     td_request_t *wait)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_bitmap *bm;
+	uint32_t blk, sec, n;
+	char *map;
+	int err, value;
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return -EOPNOTSUPP;
+
+	blk = sector / s->spb;
+	sec = sector % s->spb;
+	n   = MIN(*secs, s->spb - sec);
+
+	if (blk >= s->bat.bat.entries || bat_entry(s, blk) == DD_BLK_UNUSED) {
+		*secs = n;
+		return 0;
+	}
+
+	if (test_batmap(s, blk)) {
+		*secs = n;
+		return 1;
+	}
+
+	bm = get_bitmap(s, blk);
+	if (!bm || !bitmap_valid(bm)) {
+		if (!wait)
+			return -EAGAIN;
+
+		err = wait_for_bitmap(s, blk, wait);
+		if (!err)
+			return -EAGAIN;
+
+		/* no room to read it in: err on the side of data */
+		*secs = n;
+		return 1;
+	}
+
+	map   = bm->map;
+	value = !!vhd_bitmap_test(&s->vhd, map, sec);
+	if (value)
+		*secs = vhd_bitmap_find_clear(&s->vhd, map, sec, sec + n) - sec;
+	else
+		*secs = vhd_bitmap_find_set(&s->vhd, map, sec, sec + n) - sec;
+
+	return value;
+}
+
 int
 vhd_set_quantum(td_driver_t *driver, int quantum_mb)
 {
@@ -2702,16 +3684,60 @@ vhd_set_quantum(td_driver_t *driver, int quantum_mb)
 	return 0;
 }
 
+/*
+ * Moves the cache's charge to @budget, then gives back free and
+ * unlocked bitmaps while the budget is exceeded.
+ */
+static int
+vhd_set_cache_budget(td_driver_t *driver, td_cache_budget_t *budget)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint64_t bytes = s->bm_count * vhd_bitmap_bytes(s);
+	struct vhd_bitmap *bm;
+
+	if (s->bm_budget != budget) {
+		if (s->bm_budget)
+			s->bm_budget->used -= bytes;
+		if (budget)
+			budget->used += bytes;
+		s->bm_budget = budget;
+	}
+
+	if (!budget)
+		return 0;
+
+	while (budget->used > budget->limit && s->bm_count > VHD_CACHE_SIZE) {
+		bm = s->bm_free;
+		if (bm)
+			s->bm_free = bm->hash_next;
+		else
+			bm = remove_lru_bitmap(s);
+		if (!bm)
+			break;
+
+		vhd_release_bitmap(s, bm);
+	}
+
+	DBG(TLOG_INFO, "%s: bitmap cache: %u bitmaps, budget %"PRIu64"/%"PRIu64
+	    " bytes\n", s->vhd.file, s->bm_count, budget->used, budget->limit);
+
+	return 0;
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
-	.flags              = 0,
+	.flags              = TD_DISK_WRITE_ZEROES,
 	.private_data_size  = sizeof(struct vhd_state),
 	.td_open            = _vhd_open,
 	.td_close           = _vhd_close,
 	.td_set_quantum     = vhd_set_quantum,
+	.td_set_cache_budget = vhd_set_cache_budget,
 	.td_queue_read      = vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_get_block_map   = vhd_get_block_map,
+	.td_get_block_status = vhd_get_block_status,
 };
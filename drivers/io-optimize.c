@@ -51,6 +51,9 @@ opio_free(struct opioctx *ctx)
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->sort_queue);
+	ctx->sort_queue = NULL;
 }
 
 int
@@ -66,9 +69,10 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->free_opios    = calloc(1, sizeof(struct opio *) * num_iocbs);
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
+	ctx->sort_queue    = calloc(1, sizeof(struct opio_sort) * num_iocbs);
 
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue || !ctx->sort_queue)
 		goto fail;
 
 	for (i = 0; i < num_iocbs; i++)
@@ -101,9 +105,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -136,6 +141,12 @@ contiguous_iocbs(struct iocb *l, struct iocb *r)
 		contiguous_buffers(l, r));
 }
 
+static inline int
+opio_contiguous_buffers(struct opio *l, struct iocb *r)
+{
+	return (l->buf + l->nbytes == r->u.c.buf);
+}
+
 static inline void
 init_opio_list(struct opio *op)
 {
@@ -155,6 +166,8 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
 	op->data   = io->data;
+	op->opcode = io->aio_lio_opcode;
+	op->niov   = 1;
 	op->iocb   = io;
 	io->data   = op;
 
@@ -173,7 +186,7 @@ opio_get(struct opioctx *ctx, struct iocb *io)
 }
 
 static int
-merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io, int niov)
 {
 	struct opio *ophead, *opio;
 
@@ -186,22 +199,125 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 		return -ENOMEM;
 
 	opio->head        = ophead;
+	ophead->niov      = niov;
 	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
 	
 	return 0;
 }
 
+/*
+ * Merge sector-contiguous iocbs. If their buffers are discontiguous,
+ * the head becomes a vectored iocb in vectorize_iocb(), provided the
+ * merged iocb needs no more than OPIO_MAX_IOVS segments.
+ */
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
+	int niov = 1;
+
 	if (head->aio_lio_opcode != io->aio_lio_opcode)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	if (head->aio_fildes != io->aio_fildes ||
+	    !contiguous_sectors(head, io))
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (iocb_optimized(ctx, head)) {
+		struct opio *ophead = (struct opio *)head->data;
+
+		niov = ophead->niov;
+		if (!opio_contiguous_buffers(ophead->list.tail, io))
+			niov++;
+	} else if (!contiguous_buffers(head, io))
+		niov++;
+
+	if (niov > OPIO_MAX_IOVS)
+		return -EINVAL;
+
+	return merge_tail(ctx, head, io, niov);		
+}
+
+static void
+vectorize_iocb(struct opioctx *ctx, struct iocb *io)
+{
+	int n;
+	struct opio *ophead, *op;
+	struct iovec *iov;
+
+	if (!iocb_optimized(ctx, io))
+		return;
+
+	ophead = (struct opio *)io->data;
+	if (ophead->niov == 1)
+		return;
+
+	n   = 0;
+	iov = ophead->iov;
+	for (op = ophead; op; op = op->next) {
+		if (n && iov[n - 1].iov_base + iov[n - 1].iov_len == op->buf) {
+			iov[n - 1].iov_len += op->nbytes;
+			continue;
+		}
+
+		iov[n].iov_base = op->buf;
+		iov[n].iov_len  = op->nbytes;
+		n++;
+	}
+
+	io->aio_lio_opcode = (ophead->opcode == IO_CMD_PWRITE ?
+			      IO_CMD_PWRITEV : IO_CMD_PREADV);
+	io->u.c.nbytes     = 0;
+	io->u.v.vec        = iov;
+	io->u.v.nr         = n;
+}
+
+static int
+opio_sort_cmp(const void *_l, const void *_r)
+{
+	const struct opio_sort *l = _l, *r = _r;
+
+	if (l->iocb->aio_fildes != r->iocb->aio_fildes)
+		return l->iocb->aio_fildes < r->iocb->aio_fildes ? -1 : 1;
+
+	if (l->iocb->u.c.offset != r->iocb->u.c.offset)
+		return l->iocb->u.c.offset < r->iocb->u.c.offset ? -1 : 1;
+
+	/* keep submission order otherwise */
+	return l->idx - r->idx;
+}
+
+/*
+ * Order iocbs by fd and offset, so that requests from different
+ * sources which are contiguous on disk end up adjacent. Iocbs in one
+ * batch are in flight concurrently, so their order carries no meaning.
+ */
+static void
+sort_iocbs(struct opioctx *ctx, struct iocb **queue, int num)
+{
+	int i, sorted;
+	struct opio_sort *q;
+
+	sorted = 1;
+	for (i = 1; i < num && sorted; i++)
+		if (queue[i - 1]->aio_fildes > queue[i]->aio_fildes ||
+		    (queue[i - 1]->aio_fildes == queue[i]->aio_fildes &&
+		     queue[i - 1]->u.c.offset > queue[i]->u.c.offset))
+			sorted = 0;
+
+	if (sorted)
+		return;
+
+	q = ctx->sort_queue;
+	for (i = 0; i < num; i++) {
+		q[i].iocb = queue[i];
+		q[i].idx  = i;
+	}
+
+	qsort(q, num, sizeof(struct opio_sort), opio_sort_cmp);
+
+	for (i = 0; i < num; i++)
+		queue[i] = q[i].iocb;
 }
 
 #if (defined(TEST) || defined(DEBUG))
@@ -251,15 +367,20 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	if (!num)
 		return 0;
 
+	sort_iocbs(ctx, queue, num);
+
 	on_queue = 0;
 	q = ctx->iocb_queue;
 	memcpy(q, queue, num * sizeof(struct iocb *));
 
 	for (i = 1; i < num; i++) {
 		io = q[i];
-		if (merge(ctx, queue[on_queue], io) != 0)
+		if (merge(ctx, queue[on_queue], io) != 0) {
+			vectorize_iocb(ctx, queue[on_queue]);
 			queue[++on_queue] = io;
+		}
 	}
+	vectorize_iocb(ctx, queue[on_queue]);
 
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 
@@ -317,12 +438,17 @@ expand_event(struct opioctx *ctx,
 	struct iocb *io;
 	struct io_event *ep;
 	struct opio *ophead, *op, *next;
+	unsigned long nbytes;
 
 	io     = event->obj;
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	for (nbytes = 0; op; op = op->next)
+		nbytes += op->nbytes;
+	op = ophead;
+
+	if (event->res == nbytes)
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -375,7 +501,9 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
 	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
-	    io->u.c.buf, (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write"),
+	    io->u.c.buf, (io->aio_lio_opcode == IO_CMD_PREAD ? "read" :
+			  io->aio_lio_opcode == IO_CMD_PWRITE ? "write" :
+			  io->aio_lio_opcode == IO_CMD_PREADV ? "readv" : "writev"),
 	    (unsigned long)io->data, iocb_optimized(ctx, io));
 }
 
@@ -489,10 +617,22 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		done = num_iocbs;
 
 	for (i = 0; i < done; i++) {
+		unsigned long nbytes;
+
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+
+		nbytes  = io->u.c.nbytes;
+		if (io->aio_lio_opcode == IO_CMD_PREADV ||
+		    io->aio_lio_opcode == IO_CMD_PWRITEV) {
+			int j;
+
+			for (nbytes = 0, j = 0; j < io->u.v.nr; j++)
+				nbytes += io->u.v.vec[j].iov_len;
+		}
+
+		ep->res = (random() % 10 < 8 ? nbytes : 0);
 	}
 
 	return done;
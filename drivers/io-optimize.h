@@ -19,6 +19,10 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/* max. segments of a vectored (buffer-discontiguous) merge */
+#define OPIO_MAX_IOVS 32
 
 struct opio;
 
@@ -37,6 +41,14 @@ struct opio {
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+	short               opcode;
+	int                 niov;
+	struct iovec        iov[OPIO_MAX_IOVS];
+};
+
+struct opio_sort {
+	struct iocb        *iocb;
+	int                 idx;
 };
 
 struct opioctx {
@@ -46,6 +58,7 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+	struct opio_sort   *sort_queue;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -23,7 +23,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 
 #include "debug.h"
@@ -36,6 +38,7 @@
 #define BUG_ON(_cond)                if (_cond) td_panic()
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_EPOLL_EVENTS   256
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -43,15 +46,15 @@
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
-/**
- * Async-signal safe.
- */
 #define scheduler_for_each_event(s, event)	\
 	list_for_each_entry(event, &(s)->events, next)
 
 #define scheduler_for_each_event_safe(s, event, tmp)	\
 	list_for_each_entry_safe(event, tmp, &(s)->events, next)
 
+#define scheduler_hash(s, id)                                   \
+	(&(s)->hash[(unsigned)(id) % SCHEDULER_HASH_SIZE])
+
 typedef struct event {
 	char                         mode;
 	char                         dead;
@@ -80,150 +83,448 @@ typedef struct event {
 	event_cb_t                   cb;
 	void                        *private;
 
-	struct list_head             next;
+	/**
+	 * Position in the timer heap, or -1 if the event has no armed
+	 * timeout (infinite, masked, dead or already pending).
+	 */
+	int                          timer;
+
+	struct list_head             next;         /* events, or dead */
+	struct list_head             hash;         /* id lookup */
+	struct list_head             fd_next;      /* scheduler_fd.events */
+	struct list_head             pending_next; /* pending */
 } event_t;
 
+struct scheduler_fd {
+	int                          fd;
+	uint32_t                     interest;     /* EPOLL* currently set */
+	int                          added;
+	int                          nopoll;
+	struct list_head             events;
+	struct list_head             nopoll_next;
+};
+
+/*
+ * Timer heap
+ */
+
+static inline int
+scheduler_timer_before(event_t *a, event_t *b)
+{
+	return TV_BEFORE(a->deadline, b->deadline);
+}
+
+static inline void
+scheduler_timer_set(scheduler_t *s, int i, event_t *event)
+{
+	s->timers[i] = event;
+	event->timer = i;
+}
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_timer_up(scheduler_t *s, int i)
 {
-	struct timeval diff;
-	struct timeval now;
-	event_t *event;
+	event_t *event = s->timers[i];
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	while (i > 0) {
+		int parent = (i - 1) / 2;
 
-	s->max_fd  = -1;
-	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+		if (!scheduler_timer_before(event, s->timers[parent]))
+			break;
 
-	gettimeofday(&now, NULL);
+		scheduler_timer_set(s, i, s->timers[parent]);
+		i = parent;
+	}
 
-	scheduler_for_each_event(s, event) {
-		if (event->masked || event->dead)
-			continue;
+	scheduler_timer_set(s, i, event);
+}
 
-		if (event->mode & SCHEDULER_POLL_FD &&
-			(fcntl(event->fd, F_GETFL) < 0) &&
-			errno == EBADF)
-		{
-			EPRINTF("EBADF: Marking event dead, id: %d", event->id);
-			event->dead = 1;
-			continue;
-		}
+static void
+scheduler_timer_down(scheduler_t *s, int i)
+{
+	event_t *event = s->timers[i];
 
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	for (;;) {
+		int child = 2 * i + 1;
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		if (child >= s->n_timers)
+			break;
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		if (child + 1 < s->n_timers &&
+		    scheduler_timer_before(s->timers[child + 1],
+					   s->timers[child]))
+			child++;
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT
-				&& !TV_IS_INF(event->timeout)) {
-			TV_SUB(event->deadline, now, diff);
-			if (TV_AFTER(diff, TV_ZERO))
-				s->timeout = TV_MIN(s->timeout, diff);
-			else
-				s->timeout = TV_ZERO;
-		}
+		if (!scheduler_timer_before(s->timers[child], event))
+			break;
+
+		scheduler_timer_set(s, i, s->timers[child]);
+		i = child;
 	}
 
-	s->timeout = TV_MIN(s->timeout, s->max_timeout);
+	scheduler_timer_set(s, i, event);
+}
+
+static void
+scheduler_timer_del(scheduler_t *s, event_t *event)
+{
+	int i = event->timer;
+	event_t *last;
+
+	if (i < 0)
+		return;
+
+	event->timer = -1;
+	last = s->timers[--s->n_timers];
+	if (last == event)
+		return;
+
+	scheduler_timer_set(s, i, last);
+	scheduler_timer_up(s, i);
+	scheduler_timer_down(s, last->timer);
 }
 
 static int
-scheduler_check_fd_events(scheduler_t *s, int nfds)
+scheduler_timer_add(scheduler_t *s, event_t *event)
 {
-	event_t *event;
+	if (s->n_timers == s->max_timers) {
+		int max = s->max_timers ? 2 * s->max_timers : 64;
+		event_t **timers;
 
-	scheduler_for_each_event(s, event) {
-		if (!nfds)
-			break;
+		timers = realloc(s->timers, max * sizeof(event_t *));
+		if (!timers)
+			return -ENOMEM;
 
-		if (event->dead)
-			continue;
+		s->timers     = timers;
+		s->max_timers = max;
+	}
 
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
-			--nfds;
-		}
+	scheduler_timer_set(s, s->n_timers++, event);
+	scheduler_timer_up(s, event->timer);
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
-			--nfds;
-		}
+	return 0;
+}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
-			--nfds;
-		}
+static inline void
+scheduler_set_pending(scheduler_t *s, event_t *event, char mode)
+{
+	if (!event->pending) {
+		list_add_tail(&event->pending_next, &s->pending);
+		scheduler_timer_del(s, event);
 	}
 
-	return nfds;
+	event->pending |= mode;
+}
+
+static inline int
+scheduler_event_armed(event_t *event)
+{
+	return (event->mode & SCHEDULER_POLL_TIMEOUT) &&
+		!TV_IS_INF(event->timeout) &&
+		!event->dead && !event->masked && !event->pending;
 }
 
 /**
- * Checks all scheduler events whose mode is set to SCHEDULER_POLL_TIMEOUT
- * whether their time out has elapsed, and if so it makes them runnable.
+ * (Re)positions the event in the timer heap after a change to its
+ * deadline, mask or state.
  */
 static void
-scheduler_check_timeouts(scheduler_t *s)
+scheduler_timer_update(scheduler_t *s, event_t *event)
 {
-	struct timeval now;
-	event_t *event;
+	if (!scheduler_event_armed(event)) {
+		scheduler_timer_del(s, event);
+		return;
+	}
 
-	gettimeofday(&now, NULL);
+	if (event->timer < 0) {
+		if (scheduler_timer_add(s, event))
+			/* out of memory: run it now rather than lose it */
+			scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
+		return;
+	}
 
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
+	scheduler_timer_up(s, event->timer);
+	scheduler_timer_down(s, event->timer);
+}
 
-		if (event->dead)
-			continue;
+/*
+ * Descriptors
+ */
 
-		if (event->pending)
-			continue;
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd;
 
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-			continue;
+	if (fd >= s->n_fds) {
+		int n = MAX(fd + 1, 2 * s->n_fds);
+		struct scheduler_fd **fds;
+
+		fds = realloc(s->fds, n * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->n_fds, 0, (n - s->n_fds) * sizeof(*fds));
+		s->fds   = fds;
+		s->n_fds = n;
+	}
 
-		if (TV_IS_INF(event->timeout))
+	sfd = s->fds[fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return NULL;
+
+		sfd->fd = fd;
+		INIT_LIST_HEAD(&sfd->events);
+		INIT_LIST_HEAD(&sfd->nopoll_next);
+		s->fds[fd] = sfd;
+	}
+
+	return sfd;
+}
+
+static uint32_t
+scheduler_fd_interest(struct scheduler_fd *sfd)
+{
+	uint32_t interest = 0;
+	event_t *event;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->dead || event->masked)
 			continue;
 
-		if (TV_BEFORE(now, event->deadline))
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			interest |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			interest |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			interest |= EPOLLPRI;
+	}
+
+	return interest;
+}
+
+/**
+ * Drops every event on sfd but keep. They were registered on a file
+ * that has since been closed without unregistering them.
+ */
+static void
+scheduler_fd_reap(scheduler_t *s, struct scheduler_fd *sfd, event_t *keep)
+{
+	event_t *event, *next;
+
+	list_for_each_entry_safe(event, next, &sfd->events, fd_next) {
+		if (event == keep)
 			continue;
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+		EPRINTF("EBADF: Marking event dead, id: %d", event->id);
+
+		event->dead = 1;
+		scheduler_timer_del(s, event);
+		list_del_init(&event->pending_next);
+		list_del_init(&event->fd_next);
+		list_move_tail(&event->next, &s->dead);
 	}
 }
 
+/**
+ * Brings the epoll set in line with the events watching sfd. A new
+ * registration always goes to the kernel: epoll forgets a descriptor
+ * once it is closed, even if the number is reused right away.
+ */
 static int
-scheduler_check_events(scheduler_t *s, int nfds)
+scheduler_fd_update(scheduler_t *s, struct scheduler_fd *sfd, event_t *new)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	struct epoll_event ev;
+	uint32_t interest;
+	int err = 0;
 
-	scheduler_check_timeouts(s);
+	interest = scheduler_fd_interest(sfd);
+
+	if (sfd->nopoll) {
+		sfd->interest = interest;
+		if (!interest) {
+			list_del_init(&sfd->nopoll_next);
+			sfd->nopoll = 0;
+		}
+		return 0;
+	}
+
+	if (!new && interest == sfd->interest && sfd->added == !!interest)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = interest;
+	ev.data.fd = sfd->fd;
+
+	if (!interest) {
+		/* the fd may be gone already, that's fine */
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, sfd->fd, &ev);
+		sfd->added    = 0;
+		sfd->interest = 0;
+		return 0;
+	}
+
+	if (sfd->added) {
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+		if (err && errno == ENOENT) {
+			/* closed and reopened under the same number */
+			sfd->added = 0;
+			if (new) {
+				scheduler_fd_reap(s, sfd, new);
+				ev.events = interest = scheduler_fd_interest(sfd);
+			}
+		} else if (err)
+			err = -errno;
+	}
+
+	if (!sfd->added) {
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, sfd->fd, &ev);
+		if (err && errno == EPERM) {
+			/* regular file: always ready, as with select() */
+			sfd->nopoll = 1;
+			list_add_tail(&sfd->nopoll_next, &s->nopoll);
+			err = 0;
+		} else if (err)
+			err = -errno;
+		else
+			sfd->added = 1;
+	}
+
+	if (!err)
+		sfd->interest = interest;
 
-	return nfds;
+	return err;
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_fd_detach(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd;
+
+	if (!(event->mode & SCHEDULER_POLL_FD))
+		return;
+
+	list_del_init(&event->fd_next);
+
+	sfd = s->fds[event->fd];
+	scheduler_fd_update(s, sfd, NULL);
+
+	if (list_empty(&sfd->events)) {
+		s->fds[event->fd] = NULL;
+		free(sfd);
+	}
+}
+
+/*
+ * Event processing
+ */
+
+static void
+scheduler_prepare_events(scheduler_t *s)
+{
+	struct timeval now, diff;
+
+	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+
+	if (!list_empty(&s->pending) || !list_empty(&s->nopoll)) {
+		s->timeout = TV_ZERO;
+		return;
+	}
+
+	if (s->n_timers) {
+		gettimeofday(&now, NULL);
+
+		TV_SUB(s->timers[0]->deadline, now, diff);
+		if (TV_AFTER(diff, TV_ZERO))
+			s->timeout = TV_MIN(s->timeout, diff);
+		else
+			s->timeout = TV_ZERO;
+	}
+
+	s->timeout = TV_MIN(s->timeout, s->max_timeout);
+}
+
+static void
+scheduler_check_fd_events(scheduler_t *s, struct epoll_event *evs, int nfds)
+{
+	struct scheduler_fd *sfd;
+	event_t *event;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		uint32_t revents = evs[i].events;
+		int fd = evs[i].data.fd;
+
+		if (fd >= s->n_fds || !(sfd = s->fds[fd]))
+			continue;
+
+		/* select() reports errors and hangups as readable/writable */
+		if (revents & (EPOLLERR | EPOLLHUP))
+			revents |= EPOLLIN | EPOLLOUT;
+
+		list_for_each_entry(event, &sfd->events, fd_next) {
+			if (event->dead || event->masked)
+				continue;
+
+			if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+			    (revents & EPOLLIN))
+				scheduler_set_pending(s, event,
+						      SCHEDULER_POLL_READ_FD);
+
+			if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+			    (revents & EPOLLOUT))
+				scheduler_set_pending(s, event,
+						      SCHEDULER_POLL_WRITE_FD);
+
+			if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+			    (revents & EPOLLPRI))
+				scheduler_set_pending(s, event,
+						      SCHEDULER_POLL_EXCEPT_FD);
+		}
+	}
+
+	list_for_each_entry(sfd, &s->nopoll, nopoll_next)
+		list_for_each_entry(event, &sfd->events, fd_next) {
+			char mode;
+
+			if (event->dead || event->masked)
+				continue;
+
+			mode = event->mode & (SCHEDULER_POLL_READ_FD |
+					      SCHEDULER_POLL_WRITE_FD);
+			if (mode)
+				scheduler_set_pending(s, event, mode);
+		}
+}
+
+/**
+ * Makes every event whose deadline has elapsed runnable. Only the
+ * expired prefix of the timer heap is visited.
+ */
+static void
+scheduler_check_timeouts(scheduler_t *s)
+{
+	struct timeval now;
+	event_t *event;
+
+	gettimeofday(&now, NULL);
+
+	while (s->n_timers) {
+		event = s->timers[0];
+
+		BUG_ON(event->pending || event->masked || event->dead);
+
+		if (TV_BEFORE(now, event->deadline))
+			break;
+
+		scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT
 			&& !TV_IS_INF(event->timeout)) {
@@ -232,6 +533,8 @@ scheduler_event_callback(event_t *event, char mode)
 		TV_ADD(now, event->timeout, event->deadline);
 	}
 
+	scheduler_timer_update(s, event);
+
 	if (!event->masked)
 		event->cb(event->id, mode, event->private);
 }
@@ -242,30 +545,50 @@ scheduler_run_events(scheduler_t *s)
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	/*
+	 * Callbacks may recurse into scheduler_wait_for_events, which
+	 * keeps draining the same list, so always restart from the head.
+	 */
+	while (!list_empty(&s->pending)) {
 		char pending;
 
+		event = list_first_entry(&s->pending, event_t, pending_next);
+		list_del_init(&event->pending_next);
+
+		/* NB. must clear before cb */
+		pending = event->pending;
+		event->pending = 0;
+
 		if (event->dead)
 			continue;
 
-		pending = event->pending;
-		if (pending) {
-			event->pending = 0;
-			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
-			n_dispatched++;
-		}
+		scheduler_event_callback(s, event, pending);
+		n_dispatched++;
 	}
 
 	return n_dispatched;
 }
 
+static event_t *
+scheduler_find_event(scheduler_t *s, event_id_t id)
+{
+	event_t *event;
+
+	list_for_each_entry(event, scheduler_hash(s, id), hash)
+		if (event->id == id)
+			return event;
+
+	return NULL;
+}
+
 int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 struct timeval timeout, event_cb_t cb, void *private)
 {
+	struct scheduler_fd *sfd = NULL;
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -273,6 +596,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EBADF;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -280,6 +606,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->hash);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->pending_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -293,11 +622,43 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->private  = private;
 	event->id       = s->uuid++;
 	event->masked   = 0;
+	event->timer    = -1;
 
 	if (!s->uuid)
 		s->uuid++;
 
+	if (mode & SCHEDULER_POLL_FD) {
+		sfd = scheduler_get_fd(s, fd);
+		if (!sfd) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+
+		err = scheduler_fd_update(s, sfd, event);
+		if (err) {
+			if (err == -EBADF) {
+				EPRINTF("EBADF: Refusing event for fd %d", fd);
+				scheduler_fd_reap(s, sfd, event);
+			}
+			scheduler_fd_detach(s, event);
+			free(event);
+			return err;
+		}
+	}
+
+	err = 0;
+	if (scheduler_event_armed(event))
+		err = scheduler_timer_add(s, event);
+	if (err) {
+		scheduler_fd_detach(s, event);
+		free(event);
+		return err;
+	}
+
 	list_add_tail(&event->next, &s->events);
+	list_add_tail(&event->hash, scheduler_hash(s, event->id));
 
 	return event->id;
 }
@@ -310,11 +671,19 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->dead = 1;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event || event->dead)
+		return;
+
+	/*
+	 * Stop watching right away (the caller usually closes the fd
+	 * next), but defer the free: we may be inside its callback.
+	 */
+	event->dead = 1;
+	scheduler_timer_del(s, event);
+	list_del_init(&event->pending_next);
+	scheduler_fd_detach(s, event);
+	list_move_tail(&event->next, &s->dead);
 }
 
 void
@@ -325,11 +694,28 @@ scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->masked = !!masked;
-			break;
+	event = scheduler_find_event(s, id);
+	if (!event || event->masked == !!masked)
+		return;
+
+	event->masked = !!masked;
+
+	if (event->dead)
+		return;
+
+	if (event->mode & SCHEDULER_POLL_FD) {
+		struct scheduler_fd *sfd = s->fds[event->fd];
+
+		if (scheduler_fd_update(s, sfd, NULL) == -EBADF) {
+			/* closed under us: nobody will unregister these */
+			scheduler_fd_reap(s, sfd, NULL);
+			s->fds[event->fd] = NULL;
+			free(sfd);
+			return;
 		}
+	}
+
+	scheduler_timer_update(s, event);
 }
 
 static void
@@ -337,11 +723,11 @@ scheduler_gc_events(scheduler_t *s)
 {
 	event_t *event, *next;
 
-	scheduler_for_each_event_safe(s, event, next)
-		if (event->dead) {
-			list_del(&event->next);
-			free(event);
-		}
+	list_for_each_entry_safe(event, next, &s->dead, next) {
+		list_del(&event->next);
+		list_del(&event->hash);
+		free(event);
+	}
 }
 
 void
@@ -351,11 +737,18 @@ scheduler_set_max_timeout(scheduler_t *s, struct timeval timeout)
 		s->max_timeout = TV_MIN(s->max_timeout, timeout);
 }
 
+static int
+scheduler_timeout_ms(struct timeval tv)
+{
+	/* round up, so we don't wake just before a deadline */
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
+	struct epoll_event evs[SCHEDULER_MAX_EPOLL_EVENTS];
 	int ret;
-	struct timeval tv;
 
 	s->depth++;
 	ret = 0;
@@ -368,27 +761,26 @@ scheduler_wait_for_events(scheduler_t *s)
 
 	scheduler_prepare_events(s);
 
-	tv = s->timeout;
-
 	DBG("timeout: %ld.%ld, max_timeout: %ld.%ld\n",
 	    s->timeout.tv_sec, s->timeout.tv_usec, s->max_timeout.tv_sec, s->max_timeout.tv_usec);
 
-    do {
-    	ret = select(s->max_fd + 1, &s->read_fds, &s->write_fds,
-                &s->except_fds, &tv);
-        if (ret < 0) {
-            ret = -errno;
-            ASSERT(ret);
-        }
-    } while (ret == -EINTR);
+	ret = epoll_wait(s->epoll_fd, evs, SCHEDULER_MAX_EPOLL_EVENTS,
+			 scheduler_timeout_ms(s->timeout));
+	if (ret < 0) {
+		ret = -errno;
+		ASSERT(ret);
 
-    if (ret < 0) {
-        EPRINTF("select failed: %s\n", strerror(-ret));
-        goto out;
-    }
+		/* a signal: just recheck timeouts and go round again */
+		if (ret != -EINTR) {
+			EPRINTF("epoll_wait failed: %s\n", strerror(-ret));
+			goto out;
+		}
+		ret = 0;
+	}
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	scheduler_check_fd_events(s, evs, ret);
+	scheduler_check_timeouts(s);
+	ret = 0;
 
 	s->timeout     = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 	s->max_timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
@@ -404,19 +796,61 @@ out:
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
+	int i;
+
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid  = 1;
 	s->depth = 0;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->timeout     = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+	s->max_timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->dead);
+	INIT_LIST_HEAD(&s->pending);
+	INIT_LIST_HEAD(&s->nopoll);
+	for (i = 0; i < SCHEDULER_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&s->hash[i]);
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd < 0) {
+		int err = -errno;
+		EPRINTF("epoll_create1 failed: %s\n", strerror(-err));
+		return err;
+	}
+
+	return 0;
+}
+
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *next;
+	int i;
+
+	scheduler_for_each_event_safe(s, event, next)
+		scheduler_unregister_event(s, event->id);
+	scheduler_gc_events(s);
+
+	for (i = 0; i < s->n_fds; i++)
+		free(s->fds[i]);
+	free(s->fds);
+	s->fds   = NULL;
+	s->n_fds = 0;
+
+	free(s->timers);
+	s->timers     = NULL;
+	s->n_timers   = 0;
+	s->max_timers = 0;
+
+	if (s->epoll_fd >= 0) {
+		close(s->epoll_fd);
+		s->epoll_fd = -1;
+	}
 }
 
 int
@@ -429,22 +863,23 @@ scheduler_event_set_timeout(scheduler_t *sched, event_id_t event_id, struct time
 	if (!event_id)
 		return -EINVAL;
 
-	scheduler_for_each_event(sched, event) {
-		if (event->id == event_id) {
-			if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-				return -EINVAL;
-			event->timeout = timeo;
-			if (TV_IS_INF(event->timeout))
-				event->deadline = TV_INF;
-			else {
-				struct timeval now;
-				gettimeofday(&now, NULL);
-				TV_ADD(now, event->timeout, event->deadline);
-			}
-			return 0;
-		}
+	event = scheduler_find_event(sched, event_id);
+	if (!event)
+		return -ENOENT;
+
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+		return -EINVAL;
+
+	event->timeout = timeo;
+	if (TV_IS_INF(event->timeout))
+		event->deadline = TV_INF;
+	else {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		TV_ADD(now, event->timeout, event->deadline);
 	}
 
-	return -ENOENT;
-}
+	scheduler_timer_update(sched, event);
 
+	return 0;
+}
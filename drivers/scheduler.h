@@ -18,7 +18,7 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
+#include <sys/time.h>
 
 #include "list.h"
 
@@ -30,21 +30,47 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+#define SCHEDULER_HASH_SIZE          256
+
+struct event;
+struct scheduler_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
 
 	struct list_head             events;
+	struct list_head             dead;
+	struct list_head             pending;
+	struct list_head             hash[SCHEDULER_HASH_SIZE];
+
+	/**
+	 * Per-descriptor interest, indexed by fd. Several events may
+	 * watch the same fd, epoll only accepts it once.
+	 */
+	struct scheduler_fd        **fds;
+	int                          n_fds;
+
+	/**
+	 * Descriptors epoll refuses (regular files). select() reports
+	 * those ready at all times, so they never block a wait.
+	 */
+	struct list_head             nopoll;
+
+	/**
+	 * Binary min-heap of armed timeouts, ordered by deadline.
+	 */
+	struct event               **timers;
+	int                          n_timers;
+	int                          max_timers;
 
 	int                          uuid;
-	int                          max_fd;
 	struct timeval               timeout;
 	struct timeval               max_timeout;
 	int                          depth;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
+void scheduler_destroy(scheduler_t *);
 
 /**
  * Registers an event.
@@ -96,6 +96,15 @@ struct tapdisk_ctl_conn {
 
 	struct tapdisk_control_info *info;
 
+	/**
+	 * request handed to a worker thread
+	 */
+	struct {
+		struct tapdisk_work      work;
+		int                      worker;
+		int                      err;
+	} remote;
+
 	/**
 	 * for linked lists
 	 */
@@ -107,6 +116,9 @@ struct tapdisk_ctl_conn {
 
 #define TAPDISK_MSG_REENTER    (1<<0) /* non-blocking, idempotent */
 #define TAPDISK_MSG_VERBOSE    (1<<1) /* tell syslog about it */
+#define TAPDISK_MSG_VBD        (1<<2) /* runs on the worker owning the VBD */
+#define TAPDISK_MSG_ALL        (1<<3) /* walks all VBDs, workers quiesced */
+#define TAPDISK_MSG_ANY        (1<<4) /* VBD unknown, try each worker */
 
 struct tapdisk_control_info {
 	int (*handler)(struct tapdisk_ctl_conn *, tapdisk_message_t *,
@@ -122,6 +134,7 @@ struct tapdisk_control {
 	int                busy;
 
 	int                n_conn;
+	int                n_remote;
 	struct tapdisk_ctl_conn __conn[TD_CTL_MAX_CONNECTIONS];
 	struct tapdisk_ctl_conn *conn[TD_CTL_MAX_CONNECTIONS];
 
@@ -359,7 +372,9 @@ tapdisk_ctl_conn_write(struct tapdisk_ctl_conn *conn, void *buf, size_t size)
 
 	memcpy(conn->out.prod, buf, size);
 	conn->out.prod += size;
-	tapdisk_ctl_conn_unmask_out(conn);
+	/* on a worker, the main thread unmasks once the request is done */
+	if (!tapdisk_server_on_worker())
+		tapdisk_ctl_conn_unmask_out(conn);
 
 	return size;
 }
@@ -404,6 +419,10 @@ tapdisk_control_close(void)
 	struct tapdisk_ctl_conn *conn;
 	int i;
 
+	/* requests still running on worker threads */
+	while (td_control.n_remote)
+		tapdisk_server_iterate();
+
 	DPRINTF("tapdisk-control: draining %d connections\n",
 		td_control.n_conn);
 
@@ -533,7 +552,7 @@ tapdisk_control_list(struct tapdisk_ctl_conn *conn,
 {
 	td_vbd_t *vbd;
 	struct list_head *head;
-	int count;
+	int count, i;
 
     ASSERT(conn);
     ASSERT(request);
@@ -542,23 +561,27 @@ tapdisk_control_list(struct tapdisk_ctl_conn *conn,
 	response->type = TAPDISK_MESSAGE_LIST_RSP;
 	response->cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
 	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+	for (i = 0; i < tapdisk_server_nr_loops(); i++) {
+		head = tapdisk_server_loop_vbds(i);
+		list_for_each_entry(vbd, head, next)
+			count++;
+	}
 
-	list_for_each_entry(vbd, head, next) {
-		response->u.list.count   = count--;
-		response->u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
-		response->u.list.state   = vbd->state;
-		response->u.list.path[0] = 0;
+	for (i = 0; i < tapdisk_server_nr_loops(); i++) {
+		head = tapdisk_server_loop_vbds(i);
+		list_for_each_entry(vbd, head, next) {
+			response->u.list.count   = count--;
+			response->u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
+			response->u.list.state   = vbd->state;
+			response->u.list.path[0] = 0;
 
-		if (vbd->name)
-			strncpy(response->u.list.path, vbd->name,
-				sizeof(response->u.list.path));
+			if (vbd->name)
+				strncpy(response->u.list.path, vbd->name,
+					sizeof(response->u.list.path));
 
-		tapdisk_control_write_message(conn, response);
+			tapdisk_control_write_message(conn, response);
+		}
 	}
 
 	response->u.list.count   = count;
@@ -843,7 +866,7 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
         DPRINTF("implicitly disconnecting ring %p domid=%d, devid=%d\n",
                 blkif, blkif->domid, blkif->devid);
 
-        err = tapdisk_xenblkif_disconnect(blkif->domid, blkif->devid);
+        err = tapdisk_xenblkif_disconnect_ring(blkif);
         if (unlikely(err)) {
             EPRINTF("failed to disconnect ring %p: %s\n",
                     blkif, strerror(-err));
@@ -1034,12 +1057,16 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		tapdisk_vbd_stats(vbd, st);
 
 	} else {
-		struct list_head *list = tapdisk_server_get_all_vbds();
+		struct list_head *list;
+		int i;
 
 		tapdisk_stats_enter(st, '[');
 
-		list_for_each_entry(vbd, list, next)
-			tapdisk_vbd_stats(vbd, st);
+		for (i = 0; i < tapdisk_server_nr_loops(); i++) {
+			list = tapdisk_server_loop_vbds(i);
+			list_for_each_entry(vbd, list, next)
+				tapdisk_vbd_stats(vbd, st);
+		}
 
 		tapdisk_stats_leave(st, ']');
 	}
@@ -1119,11 +1146,14 @@ tapdisk_control_xenblkif_connect(
     } else
         pool = blkif->pool;
 
-    DPRINTF("connecting VBD %d domid=%d, devid=%d, pool %s, evt %d, poll duration %d, poll idle threshold %d\n",
-            vbd->uuid, blkif->domid, blkif->devid, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold);
+    DPRINTF("connecting VBD %d domid=%d, devid=%d, queue %d/%d, pool %s, evt %d, poll duration %d, poll idle threshold %d, persistent %d, max indirect segments %d\n",
+            vbd->uuid, blkif->domid, blkif->devid, blkif->queue, blkif->nr_queues, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold,
+            blkif->persistent, blkif->max_indirect_segments);
 
-    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->gref,
-            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold, pool, vbd);
+    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->queue,
+            blkif->nr_queues, blkif->gref,
+            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold,
+            !!blkif->persistent, blkif->max_indirect_segments, pool, vbd);
 
 out:
 	response->cookie = request->cookie;
@@ -1198,54 +1228,86 @@ out:
     return err;
 }
 
-struct tapdisk_control_info message_infos[] = {
+static int
+tapdisk_control_set_cache(
+        struct tapdisk_ctl_conn *conn __attribute__((unused)),
+        tapdisk_message_t * request, tapdisk_message_t * const response)
+{
+    tapdisk_message_cache_t *cache;
+    td_vbd_t *vbd;
+    int err;
+
+    ASSERT(request);
+    ASSERT(response);
+
+    cache = &request->u.cache;
+
+    vbd = tapdisk_server_get_vbd(request->cookie);
+    if (!vbd)
+        return -ENODEV;
+
+    DPRINTF("VBD %d bitmap cache budget %uMB\n", vbd->uuid,
+            cache->bitmap_cache_mb);
+
+    err = tapdisk_vbd_set_bitmap_cache(vbd,
+            (uint64_t)cache->bitmap_cache_mb << 20);
+    if (!err)
+        response->type = TAPDISK_MESSAGE_SET_CACHE_RSP;
+    return err;
+}
+
+struct tapdisk_control_info message_infos[TAPDISK_MESSAGE_MAX + 1] = {
 	[TAPDISK_MESSAGE_PID] = {
 		.handler = tapdisk_control_get_pid,
 		.flags   = TAPDISK_MSG_REENTER,
 	},
 	[TAPDISK_MESSAGE_LIST] = {
 		.handler = tapdisk_control_list,
-		.flags   = TAPDISK_MSG_REENTER,
+		.flags   = TAPDISK_MSG_REENTER | TAPDISK_MSG_ALL,
 	},
 	[TAPDISK_MESSAGE_ATTACH] = {
 		.handler = tapdisk_control_attach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_DETACH] = {
 		.handler = tapdisk_control_detach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
     [TAPDISK_MESSAGE_XENBLKIF_CONNECT] = {
 		.handler = tapdisk_control_xenblkif_connect,
-		.flags = TAPDISK_MSG_VERBOSE
+		.flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
 	},
     [TAPDISK_MESSAGE_XENBLKIF_DISCONNECT] = {
         .handler = tapdisk_control_xenblkif_disconnect,
-		.flags = TAPDISK_MSG_VERBOSE
+		.flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_ANY
     },
     [TAPDISK_MESSAGE_DISK_INFO] = {
         .handler = tapdisk_control_disk_info,
-        .flags = TAPDISK_MSG_VERBOSE
+        .flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
     },
 	[TAPDISK_MESSAGE_OPEN] = {
 		.handler = tapdisk_control_open_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_PAUSE] = {
 		.handler = tapdisk_control_pause_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_RESUME] = {
 		.handler = tapdisk_control_resume_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_CLOSE] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_STATS] = {
 		.handler = tapdisk_control_stats,
-		.flags   = TAPDISK_MSG_REENTER,
+		.flags   = TAPDISK_MSG_REENTER | TAPDISK_MSG_VBD | TAPDISK_MSG_ALL,
+	},
+	[TAPDISK_MESSAGE_SET_CACHE] = {
+		.handler = tapdisk_control_set_cache,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 };
 
@@ -1264,7 +1326,7 @@ tapdisk_control_receive_request(struct tapdisk_ctl_conn *conn)
 	if (err)
 		goto invalid;
 
-	if (conn->request.type > TAPDISK_MESSAGE_EXIT)
+	if (conn->request.type > TAPDISK_MESSAGE_MAX)
 		goto invalid;
 
 	conn->info = &message_infos[conn->request.type];
@@ -1304,29 +1366,38 @@ invalid:
 	goto error;
 }
 
-static void
-tapdisk_control_process_request(event_id_t event_id,
-			char mode __attribute__((unused)), void *private)
+/*
+ * Where a request runs: the worker thread owning its VBD, the first
+ * worker for requests which need to look for their VBD, or -1 for
+ * the main thread.
+ */
+static int
+tapdisk_control_request_worker(struct tapdisk_ctl_conn *conn)
 {
-	int err, excl;
-	struct tapdisk_ctl_conn *conn = private;
+	int flags = conn->info->flags;
 
-	ASSERT(conn);
-	ASSERT(event_id == conn->event_id);
+	if (!tapdisk_server_nr_workers())
+		return -1;
 
-	if (conn->event_id)
-		tapdisk_server_unregister_event(conn->event_id);
+	if (flags & TAPDISK_MSG_ANY)
+		return 0;
 
-	excl = !(conn->info->flags & TAPDISK_MSG_REENTER);
+	if ((flags & TAPDISK_MSG_ALL) &&
+	    (!(flags & TAPDISK_MSG_VBD) ||
+	     conn->request.cookie == (uint16_t)-1))
+		return -1;
 
-	if (excl)
-		td_control.busy = 1;
-	conn->in.busy = 1;
+	if (flags & TAPDISK_MSG_VBD)
+		return tapdisk_server_vbd_worker(conn->request.cookie);
 
-	memset(&conn->response, 0, sizeof(conn->response));
-	conn->response.cookie = conn->request.cookie;
+	return -1;
+}
+
+static void
+tapdisk_control_finish_request(struct tapdisk_ctl_conn *conn, int err)
+{
+	int excl;
 
-    err = conn->info->handler(conn, &conn->request, &conn->response);
     if (err) {
         conn->response.type = TAPDISK_MESSAGE_ERROR;
         conn->response.u.response.error = -err;
@@ -1334,6 +1405,8 @@ tapdisk_control_process_request(event_id_t event_id,
 	if (err || conn->response.type != TAPDISK_MESSAGE_STATS_RSP)
 	    tapdisk_control_write_message(conn, &conn->response);
 
+	excl = !(conn->info->flags & TAPDISK_MSG_REENTER);
+
 	conn->in.busy = 0;
 	if (excl) {
 		if (!list_empty(&td_control.pending)) {
@@ -1350,6 +1423,94 @@ tapdisk_control_process_request(event_id_t event_id,
 	tapdisk_control_release_connection(conn);
 }
 
+static void
+tapdisk_control_remote_done(struct tapdisk_work *work)
+{
+	struct tapdisk_ctl_conn *conn;
+
+	conn = containerof(work, struct tapdisk_ctl_conn, remote.work);
+	td_control.n_remote--;
+
+	if (conn->out.prod != conn->out.cons)
+		tapdisk_ctl_conn_unmask_out(conn);
+
+	tapdisk_control_finish_request(conn, conn->remote.err);
+}
+
+/* runs on a worker thread, completes on the main thread */
+static void
+tapdisk_control_remote_request(struct tapdisk_work *work)
+{
+	struct tapdisk_ctl_conn *conn;
+	int err;
+
+	conn = containerof(work, struct tapdisk_ctl_conn, remote.work);
+
+	err = conn->info->handler(conn, &conn->request, &conn->response);
+
+	if (err == -ENODEV && conn->info->flags & TAPDISK_MSG_ANY &&
+	    ++conn->remote.worker < tapdisk_server_nr_workers()) {
+		memset(&conn->response, 0, sizeof(conn->response));
+		conn->response.cookie = conn->request.cookie;
+		tapdisk_server_post(conn->remote.worker, work);
+		return;
+	}
+
+	conn->remote.err = err;
+	work->fn = tapdisk_control_remote_done;
+	tapdisk_server_post(-1, work);
+}
+
+static void
+tapdisk_control_process_request(event_id_t event_id,
+			char mode __attribute__((unused)), void *private)
+{
+	int err, excl, all;
+	struct tapdisk_ctl_conn *conn = private;
+
+	ASSERT(conn);
+	ASSERT(event_id == conn->event_id);
+
+	if (conn->event_id)
+		tapdisk_server_unregister_event(conn->event_id);
+
+	excl = !(conn->info->flags & TAPDISK_MSG_REENTER);
+
+	if (excl)
+		td_control.busy = 1;
+	conn->in.busy = 1;
+
+	memset(&conn->response, 0, sizeof(conn->response));
+	conn->response.cookie = conn->request.cookie;
+
+	conn->remote.worker = tapdisk_control_request_worker(conn);
+	if (conn->remote.worker >= 0) {
+		if (conn->in.event_id > 0)
+			tapdisk_server_mask_event(conn->in.event_id, 1);
+
+		conn->remote.work.fn = tapdisk_control_remote_request;
+		td_control.n_remote++;
+		tapdisk_server_post(conn->remote.worker, &conn->remote.work);
+		return;
+	}
+
+	all = conn->info->flags & TAPDISK_MSG_ALL;
+	if (all) {
+		err = tapdisk_server_quiesce_workers();
+		if (err) {
+			tapdisk_control_finish_request(conn, err);
+			return;
+		}
+	}
+
+	err = conn->info->handler(conn, &conn->request, &conn->response);
+
+	if (all)
+		tapdisk_server_release_workers();
+
+	tapdisk_control_finish_request(conn, err);
+}
+
 
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
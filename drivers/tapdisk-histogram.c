@@ -0,0 +1,81 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tapdisk-histogram.h"
+
+static uint64_t
+td_histogram_bucket_max(int idx)
+{
+	const int sub = 1 << TD_HIST_SUB_BITS;
+	int shift;
+
+	if (idx < sub)
+		return idx;
+
+	if (idx == TD_HIST_BUCKETS - 1)
+		return UINT64_MAX;
+
+	shift = idx / sub - 1;
+
+	return ((uint64_t)(sub + idx % sub + 1) << shift) - 1;
+}
+
+uint64_t
+td_histogram_percentile(const struct td_histogram *h, int permille)
+{
+	uint64_t rank, sum;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (h->count * permille + 999) / 1000;
+	if (!rank)
+		rank = 1;
+
+	for (i = 0, sum = 0; i < TD_HIST_BUCKETS; i++) {
+		sum += h->buckets[i];
+		if (sum >= rank)
+			break;
+	}
+
+	/* never report more than was seen */
+	if (i == TD_HIST_BUCKETS || td_histogram_bucket_max(i) > h->max)
+		return h->max;
+
+	return td_histogram_bucket_max(i);
+}
+
+void
+td_histogram_stats(td_stats_t *st, const char *key,
+		   const struct td_histogram *h)
+{
+	tapdisk_stats_field(st, key, "{");
+	tapdisk_stats_field(st, "count", "llu", (unsigned long long)h->count);
+	tapdisk_stats_field(st, "max", "llu", (unsigned long long)h->max);
+	tapdisk_stats_field(st, "p50", "llu",
+			    (unsigned long long)td_histogram_percentile(h, 500));
+	tapdisk_stats_field(st, "p99", "llu",
+			    (unsigned long long)td_histogram_percentile(h, 990));
+	tapdisk_stats_field(st, "p999", "llu",
+			    (unsigned long long)td_histogram_percentile(h, 999));
+	tapdisk_stats_leave(st, '}');
+}
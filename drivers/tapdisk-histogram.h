@@ -0,0 +1,78 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_HISTOGRAM_H_
+#define _TAPDISK_HISTOGRAM_H_
+
+#include <stdint.h>
+
+#include "tapdisk-metrics-stats.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Log-linear latency histogram, in microseconds. The bucket layout is
+ * the one exported through the metrics page, see
+ * tapdisk-metrics-stats.h.
+ */
+struct td_histogram {
+	uint64_t                     count;
+	uint64_t                     max;
+	uint64_t                     buckets[TD_HIST_BUCKETS];
+};
+
+static inline int
+td_histogram_bucket(uint64_t usecs)
+{
+	const int sub = 1 << TD_HIST_SUB_BITS;
+	int msb;
+
+	if (usecs < sub)
+		return usecs;
+
+	msb = 63 - __builtin_clzll(usecs);
+	if (msb > TD_HIST_MAX_BITS - 1)
+		return TD_HIST_BUCKETS - 1;
+
+	return (msb - TD_HIST_SUB_BITS + 1) * sub +
+		((usecs >> (msb - TD_HIST_SUB_BITS)) & (sub - 1));
+}
+
+static inline void
+td_histogram_add(struct td_histogram *h, int64_t usecs)
+{
+	if (usecs < 0)
+		usecs = 0;
+
+	h->buckets[td_histogram_bucket(usecs)]++;
+	h->count++;
+	if (usecs > h->max)
+		h->max = usecs;
+}
+
+/**
+ * Upper bound of the latency below which @permille/1000 of the samples
+ * fall, or 0 if there are none.
+ */
+uint64_t td_histogram_percentile(const struct td_histogram *, int permille);
+
+/**
+ * Emits count, max, p50, p99 and p999 as stats object field @key.
+ */
+void td_histogram_stats(td_stats_t *, const char *key,
+			const struct td_histogram *);
+
+#endif /* _TAPDISK_HISTOGRAM_H_ */
@@ -94,10 +94,10 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &image->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && !td_op_write(treq.op))
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly) {
+	if (td_op_write(treq.op) && rdonly) {
 		err = -EPERM;
 		goto fail;
 	}
@@ -141,6 +141,7 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 
 	switch (vreq->op) {
 	case TD_OP_WRITE:
+	case TD_OP_WRITE_ZEROES:
 		if (rdonly) {
 			err = -EPERM;
 			goto fail;
@@ -543,6 +544,11 @@ tapdisk_image_stats(td_image_t *image, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", image->stats.fail.wr);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "latency", "{");
+	td_histogram_stats(st, "read", &image->stats.latency[TD_OP_READ]);
+	td_histogram_stats(st, "write", &image->stats.latency[TD_OP_WRITE]);
+	tapdisk_stats_leave(st, '}');
+
 	tapdisk_stats_field(st, "driver", "{");
 	tapdisk_driver_stats(image->driver, st);
 	tapdisk_stats_leave(st, '}');
@@ -19,6 +19,7 @@
 #define _TAPDISK_IMAGE_H_
 
 #include "tapdisk.h"
+#include "tapdisk-histogram.h"
 
 struct td_image_handle {
 	int                          type;
@@ -44,10 +45,14 @@ struct td_image_handle {
 	 * This is because we'd have to compensate for restarts due to
 	 * -EBUSY conditions. Those can be extrapolated by following
 	 * the chain instead: sum(image[i].hits, i=0..) == vbd.secs;
+	 *
+	 * latency: of the requests completed by this image, by TD_OP_*,
+	 * since the last (re)issue of their VBD request.
 	 */
 	struct {
 		td_sector_count_t    hits;
 		td_sector_count_t    fail;
+		struct td_histogram  latency[2];
 	} stats;
 };
 
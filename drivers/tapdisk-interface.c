@@ -108,6 +108,21 @@ td_set_quantum(td_image_t *image, int quantum)
 	return -EINVAL;
 }
 
+int
+td_set_cache_budget(td_image_t *image, td_cache_budget_t *budget)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -EINVAL;
+
+	if (driver->ops->td_set_cache_budget)
+		return driver->ops->td_set_cache_budget(driver, budget);
+
+	return -EOPNOTSUPP;
+}
+
 int
 td_open(td_image_t *image)
 {
@@ -254,6 +269,23 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+void
+td_register_fd(td_driver_t *driver, int fd)
+{
+	int err;
+
+	err = tapdisk_server_register_fd(fd);
+	if (err)
+		DPRINTF("%s: fd %d not registered with I/O queue: %d\n",
+			driver->name, fd, err);
+}
+
+void
+td_unregister_fd(td_driver_t *driver, int fd)
+{
+	tapdisk_server_unregister_fd(fd);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
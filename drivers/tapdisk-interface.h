@@ -30,6 +30,7 @@ int td_close(td_image_t *);
 int td_get_parent_id(td_image_t *, td_disk_id_t *);
 int td_validate_parent(td_image_t *, td_image_t *);
 int td_set_quantum(td_image_t *, int);
+int td_set_cache_budget(td_image_t *, td_cache_budget_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
@@ -39,6 +40,8 @@ void td_complete_request(td_request_t, int);
 void td_debug(td_image_t *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
+void td_register_fd(td_driver_t *, int);
+void td_unregister_fd(td_driver_t *, int);
 void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
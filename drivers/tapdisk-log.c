@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "tapdisk-log.h"
 #include "tapdisk-utils.h"
@@ -50,9 +51,14 @@ struct tlog {
 	td_syslog_t    syslog;
 	unsigned long  errors;
 	int            facility;
+
+	/* held by writers, and while the log is reopened */
+	pthread_mutex_t lock;
 };
 
-static struct tlog tapdisk_log;
+static struct tlog tapdisk_log = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 static void
 tlog_logfile_vprint(const char *fmt, va_list ap)
@@ -134,8 +140,12 @@ tlog_syslog_close(void)
 	td_syslog_t *syslog = &tapdisk_log.syslog;
 
 	tapdisk_syslog_stats(syslog, LOG_INFO);
+	/* NB. iterates the server, must not hold the lock */
 	tapdisk_syslog_flush(syslog);
+
+	pthread_mutex_lock(&tapdisk_log.lock);
 	tapdisk_syslog_close(syslog);
+	pthread_mutex_unlock(&tapdisk_log.lock);
 }
 
 static int
@@ -144,9 +154,11 @@ tlog_syslog_open(const char *ident, int facility)
 	td_syslog_t *syslog = &tapdisk_log.syslog;
 	int err;
 
+	pthread_mutex_lock(&tapdisk_log.lock);
 	err = tapdisk_syslog_open(syslog,
 				  tapdisk_log.ident, facility,
 				  TLOG_SYSLOG_BUFSZ);
+	pthread_mutex_unlock(&tapdisk_log.lock);
 	return err;
 }
 
@@ -155,7 +167,9 @@ tlog_vsyslog(int prio, const char *fmt, va_list ap)
 {
 	td_syslog_t *syslog = &tapdisk_log.syslog;
 
+	pthread_mutex_lock(&tapdisk_log.lock);
 	tapdisk_vsyslog(syslog, prio, fmt, ap);
+	pthread_mutex_unlock(&tapdisk_log.lock);
 }
 
 void
@@ -208,8 +222,10 @@ tlog_reopen(void)
 {
 	int err;
 
+	pthread_mutex_lock(&tapdisk_log.lock);
 	tlog_logfile_close(true);
 	err = tlog_logfile_open(tapdisk_log.name, tapdisk_log.level);
+	pthread_mutex_unlock(&tapdisk_log.lock);
 	if (err)
 		return err;
 
@@ -223,7 +239,9 @@ tlog_close(void)
 	DPRINTF("tapdisk-log: closing after %lu errors\n",
 		tapdisk_log.errors);
 
+	pthread_mutex_lock(&tapdisk_log.lock);
 	tlog_logfile_close(false);
+	pthread_mutex_unlock(&tapdisk_log.lock);
 	tlog_syslog_close();
 
 	free(tapdisk_log.ident);
@@ -233,10 +251,14 @@ tlog_close(void)
 void
 tlog_precious(int force_flush)
 {
+	pthread_mutex_lock(&tapdisk_log.lock);
+
 	if (!tapdisk_log.precious || force_flush)
 		tapdisk_logfile_flush(&tapdisk_log.logfile);
 
 	tapdisk_log.precious = 1;
+
+	pthread_mutex_unlock(&tapdisk_log.lock);
 }
 
 void
@@ -245,9 +267,11 @@ __tlog_write(int level, const char *fmt, ...)
 	va_list ap;
 
 	if (level <= tapdisk_log.level) {
+		pthread_mutex_lock(&tapdisk_log.lock);
 		va_start(ap, fmt);
 		tlog_logfile_vprint(fmt, ap);
 		va_end(ap);
+		pthread_mutex_unlock(&tapdisk_log.lock);
 	}
 }
 
@@ -260,7 +284,7 @@ __tlog_error(const char *fmt, ...)
 	tlog_vsyslog(LOG_ERR, fmt, ap);
 	va_end(ap);
 
-	tapdisk_log.errors++;
+	__atomic_add_fetch(&tapdisk_log.errors, 1, __ATOMIC_RELAXED);
 }
 
 void
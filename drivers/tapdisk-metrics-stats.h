@@ -38,4 +38,97 @@ struct stats {
     uint64_t flags;
 };
 
+/*
+ * Binary metrics page, in the vdi stats file right after struct stats
+ * (at TD_METRICS_PAGE_OFFSET). Refreshed on every pass of the tapdisk
+ * event loop, so it can be sampled at any rate without tapdisk doing
+ * any formatting.
+ *
+ * The page is a seqlock: seq is odd while tapdisk updates values[].
+ * Readers copy the values they need and retry on a torn read:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+ *		memcpy(v, page->values, sizeof(v));
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while ((seq & 1) || seq != page->seq);
+ *
+ * New values are only ever appended to enum td_metrics_value; readers
+ * must ignore values[] beyond nr_values.
+ *
+ * Version 2 adds latency histograms (struct td_metrics_hists) at
+ * TD_METRICS_HIST_OFFSET, covered by the same seq.
+ */
+#define TD_METRICS_PAGE_MAGIC   0x4d334454 /* "TD3M" */
+#define TD_METRICS_PAGE_VERSION 2
+#define TD_METRICS_PAGE_OFFSET  512
+#define TD_METRICS_HIST_OFFSET  1024
+
+enum td_metrics_value {
+    TD_METRICS_TIMESTAMP_US = 0,  /* CLOCK_MONOTONIC, of the last update */
+    TD_METRICS_READ_REQS_SUBMITTED,
+    TD_METRICS_READ_REQS_COMPLETED,
+    TD_METRICS_READ_SECTORS,
+    TD_METRICS_READ_TOTAL_TICKS,
+    TD_METRICS_WRITE_REQS_SUBMITTED,
+    TD_METRICS_WRITE_REQS_COMPLETED,
+    TD_METRICS_WRITE_SECTORS,
+    TD_METRICS_WRITE_TOTAL_TICKS,
+    TD_METRICS_REQS_RECEIVED,
+    TD_METRICS_REQS_RETURNED,
+    TD_METRICS_SECS_PENDING,
+    TD_METRICS_RETRIES,
+    TD_METRICS_IO_ERRORS,
+    TD_METRICS_VBD_STATE,
+    TD_METRICS_NR_VALUES
+};
+
+struct td_metrics_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t nr_values;
+    uint64_t values[TD_METRICS_NR_VALUES];
+};
+
+/*
+ * Log-linear latency histograms, in microseconds. Values below
+ * 1 << TD_HIST_SUB_BITS get a bucket each; above, every power of two
+ * is split into 1 << TD_HIST_SUB_BITS equal buckets. Bucket i >= 4
+ * covers [(4 + i % 4) << (i / 4 - 1), (5 + i % 4) << (i / 4 - 1)).
+ * The last bucket also takes anything from 1 << TD_HIST_MAX_BITS up.
+ */
+#define TD_HIST_SUB_BITS 2
+#define TD_HIST_MAX_BITS 32
+#define TD_HIST_BUCKETS  \
+    ((TD_HIST_MAX_BITS - TD_HIST_SUB_BITS + 1) << TD_HIST_SUB_BITS)
+
+enum td_metrics_hist {
+    TD_METRICS_HIST_READ = 0,
+    TD_METRICS_HIST_WRITE,
+    TD_METRICS_HIST_FLUSH,
+    TD_METRICS_NR_HISTS
+};
+
+struct td_metrics_hists {
+    uint32_t sub_bits;
+    uint32_t nr_buckets;
+    uint64_t counts[TD_METRICS_NR_HISTS][TD_HIST_BUCKETS];
+};
+
+/*
+ * The vdi stats file is a single page. Growing any of the above must
+ * not push a later part into the next one.
+ */
+#define TD_METRICS_FILE_SIZE    4096
+
+_Static_assert(sizeof(struct stats) <= TD_METRICS_PAGE_OFFSET,
+               "struct stats overlaps the metrics page");
+_Static_assert(TD_METRICS_PAGE_OFFSET + sizeof(struct td_metrics_page) <=
+               TD_METRICS_HIST_OFFSET,
+               "metrics page overlaps the histograms");
+_Static_assert(TD_METRICS_HIST_OFFSET + sizeof(struct td_metrics_hists) <=
+               TD_METRICS_FILE_SIZE,
+               "histograms do not fit in the vdi stats page");
+
 #endif /* TAPDISK_METRICS_STATS_H */
@@ -165,6 +165,15 @@ td_metrics_vdi_start(int minor, stats_t *vdi_stats)
 
     vdi_stats->stats = vdi_stats->shm.mem;
 
+    vdi_stats->page = vdi_stats->shm.mem + TD_METRICS_PAGE_OFFSET;
+    vdi_stats->page->magic     = TD_METRICS_PAGE_MAGIC;
+    vdi_stats->page->version   = TD_METRICS_PAGE_VERSION;
+    vdi_stats->page->nr_values = TD_METRICS_NR_VALUES;
+
+    vdi_stats->hists = vdi_stats->shm.mem + TD_METRICS_HIST_OFFSET;
+    vdi_stats->hists->sub_bits   = TD_HIST_SUB_BITS;
+    vdi_stats->hists->nr_buckets = TD_HIST_BUCKETS;
+
 out:
     return err;
 }
@@ -177,6 +186,9 @@ td_metrics_vdi_stop(stats_t *vdi_stats)
     if(!vdi_stats->shm.path)
         goto end;
 
+    vdi_stats->page  = NULL;
+    vdi_stats->hists = NULL;
+
     err = shm_destroy(&vdi_stats->shm);
     if (unlikely(err)) {
         err = errno;
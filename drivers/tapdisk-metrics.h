@@ -34,6 +34,8 @@
 typedef struct {
     struct shm shm;
     struct stats *stats;
+    struct td_metrics_page *page;
+    struct td_metrics_hists *hists;
 } stats_t;
 
 typedef struct {
@@ -66,4 +68,21 @@ int td_metrics_blktap_stop(stats_t *blktap_stats);
 int td_metrics_nbd_start(stats_t *nbd_server, int minor);
 
 int td_metrics_nbd_stop(stats_t *nbd_server);
+
+/*
+ * Writer side of the binary metrics page seqlock, see
+ * tapdisk-metrics-stats.h.
+ */
+static inline void
+td_metrics_page_begin(struct td_metrics_page *page)
+{
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+td_metrics_page_end(struct td_metrics_page *page)
+{
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
 #endif /* TAPDISK_METRICS_H */
@@ -22,6 +22,8 @@
 //#include <linux/types.h>
 
 #define NBD_NEGOTIATION_MAGIC 0x00420281861253LL
+#define NBD_OPTS_MAGIC        0x49484156454F5054LL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC         0x0003e889045565a9LL
 
 #define NBD_SET_SOCK	_IO( 0xab, 0 )
 #define NBD_SET_BLKSIZE	_IO( 0xab, 1 )
@@ -40,11 +42,72 @@ enum {
 	NBD_CMD_WRITE = 1,
 	NBD_CMD_DISC = 2,
 	NBD_CMD_FLUSH = 3,
-	NBD_CMD_TRIM = 4
+	NBD_CMD_TRIM = 4,
+	NBD_CMD_WRITE_ZEROES = 6,
+	NBD_CMD_BLOCK_STATUS = 7
 };
 
 #define NBD_CMD_MASK_COMMAND 0x0000ffff
 #define NBD_CMD_FLAG_FUA (1<<16)
+#define NBD_CMD_FLAG_NO_HOLE (1<<17)
+#define NBD_CMD_FLAG_DF (1<<18)
+#define NBD_CMD_FLAG_REQ_ONE (1<<19)
+#define NBD_CMD_FLAG_FAST_ZERO (1<<20)
+
+/* handshake flags, sent by the server */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+/* client flags */
+#define NBD_FLAG_C_FIXED_NEWSTYLE NBD_FLAG_FIXED_NEWSTYLE
+#define NBD_FLAG_C_NO_ZEROES      NBD_FLAG_NO_ZEROES
+
+/* options */
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_ABORT             2
+#define NBD_OPT_LIST              3
+#define NBD_OPT_STARTTLS          5
+#define NBD_OPT_INFO              6
+#define NBD_OPT_GO                7
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT  10
+
+/* option replies */
+#define NBD_REP_ACK               1
+#define NBD_REP_SERVER            2
+#define NBD_REP_INFO              3
+#define NBD_REP_META_CONTEXT      4
+#define NBD_REP_FLAG_ERROR        (1U << 31)
+#define NBD_REP_ERR_UNSUP         (NBD_REP_FLAG_ERROR | 1)
+#define NBD_REP_ERR_POLICY        (NBD_REP_FLAG_ERROR | 2)
+#define NBD_REP_ERR_INVALID       (NBD_REP_FLAG_ERROR | 3)
+#define NBD_REP_ERR_PLATFORM      (NBD_REP_FLAG_ERROR | 4)
+#define NBD_REP_ERR_TLS_REQD      (NBD_REP_FLAG_ERROR | 5)
+#define NBD_REP_ERR_UNKNOWN       (NBD_REP_FLAG_ERROR | 6)
+#define NBD_REP_ERR_SHUTDOWN      (NBD_REP_FLAG_ERROR | 7)
+#define NBD_REP_ERR_TOO_BIG       (NBD_REP_FLAG_ERROR | 9)
+
+/* NBD_REP_INFO types */
+#define NBD_INFO_EXPORT           0
+#define NBD_INFO_NAME             1
+#define NBD_INFO_DESCRIPTION      2
+#define NBD_INFO_BLOCK_SIZE       3
+
+/* structured reply chunks */
+#define NBD_REPLY_FLAG_DONE       (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) | 2)
+
+/* "base:allocation" metadata context */
+#define NBD_META_BASE_ALLOCATION  "base:allocation"
+#define NBD_STATE_HOLE            (1 << 0)
+#define NBD_STATE_ZERO            (1 << 1)
 
 /* values for flags field */
 #define NBD_FLAG_HAS_FLAGS      (1 << 0) /* Flags are there */
@@ -54,6 +117,10 @@ enum {
 #define NBD_FLAG_ROTATIONAL     (1 << 4) /* Use elevator algorithm -
 					    rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5) /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6) /* Send WRITE_ZEROES */
+#define NBD_FLAG_SEND_DF        (1 << 7) /* Send DF (do not fragment) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8) /* Consistent across connections */
+#define NBD_FLAG_SEND_FAST_ZERO (1 << 11) /* Send FAST_ZERO */
 
 #define nbd_cmd(req) ((req)->cmd[0])
 
@@ -63,6 +130,7 @@ enum {
 
 #define NBD_REQUEST_MAGIC 0x25609513
 #define NBD_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 /* Do *not* use magics: 0x12560953 0x96744668. */
 
 #define __be32 uint32_t
@@ -91,6 +159,38 @@ struct nbd_reply {
 	char handle[8];		/* handle you got from request	*/
 };
 
+/*
+ * Chunk header of a structured reply, followed by @length bytes of
+ * type-specific payload.
+ */
+struct nbd_structured_reply {
+	__be32 magic;
+	uint16_t flags;
+	uint16_t type;
+	char handle[8];
+	__be32 length;
+} __attribute__ ((packed));
+
+/*
+ * Header of an option request from the client during fixed-newstyle
+ * negotiation, followed by @length bytes of option data.
+ */
+struct nbd_option {
+	__be64 magic;
+	__be32 option;
+	__be32 length;
+} __attribute__ ((packed));
+
+/*
+ * Header of the server's reply to an option.
+ */
+struct nbd_option_reply {
+	__be64 magic;
+	__be32 option;
+	__be32 type;
+	__be32 length;
+} __attribute__ ((packed));
+
 /*
  * XXX The following are not part of the original NBD header file.
  */
@@ -105,5 +205,6 @@ struct nbd_reply {
 #define TAPDISK_NBDSERVER_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdserver"
 
 #define TAPDISK_NBDSERVER_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd"
+#define TAPDISK_NBDSERVER_NEWSTYLE_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd-newstyle"
 
 #endif
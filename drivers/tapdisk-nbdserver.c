@@ -27,6 +27,9 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/param.h>
+#include <linux/errqueue.h>
 
 #include "debug.h"
 #include "tapdisk.h"
@@ -47,6 +50,41 @@
 
 #define NBD_SERVER_NUM_REQS TAPDISK_DATA_REQUESTS
 
+/*
+ * Granularity of holes in structured read replies, also advertised as
+ * the preferred block size.
+ */
+#define TD_NBDSERVER_HOLE_SIZE          4096
+#define TD_NBDSERVER_MAX_PAYLOAD        (32 << 20)
+#define TD_NBDSERVER_MAX_OPTION_LEN     (64 << 10)
+
+/*
+ * Bounds on the work done for a single NBD_CMD_BLOCK_STATUS.
+ */
+#define TD_NBDSERVER_MAX_EXTENTS        256
+#define TD_NBDSERVER_MAX_LOOKUPS        1024
+
+#define TD_NBDSERVER_META_ALLOCATION_ID 1
+
+/*
+ * MSG_ZEROCOPY only pays off for large payloads. The buffers the kernel
+ * still holds are bounded; past that, payloads are copied.
+ */
+#define TD_NBDSERVER_ZEROCOPY_ENV       "TAPDISK_NBD_ZEROCOPY"
+#define TD_NBDSERVER_ZEROCOPY_MIN       (32 << 10)
+#define TD_NBDSERVER_ZEROCOPY_MAX_BUFS  256
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY                     60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY                    0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY           5
+#define SO_EE_CODE_ZEROCOPY_COPIED      1
+#endif
+
 /*
  * Server
  */
@@ -66,9 +104,109 @@
 struct td_nbdserver_req {
 	td_vbd_request_t        vreq;
 	char                    id[16];
+	uint16_t                cmd;
+	uint32_t                flags;
 	struct td_iovec         iov;
+	size_t                  buf_size;
+
+	/*
+	 * Writes: position in td_nbdserver.writes. Flushes: position in
+	 * td_nbdserver.flushes, seq being the last write to wait for.
+	 */
+	struct list_head        entry;
+	uint64_t                seq;
+
+	struct td_nbdserver_zc_buf *zc;
+
+	/* NBD_CMD_BLOCK_STATUS, waiting for image metadata */
+	td_vbd_status_wait_t    status;
+	uint64_t                status_from;
+	uint32_t                status_len;
+};
+
+/*
+ * A payload buffer pinned by MSG_ZEROCOPY sends first .. first + sends - 1.
+ * Pending counts the sends not completed yet, plus one for the request
+ * until it is done sending.
+ */
+struct td_nbdserver_zc_buf {
+	struct list_head        entry;
+	void                   *base;
+	size_t                  size;
+	uint32_t                first;
+	int                     sends;
+	int                     pending;
+};
+
+/*
+ * Clients start with a small request pool which grows on demand, up to
+ * an equal share of what the server allows for all the clients.
+ */
+#define TD_NBDSERVER_MIN_REQS           16
+#define TD_NBDSERVER_MAX_REQS           (4 * (int)NBD_SERVER_NUM_REQS)
+
+struct td_nbdserver_req_pool {
+	struct list_head        entry;
+	td_nbdserver_req_t      reqs[0];
 };
 
+static int tapdisk_nbdserver_enable_client(td_nbdserver_client_t *);
+
+static int
+tapdisk_nbdserver_reqs_grow(td_nbdserver_client_t *client, int n_reqs)
+{
+	struct td_nbdserver_req_pool *pool;
+	td_nbdserver_req_t **reqs_free;
+	int i;
+
+	pool = malloc(sizeof(*pool) + n_reqs * sizeof(td_nbdserver_req_t));
+	if (!pool)
+		return -errno;
+
+	reqs_free = realloc(client->reqs_free,
+			(client->n_reqs + n_reqs) * sizeof(td_nbdserver_req_t *));
+	if (!reqs_free) {
+		free(pool);
+		return -errno;
+	}
+
+	list_add_tail(&pool->entry, &client->pools);
+	client->reqs_free = reqs_free;
+	client->n_reqs += n_reqs;
+	client->server->n_reqs += n_reqs;
+
+	for (i = 0; i < n_reqs; i++)
+		client->reqs_free[client->n_reqs_free++] = &pool->reqs[i];
+
+	return 0;
+}
+
+/*
+ * Doubles the request pool of a client that ran out of requests, unless
+ * the client already holds its share.
+ */
+static int
+tapdisk_nbdserver_reqs_expand(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_client_t *pos;
+	int n_clients = 0, share, n_reqs;
+
+	list_for_each_entry(pos, &server->clients, clientlist)
+		n_clients++;
+
+	share = MAX(TD_NBDSERVER_MAX_REQS / MAX(n_clients, 1),
+			TD_NBDSERVER_MIN_REQS);
+	share = MIN(share, (int)NBD_SERVER_NUM_REQS);
+
+	n_reqs = MIN(client->n_reqs, share - client->n_reqs);
+	n_reqs = MIN(n_reqs, TD_NBDSERVER_MAX_REQS - server->n_reqs);
+	if (n_reqs <= 0)
+		return -EBUSY;
+
+	return tapdisk_nbdserver_reqs_grow(client, n_reqs);
+}
+
 td_nbdserver_req_t *
 tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 {
@@ -76,6 +214,9 @@ tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 
 	ASSERT(client);
 
+	if (unlikely(!client->n_reqs_free))
+		tapdisk_nbdserver_reqs_expand(client);
+
 	if (likely(client->n_reqs_free))
 		req = client->reqs_free[--client->n_reqs_free];
 
@@ -92,23 +233,32 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 
 	client->reqs_free[client->n_reqs_free++] = req;
 
-	if (unlikely(client->dead && !tapdisk_nbdserver_reqs_pending(client)))
+	if (unlikely(client->dead && !tapdisk_nbdserver_reqs_pending(client))) {
 		tapdisk_nbdserver_free_client(client);
+		return;
+	}
+
+	if (unlikely(client->throttled) && !client->paused && !client->dead &&
+	    client->client_fd >= 0) {
+		client->throttled = false;
+		tapdisk_nbdserver_enable_client(client);
+	}
 }
 
 static void
 tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
 {
-	if (client->reqs) {
-		free(client->reqs);
-		client->reqs = NULL;
-	}
+	struct td_nbdserver_req_pool *pool, *next;
 
-	if (client->iovecs) {
-		free(client->iovecs);
-		client->iovecs = NULL;
+	list_for_each_entry_safe(pool, next, &client->pools, entry) {
+		list_del(&pool->entry);
+		free(pool);
 	}
 
+	client->server->n_reqs -= client->n_reqs;
+	client->n_reqs = 0;
+	client->n_reqs_free = 0;
+
 	if (client->reqs_free) {
 		free(client->reqs_free);
 		client->reqs_free = NULL;
@@ -118,44 +268,187 @@ tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
 int
 tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
 {
-	int i, err;
+	int err;
 
 	ASSERT(client);
 	ASSERT(n_reqs > 0);
 
 	INFO("Reqs init");
 
-	client->reqs = malloc(n_reqs * sizeof(td_nbdserver_req_t));
-	if (!client->reqs) {
-		err = -errno;
-		goto fail;
-	}
+	INIT_LIST_HEAD(&client->pools);
+	client->n_reqs      = 0;
+	client->n_reqs_free = 0;
+	client->reqs_free   = NULL;
 
-	client->iovecs = malloc(n_reqs * sizeof(struct td_iovec));
-	if (!client->iovecs) {
-		err = - errno;
-		goto fail;
+	err = tapdisk_nbdserver_reqs_grow(client, n_reqs);
+	if (err)
+		tapdisk_nbdserver_reqs_free(client);
+
+	return err;
+}
+
+/*
+ * Returns a page-aligned buffer of at least @size bytes.
+ */
+static inline void *
+tapdisk_nbdserver_get_buf(td_nbdserver_client_t *client, size_t size)
+{
+	return td_arena_alloc(&client->bufs, size);
+}
+
+static inline void
+tapdisk_nbdserver_put_buf(td_nbdserver_client_t *client, void *buf,
+		size_t size)
+{
+	td_arena_free(&client->bufs, buf, size);
+}
+
+static void
+tapdisk_nbdserver_zc_init(td_nbdserver_client_t *client)
+{
+	int one = 1;
+
+	if (!client->server->zerocopy)
+		return;
+
+	if (setsockopt(client->client_fd, SOL_SOCKET, SO_ZEROCOPY,
+				&one, sizeof(one))) {
+		INFO("MSG_ZEROCOPY not available: %s", strerror(errno));
+		return;
 	}
 
-	client->reqs_free = malloc(n_reqs * sizeof(td_nbdserver_req_t*));
-	if (!client->reqs_free) {
-		err = -errno;
-		goto fail;
+	client->zerocopy = true;
+}
+
+/*
+ * Tracks the payload of a request about to be sent with MSG_ZEROCOPY.
+ * It is linked before the first send, so that completions reaped while
+ * the request is still sending are accounted for.
+ */
+static int
+tapdisk_nbdserver_zc_hold(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	struct td_nbdserver_zc_buf *zc;
+
+	zc = calloc(1, sizeof(*zc));
+	if (!zc)
+		return -ENOMEM;
+
+	zc->base    = req->vreq.iov->base;
+	zc->size    = req->buf_size;
+	zc->pending = 1;
+
+	list_add_tail(&zc->entry, &client->zc_bufs);
+	client->n_zc_bufs++;
+	req->zc = zc;
+
+	return 0;
+}
+
+static void
+tapdisk_nbdserver_zc_put(td_nbdserver_client_t *client,
+		struct td_nbdserver_zc_buf *zc, int n)
+{
+	zc->pending -= n;
+	if (zc->pending)
+		return;
+
+	list_del(&zc->entry);
+	client->n_zc_bufs--;
+	tapdisk_nbdserver_put_buf(client, zc->base, zc->size);
+	free(zc);
+}
+
+/*
+ * Drops the request's hold on its payload, which is returned once the
+ * kernel is done with it too.
+ */
+static void
+tapdisk_nbdserver_zc_release(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	struct td_nbdserver_zc_buf *zc = req->zc;
+
+	req->zc = NULL;
+	tapdisk_nbdserver_zc_put(client, zc, 1);
+}
+
+static void
+tapdisk_nbdserver_zc_complete(td_nbdserver_client_t *client,
+		uint32_t lo, uint32_t hi)
+{
+	struct td_nbdserver_zc_buf *zc, *next;
+	int i, n;
+
+	list_for_each_entry_safe(zc, next, &client->zc_bufs, entry) {
+		for (i = 0, n = 0; i < zc->sends; i++)
+			if (zc->first + i - lo <= hi - lo)
+				n++;
+
+		if (n)
+			tapdisk_nbdserver_zc_put(client, zc, n);
 	}
+}
 
-	client->n_reqs      = n_reqs;
-	client->n_reqs_free = 0;
+/*
+ * Reads MSG_ZEROCOPY completions off the socket error queue.
+ */
+static void
+tapdisk_nbdserver_zc_reap(td_nbdserver_client_t *client)
+{
+	struct sock_extended_err *serr;
+	char control[128];
+	struct cmsghdr *cm;
+	struct msghdr msg;
+
+	while (!list_empty(&client->zc_bufs)) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(client->client_fd, &msg,
+					MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED &&
+			    client->zerocopy) {
+				INFO("MSG_ZEROCOPY sends are being copied, "
+						"disabling it");
+				client->zerocopy = false;
+			}
 
-	for (i = 0; i < n_reqs; i++) {
-		client->reqs[i].vreq.iov = &client->iovecs[i];
-		tapdisk_nbdserver_free_request(client, &client->reqs[i]);
+			tapdisk_nbdserver_zc_complete(client, serr->ee_info,
+					serr->ee_data);
+		}
 	}
+}
 
-	return 0;
+static void
+tapdisk_nbdserver_bufs_free(td_nbdserver_client_t *client)
+{
+	struct td_nbdserver_zc_buf *zc, *next;
 
-fail:
-	tapdisk_nbdserver_reqs_free(client);
-	return err;
+	list_for_each_entry_safe(zc, next, &client->zc_bufs, entry) {
+		list_del(&zc->entry);
+		tapdisk_nbdserver_put_buf(client, zc->base, zc->size);
+		free(zc);
+	}
+	client->n_zc_bufs = 0;
+
+	td_arena_destroy(&client->bufs);
 }
 
 static int
@@ -179,87 +472,1029 @@ tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 		return client->client_event_id;
 	}
 
-	return client->client_event_id;
-}
+	return client->client_event_id;
+}
+
+static void
+tapdisk_nbdserver_disable_client(td_nbdserver_client_t *client)
+{
+	ASSERT(client);
+	ASSERT(client->client_event_id >= 0);
+
+	INFO("Disable client");
+
+	tapdisk_server_unregister_event(client->client_event_id);
+	client->client_event_id = -1;
+}
+
+td_nbdserver_client_t *
+tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
+{
+	td_nbdserver_client_t *client = NULL;
+	int err;
+
+	ASSERT(server);
+
+	INFO("Alloc client");
+
+	client = calloc(1, sizeof(td_nbdserver_client_t));
+	if (!client) {
+		ERR("Couldn't allocate client structure: %s",
+				strerror(errno));
+		goto fail;
+	}
+
+	client->server = server;
+
+	err = tapdisk_nbdserver_reqs_init(client, TD_NBDSERVER_MIN_REQS);
+	if (err < 0) {
+		ERR("Couldn't allocate client reqs: %d", err);
+		goto fail;
+	}
+
+	err = td_arena_init(&client->bufs, "nbd-bufs", TD_NBDSERVER_BUF_SHIFT,
+			TD_NBDSERVER_BUF_SHIFT + TD_NBDSERVER_BUF_CLASSES - 1,
+			0);
+	if (err) {
+		ERR("Couldn't set up client buffers: %d", err);
+		tapdisk_nbdserver_reqs_free(client);
+		goto fail;
+	}
+
+	client->client_fd = -1;
+	client->client_event_id = -1;
+	INIT_LIST_HEAD(&client->zc_bufs);
+	INIT_LIST_HEAD(&client->clientlist);
+	list_add(&client->clientlist, &server->clients);
+
+	client->paused = 0;
+	client->dead = false;
+
+	return client;
+
+fail:
+	if (client)
+		free(client);
+
+	return NULL;
+}
+
+void
+tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
+{
+	INFO("Free client");
+
+	ASSERT(client);
+
+	if (client->client_event_id >= 0)
+		tapdisk_nbdserver_disable_client(client);
+
+	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
+		list_del(&client->clientlist);
+		tapdisk_nbdserver_reqs_free(client);
+		tapdisk_nbdserver_bufs_free(client);
+		free(client);
+	} else
+		client->dead = true;
+}
+
+static void
+*get_in_addr(struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET)
+		return &(((struct sockaddr_in*)ss)->sin_addr);
+
+	return &(((struct sockaddr_in6*)ss)->sin6_addr);
+}
+
+static int
+__tapdisk_nbdserver_sendv(int fd, struct iovec *iov, int cnt, int flags)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+
+	while (cnt > 0) {
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = cnt;
+
+		n = sendmsg(fd, &msg, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		while (cnt && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+
+		if (cnt) {
+			iov->iov_base += n;
+			iov->iov_len  -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_sendv(int fd, struct iovec *iov, int cnt)
+{
+	return __tapdisk_nbdserver_sendv(fd, iov, cnt, 0);
+}
+
+/*
+ * Sends a reply whose last iovec is read payload. Large payloads go out
+ * with MSG_ZEROCOPY, after the headers as those live on the stack; the
+ * request then records the sends pinning its buffer.
+ */
+static int
+tapdisk_nbdserver_send_payload(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, struct iovec *iov, int cnt)
+{
+	struct iovec *data = &iov[cnt - 1];
+	struct msghdr msg;
+	ssize_t n;
+	int err;
+
+	if (client->zerocopy &&
+	    client->n_zc_bufs >= TD_NBDSERVER_ZEROCOPY_MAX_BUFS)
+		tapdisk_nbdserver_zc_reap(client);
+
+	if (!client->zerocopy || data->iov_len < TD_NBDSERVER_ZEROCOPY_MIN ||
+	    client->n_zc_bufs >= TD_NBDSERVER_ZEROCOPY_MAX_BUFS)
+		return tapdisk_nbdserver_sendv(client->client_fd, iov, cnt);
+
+	if (!req->zc && tapdisk_nbdserver_zc_hold(client, req))
+		return tapdisk_nbdserver_sendv(client->client_fd, iov, cnt);
+
+	err = __tapdisk_nbdserver_sendv(client->client_fd, iov, cnt - 1,
+			MSG_MORE);
+	if (err)
+		return err;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = data;
+	msg.msg_iovlen = 1;
+
+	while (data->iov_len) {
+		n = sendmsg(client->client_fd, &msg, MSG_ZEROCOPY);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS)
+				return tapdisk_nbdserver_sendv(client->client_fd,
+						data, 1);
+			return -errno;
+		}
+
+		if (!req->zc->sends)
+			req->zc->first = client->zc_next;
+		req->zc->sends++;
+		req->zc->pending++;
+		client->zc_next++;
+
+		data->iov_base += n;
+		data->iov_len  -= n;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_send(int fd, const void *buf, size_t len)
+{
+	struct iovec iov = { (void *)buf, len };
+
+	return tapdisk_nbdserver_sendv(fd, &iov, 1);
+}
+
+static int
+tapdisk_nbdserver_recv(int fd, void *buf, size_t len)
+{
+	size_t n = 0;
+	ssize_t rc;
+
+	while (n < len) {
+		rc = recv(fd, buf + n, len - n, 0);
+		if (rc == 0)
+			return -ECONNRESET;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		n += rc;
+	}
+
+	return 0;
+}
+
+/*
+ * The protocol only defines a handful of error values.
+ */
+static uint32_t
+tapdisk_nbdserver_errno(int err)
+{
+	err = abs(err);
+
+	switch (err) {
+	case 0:
+	case EPERM:
+	case EIO:
+	case ENOMEM:
+	case EINVAL:
+	case ENOSPC:
+	case EOVERFLOW:
+	case EOPNOTSUPP:
+	case ESHUTDOWN:
+		return err;
+	default:
+		return EIO;
+	}
+}
+
+static void
+tapdisk_nbdserver_init_reply(struct nbd_reply *reply, const char *handle,
+		int error)
+{
+	reply->magic = htonl(NBD_REPLY_MAGIC);
+	reply->error = htonl(tapdisk_nbdserver_errno(error));
+	memcpy(reply->handle, handle, sizeof(reply->handle));
+}
+
+static int
+tapdisk_nbdserver_send_reply(td_nbdserver_client_t *client,
+		const char *handle, int error)
+{
+	struct nbd_reply reply;
+
+	tapdisk_nbdserver_init_reply(&reply, handle, error);
+
+	return tapdisk_nbdserver_send(client->client_fd, &reply, sizeof(reply));
+}
+
+/*
+ * Sends one structured reply chunk: the header, @hdrlen bytes of
+ * type-specific fields and @len bytes of payload. The payload of a read,
+ * @req, may be sent without copying.
+ */
+static int
+__tapdisk_nbdserver_send_chunk(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, const char *handle,
+		uint16_t flags, uint16_t type,
+		const void *hdr, size_t hdrlen, const void *data, size_t len)
+{
+	struct nbd_structured_reply reply;
+	struct iovec iov[3];
+
+	reply.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	reply.flags  = htons(flags);
+	reply.type   = htons(type);
+	reply.length = htonl(hdrlen + len);
+	memcpy(reply.handle, handle, sizeof(reply.handle));
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+	iov[1].iov_base = (void *)hdr;
+	iov[1].iov_len  = hdrlen;
+	iov[2].iov_base = (void *)data;
+	iov[2].iov_len  = len;
+
+	if (req)
+		return tapdisk_nbdserver_send_payload(client, req, iov, 3);
+
+	return tapdisk_nbdserver_sendv(client->client_fd, iov, 3);
+}
+
+static int
+tapdisk_nbdserver_send_chunk(td_nbdserver_client_t *client,
+		const char *handle, uint16_t flags, uint16_t type,
+		const void *hdr, size_t hdrlen, const void *data, size_t len)
+{
+	return __tapdisk_nbdserver_send_chunk(client, NULL, handle, flags,
+			type, hdr, hdrlen, data, len);
+}
+
+static int
+tapdisk_nbdserver_send_error_chunk(td_nbdserver_client_t *client,
+		const char *handle, int error)
+{
+	struct {
+		uint32_t error;
+		uint16_t len;
+	} __attribute__((packed)) hdr;
+
+	hdr.error = htonl(tapdisk_nbdserver_errno(error));
+	hdr.len   = 0;
+
+	return tapdisk_nbdserver_send_chunk(client, handle,
+			NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,
+			&hdr, sizeof(hdr), NULL, 0);
+}
+
+/*
+ * Fails a command which has no payload to send: with a structured error
+ * chunk when the client understands them, a simple reply otherwise.
+ */
+static int
+tapdisk_nbdserver_send_error(td_nbdserver_client_t *client,
+		const char *handle, int error)
+{
+	if (client->structured)
+		return tapdisk_nbdserver_send_error_chunk(client, handle, error);
+
+	return tapdisk_nbdserver_send_reply(client, handle, error);
+}
+
+static inline int
+tapdisk_nbdserver_is_zero(const char *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/*
+ * Sends the data of a completed read as structured reply chunks, with
+ * runs of zeroes sent as holes unless the client asked for a single
+ * chunk.
+ */
+static int
+tapdisk_nbdserver_send_read(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	const char *buf = vreq->iov->base;
+	size_t len = vreq->iov->secs << SECTOR_SHIFT;
+	uint64_t from = vreq->sec << SECTOR_SHIFT;
+	size_t off, end, n;
+	uint16_t flags;
+	int zero, err;
+	struct {
+		uint64_t offset;
+		uint32_t len;
+	} __attribute__((packed)) hdr;
+
+	if (!len)
+		return tapdisk_nbdserver_send_chunk(client, req->id,
+				NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+				NULL, 0, NULL, 0);
+
+	for (off = 0; off < len; off = end) {
+		if (req->flags & NBD_CMD_FLAG_DF) {
+			zero = 0;
+			end  = len;
+		} else {
+			n    = MIN(len - off, TD_NBDSERVER_HOLE_SIZE);
+			zero = tapdisk_nbdserver_is_zero(buf + off, n);
+			for (end = off + n; end < len; end += n) {
+				n = MIN(len - end, TD_NBDSERVER_HOLE_SIZE);
+				if (tapdisk_nbdserver_is_zero(buf + end, n) != zero)
+					break;
+			}
+		}
+
+		flags      = end == len ? NBD_REPLY_FLAG_DONE : 0;
+		hdr.offset = htonll(from + off);
+		hdr.len    = htonl(end - off);
+
+		if (zero)
+			err = tapdisk_nbdserver_send_chunk(client, req->id,
+					flags, NBD_REPLY_TYPE_OFFSET_HOLE,
+					&hdr, sizeof(hdr), NULL, 0);
+		else
+			err = __tapdisk_nbdserver_send_chunk(client, req,
+					req->id, flags, NBD_REPLY_TYPE_OFFSET_DATA,
+					&hdr, sizeof(hdr.offset),
+					buf + off, end - off);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Answers NBD_CMD_BLOCK_STATUS for the "base:allocation" context from the
+ * allocation state of the image chain. Replies may cover less than the
+ * requested range. Returns -EAGAIN, having sent nothing, while image
+ * metadata is read in: req->status.cb then starts over.
+ */
+static int
+tapdisk_nbdserver_block_status(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	td_nbdserver_t *server = client->server;
+	uint32_t descs[2 * TD_NBDSERVER_MAX_EXTENTS];
+	const char *handle = req->id;
+	uint64_t from = req->status_from;
+	uint32_t len = req->status_len;
+	uint64_t pos, end, size, run;
+	uint32_t context, secs, state;
+	td_sector_t sec;
+	int i, n, status;
+
+	if (!client->structured || !client->meta_allocation)
+		return tapdisk_nbdserver_send_error(client, handle, -EINVAL);
+
+	size = server->info.size << SECTOR_SHIFT;
+	if (!len || from >= size || len > size - from)
+		return tapdisk_nbdserver_send_error(client, handle, -EINVAL);
+
+	end = from + len;
+	n   = 0;
+
+	for (i = 0, pos = from; pos < end && i < TD_NBDSERVER_MAX_LOOKUPS; i++) {
+		sec  = pos >> SECTOR_SHIFT;
+		secs = ((end + (1 << SECTOR_SHIFT) - 1) >> SECTOR_SHIFT) - sec;
+
+		status = tapdisk_vbd_block_status(server->vbd, sec, &secs,
+				&req->status);
+		if (status == -EAGAIN)
+			return status;
+		if (status < 0)
+			return tapdisk_nbdserver_send_error(client, handle, status);
+
+		run   = MIN((sec + secs) << SECTOR_SHIFT, end) - pos;
+		state = status ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+
+		if (n && ntohl(descs[2 * n - 1]) == state)
+			descs[2 * n - 2] = htonl(ntohl(descs[2 * n - 2]) + run);
+		else {
+			if (n == TD_NBDSERVER_MAX_EXTENTS ||
+			    (n && (req->flags & NBD_CMD_FLAG_REQ_ONE)))
+				break;
+			descs[2 * n]     = htonl(run);
+			descs[2 * n + 1] = htonl(state);
+			n++;
+		}
+
+		pos += run;
+	}
+
+	context = htonl(TD_NBDSERVER_META_ALLOCATION_ID);
+
+	return tapdisk_nbdserver_send_chunk(client, handle,
+			NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+			&context, sizeof(context), descs, n * 2 * sizeof(uint32_t));
+}
+
+/*
+ * Runs a block status request, or finishes it after a wait for image
+ * metadata (@error being the outcome of the metadata read).
+ */
+static void
+tapdisk_nbdserver_run_block_status(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, int error)
+{
+	int err;
+
+	if (client->dead || client->client_fd < 0) {
+		tapdisk_nbdserver_free_request(client, req);
+		return;
+	}
+
+	if (error)
+		err = tapdisk_nbdserver_send_error(client, req->id, error);
+	else {
+		err = tapdisk_nbdserver_block_status(client, req);
+		if (err == -EAGAIN)
+			return;
+	}
+
+	tapdisk_nbdserver_free_request(client, req);
+	if (err) {
+		ERR("Failed to send block status: %s", strerror(-err));
+		tapdisk_nbdserver_free_client(client);
+	}
+}
+
+static void
+tapdisk_nbdserver_block_status_cb(td_vbd_status_wait_t *wait, int error)
+{
+	td_nbdserver_req_t *req =
+		containerof(wait, td_nbdserver_req_t, status);
+
+	tapdisk_nbdserver_run_block_status(req->vreq.token, req, error);
+}
+
+static void
+tapdisk_nbdserver_start_write(td_nbdserver_t *server, td_nbdserver_req_t *req)
+{
+	req->seq = ++server->write_seq;
+	list_add_tail(&req->entry, &server->writes);
+}
+
+/*
+ * Answers the flushes that no longer wait for any write. Completed
+ * writes are as durable as tapdisk makes them, so a flush only has to
+ * wait for the writes in flight when it was received, on any client.
+ */
+static void
+tapdisk_nbdserver_complete_flushes(td_nbdserver_t *server)
+{
+	td_nbdserver_req_t *req, *next;
+	td_nbdserver_client_t *client;
+	uint64_t oldest = UINT64_MAX;
+	int err;
+
+	if (!list_empty(&server->writes))
+		oldest = list_first_entry(&server->writes,
+				td_nbdserver_req_t, entry)->seq;
+
+	list_for_each_entry_safe(req, next, &server->flushes, entry) {
+		if (req->seq >= oldest)
+			break;
+
+		list_del(&req->entry);
+		client = req->vreq.token;
+
+		if (client->client_fd >= 0) {
+			err = tapdisk_nbdserver_send_reply(client, req->id, 0);
+			if (err)
+				ERR("Failed to reply to flush: %s",
+						strerror(-err));
+		}
+
+		tapdisk_nbdserver_free_request(client, req);
+	}
+}
+
+static void
+tapdisk_nbdserver_flush(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	td_nbdserver_t *server = client->server;
+
+	req->seq        = server->write_seq;
+	req->vreq.token = client;
+	list_add_tail(&req->entry, &server->flushes);
+
+	tapdisk_nbdserver_complete_flushes(server);
+}
+
+static void __tapdisk_nbdserver_request_cb(td_vbd_request_t *, int,
+		void *, int);
+
+/*
+ * Queues an NBD_CMD_WRITE_ZEROES against the shared zero buffer. With
+ * NBD_CMD_FLAG_FAST_ZERO the command fails unless the range can be
+ * zeroed without writing data.
+ */
+static int
+tapdisk_nbdserver_write_zeroes(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, uint64_t from, uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	td_vbd_request_t *vreq = &req->vreq;
+	td_sector_t sec, secs;
+	char *zeroes;
+	int i, err;
+
+	if (td_flag_test(server->vbd->flags, TD_OPEN_RDONLY)) {
+		err = -EPERM;
+		goto reply;
+	}
+
+	sec  = from >> SECTOR_SHIFT;
+	secs = len >> SECTOR_SHIFT;
+
+	if (!secs || (from | len) & ((1 << SECTOR_SHIFT) - 1) ||
+	    sec >= server->info.size || secs > server->info.size - sec) {
+		err = -EINVAL;
+		goto reply;
+	}
+
+	if (req->flags & NBD_CMD_FLAG_FAST_ZERO &&
+	    (req->flags & NBD_CMD_FLAG_NO_HOLE ||
+	     tapdisk_vbd_can_zero(server->vbd, sec, secs) != 1)) {
+		err = -EOPNOTSUPP;
+		goto reply;
+	}
+
+	zeroes = tapdisk_zeroes();
+	if (!zeroes) {
+		err = -ENOMEM;
+		goto reply;
+	}
+
+	vreq->iovcnt = (secs + (TD_ZEROES_SIZE >> SECTOR_SHIFT) - 1) /
+		(TD_ZEROES_SIZE >> SECTOR_SHIFT);
+	vreq->iov = &req->iov;
+	if (vreq->iovcnt > 1) {
+		vreq->iov = calloc(vreq->iovcnt, sizeof(struct td_iovec));
+		if (!vreq->iov) {
+			err = -ENOMEM;
+			goto reply;
+		}
+	}
+
+	for (i = 0; i < vreq->iovcnt; i++) {
+		vreq->iov[i].base = zeroes;
+		vreq->iov[i].secs = MIN(secs, TD_ZEROES_SIZE >> SECTOR_SHIFT);
+		secs -= vreq->iov[i].secs;
+	}
+
+	vreq->op    = req->flags & NBD_CMD_FLAG_NO_HOLE ?
+		TD_OP_WRITE : TD_OP_WRITE_ZEROES;
+	vreq->sec   = sec;
+	vreq->token = client;
+	vreq->cb    = __tapdisk_nbdserver_request_cb;
+	vreq->name  = req->id;
+	vreq->vbd   = server->vbd;
+
+	server->nbd_stats.stats->write_reqs_submitted++;
+	tapdisk_nbdserver_start_write(server, req);
+
+	err = tapdisk_vbd_queue_request(server->vbd, vreq);
+	if (err) {
+		ERR("tapdisk_vbd_queue_request failed: %d", err);
+		list_del(&req->entry);
+		if (vreq->iov != &req->iov)
+			free(vreq->iov);
+		tapdisk_nbdserver_free_request(client, req);
+	}
+
+	return err;
+
+reply:
+	err = tapdisk_nbdserver_send_error(client, req->id, err);
+	tapdisk_nbdserver_free_request(client, req);
+	return err;
+}
+
+static int
+tapdisk_nbdserver_send_option_reply(td_nbdserver_client_t *client,
+		uint32_t option, uint32_t type, const void *data, uint32_t len)
+{
+	struct nbd_option_reply reply;
+	struct iovec iov[2];
+
+	reply.magic  = htonll(NBD_REP_MAGIC);
+	reply.option = htonl(option);
+	reply.type   = htonl(type);
+	reply.length = htonl(len);
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len  = len;
+
+	return tapdisk_nbdserver_sendv(client->client_fd, iov, 2);
+}
+
+static uint16_t
+tapdisk_nbdserver_transmission_flags(td_nbdserver_client_t *client)
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS;
+
+	if (td_flag_test(client->server->vbd->flags, TD_OPEN_RDONLY))
+		flags |= NBD_FLAG_READ_ONLY;
+
+	if (client->structured)
+		flags |= NBD_FLAG_SEND_DF;
+
+	flags |= NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_SEND_FAST_ZERO;
+	flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_CAN_MULTI_CONN;
+
+	return flags;
+}
+
+static int
+tapdisk_nbdserver_opt_export_name(td_nbdserver_client_t *client)
+{
+	char buf[sizeof(uint64_t) + sizeof(uint16_t) + 124];
+	uint64_t size;
+	uint16_t flags;
+	size_t len;
+
+	size  = htonll(client->server->info.size *
+		       client->server->info.sector_size);
+	flags = htons(tapdisk_nbdserver_transmission_flags(client));
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &size, sizeof(size));
+	memcpy(buf + sizeof(size), &flags, sizeof(flags));
+
+	len = sizeof(buf);
+	if (client->no_zeroes)
+		len = sizeof(size) + sizeof(flags);
+
+	client->phase = TD_NBDSERVER_TRANSMISSION;
+
+	return tapdisk_nbdserver_send(client->client_fd, buf, len);
+}
+
+/*
+ * Every connection serves this VBD, so export names are not checked.
+ */
+static int
+tapdisk_nbdserver_opt_list(td_nbdserver_client_t *client, uint32_t len)
+{
+	const char *name = client->server->vbd->name;
+	char buf[sizeof(uint32_t) + TAPDISK_NBDSERVER_MAX_PATH_LEN];
+	uint32_t namelen;
+	int err;
+
+	if (len)
+		return tapdisk_nbdserver_send_option_reply(client, NBD_OPT_LIST,
+				NBD_REP_ERR_INVALID, NULL, 0);
+
+	namelen = MIN(strlen(name), TAPDISK_NBDSERVER_MAX_PATH_LEN);
+	*(uint32_t *)buf = htonl(namelen);
+	memcpy(buf + sizeof(uint32_t), name, namelen);
+
+	err = tapdisk_nbdserver_send_option_reply(client, NBD_OPT_LIST,
+			NBD_REP_SERVER, buf, sizeof(uint32_t) + namelen);
+	if (err)
+		return err;
+
+	return tapdisk_nbdserver_send_option_reply(client, NBD_OPT_LIST,
+			NBD_REP_ACK, NULL, 0);
+}
+
+static int
+tapdisk_nbdserver_opt_info(td_nbdserver_client_t *client, uint32_t option,
+		const char *data, uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	uint32_t namelen, i;
+	uint16_t nr_infos, info;
+	bool block_size = false;
+	int err;
+	struct {
+		uint16_t type;
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) export;
+	struct {
+		uint16_t type;
+		uint32_t min;
+		uint32_t preferred;
+		uint32_t max;
+	} __attribute__((packed)) bsize;
+
+	if (len < sizeof(namelen) + sizeof(nr_infos))
+		goto invalid;
+
+	namelen = ntohl(*(uint32_t *)data);
+	if (namelen > len - sizeof(namelen) - sizeof(nr_infos))
+		goto invalid;
+
+	nr_infos = ntohs(*(uint16_t *)(data + sizeof(namelen) + namelen));
+	if (len != sizeof(namelen) + namelen + sizeof(nr_infos) +
+	    nr_infos * sizeof(info))
+		goto invalid;
+
+	for (i = 0; i < nr_infos; i++) {
+		info = ntohs(*(uint16_t *)(data + sizeof(namelen) + namelen +
+					   sizeof(nr_infos) + i * sizeof(info)));
+		if (info == NBD_INFO_BLOCK_SIZE)
+			block_size = true;
+	}
+
+	export.type  = htons(NBD_INFO_EXPORT);
+	export.size  = htonll(server->info.size * server->info.sector_size);
+	export.flags = htons(tapdisk_nbdserver_transmission_flags(client));
+
+	err = tapdisk_nbdserver_send_option_reply(client, option,
+			NBD_REP_INFO, &export, sizeof(export));
+	if (err)
+		return err;
+
+	if (block_size) {
+		bsize.type      = htons(NBD_INFO_BLOCK_SIZE);
+		bsize.min       = htonl(1 << SECTOR_SHIFT);
+		bsize.preferred = htonl(TD_NBDSERVER_HOLE_SIZE);
+		bsize.max       = htonl(TD_NBDSERVER_MAX_PAYLOAD);
+
+		err = tapdisk_nbdserver_send_option_reply(client, option,
+				NBD_REP_INFO, &bsize, sizeof(bsize));
+		if (err)
+			return err;
+	}
+
+	err = tapdisk_nbdserver_send_option_reply(client, option,
+			NBD_REP_ACK, NULL, 0);
+	if (err)
+		return err;
+
+	if (option == NBD_OPT_GO)
+		client->phase = TD_NBDSERVER_TRANSMISSION;
+
+	return 0;
+
+invalid:
+	return tapdisk_nbdserver_send_option_reply(client, option,
+			NBD_REP_ERR_INVALID, NULL, 0);
+}
+
+static int
+tapdisk_nbdserver_opt_meta_context(td_nbdserver_client_t *client,
+		uint32_t option, const char *data, uint32_t len)
+{
+	const size_t namelen = strlen(NBD_META_BASE_ALLOCATION);
+	char buf[sizeof(uint32_t) + sizeof(NBD_META_BASE_ALLOCATION)];
+	uint32_t off, qlen, nr_queries, i;
+	bool match = false;
+	int err;
+
+	if (option == NBD_OPT_SET_META_CONTEXT && !client->structured)
+		goto invalid;
+
+	/* export name */
+	if (len < sizeof(uint32_t))
+		goto invalid;
+	off = ntohl(*(uint32_t *)data);
+	if (off > len - sizeof(uint32_t))
+		goto invalid;
+	off += sizeof(uint32_t);
+
+	if (len - off < sizeof(uint32_t))
+		goto invalid;
+	nr_queries = ntohl(*(uint32_t *)(data + off));
+	off += sizeof(uint32_t);
+
+	/* listing with no queries returns every context */
+	if (!nr_queries && option == NBD_OPT_LIST_META_CONTEXT)
+		match = true;
+
+	for (i = 0; i < nr_queries; i++) {
+		if (len - off < sizeof(uint32_t))
+			goto invalid;
+		qlen = ntohl(*(uint32_t *)(data + off));
+		off += sizeof(uint32_t);
+		if (qlen > len - off)
+			goto invalid;
+
+		if (qlen == namelen &&
+		    !memcmp(data + off, NBD_META_BASE_ALLOCATION, qlen))
+			match = true;
+
+		if (option == NBD_OPT_LIST_META_CONTEXT &&
+		    qlen == strlen("base:") && !memcmp(data + off, "base:", qlen))
+			match = true;
+
+		off += qlen;
+	}
+
+	if (off != len)
+		goto invalid;
 
-static void
-tapdisk_nbdserver_disable_client(td_nbdserver_client_t *client)
-{
-	ASSERT(client);
-	ASSERT(client->client_event_id >= 0);
+	if (option == NBD_OPT_SET_META_CONTEXT)
+		client->meta_allocation = match;
 
-	INFO("Disable client");
+	if (match) {
+		*(uint32_t *)buf = htonl(TD_NBDSERVER_META_ALLOCATION_ID);
+		memcpy(buf + sizeof(uint32_t), NBD_META_BASE_ALLOCATION,
+		       namelen);
 
-	tapdisk_server_unregister_event(client->client_event_id);
-	client->client_event_id = -1;
+		err = tapdisk_nbdserver_send_option_reply(client, option,
+				NBD_REP_META_CONTEXT, buf,
+				sizeof(uint32_t) + namelen);
+		if (err)
+			return err;
+	}
+
+	return tapdisk_nbdserver_send_option_reply(client, option,
+			NBD_REP_ACK, NULL, 0);
+
+invalid:
+	return tapdisk_nbdserver_send_option_reply(client, option,
+			NBD_REP_ERR_INVALID, NULL, 0);
 }
 
-td_nbdserver_client_t *
-tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
+static int
+tapdisk_nbdserver_recv_option(td_nbdserver_client_t *client)
 {
-	td_nbdserver_client_t *client = NULL;
+	struct nbd_option opt;
+	uint32_t option, len;
+	char *data = NULL;
 	int err;
 
-	ASSERT(server);
+	err = tapdisk_nbdserver_recv(client->client_fd, &opt, sizeof(opt));
+	if (err)
+		return err;
 
-	INFO("Alloc client");
+	if (ntohll(opt.magic) != NBD_OPTS_MAGIC) {
+		ERR("Bad option magic 0x%"PRIx64, ntohll(opt.magic));
+		return -EINVAL;
+	}
 
-	client = calloc(1, sizeof(td_nbdserver_client_t));
-	if (!client) {
-		ERR("Couldn't allocate client structure: %s",
-				strerror(errno));
-		goto fail;
+	option = ntohl(opt.option);
+	len    = ntohl(opt.length);
+
+	if (len > TD_NBDSERVER_MAX_OPTION_LEN) {
+		ERR("Option %u too long: %u bytes", option, len);
+		return -E2BIG;
 	}
 
-	err = tapdisk_nbdserver_reqs_init(client, NBD_SERVER_NUM_REQS);
-	if (err < 0) {
-		ERR("Couldn't allocate client reqs: %d", err);
-		goto fail;
+	if (len) {
+		data = malloc(len);
+		if (!data)
+			return -ENOMEM;
+
+		err = tapdisk_nbdserver_recv(client->client_fd, data, len);
+		if (err)
+			goto out;
 	}
 
-	client->client_fd = -1;
-	client->client_event_id = -1;
-	client->server = server;
-	INIT_LIST_HEAD(&client->clientlist);
-	list_add(&client->clientlist, &server->clients);
+	switch (option) {
+	case NBD_OPT_EXPORT_NAME:
+		err = tapdisk_nbdserver_opt_export_name(client);
+		break;
 
-	client->paused = 0;
-	client->dead = false;
+	case NBD_OPT_ABORT:
+		tapdisk_nbdserver_send_option_reply(client, option,
+				NBD_REP_ACK, NULL, 0);
+		err = -ESHUTDOWN;
+		break;
 
-	return client;
+	case NBD_OPT_LIST:
+		err = tapdisk_nbdserver_opt_list(client, len);
+		break;
 
-fail:
-	if (client)
-		free(client);
+	case NBD_OPT_INFO:
+	case NBD_OPT_GO:
+		err = tapdisk_nbdserver_opt_info(client, option, data, len);
+		break;
 
-	return NULL;
+	case NBD_OPT_STRUCTURED_REPLY:
+		if (len) {
+			err = tapdisk_nbdserver_send_option_reply(client, option,
+					NBD_REP_ERR_INVALID, NULL, 0);
+			break;
+		}
+		client->structured = true;
+		err = tapdisk_nbdserver_send_option_reply(client, option,
+				NBD_REP_ACK, NULL, 0);
+		break;
+
+	case NBD_OPT_LIST_META_CONTEXT:
+	case NBD_OPT_SET_META_CONTEXT:
+		err = tapdisk_nbdserver_opt_meta_context(client, option,
+				data, len);
+		break;
+
+	default:
+		INFO("Unsupported option %u", option);
+		err = tapdisk_nbdserver_send_option_reply(client, option,
+				NBD_REP_ERR_UNSUP, NULL, 0);
+		break;
+	}
+
+out:
+	free(data);
+	return err;
 }
 
-void
-tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
+static int
+tapdisk_nbdserver_recv_client_flags(td_nbdserver_client_t *client)
 {
-	INFO("Free client");
+	uint32_t flags;
+	int err;
 
-	ASSERT(client);
+	err = tapdisk_nbdserver_recv(client->client_fd, &flags, sizeof(flags));
+	if (err)
+		return err;
 
-	if (client->client_event_id >= 0)
-		tapdisk_nbdserver_disable_client(client);
+	flags = ntohl(flags);
+	if (flags & ~(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+		ERR("Unknown client flags 0x%x", flags);
+		return -EINVAL;
+	}
 
-	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
-		list_del(&client->clientlist);
-		tapdisk_nbdserver_reqs_free(client);
-		free(client);
-	} else
-		client->dead = true;
+	client->no_zeroes = !!(flags & NBD_FLAG_C_NO_ZEROES);
+	client->phase     = TD_NBDSERVER_OPTIONS;
+
+	return 0;
 }
 
+/*
+ * Handles the next message of a fixed-newstyle negotiation.
+ */
 static void
-*get_in_addr(struct sockaddr_storage *ss)
+tapdisk_nbdserver_negotiate(td_nbdserver_client_t *client)
 {
-	if (ss->ss_family == AF_INET)
-		return &(((struct sockaddr_in*)ss)->sin_addr);
+	int err;
 
-	return &(((struct sockaddr_in6*)ss)->sin6_addr);
+	if (client->phase == TD_NBDSERVER_CLIENT_FLAGS)
+		err = tapdisk_nbdserver_recv_client_flags(client);
+	else
+		err = tapdisk_nbdserver_recv_option(client);
+
+	if (!err)
+		return;
+
+	if (err != -ESHUTDOWN)
+		INFO("Negotiation failed: %s", strerror(-err));
+
+	close(client->client_fd);
+	client->client_fd = -1;
+	tapdisk_nbdserver_free_client(client);
 }
 
 static void
@@ -270,15 +1505,10 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 	td_nbdserver_t *server = client->server;
 	td_nbdserver_req_t *req = containerof(vreq, td_nbdserver_req_t, vreq);
 	unsigned long long interval;
-	struct timeval now;
 	struct nbd_reply reply;
-	int tosend = 0;
-	int sent = 0;
-	int len = 0;
-
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
-	memcpy(reply.handle, req->id, sizeof(reply.handle));
+	struct iovec iov[2];
+	struct timeval now;
+	int i, err, write;
 
 	gettimeofday(&now, NULL);
 	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
@@ -288,59 +1518,68 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		goto finish;
 	}
 
-	send(client->client_fd, &reply, sizeof(reply), 0);
-
 	switch(vreq->op) {
 	case TD_OP_READ:
-		tosend = len = vreq->iov->secs << SECTOR_SHIFT;
 		server->nbd_stats.stats->read_reqs_completed++;
 		server->nbd_stats.stats->read_sectors += vreq->iov->secs;
 		server->nbd_stats.stats->read_total_ticks += interval;
-		while (tosend > 0) {
-			sent = send(client->client_fd,
-					vreq->iov->base + (len - tosend),
-					tosend, 0);
-			if (sent <= 0) {
-				sent = errno;
-				ERR("Short send/error in callback: %s", strerror(sent));
-				goto finish;
-			}
-
-			tosend -= sent;
-		}
+		if (!client->structured) {
+			tapdisk_nbdserver_init_reply(&reply, req->id, error);
+			iov[0].iov_base = &reply;
+			iov[0].iov_len  = sizeof(reply);
+			iov[1].iov_base = vreq->iov->base;
+			iov[1].iov_len  = vreq->iov->secs << SECTOR_SHIFT;
+			err = tapdisk_nbdserver_send_payload(client, req, iov, 2);
+		} else if (error)
+			err = tapdisk_nbdserver_send_error_chunk(client, req->id,
+					error);
+		else
+			err = tapdisk_nbdserver_send_read(client, req);
 		break;
 	case TD_OP_WRITE:
+	case TD_OP_WRITE_ZEROES:
 		server->nbd_stats.stats->write_reqs_completed++;
-		server->nbd_stats.stats->write_sectors += vreq->iov->secs;
+		for (i = 0; i < vreq->iovcnt; i++)
+			server->nbd_stats.stats->write_sectors +=
+				vreq->iov[i].secs;
 		server->nbd_stats.stats->write_total_ticks += interval;
 	default:
+		err = tapdisk_nbdserver_send_reply(client, req->id, error);
 		break;
 	}
 
+	if (err)
+		ERR("Short send/error in callback: %s", strerror(-err));
+
 	if (error)
 		server->nbd_stats.stats->io_errors++;
 
 finish:
-	free(vreq->iov->base);
+	write = td_op_write(vreq->op);
+	if (write)
+		list_del(&req->entry);
+
+	if (req->zc)
+		tapdisk_nbdserver_zc_release(client, req);
+	else if (req->cmd != NBD_CMD_WRITE_ZEROES)
+		tapdisk_nbdserver_put_buf(client, vreq->iov->base,
+				req->buf_size);
+	else if (vreq->iov != &req->iov)
+		free(vreq->iov);
+
 	tapdisk_nbdserver_free_request(client, req);
+
+	if (write)
+		tapdisk_nbdserver_complete_flushes(server);
 }
 
-static void
-tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
+static int
+tapdisk_nbdserver_send_oldstyle(td_nbdserver_t *server, int fd)
 {
-	td_nbdserver_client_t *client;
-	char buffer[256];
-	int rc;
+	char buffer[152];
 	uint64_t tmp64;
 	uint32_t tmp32;
 
-	ASSERT(server);
-	ASSERT(new_fd >= 0);
-
-	INFO("Got a new client!");
-
-	/* Spit out the NBD connection stuff */
-
 	memcpy(buffer, "NBDMAGIC", 8);
 	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
 	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
@@ -350,23 +1589,68 @@ tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
 	bzero(buffer + 28, 124);
 
-	rc = send(new_fd, buffer, 152, 0);
+	return tapdisk_nbdserver_send(fd, buffer, sizeof(buffer));
+}
+
+static int
+tapdisk_nbdserver_send_newstyle(int fd)
+{
+	char buffer[18];
+	uint64_t tmp64;
+	uint16_t tmp16;
+
+	memcpy(buffer, "NBDMAGIC", 8);
+	tmp64 = htonll(NBD_OPTS_MAGIC);
+	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+	tmp16 = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	memcpy(buffer + 16, &tmp16, sizeof(tmp16));
+
+	return tapdisk_nbdserver_send(fd, buffer, sizeof(buffer));
+}
+
+/*
+ * Greets a new client. The fd receiver, inet and UNIX domain listeners
+ * serve tapdisk's own NBD client and speak the oldstyle protocol; clients
+ * of the newstyle UNIX domain socket go through fixed-newstyle
+ * negotiation.
+ */
+static void
+tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd,
+		bool newstyle)
+{
+	td_nbdserver_client_t *client;
+	int err;
+
+	ASSERT(server);
+	ASSERT(new_fd >= 0);
+
+	INFO("Got a new %s client!", newstyle ? "newstyle" : "oldstyle");
+
+	/* Spit out the NBD connection stuff */
 
-	if (rc != 152) {
-		int err = errno;
+	if (newstyle)
+		err = tapdisk_nbdserver_send_newstyle(new_fd);
+	else
+		err = tapdisk_nbdserver_send_oldstyle(server, new_fd);
+	if (err) {
+		INFO("Short write in negotiation: %s", strerror(-err));
 		close(new_fd);
-		if (rc == -1)
-			INFO("Short write in negotiation: %s", strerror(err));
-		else
-			INFO("Short write in negotiation: wrote %d bytes instead of 152\n",
-					rc);
+		return;
 	}
 
 	INFO("About to alloc client");
 	client = tapdisk_nbdserver_alloc_client(server);
+	if (!client) {
+		close(new_fd);
+		return;
+	}
 
 	INFO("Got an allocated client at %p", client);
 	client->client_fd = new_fd;
+	client->newstyle = newstyle;
+	tapdisk_nbdserver_zc_init(client);
+	if (newstyle)
+		client->phase = TD_NBDSERVER_CLIENT_FLAGS;
 
 	INFO("About to enable client");
 	if (tapdisk_nbdserver_enable_client(client) < 0) {
@@ -382,7 +1666,7 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	td_nbdserver_client_t *client = data;
 	td_nbdserver_t *server = client->server;
 	int rc;
-	int len;
+	uint32_t len;
 	int hdrlen;
 	int n;
 	int fd = client->client_fd;
@@ -390,11 +1674,27 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	td_vbd_request_t *vreq;
 	struct nbd_request request;
 	td_nbdserver_req_t *req;
+	uint32_t cmd;
+
+	if (client->phase != TD_NBDSERVER_TRANSMISSION) {
+		tapdisk_nbdserver_negotiate(client);
+		return;
+	}
+
+	/* zerocopy completions also make the socket readable */
+	if (!list_empty(&client->zc_bufs)) {
+		tapdisk_nbdserver_zc_reap(client);
+		if (recv(fd, &request, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+	}
 
 	req = tapdisk_nbdserver_alloc_request(client);
 	if (!req) {
-		ERR("Couldn't allocate request in clientcb - killing client");
-		tapdisk_nbdserver_free_client(client);
+		/* leave the request in the socket until one completes */
+		if (client->client_event_id >= 0)
+			tapdisk_nbdserver_disable_client(client);
+		client->throttled = true;
 		return;
 	}
 
@@ -431,17 +1731,72 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	request.from = ntohll(request.from);
 	request.type = ntohl(request.type);
 	len = ntohl(request.len);
-	if (((len & 0x1ff) != 0) || ((request.from & 0x1ff) != 0)) {
-		ERR("Non sector-aligned request (%"PRIu64", %d)",
-				request.from, len);
-	}
+	cmd = request.type & NBD_CMD_MASK_COMMAND;
 
 	bzero(req->id, sizeof(req->id));
 	memcpy(req->id, request.handle, sizeof(request.handle));
+	req->cmd   = cmd;
+	req->flags = request.type & ~NBD_CMD_MASK_COMMAND;
+
+	switch (cmd) {
+	case NBD_CMD_BLOCK_STATUS:
+		vreq->token      = client;
+		req->status.cb   = tapdisk_nbdserver_block_status_cb;
+		req->status_from = request.from;
+		req->status_len  = len;
+		tapdisk_nbdserver_run_block_status(client, req, 0);
+		return;
+
+	case NBD_CMD_FLUSH:
+		tapdisk_nbdserver_flush(client, req);
+		return;
+
+	case NBD_CMD_WRITE_ZEROES:
+		rc = tapdisk_nbdserver_write_zeroes(client, req,
+				request.from, len);
+		if (rc) {
+			ERR("Failed to write zeroes: %s", strerror(-rc));
+			tapdisk_nbdserver_free_client(client);
+		}
+		return;
+
+	case NBD_CMD_DISC:
+		INFO("Received close message");
+		tapdisk_nbdserver_free_request(client, req);
+		if (client->newstyle) {
+			close(fd);
+			client->client_fd = -1;
+			tapdisk_nbdserver_free_client(client);
+			return;
+		}
+		/* oldstyle clients keep the connection for the next open */
+		INFO("Sending reconnect header");
+		tapdisk_nbdserver_free_client(client);
+		tapdisk_nbdserver_newclient_fd(server, fd, false);
+		return;
+	}
+
+	/*
+	 * Check the payload before allocating for it. A write's payload
+	 * follows in the stream and can't be skipped safely, so a bad
+	 * write also costs the client its connection.
+	 */
+	if (len > TD_NBDSERVER_MAX_PAYLOAD ||
+	    ((len | request.from) & ((1 << SECTOR_SHIFT) - 1))) {
+		rc = len > TD_NBDSERVER_MAX_PAYLOAD ? -EOVERFLOW : -EINVAL;
+		ERR("Rejecting request (%"PRIu64", %u): %s",
+				request.from, len, strerror(-rc));
+		rc = tapdisk_nbdserver_send_error(client, req->id, rc);
+		tapdisk_nbdserver_free_request(client, req);
+		if (rc || cmd == NBD_CMD_WRITE)
+			tapdisk_nbdserver_free_client(client);
+		return;
+	}
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERR("posix_memalign failed (%d)", rc);
+	req->buf_size = len;
+	req->iov.base = tapdisk_nbdserver_get_buf(client, len);
+	if (!req->iov.base) {
+		ERR("Failed to allocate a %u byte buffer", len);
 		goto fail;
 	}
 
@@ -454,7 +1809,7 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	vreq->name = req->id;
 	vreq->vbd = server->vbd;
 
-	switch(request.type) {
+	switch(cmd) {
 	case NBD_CMD_READ:
 		vreq->op = TD_OP_READ;
                 server->nbd_stats.stats->read_reqs_submitted++;
@@ -464,7 +1819,8 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 		server->nbd_stats.stats->write_reqs_submitted++;
 		n = 0;
 		while (n < len) {
-			rc = recv(fd, vreq->iov->base + n, (len - n), 0);
+			rc = recv(fd, vreq->iov->base + n, (len - n),
+					MSG_WAITALL);
 			if (rc <= 0) {
 				ERR("Short send or error in "
 						"callback: %d", rc);
@@ -474,15 +1830,8 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 			n += rc;
 		};
 
+		tapdisk_nbdserver_start_write(server, req);
 		break;
-	case NBD_CMD_DISC:
-		INFO("Received close message. Sending reconnect "
-				"header");
-		tapdisk_nbdserver_free_client(client);
-		INFO("About to send initial connection message");
-		tapdisk_nbdserver_newclient_fd(server, fd);
-		INFO("Sent");
-		return;
 
 	default:
 		ERR("Unsupported operation: 0x%x", request.type);
@@ -492,6 +1841,10 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
 	if (rc) {
 		ERR("tapdisk_vbd_queue_request failed: %d", rc);
+		if (td_op_write(vreq->op)) {
+			list_del(&req->entry);
+			tapdisk_nbdserver_complete_flushes(server);
+		}
 		goto fail;
 	}
 
@@ -513,7 +1866,7 @@ tapdisk_nbdserver_fdreceiver_cb(int fd, char *msg, void *data)
 
 	INFO("Received fd with msg: %s", msg);
 
-	tapdisk_nbdserver_newclient_fd(server, fd);
+	tapdisk_nbdserver_newclient_fd(server, fd, false);
 }
 
 static void
@@ -544,23 +1897,21 @@ tapdisk_nbdserver_newclient(event_id_t id, char mode, void *data)
 
 	INFO("server: got connection from %s\n", s);
 
-	tapdisk_nbdserver_newclient_fd(server, new_fd);
+	tapdisk_nbdserver_newclient_fd(server, new_fd, false);
 }
 
 static void
-tapdisk_nbdserver_newclient_unix(event_id_t id, char mode, void *data)
+tapdisk_nbdserver_accept_unix(td_nbdserver_t *server, int fd, bool newstyle)
 {
 	int new_fd = 0;
 	struct sockaddr_un remote;
 	socklen_t t = sizeof(remote);
-	td_nbdserver_t *server = data;
 
 	ASSERT(server);
 
-	INFO("About to accept (server->unix_listening_fd = %d)",
-			server->unix_listening_fd);
+	INFO("About to accept (fd = %d)", fd);
 
-	new_fd = accept(server->unix_listening_fd, (struct sockaddr *)&remote, &t);
+	new_fd = accept(fd, (struct sockaddr *)&remote, &t);
 	if (new_fd == -1) {
 		ERR("failed to accept connection: %s\n", strerror(errno));
 		return;
@@ -568,7 +1919,43 @@ tapdisk_nbdserver_newclient_unix(event_id_t id, char mode, void *data)
 
 	INFO("server: got connection\n");
 
-	tapdisk_nbdserver_newclient_fd(server, new_fd);
+	tapdisk_nbdserver_newclient_fd(server, new_fd, newstyle);
+}
+
+static void
+tapdisk_nbdserver_newclient_unix(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_t *server = data;
+
+	tapdisk_nbdserver_accept_unix(server, server->unix_listening_fd, false);
+}
+
+static void
+tapdisk_nbdserver_newclient_newstyle(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_t *server = data;
+
+	tapdisk_nbdserver_accept_unix(server, server->newstyle_listening_fd,
+			true);
+}
+
+static bool
+tapdisk_nbdserver_zerocopy_enabled(void)
+{
+	const char *env = getenv(TD_NBDSERVER_ZEROCOPY_ENV);
+	char *end;
+	long val;
+
+	if (!env)
+		return false;
+
+	val = strtol(env, &end, 10);
+	if (!*env || *end) {
+		ERR("ignoring invalid %s: '%s'", TD_NBDSERVER_ZEROCOPY_ENV, env);
+		return false;
+	}
+
+	return val != 0;
 }
 
 td_nbdserver_t *
@@ -590,7 +1977,12 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
 	server->fdrecv_listening_event_id = -1;
 	server->unix_listening_fd = -1;
 	server->unix_listening_event_id = -1;
+	server->newstyle_listening_fd = -1;
+	server->newstyle_listening_event_id = -1;
+	server->zerocopy = tapdisk_nbdserver_zerocopy_enabled();
 	INIT_LIST_HEAD(&server->clients);
+	INIT_LIST_HEAD(&server->writes);
+	INIT_LIST_HEAD(&server->flushes);
 
 	if (td_metrics_nbd_start(&server->nbd_stats, server->vbd->tap->minor)) {
 		ERR("failed to create metrics file for nbdserver");
@@ -618,6 +2010,13 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
 		goto fail;
 	}
 
+	if (snprintf(server->newstyle_sockpath, TAPDISK_NBDSERVER_MAX_PATH_LEN,
+			"%s%d.%d", TAPDISK_NBDSERVER_NEWSTYLE_SOCK_PATH, getpid(),
+			vbd->uuid) < 0) {
+		ERR("Failed to snprintf newstyle_sockpath");
+		goto fail;
+	}
+
 	return server;
 
 fail:
@@ -638,8 +2037,10 @@ tapdisk_nbdserver_pause(td_nbdserver_t *server)
 	INFO("NBD server pause(%p)", server);
 
 	list_for_each_entry_safe(pos, q, &server->clients, clientlist){
-		if (pos->paused != 1 && pos->client_event_id >= 0) {
-			tapdisk_nbdserver_disable_client(pos);
+		if (pos->paused != 1 &&
+		    (pos->client_event_id >= 0 || pos->throttled)) {
+			if (pos->client_event_id >= 0)
+				tapdisk_nbdserver_disable_client(pos);
 			pos->paused = 1;
 		}
 	}
@@ -653,6 +2054,12 @@ tapdisk_nbdserver_pause(td_nbdserver_t *server)
 		tapdisk_server_unregister_event(server->unix_listening_event_id);
 		server->unix_listening_event_id = -1;
 	}
+
+	if (server->newstyle_listening_event_id >= 0) {
+		tapdisk_server_unregister_event(
+				server->newstyle_listening_event_id);
+		server->newstyle_listening_event_id = -1;
+	}
 }
 
 static int
@@ -697,6 +2104,21 @@ tapdisk_nbdserver_unpause_unix(td_nbdserver_t *server)
 		if (server->unix_listening_event_id < 0) {
 			err = server->unix_listening_event_id;
 			server->unix_listening_event_id = -1;
+			return err;
+		}
+	}
+
+	if (server->newstyle_listening_event_id < 0
+			&& server->newstyle_listening_fd >= 0) {
+		INFO("registering for newstyle_listening_fd");
+		server->newstyle_listening_event_id =
+			tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					server->newstyle_listening_fd, TV_ZERO,
+					tapdisk_nbdserver_newclient_newstyle,
+					server);
+		if (server->newstyle_listening_event_id < 0) {
+			err = server->newstyle_listening_event_id;
+			server->newstyle_listening_event_id = -1;
 		}
 	}
 
@@ -788,47 +2210,72 @@ out:
 	return err;
 }
 
-int
-tapdisk_nbdserver_listen_unix(td_nbdserver_t *server)
+/*
+ * Returns a UNIX domain socket listening on path, or -errno.
+ */
+static int
+tapdisk_nbdserver_bind_unix(const char *path, struct sockaddr_un *local)
 {
 	size_t len = 0;
-	int err = 0;
+	int fd, err = 0;
 
-	ASSERT(server);
-	ASSERT(server->unix_listening_fd == -1);
-
-	server->unix_listening_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (server->unix_listening_fd == -1) {
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
 		err = -errno;
 		ERR("failed to create UNIX domain socket: %s\n", strerror(-err));
-		goto out;
+		return err;
 	}
 
-	server->local.sun_family = AF_UNIX;
-	strcpy(server->local.sun_path, server->sockpath);
-	err = unlink(server->local.sun_path);
+	local->sun_family = AF_UNIX;
+	strcpy(local->sun_path, path);
+	err = unlink(local->sun_path);
 	if (err == -1 && errno != ENOENT) {
 		err = -errno;
-		ERR("failed to remove %s: %s\n", server->local.sun_path,
-				strerror(-err));
-		goto out;
+		ERR("failed to remove %s: %s\n", local->sun_path, strerror(-err));
+		goto fail;
 	}
-	len = strlen(server->local.sun_path) + sizeof(server->local.sun_family);
-	err = bind(server->unix_listening_fd, (struct sockaddr *)&server->local,
-			len);
+	len = strlen(local->sun_path) + sizeof(local->sun_family);
+	err = bind(fd, (struct sockaddr *)local, len);
 	if (err == -1) {
 		err = -errno;
 		ERR("failed to bind: %s\n", strerror(-err));
-		goto out;
+		goto fail;
 	}
 
-	err = listen(server->unix_listening_fd, 10);
+	err = listen(fd, 10);
 	if (err == -1) {
 		err = -errno;
 		ERR("failed to listen: %s\n", strerror(-err));
-		goto out;
+		goto fail;
 	}
 
+	return fd;
+
+fail:
+	close(fd);
+	return err;
+}
+
+int
+tapdisk_nbdserver_listen_unix(td_nbdserver_t *server)
+{
+	struct sockaddr_un local;
+	int err = 0;
+
+	ASSERT(server);
+	ASSERT(server->unix_listening_fd == -1);
+	ASSERT(server->newstyle_listening_fd == -1);
+
+	err = tapdisk_nbdserver_bind_unix(server->sockpath, &server->local);
+	if (err < 0)
+		goto out;
+	server->unix_listening_fd = err;
+
+	err = tapdisk_nbdserver_bind_unix(server->newstyle_sockpath, &local);
+	if (err < 0)
+		goto out;
+	server->newstyle_listening_fd = err;
+
 	err = tapdisk_nbdserver_unpause_unix(server);
 	if (err) {
 		ERR("failed to unpause the NBD server (unix): %s\n",
@@ -836,14 +2283,27 @@ tapdisk_nbdserver_listen_unix(td_nbdserver_t *server)
 		goto out;
 	}
 
-	INFO("Successfully started NBD server on %s\n", server->sockpath);
+	INFO("Successfully started NBD server on %s and %s\n",
+			server->sockpath, server->newstyle_sockpath);
 
 out:
-	if (err && (server->unix_listening_fd != -1)) {
-		close(server->unix_listening_fd);
-		server->unix_listening_fd = -1;
+	if (err < 0) {
+		if (server->unix_listening_event_id >= 0) {
+			tapdisk_server_unregister_event(
+					server->unix_listening_event_id);
+			server->unix_listening_event_id = -1;
+		}
+		if (server->unix_listening_fd != -1) {
+			close(server->unix_listening_fd);
+			server->unix_listening_fd = -1;
+		}
+		if (server->newstyle_listening_fd != -1) {
+			close(server->newstyle_listening_fd);
+			server->newstyle_listening_fd = -1;
+		}
+		return err;
 	}
-	return err;
+	return 0;
 }
 
 int
@@ -860,6 +2320,7 @@ tapdisk_nbdserver_unpause(td_nbdserver_t *server)
 
 	list_for_each_entry_safe(pos, q, &server->clients, clientlist){
 		if (pos->paused == 1) {
+			pos->throttled = false;
 			tapdisk_nbdserver_enable_client(pos);
 			pos->paused = 0;
 		}
@@ -910,10 +2371,26 @@ tapdisk_nbdserver_free(td_nbdserver_t *server)
 		server->unix_listening_fd = -1;
 	}
 
+	if (server->newstyle_listening_event_id >= 0) {
+		tapdisk_server_unregister_event(
+				server->newstyle_listening_event_id);
+		server->newstyle_listening_event_id = -1;
+	}
+
+	if (server->newstyle_listening_fd >= 0) {
+		close(server->newstyle_listening_fd);
+		server->newstyle_listening_fd = -1;
+	}
+
 	err = unlink(server->sockpath);
 	if (err)
 		ERR("failed to remove UNIX domain socket %s: %s\n", server->sockpath,
 				strerror(errno));
+
+	err = unlink(server->newstyle_sockpath);
+	if (err && errno != ENOENT)
+		ERR("failed to remove UNIX domain socket %s: %s\n",
+				server->newstyle_sockpath, strerror(errno));
 	err = td_metrics_nbd_stop(&server->nbd_stats);
 
 	if (err)
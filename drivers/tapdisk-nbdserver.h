@@ -26,9 +26,17 @@ typedef struct td_nbdserver_client td_nbdserver_client_t;
 #include "tapdisk-vbd.h"
 #include "list.h"
 #include "tapdisk-nbd.h"
+#include "tapdisk-slab.h"
 #include <sys/un.h>
 #include <stdbool.h>
 
+/*
+ * Payload buffers come from a per-client arena of power-of-two size
+ * classes, from a page up to TD_NBDSERVER_BUF_CLASSES pages.
+ */
+#define TD_NBDSERVER_BUF_SHIFT   12
+#define TD_NBDSERVER_BUF_CLASSES 10
+
 struct td_nbdserver {
 	td_vbd_t               *vbd;
 	td_disk_info_t          info;
@@ -65,15 +73,59 @@ struct td_nbdserver {
 	 */
 	char                    sockpath[TAPDISK_NBDSERVER_MAX_PATH_LEN];
 
+	/**
+	 * Listening file descriptor, event ID and path of the UNIX domain
+	 * socket for fixed-newstyle clients. The sockets above keep the
+	 * oldstyle handshake tapdisk's NBD client expects.
+	 */
+	int                     newstyle_listening_fd;
+	int                     newstyle_listening_event_id;
+	char                    newstyle_sockpath[TAPDISK_NBDSERVER_MAX_PATH_LEN];
+
 	struct list_head        clients;
 
+	/**
+	 * Requests allocated by all the clients together.
+	 */
+	int                     n_reqs;
+
+	/**
+	 * Writes in flight, oldest first, and the flushes waiting for them.
+	 * Shared by all the clients so that a flush also covers writes
+	 * completed on other connections.
+	 */
+	struct list_head        writes;
+	struct list_head        flushes;
+	uint64_t                write_seq;
+
+	/**
+	 * Send read payloads with MSG_ZEROCOPY where the socket supports it.
+	 */
+	bool                    zerocopy;
+
 	stats_t                 nbd_stats;
 };
 
+enum td_nbdserver_phase {
+	/**
+	 * Serving commands: oldstyle clients start here.
+	 */
+	TD_NBDSERVER_TRANSMISSION = 0,
+
+	/**
+	 * Fixed-newstyle negotiation, waiting for the client flags.
+	 */
+	TD_NBDSERVER_CLIENT_FLAGS,
+
+	/**
+	 * Fixed-newstyle negotiation, waiting for the next option.
+	 */
+	TD_NBDSERVER_OPTIONS,
+};
+
 struct td_nbdserver_client {
 	int                     n_reqs;
-	td_nbdserver_req_t     *reqs;
-	struct td_iovec        *iovecs;
+	struct list_head        pools;
 	int                     n_reqs_free;
 	td_nbdserver_req_t    **reqs_free;
 
@@ -86,6 +138,35 @@ struct td_nbdserver_client {
 	int                     paused;
 
 	bool                    dead;
+
+	/**
+	 * Out of requests: the client is not read from until one is freed.
+	 */
+	bool                    throttled;
+
+	enum td_nbdserver_phase phase;
+	bool                    newstyle;
+
+	/**
+	 * Negotiated by a fixed-newstyle client.
+	 */
+	bool                    no_zeroes;
+	bool                    structured;
+	bool                    meta_allocation;
+
+	/**
+	 * MSG_ZEROCOPY: the id the kernel gives the next zerocopy send, and
+	 * the payload buffers it has not reported done with.
+	 */
+	bool                    zerocopy;
+	uint32_t                zc_next;
+	struct list_head        zc_bufs;
+	int                     n_zc_bufs;
+
+	/**
+	 * Payload buffers.
+	 */
+	td_arena_t              bufs;
 };
 
 td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t);
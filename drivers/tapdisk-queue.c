@@ -26,6 +26,11 @@
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -130,7 +135,7 @@ static int
 cancel_tiocbs(struct tqueue *queue, int err)
 {
 	int queued;
-	struct tiocb *tiocb;
+	struct tiocb *tiocb, *next;
 
 	if (!queue->queued)
 		return 0;
@@ -145,8 +150,11 @@ cancel_tiocbs(struct tqueue *queue, int err)
 	queued = queue->queued;
 	queue->queued = 0;
 
-	for (; tiocb != NULL; tiocb = tiocb->next)
+	/* callbacks may free their tiocb */
+	for (; tiocb != NULL; tiocb = next) {
+		next = tiocb->next;
 		complete_tiocb(queue, tiocb, err);
+	}
 
 	return queued;
 }
@@ -154,6 +162,9 @@ cancel_tiocbs(struct tqueue *queue, int err)
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
+	int i;
+	struct tiocb *tiocb;
+
 	ERR(err, "io_submit error: %d of %d failed",
 	    total - succeeded, total);
 
@@ -162,6 +173,13 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 	queue->queued = io_expand_iocbs(&queue->opioctx,
 					queue->iocbs, succeeded, total);
 
+	/* io_merge reorders iocbs, relink them for cancel_tiocbs */
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+
 	return cancel_tiocbs(queue, err);
 }
 
@@ -199,16 +217,31 @@ tapdisk_rwio_setup(struct tqueue *queue, int size)
 static inline ssize_t
 tapdisk_rwio_rw(const struct iocb *iocb)
 {
-	int fd        = iocb->aio_fildes;
+	int i, fd     = iocb->aio_fildes;
 	char *buf     = iocb->u.c.buf;
 	long long off = iocb->u.c.offset;
 	size_t size   = iocb->u.c.nbytes;
 	ssize_t (*func)(int, void *, size_t) = 
-		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+		(iocb->aio_lio_opcode == IO_CMD_PWRITE ||
+		 iocb->aio_lio_opcode == IO_CMD_PWRITEV ? vwrite : read);
 
 	if (lseek64(fd, off, SEEK_SET) == (off64_t)-1)
 		return -errno;
 
+	if (iocb->aio_lio_opcode == IO_CMD_PREADV ||
+	    iocb->aio_lio_opcode == IO_CMD_PWRITEV) {
+		const struct iovec *iov = iocb->u.v.vec;
+
+		for (size = 0, i = 0; i < iocb->u.v.nr; i++) {
+			if (atomicio(func, fd, iov[i].iov_base,
+				     iov[i].iov_len) != iov[i].iov_len)
+				return -errno;
+			size += iov[i].iov_len;
+		}
+
+		return size;
+	}
+
 	if (atomicio(func, fd, buf, size) != size)
 		return -errno;
 
@@ -540,6 +573,518 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * io_uring
+ *
+ * Completions are signalled through an eventfd registered with the
+ * ring, so they are dispatched by the scheduler exactly like libaio
+ * ones. Submission and reaping go through the shared SQ/CQ rings:
+ * one io_uring_enter per tapdisk_submit_tiocbs batch, and no syscall
+ * at all to reap completions.
+ */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter     426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register  427
+#endif
+
+/* slots in the sparse registered file table */
+#define URING_MAX_FILES         64
+
+struct uring {
+	int                   ring_fd;
+
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_mask;
+	unsigned             *sq_array;
+	struct io_uring_sqe  *sqes;
+
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned             *cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	void                 *sq_ring;
+	size_t                sq_ring_size;
+	void                 *cq_ring;
+	size_t                cq_ring_size;
+	size_t                sqes_size;
+
+	struct io_event      *aio_events;
+
+	int                   event_fd;
+	int                   event_id;
+
+	int                   files[URING_MAX_FILES];
+	int                   nr_files;
+
+	int                   flags;
+};
+
+#define URING_FLAG_FIXED_FILES  (1<<0)
+
+static inline int
+__io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__io_uring_register(int fd, unsigned opcode, const void *arg,
+		    unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_unmap(struct uring *uring)
+{
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
+	}
+
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	uring->cq_ring = NULL;
+
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+		uring->sq_ring = NULL;
+	}
+}
+
+static int
+tapdisk_uring_map(struct uring *uring, struct io_uring_params *p)
+{
+	void *ptr;
+
+	uring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_size    = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	ptr = mmap(NULL, uring->sq_ring_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	uring->sq_ring = ptr;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else {
+		ptr = mmap(NULL, uring->cq_ring_size, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		uring->cq_ring = ptr;
+	}
+
+	ptr = mmap(NULL, uring->sqes_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	uring->sqes = ptr;
+
+	uring->sq_head  = uring->sq_ring + p->sq_off.head;
+	uring->sq_tail  = uring->sq_ring + p->sq_off.tail;
+	uring->sq_mask  = uring->sq_ring + p->sq_off.ring_mask;
+	uring->sq_array = uring->sq_ring + p->sq_off.array;
+
+	uring->cq_head  = uring->cq_ring + p->cq_off.head;
+	uring->cq_tail  = uring->cq_ring + p->cq_off.tail;
+	uring->cq_mask  = uring->cq_ring + p->cq_off.ring_mask;
+	uring->cqes     = uring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+
+fail:
+	tapdisk_uring_unmap(uring);
+	return -errno;
+}
+
+/*
+ * Register a sparse file table. Slots are filled in by
+ * tapdisk_queue_register_fd as drivers open their images. This is
+ * an optimization only: failure just leaves us on plain fds.
+ */
+static void
+tapdisk_uring_setup_files(struct uring *uring)
+{
+	int i, err;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		uring->files[i] = -1;
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_FILES,
+				  uring->files, URING_MAX_FILES);
+	if (err) {
+		DPRINTF("io_uring: no registered files: %d\n", -errno);
+		return;
+	}
+
+	uring->flags |= URING_FLAG_FIXED_FILES;
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	tapdisk_uring_unmap(uring);
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+/*
+ * Pull up to queue->size CQEs off the completion ring and translate
+ * them into io_events, so io_split and the filter work unchanged.
+ */
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	unsigned head, tail;
+	int n = 0;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail && n < queue->size) {
+		struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+		struct io_event *ep = &uring->aio_events[n++];
+
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = (long)cqe->res;
+		head++;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	uint64_t val;
+
+	if (read(uring->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		WARN("io_uring: eventfd read failed: %d\n", -errno);
+
+	while ((ret = tapdisk_uring_reap(queue)) > 0) {
+		split = io_split(&queue->opioctx, uring->aio_events, ret);
+		tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+		DBG("events: %d, tiocbs: %d\n", ret, split);
+
+		queue->iocbs_pending  -= ret;
+		queue->tiocbs_pending -= split;
+
+		for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+			iocb  = ep->obj;
+			tiocb = iocb->data;
+			complete_tiocb(queue, tiocb, ep->res);
+		}
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 2 * qlen;
+
+	uring->ring_fd = __io_uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		DPRINTF("io_uring_setup(%d) failed: %d\n", qlen, err);
+		goto fail;
+	}
+
+	err = tapdisk_uring_map(uring, &p);
+	if (err)
+		goto fail;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+				  &uring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	tapdisk_uring_setup_files(uring);
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, TV_ZERO,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static inline int
+tapdisk_uring_file_slot(struct uring *uring, int fd)
+{
+	int i;
+
+	for (i = 0; i < uring->nr_files; i++)
+		if (uring->files[i] == fd)
+			return i;
+
+	return -1;
+}
+
+static int
+tapdisk_uring_update_file(struct uring *uring, int slot, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (uintptr_t)&fd;
+
+	if (__io_uring_register(uring->ring_fd, IORING_REGISTER_FILES_UPDATE,
+				&up, 1) != 1)
+		return -errno;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_register_fd(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	int slot, err;
+
+	if (!(uring->flags & URING_FLAG_FIXED_FILES))
+		return 0;
+
+	if (tapdisk_uring_file_slot(uring, fd) >= 0)
+		return 0;
+
+	slot = tapdisk_uring_file_slot(uring, -1);
+	if (slot < 0) {
+		if (uring->nr_files == URING_MAX_FILES)
+			return -ENOSPC;
+		slot = uring->nr_files++;
+	}
+
+	err = tapdisk_uring_update_file(uring, slot, fd);
+	if (err) {
+		if (slot == uring->nr_files - 1)
+			uring->nr_files--;
+		return err;
+	}
+
+	uring->files[slot] = fd;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_fd(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	int slot;
+
+	if (!(uring->flags & URING_FLAG_FIXED_FILES))
+		return;
+
+	slot = tapdisk_uring_file_slot(uring, fd);
+	if (slot < 0)
+		return;
+
+	/* drop the ring's file reference before the caller closes fd */
+	tapdisk_uring_update_file(uring, slot, -1);
+	uring->files[slot] = -1;
+
+	while (uring->nr_files && uring->files[uring->nr_files - 1] == -1)
+		uring->nr_files--;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *uring, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int slot;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		sqe->opcode = (iocb->aio_lio_opcode == IO_CMD_PWRITEV ?
+			       IORING_OP_WRITEV : IORING_OP_READV);
+		sqe->addr   = (uintptr_t)iocb->u.v.vec;
+		sqe->len    = iocb->u.v.nr;
+		sqe->off    = iocb->u.v.offset;
+		break;
+	default:
+		sqe->opcode = (iocb->aio_lio_opcode == IO_CMD_PWRITE ?
+			       IORING_OP_WRITE : IORING_OP_READ);
+		sqe->addr   = (uintptr_t)iocb->u.c.buf;
+		sqe->len    = iocb->u.c.nbytes;
+		sqe->off    = iocb->u.c.offset;
+		break;
+	}
+
+	sqe->user_data = (uintptr_t)iocb;
+
+	slot = tapdisk_uring_file_slot(uring, iocb->aio_fildes);
+	if (slot >= 0) {
+		sqe->fd     = slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd     = iocb->aio_fildes;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail, idx;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	/*
+	 * tapdisk_queue_full bounds iocbs_pending + queued by the
+	 * queue size, which is also the SQ size, so there is always
+	 * room for the whole batch.
+	 */
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++) {
+		idx = tail & *uring->sq_mask;
+		tapdisk_uring_prep_sqe(uring, &uring->sqes[idx],
+				       queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = __io_uring_enter(uring->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	if (err)
+		/* withdraw the SQEs the kernel did not consume */
+		__atomic_store_n(uring->sq_tail,
+				 __atomic_load_n(uring->sq_head,
+						 __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name               = "uring",
+	.data_size          = sizeof(struct uring),
+	.tio_setup          = tapdisk_uring_setup,
+	.tio_destroy        = tapdisk_uring_destroy,
+	.tio_submit         = tapdisk_uring_submit,
+	.tio_register_fd    = tapdisk_uring_register_fd,
+	.tio_unregister_fd  = tapdisk_uring_unregister_fd,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -568,6 +1113,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_LINUX_IO_URING_H
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -683,6 +1233,22 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+int
+tapdisk_queue_register_fd(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_fd)
+		return 0;
+
+	return queue->tio->tio_register_fd(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_fd(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_fd)
+		queue->tio->tio_unregister_fd(queue, fd);
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
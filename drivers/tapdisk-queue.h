@@ -80,11 +80,16 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: pin an image fd in the backend (e.g. uring fixed files) */
+	int  (*tio_register_fd)   (struct tqueue *queue, int fd);
+	void (*tio_unregister_fd) (struct tqueue *queue, int fd);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -104,6 +109,8 @@ int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
+int tapdisk_queue_register_fd(struct tqueue *, int fd);
+void tapdisk_queue_unregister_fd(struct tqueue *, int fd);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
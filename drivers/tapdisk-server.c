@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 #ifdef HAVE_EVENTFD
@@ -50,11 +51,57 @@
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
-typedef struct tapdisk_server {
+/*
+ * Selects the I/O queue backend: "lio" (default), "uring" or "rwio".
+ * Falls back to lio if the requested backend cannot be set up.
+ */
+#define TAPDISK_IO_DRIVER_ENV       "TAPDISK_IO_DRIVER"
+
+/*
+ * Number of worker threads VBDs are sharded across (by minor). Unset
+ * or 0 runs everything on the main thread.
+ */
+#define TAPDISK_WORKERS_ENV         "TAPDISK_WORKERS"
+#define TAPDISK_WORKERS_MAX         64
+
+/*
+ * An event loop: a scheduler, an I/O queue and the VBDs it runs. The
+ * main thread owns server.loop, each worker thread one of
+ * server.workers. Nothing in a loop is touched by other threads;
+ * they post work to its inbox instead.
+ */
+struct tapdisk_loop {
+	int                          id;          /* -1: main thread */
 	int                          run;
+	pthread_t                    thread;
 	struct list_head             vbds;
+	struct list_head             xenio_ctxs;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	struct tapdisk_work         *inbox;       /* lifo, lock-free */
+	int                          inbox_fd;    /* eventfd */
+	event_id_t                   inbox_evid;
+
+	int                          check_state;
+	int                          check_pending;
+	struct tapdisk_work          check_work;
+};
+
+typedef struct tapdisk_server {
+	int                          run;
+	struct tapdisk_loop          loop;
+	int                          nr_vbds;
+
+	int                          nr_workers;
+	struct tapdisk_loop         *workers;
+
+	/* stop-the-world, for commands which walk every VBD */
+	pthread_mutex_t              quiesce_lock;
+	pthread_cond_t               quiesce_cond;
+	int                          quiesce_gen;
+	int                          parked;
+
 	char                        *name;
 	char                        *ident;
 	int                          facility;
@@ -82,16 +129,29 @@ typedef struct tapdisk_server {
 	} cpumond_state;
 
 	event_id_t                   tlog_reopen_evid;
+
+	/*
+	 * Signals are only recorded by the handler and delivered from
+	 * the event loop, through a self-pipe: the scheduler is not
+	 * async-signal safe.
+	 */
+	int                          sig_pipe[2];
+	event_id_t                   sig_evid;
 } tapdisk_server_t;
 
+static volatile sig_atomic_t tapdisk_server_signals[_NSIG];
+
 static tapdisk_server_t server;
 
+/* the loop the calling thread runs */
+static __thread struct tapdisk_loop *loop = &server.loop;
+
 unsigned int PAGE_SIZE;
 unsigned int PAGE_MASK;
 unsigned int PAGE_SHIFT;
 
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp, &loop->vbds, next)
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -114,7 +174,28 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &loop->vbds;
+}
+
+struct list_head *
+tapdisk_server_xenio_ctxs(void)
+{
+	return &loop->xenio_ctxs;
+}
+
+int
+tapdisk_server_nr_loops(void)
+{
+	return server.nr_workers ? : 1;
+}
+
+struct list_head *
+tapdisk_server_loop_vbds(int i)
+{
+	if (!server.nr_workers)
+		return &server.loop.vbds;
+
+	return &server.workers[i].vbds;
 }
 
 td_vbd_t *
@@ -132,7 +213,8 @@ tapdisk_server_get_vbd(uint16_t uuid)
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->next, &loop->vbds);
+	__atomic_add_fetch(&server.nr_vbds, 1, __ATOMIC_SEQ_CST);
 }
 
 void
@@ -140,13 +222,26 @@ tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	__atomic_sub_fetch(&server.nr_vbds, 1, __ATOMIC_SEQ_CST);
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&loop->aio_queue, tiocb);
+}
+
+int
+tapdisk_server_register_fd(int fd)
+{
+	return tapdisk_queue_register_fd(&loop->aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_fd(int fd)
+{
+	tapdisk_queue_unregister_fd(&loop->aio_queue, fd);
 }
 
 void
@@ -154,7 +249,7 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&loop->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -166,7 +261,13 @@ tapdisk_server_debug(void)
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
+	if (loop != &server.loop) {
+		/* deferred to the main thread, see tapdisk_worker_thread */
+		loop->check_state = 1;
+		return;
+	}
+
+	if (!__atomic_load_n(&server.nr_vbds, __ATOMIC_SEQ_CST))
 		server.run = 0;
 }
 
@@ -174,26 +275,229 @@ event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      struct timeval timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&loop->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&loop->scheduler, event);
 }
 
 void
 tapdisk_server_mask_event(event_id_t event, int masked)
 {
-	return scheduler_mask_event(&server.scheduler, event, masked);
+	return scheduler_mask_event(&loop->scheduler, event, masked);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, TV_SECS(seconds));
+	scheduler_set_max_timeout(&loop->scheduler, TV_SECS(seconds));
+}
+
+/*
+ * Cross-thread work. Posting pushes onto the target loop's inbox and
+ * kicks its eventfd if the inbox was empty; the loop takes the whole
+ * inbox at once and runs it in posting order.
+ */
+static void
+tapdisk_loop_wake(struct tapdisk_loop *l)
+{
+	uint64_t one = 1;
+
+	if (write(l->inbox_fd, &one, sizeof(one)) < 0)
+		ERR(-errno, "failed to wake loop %d\n", l->id);
+}
+
+static void
+tapdisk_loop_post(struct tapdisk_loop *l, struct tapdisk_work *work)
+{
+	struct tapdisk_work *head;
+
+	head = __atomic_load_n(&l->inbox, __ATOMIC_RELAXED);
+	do {
+		work->next = head;
+	} while (!__atomic_compare_exchange_n(&l->inbox, &head, work, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	if (!head)
+		tapdisk_loop_wake(l);
+}
+
+static void
+tapdisk_loop_inbox_event(event_id_t id, char mode, void *private)
+{
+	struct tapdisk_loop *l = private;
+	struct tapdisk_work *work, *next, *fifo;
+	uint64_t val;
+
+	if (read(l->inbox_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		ERR(-errno, "failed to read loop %d inbox\n", l->id);
+
+	work = __atomic_exchange_n(&l->inbox, NULL, __ATOMIC_ACQUIRE);
+
+	for (fifo = NULL; work; work = next) {
+		next       = work->next;
+		work->next = fifo;
+		fifo       = work;
+	}
+
+	for (work = fifo; work; work = next) {
+		next = work->next;
+		work->fn(work);
+	}
+}
+
+int
+tapdisk_server_nr_workers(void)
+{
+	return server.nr_workers;
+}
+
+int
+tapdisk_server_on_worker(void)
+{
+	return loop != &server.loop;
+}
+
+int
+tapdisk_server_vbd_worker(int minor)
+{
+	if (!server.nr_workers || minor < 0)
+		return -1;
+
+	return minor % server.nr_workers;
+}
+
+void
+tapdisk_server_post(int worker, struct tapdisk_work *work)
+{
+	if (worker < 0)
+		tapdisk_loop_post(&server.loop, work);
+	else
+		tapdisk_loop_post(&server.workers[worker], work);
+}
+
+struct tapdisk_broadcast {
+	struct tapdisk_work          work;
+	void                       (*fn)(int);
+	int                          arg;
+};
+
+static void
+tapdisk_server_run_broadcast(struct tapdisk_work *work)
+{
+	struct tapdisk_broadcast *b;
+
+	b = containerof(work, struct tapdisk_broadcast, work);
+	b->fn(b->arg);
+	free(b);
+}
+
+/*
+ * Runs @fn(@arg) on every loop that runs VBDs: the main thread,
+ * or each worker. Either every loop gets it, or none does.
+ */
+int
+tapdisk_server_broadcast(void (*fn)(int), int arg)
+{
+	struct tapdisk_broadcast **b;
+	int i, err;
+
+	if (!server.nr_workers) {
+		fn(arg);
+		return 0;
+	}
+
+	b = calloc(server.nr_workers, sizeof(*b));
+	if (!b) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < server.nr_workers; i++) {
+		b[i] = malloc(sizeof(*b[i]));
+		if (!b[i]) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		b[i]->work.fn = tapdisk_server_run_broadcast;
+		b[i]->fn      = fn;
+		b[i]->arg     = arg;
+	}
+
+	for (i = 0; i < server.nr_workers; i++)
+		tapdisk_loop_post(&server.workers[i], &b[i]->work);
+
+	free(b);
+	return 0;
+
+fail:
+	if (b)
+		for (i = 0; i < server.nr_workers; i++)
+			free(b[i]);
+	free(b);
+	ERR(err, "dropping broadcast\n");
+	return err;
+}
+
+static void
+tapdisk_server_park(int gen)
+{
+	pthread_mutex_lock(&server.quiesce_lock);
+
+	server.parked++;
+	pthread_cond_broadcast(&server.quiesce_cond);
+
+	while (server.quiesce_gen == gen)
+		pthread_cond_wait(&server.quiesce_cond, &server.quiesce_lock);
+
+	pthread_mutex_unlock(&server.quiesce_lock);
+}
+
+/*
+ * Parks every worker between loop iterations, so the main thread can
+ * walk all VBDs. On success, must be paired with
+ * tapdisk_server_release_workers.
+ */
+int
+tapdisk_server_quiesce_workers(void)
+{
+	int err;
+
+	if (!server.nr_workers)
+		return 0;
+
+	pthread_mutex_lock(&server.quiesce_lock);
+	server.parked = 0;
+	pthread_mutex_unlock(&server.quiesce_lock);
+
+	err = tapdisk_server_broadcast(tapdisk_server_park, server.quiesce_gen);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&server.quiesce_lock);
+	while (server.parked < server.nr_workers)
+		pthread_cond_wait(&server.quiesce_cond, &server.quiesce_lock);
+	pthread_mutex_unlock(&server.quiesce_lock);
+
+	return 0;
+}
+
+void
+tapdisk_server_release_workers(void)
+{
+	if (!server.nr_workers)
+		return;
+
+	pthread_mutex_lock(&server.quiesce_lock);
+	server.quiesce_gen++;
+	pthread_cond_broadcast(&server.quiesce_cond);
+	pthread_mutex_unlock(&server.quiesce_lock);
 }
 
 static void
@@ -229,7 +533,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&loop->aio_queue);
 }
 
 static void
@@ -276,16 +580,44 @@ tapdisk_server_stop_vbds(void)
 }
 
 static int
-tapdisk_server_init_aio(void)
+tapdisk_server_io_driver(void)
+{
+	const char *name = getenv(TAPDISK_IO_DRIVER_ENV);
+
+	if (!name || !strcmp(name, "lio"))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, "uring"))
+		return TIO_DRV_URING;
+	if (!strcmp(name, "rwio"))
+		return TIO_DRV_RWIO;
+
+	EPRINTF("unknown %s '%s', using lio\n", TAPDISK_IO_DRIVER_ENV, name);
+	return TIO_DRV_LIO;
+}
+
+static int
+tapdisk_server_init_aio(struct tapdisk_loop *l)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int err, drv;
+
+	drv = tapdisk_server_io_driver();
+
+	err = tapdisk_init_queue(&l->aio_queue, TAPDISK_TIOCBS,
+				 drv, NULL);
+	if (err && drv != TIO_DRV_LIO) {
+		EPRINTF("I/O queue driver %d unavailable (%d), "
+			"falling back to lio\n", drv, err);
+		err = tapdisk_init_queue(&l->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	return err;
 }
 
 static void
-tapdisk_server_close_aio(void)
+tapdisk_server_close_aio(struct tapdisk_loop *l)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&l->aio_queue);
 }
 
 int
@@ -332,14 +664,71 @@ tapdisk_server_close_tlog(void)
 	tlog_close();
 }
 
+static void tapdisk_server_close_signals(void);
+static void tapdisk_server_stop_workers(void);
+static void tapdisk_worker_check_state(struct tapdisk_work *);
+
+static void
+tapdisk_loop_init(struct tapdisk_loop *l, int id)
+{
+	l->id         = id;
+	l->inbox      = NULL;
+	l->inbox_fd   = -1;
+	l->inbox_evid = -1;
+	l->check_work.fn = tapdisk_worker_check_state;
+	INIT_LIST_HEAD(&l->vbds);
+	INIT_LIST_HEAD(&l->xenio_ctxs);
+}
+
+static int
+tapdisk_loop_open_inbox(struct tapdisk_loop *l)
+{
+	int err;
+
+	l->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (l->inbox_fd == -1)
+		return -errno;
+
+	err = scheduler_register_event(&l->scheduler, SCHEDULER_POLL_READ_FD,
+				       l->inbox_fd, TV_ZERO,
+				       tapdisk_loop_inbox_event, l);
+	if (err < 0) {
+		close(l->inbox_fd);
+		l->inbox_fd = -1;
+		return err;
+	}
+
+	l->inbox_evid = err;
+	return 0;
+}
+
+static void
+tapdisk_loop_close_inbox(struct tapdisk_loop *l)
+{
+	if (l->inbox_evid >= 0) {
+		scheduler_unregister_event(&l->scheduler, l->inbox_evid);
+		l->inbox_evid = -1;
+	}
+
+	if (l->inbox_fd >= 0) {
+		close(l->inbox_fd);
+		l->inbox_fd = -1;
+	}
+}
+
 static void
 tapdisk_server_close(void)
 {
+	tapdisk_server_stop_workers();
+
 	if (likely(server.tlog_reopen_evid >= 0))
 		tapdisk_server_unregister_event(server.tlog_reopen_evid);
 
 	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	tapdisk_server_close_aio(&server.loop);
+	tapdisk_server_close_signals();
+	tapdisk_loop_close_inbox(&server.loop);
+	scheduler_destroy(&server.loop.scheduler);
 }
 
 void
@@ -351,7 +740,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&loop->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %s\n", strerror(-ret));
 
@@ -371,12 +760,164 @@ __tapdisk_server_run(void)
 		tapdisk_server_iterate();
 }
 
+static void *
+tapdisk_worker_thread(void *arg)
+{
+	sigset_t set;
+
+	/* signals go to the main thread; faults stay with the thread */
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	loop = arg;
+
+	while (loop->run) {
+		tapdisk_server_iterate();
+
+		/*
+		 * NB. Only between iterations: a control request removing
+		 * the last VBD must have posted its response to the main
+		 * thread before the main thread considers exiting.
+		 */
+		if (loop->check_state) {
+			loop->check_state = 0;
+			if (!__atomic_exchange_n(&loop->check_pending, 1,
+						 __ATOMIC_SEQ_CST))
+				tapdisk_loop_post(&server.loop, &loop->check_work);
+		}
+	}
+
+	return NULL;
+}
+
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_worker_check_state(struct tapdisk_work *work)
+{
+	struct tapdisk_loop *w;
+
+	w = containerof(work, struct tapdisk_loop, check_work);
+	__atomic_store_n(&w->check_pending, 0, __ATOMIC_SEQ_CST);
+
+	tapdisk_server_check_state();
+}
+
+static void
+tapdisk_worker_stop(int unused)
+{
+	loop->run = 0;
+}
+
+static void
+tapdisk_worker_free(struct tapdisk_loop *w)
+{
+	tapdisk_loop_close_inbox(w);
+	tapdisk_server_close_aio(w);
+	scheduler_destroy(&w->scheduler);
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	int i;
+
+	if (!server.nr_workers)
+		return;
+
+	tapdisk_server_broadcast(tapdisk_worker_stop, 0);
+
+	for (i = 0; i < server.nr_workers; i++) {
+		pthread_join(server.workers[i].thread, NULL);
+		tapdisk_worker_free(&server.workers[i]);
+	}
+
+	free(server.workers);
+	server.workers    = NULL;
+	server.nr_workers = 0;
+}
+
+static int
+tapdisk_server_nr_workers_env(void)
+{
+	const char *env = getenv(TAPDISK_WORKERS_ENV);
+	char *end;
+	long n;
+
+	if (!env)
+		return 0;
+
+	n = strtol(env, &end, 10);
+	if (!*env || *end || n < 0 || n > TAPDISK_WORKERS_MAX) {
+		EPRINTF("ignoring invalid %s '%s'\n", TAPDISK_WORKERS_ENV, env);
+		return 0;
+	}
+
+	return n;
+}
+
+static int
+tapdisk_server_start_workers(void)
+{
+	struct tapdisk_loop *w;
+	int i, n, err;
+
+	n = tapdisk_server_nr_workers_env();
+	if (!n)
+		return 0;
+
+	server.workers = calloc(n, sizeof(struct tapdisk_loop));
+	if (!server.workers)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		w = &server.workers[i];
+		tapdisk_loop_init(w, i);
+		w->run = 1;
+
+		err = scheduler_initialize(&w->scheduler);
+		if (err)
+			goto fail;
+
+		err = tapdisk_server_init_aio(w);
+		if (err) {
+			scheduler_destroy(&w->scheduler);
+			goto fail;
+		}
+
+		err = tapdisk_loop_open_inbox(w);
+		if (err) {
+			tapdisk_worker_free(w);
+			goto fail;
+		}
+
+		err = pthread_create(&w->thread, NULL, tapdisk_worker_thread, w);
+		if (err) {
+			err = -err;
+			tapdisk_worker_free(w);
+			goto fail;
+		}
+
+		server.nr_workers++;
+	}
+
+	DPRINTF("started %d worker threads\n", n);
+	return 0;
+
+fail:
+	EPRINTF("failed to start worker %d: %s\n", i, strerror(-err));
+	tapdisk_server_stop_workers();
+	free(server.workers);
+	server.workers = NULL;
+	return err;
+}
+
+/* the part of signal handling which acts on the VBDs of a loop */
+static void
+tapdisk_server_signal_vbds(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	struct td_xenblkif *blkif;
-	static int xfsz_error_sent = 0;
 
 	switch (signal) {
 	case SIGBUS:
@@ -386,8 +927,39 @@ tapdisk_server_signal_handler(int signal)
 		break;
 
 	case SIGXFSZ:
-		ERR(EFBIG, "received SIGXFSZ");
 		tapdisk_server_stop_vbds();
+		break;
+
+	case SIGUSR1:
+		tapdisk_server_debug();
+		break;
+
+	case SIGUSR2:
+		tapdisk_server_for_each_vbd(vbd, tmp)
+			list_for_each_entry(blkif, &vbd->rings, entry)
+				tapdisk_start_polling(blkif);
+		break;
+	}
+}
+
+static void
+tapdisk_server_handle_signal(int signal)
+{
+	static int xfsz_error_sent = 0;
+
+	switch (signal) {
+	case SIGBUS:
+		/* from the signal handler, on the faulting thread */
+		tapdisk_server_signal_vbds(signal);
+		break;
+
+	case SIGINT:
+		tapdisk_server_broadcast(tapdisk_server_signal_vbds, signal);
+		break;
+
+	case SIGXFSZ:
+		ERR(EFBIG, "received SIGXFSZ");
+		tapdisk_server_broadcast(tapdisk_server_signal_vbds, signal);
 		if (xfsz_error_sent)
 			break;
 
@@ -396,14 +968,12 @@ tapdisk_server_signal_handler(int signal)
 
 	case SIGUSR1:
 		DBG(TLOG_INFO, "debugging on signal %d\n", signal);
-		tapdisk_server_debug();
+		tapdisk_server_broadcast(tapdisk_server_signal_vbds, signal);
 		break;
 
 	case SIGUSR2:
 		DBG(TLOG_INFO, "triggering polling on signal %d\n", signal);
-		tapdisk_server_for_each_vbd(vbd, tmp)
-			list_for_each_entry(blkif, &vbd->rings, entry)
-				tapdisk_start_polling(blkif);
+		tapdisk_server_broadcast(tapdisk_server_signal_vbds, signal);
 		break;
 
 	case SIGHUP:
@@ -413,6 +983,88 @@ tapdisk_server_signal_handler(int signal)
 }
 
 
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	int saved_errno = errno;
+	char c = 0;
+
+	/* a fault: returning without acting would just fault again */
+	if (signal == SIGBUS) {
+		tapdisk_server_handle_signal(signal);
+		return;
+	}
+
+	tapdisk_server_signals[signal] = 1;
+
+	if (write(server.sig_pipe[1], &c, 1) < 0) {
+		/* pipe full: a wakeup is already pending */
+	}
+
+	errno = saved_errno;
+}
+
+static void
+tapdisk_server_signal_event(event_id_t id, char mode, void *private)
+{
+	char buf[64];
+	int signal;
+
+	while (read(server.sig_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	for (signal = 1; signal < _NSIG; signal++)
+		if (tapdisk_server_signals[signal]) {
+			tapdisk_server_signals[signal] = 0;
+			tapdisk_server_handle_signal(signal);
+		}
+}
+
+static void
+tapdisk_server_close_signals(void)
+{
+	if (server.sig_evid >= 0) {
+		tapdisk_server_unregister_event(server.sig_evid);
+		server.sig_evid = -1;
+	}
+
+	if (server.sig_pipe[0] >= 0) {
+		close(server.sig_pipe[0]);
+		server.sig_pipe[0] = -1;
+	}
+
+	if (server.sig_pipe[1] >= 0) {
+		close(server.sig_pipe[1]);
+		server.sig_pipe[1] = -1;
+	}
+}
+
+static int
+tapdisk_server_open_signals(void)
+{
+	int err;
+
+	err = pipe2(server.sig_pipe, O_NONBLOCK | O_CLOEXEC);
+	if (err) {
+		err = -errno;
+		server.sig_pipe[0] = server.sig_pipe[1] = -1;
+		return err;
+	}
+
+	server.sig_evid =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      server.sig_pipe[0], TV_ZERO,
+					      tapdisk_server_signal_event,
+					      NULL);
+	if (server.sig_evid < 0) {
+		err = server.sig_evid;
+		tapdisk_server_close_signals();
+		return err;
+	}
+
+	return 0;
+}
+
 static void
 tlog_reopen_cb(event_id_t id, char mode __attribute__((unused)), void *private)
 {
@@ -487,22 +1139,34 @@ static void lowmem_cleanup(void)
 	lowmem_state_init();
 }
 
+static void
+lowmem_flag_vbds(int set)
+{
+	td_vbd_t           *vbd,   *tmpv;
+	struct td_xenblkif *blkif, *tmpb;
+
+	tapdisk_server_for_each_vbd(vbd, tmpv)
+		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
+			if (set) {
+				td_flag_set(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
+				td_flag_set(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
+			} else {
+				td_flag_clear(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
+				td_flag_clear(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
+			}
+	}
+}
+
 /* Called when backoff period finishes */
 static void lowmem_timeout(event_id_t id, char mode, void *data)
 {
 	int ret;
-	td_vbd_t           *vbd,   *tmpv;
-	struct td_xenblkif *blkif, *tmpb;
 
 	server.mem_state.mode = NORMAL_MEMORY_MODE;
 	tapdisk_server_unregister_event(server.mem_state.mem_evid);
 	server.mem_state.mem_evid = -1;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
-		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
-			td_flag_clear(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
-			td_flag_clear(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
-	}
+	tapdisk_server_broadcast(lowmem_flag_vbds, 0);
 
 	if ((ret = tapdisk_server_reset_lowmem_mode()) < 0) {
 		ERR(-ret, "Failed to re-init low memory handler: %s\n",
@@ -519,9 +1183,6 @@ static void lowmem_event(event_id_t id, char mode, void *data)
 	ssize_t n;
 	int backoff;
 
-	td_vbd_t           *vbd,   *tmpv;
-	struct td_xenblkif *blkif, *tmpb;
-
 	n = read(server.mem_state.efd, &result, sizeof(result));
 	if (n < 0) {
 		ERR(-errno, "Failed to read from eventfd: %s\n",
@@ -564,11 +1225,7 @@ static void lowmem_event(event_id_t id, char mode, void *data)
 	}
 	server.mem_state.mode = LOW_MEMORY_MODE;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
-		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
-			td_flag_set(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
-			td_flag_set(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
-	}
+	tapdisk_server_broadcast(lowmem_flag_vbds, 1);
 
 	/* Increment backoff up to a limit */
 	if (server.mem_state.backoff < MAX_BACKOFF)
@@ -704,9 +1361,26 @@ tapdisk_server_init(void)
 	for (i = PAGE_SIZE, PAGE_SHIFT = 0; i > 1; i >>= 1, PAGE_SHIFT++);
 
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
+	tapdisk_loop_init(&server.loop, -1);
+	pthread_mutex_init(&server.quiesce_lock, NULL);
+	pthread_cond_init(&server.quiesce_cond, NULL);
+
+	server.sig_pipe[0] = server.sig_pipe[1] = -1;
+	server.sig_evid    = -1;
 
-	scheduler_initialize(&server.scheduler);
+	ret = scheduler_initialize(&server.loop.scheduler);
+	if (ret) {
+		EPRINTF("Failed to initialize scheduler: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+
+	ret = tapdisk_loop_open_inbox(&server.loop);
+	if (ret) {
+		EPRINTF("Failed to initialize inbox: %s\n", strerror(-ret));
+		scheduler_destroy(&server.loop.scheduler);
+		return ret;
+	}
 
 	if ((ret = tapdisk_server_initialize_lowmem_mode()) < 0) {
 		EPRINTF("Failed to initialize low memory handler: %s\n",
@@ -733,7 +1407,7 @@ tapdisk_server_complete(void)
 {
 	int err;
 
-	err = tapdisk_server_init_aio();
+	err = tapdisk_server_init_aio(&server.loop);
 	if (err)
 		goto fail;
 
@@ -741,13 +1415,17 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
+	err = tapdisk_server_start_workers();
+	if (err)
+		goto fail;
+
 	server.run = 1;
 
 	return 0;
 
 fail:
 	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	tapdisk_server_close_aio(&server.loop);
 	return err;
 }
 
@@ -756,7 +1434,9 @@ tapdisk_server_initialize(const char *read, const char *write)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
@@ -778,6 +1458,13 @@ tapdisk_server_run()
 	if (err)
 		return err;
 
+	err = tapdisk_server_open_signals();
+	if (err) {
+		EPRINTF("failed to set up signal delivery: %s\n",
+			strerror(-err));
+		goto out;
+	}
+
 	signal(SIGBUS, tapdisk_server_signal_handler);
 	signal(SIGINT, tapdisk_server_signal_handler);
 	signal(SIGUSR1, tapdisk_server_signal_handler);
@@ -804,6 +1491,6 @@ out:
 
 int
 tapdisk_server_event_set_timeout(event_id_t event_id, struct timeval timeo) {
-	return scheduler_event_set_timeout(&server.scheduler, event_id, timeo);
+	return scheduler_event_set_timeout(&loop->scheduler, event_id, timeo);
 }
 
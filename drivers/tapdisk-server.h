@@ -50,6 +50,13 @@ void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
 
+/**
+ * Lets the I/O queue backend pin an image fd (io_uring fixed files).
+ * Best effort; fds which are not registered still work.
+ */
+int tapdisk_server_register_fd(int fd);
+void tapdisk_server_unregister_fd(int fd);
+
 void tapdisk_server_check_state(void);
 
 event_id_t tapdisk_server_register_event(char, int, struct timeval, event_cb_t, void *);
@@ -70,6 +77,53 @@ void tapdisk_stop_logging(void);
 
 int tapdisk_server_event_set_timeout(event_id_t, struct timeval timeo);
 
+/*
+ * Worker threads (TAPDISK_WORKERS=N). Each worker runs its own event
+ * loop; VBDs are assigned to a worker by minor, and everything above
+ * acts on the loop of the calling thread. With no workers, all VBDs
+ * run on the main thread and the calls below degrade accordingly.
+ */
+struct tapdisk_work {
+	void                       (*fn)(struct tapdisk_work *);
+	struct tapdisk_work         *next;
+};
+
+int tapdisk_server_nr_workers(void);
+int tapdisk_server_on_worker(void);
+
+/**
+ * Returns the worker owning the VBD of the given minor, or -1 for
+ * the main thread.
+ */
+int tapdisk_server_vbd_worker(int minor);
+
+/**
+ * Queues @work to run on the loop of @worker (-1: main thread).
+ * Safe to call from any thread.
+ */
+void tapdisk_server_post(int worker, struct tapdisk_work *);
+
+/**
+ * Runs @fn(@arg) asynchronously on every loop owning VBDs. Returns
+ * -ENOMEM, having posted nothing, if it cannot reach them all.
+ */
+int tapdisk_server_broadcast(void (*fn)(int), int arg);
+
+/**
+ * Stops every worker between iterations, until released, so the
+ * main thread may walk all VBDs (see tapdisk_server_loop_vbds).
+ */
+int tapdisk_server_quiesce_workers(void);
+void tapdisk_server_release_workers(void);
+
+int tapdisk_server_nr_loops(void);
+struct list_head *tapdisk_server_loop_vbds(int);
+
+/**
+ * The xenio contexts of the calling thread's loop.
+ */
+struct list_head *tapdisk_server_xenio_ctxs(void);
+
 float tapdisk_server_system_idle_cpu(void);
 
 #endif
@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "tapdisk.h"
+#include "tapdisk-log.h"
+#include "tapdisk-slab.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+struct td_slab_chunk {
+	struct list_head        entry;
+	void                   *base;
+	size_t                  size;
+
+	/* scratch, for td_slab_shrink */
+	int                     n_free;
+	int                     release;
+};
+
+/*
+ * Reads TD_SLAB_NUMA_NODE_ENV once. -1 means no preference.
+ */
+static int
+td_slab_numa_node(void)
+{
+	static int node = -2;
+	const char *env;
+	char *end;
+	long n;
+
+	if (node != -2)
+		return node;
+
+	n = -1;
+	env = getenv(TD_SLAB_NUMA_NODE_ENV);
+	if (env) {
+		n = strtol(env, &end, 10);
+		if (!*env || *end || n < 0 || n >= 8 * (long)sizeof(unsigned long)) {
+			EPRINTF("ignoring invalid %s '%s'\n",
+				TD_SLAB_NUMA_NODE_ENV, env);
+			n = -1;
+		}
+	}
+
+	/* workers may race us here, they all read the same value */
+	node = n;
+
+	return node;
+}
+
+static void
+td_slab_bind(td_slab_t *slab, void *base, size_t size)
+{
+#ifdef SYS_mbind
+	unsigned long mask;
+
+	if (slab->node < 0)
+		return;
+
+	mask = 1UL << slab->node;
+	if (syscall(SYS_mbind, base, size, MPOL_PREFERRED, &mask,
+		    8 * sizeof(mask), 0))
+		DPRINTF("%s: failed to prefer NUMA node %d: %s\n",
+			slab->name, slab->node, strerror(errno));
+#endif
+}
+
+static void *
+td_slab_map(td_slab_t *slab, size_t size)
+{
+	int flags = MAP_ANONYMOUS;
+	void *base;
+
+	flags |= slab->flags & TD_SLAB_SHARED ? MAP_SHARED : MAP_PRIVATE;
+
+#ifdef MAP_HUGETLB
+	if (slab->flags & TD_SLAB_HUGEPAGE &&
+	    !(size & (TD_SLAB_CHUNK_SIZE - 1))) {
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    flags | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			slab->stats.huge++;
+			return base;
+		}
+	}
+#endif
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	/* no reserved huge pages, let THP have a go */
+	if (slab->flags & TD_SLAB_HUGEPAGE)
+		madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+	return base;
+}
+
+static int
+td_slab_grow(td_slab_t *slab)
+{
+	struct td_slab_chunk *chunk;
+	char *obj;
+	int i;
+
+	chunk = malloc(sizeof(*chunk));
+	if (!chunk)
+		return -ENOMEM;
+
+	chunk->size = slab->chunk_size;
+	chunk->base = td_slab_map(slab, chunk->size);
+	if (!chunk->base) {
+		int err = -errno;
+		EPRINTF("%s: failed to map %zu bytes: %s\n",
+			slab->name, chunk->size, strerror(-err));
+		free(chunk);
+		return err;
+	}
+
+	td_slab_bind(slab, chunk->base, chunk->size);
+
+	/* hand out objects in address order */
+	obj = (char *)chunk->base + (slab->per_chunk - 1) * slab->size;
+	for (i = 0; i < slab->per_chunk; i++, obj -= slab->size) {
+		*(void **)obj = slab->free;
+		slab->free = obj;
+	}
+
+	list_add_tail(&chunk->entry, &slab->chunks);
+	slab->n_chunks++;
+	slab->n_objs += slab->per_chunk;
+	slab->n_free += slab->per_chunk;
+	slab->stats.grows++;
+
+	return 0;
+}
+
+int
+td_slab_init(td_slab_t *slab, const char *name, size_t size, size_t align,
+	     int per_chunk, int flags)
+{
+	size_t page = sysconf(_SC_PAGE_SIZE);
+
+	ASSERT(slab);
+	ASSERT(size);
+	ASSERT(align && !(align & (align - 1)) && align <= page);
+
+	memset(slab, 0, sizeof(*slab));
+	INIT_LIST_HEAD(&slab->chunks);
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	size = (size + align - 1) & ~(align - 1);
+
+	if (!per_chunk) {
+		per_chunk = TD_SLAB_CHUNK_SIZE / size;
+		if (!per_chunk)
+			per_chunk = 1;
+	}
+
+	slab->name       = name;
+	slab->size       = size;
+	slab->per_chunk  = per_chunk;
+	slab->chunk_size = (per_chunk * size + page - 1) & ~(page - 1);
+	slab->flags      = flags;
+	slab->node       = td_slab_numa_node();
+
+	/* a huge page costs the same as the objects that fit in it */
+	if (flags & TD_SLAB_HUGEPAGE &&
+	    slab->chunk_size < TD_SLAB_CHUNK_SIZE &&
+	    slab->chunk_size > TD_SLAB_CHUNK_SIZE / 2) {
+		slab->chunk_size = TD_SLAB_CHUNK_SIZE;
+		slab->per_chunk  = TD_SLAB_CHUNK_SIZE / size;
+	}
+
+	return 0;
+}
+
+static void
+td_slab_release(td_slab_t *slab, struct td_slab_chunk *chunk)
+{
+	munmap(chunk->base, chunk->size);
+	list_del(&chunk->entry);
+	free(chunk);
+
+	slab->n_chunks--;
+	slab->n_objs -= slab->per_chunk;
+	slab->n_free -= slab->per_chunk;
+}
+
+void
+td_slab_destroy(td_slab_t *slab)
+{
+	struct td_slab_chunk *chunk, *next;
+
+	ASSERT(slab);
+
+	if (slab->n_free != slab->n_objs)
+		EPRINTF("%s: %lu objects still in use\n",
+			slab->name, slab->n_objs - slab->n_free);
+
+	list_for_each_entry_safe(chunk, next, &slab->chunks, entry)
+		td_slab_release(slab, chunk);
+
+	slab->free = NULL;
+}
+
+int
+td_slab_reserve(td_slab_t *slab, unsigned long n)
+{
+	int err;
+
+	ASSERT(slab);
+
+	while (slab->n_objs < n) {
+		err = td_slab_grow(slab);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+void *
+td_slab_alloc(td_slab_t *slab)
+{
+	void *obj;
+	int err;
+
+	ASSERT(slab);
+
+	if (unlikely(!slab->free)) {
+		err = td_slab_grow(slab);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+	}
+
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	slab->n_free--;
+	slab->stats.allocs++;
+
+	return obj;
+}
+
+void
+td_slab_free(td_slab_t *slab, void *obj)
+{
+	ASSERT(slab);
+	ASSERT(obj);
+	ASSERT(slab->n_free < slab->n_objs);
+
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	slab->n_free++;
+}
+
+static int
+td_slab_chunk_cmp(const void *a, const void *b)
+{
+	const struct td_slab_chunk *x = *(const struct td_slab_chunk **)a;
+	const struct td_slab_chunk *y = *(const struct td_slab_chunk **)b;
+
+	return x->base < y->base ? -1 : x->base > y->base;
+}
+
+/*
+ * Looks up the chunk holding @obj in @v, sorted by address.
+ */
+static struct td_slab_chunk *
+td_slab_find_chunk(td_slab_t *slab, struct td_slab_chunk **v, int n,
+		   void *obj)
+{
+	int lo = 0, hi = n - 1, mid;
+	char *base;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		base = v[mid]->base;
+
+		if ((char *)obj < base)
+			hi = mid - 1;
+		else if ((char *)obj >= base + slab->per_chunk * slab->size)
+			lo = mid + 1;
+		else
+			return v[mid];
+	}
+
+	ASSERT(0);
+	return NULL;
+}
+
+/*
+ * Some objects are in use: count the free objects of each chunk, drop
+ * the fully free ones, newest first, and filter them out of the free
+ * list. Best effort, gives up if it can't allocate the lookup table.
+ */
+static void
+td_slab_shrink_busy(td_slab_t *slab, int n_keep)
+{
+	struct td_slab_chunk **v, *chunk;
+	void *obj, *next_obj, **tail;
+	int i, n, n_release;
+
+	v = malloc(slab->n_chunks * sizeof(*v));
+	if (!v)
+		return;
+
+	n = 0;
+	list_for_each_entry(chunk, &slab->chunks, entry) {
+		chunk->n_free  = 0;
+		chunk->release = 0;
+		v[n++] = chunk;
+	}
+	qsort(v, n, sizeof(*v), td_slab_chunk_cmp);
+
+	for (obj = slab->free; obj; obj = *(void **)obj)
+		td_slab_find_chunk(slab, v, n, obj)->n_free++;
+
+	n_release = 0;
+	list_for_each_entry_reverse(chunk, &slab->chunks, entry) {
+		if (slab->n_chunks - n_release <= n_keep)
+			break;
+		if (chunk->n_free == slab->per_chunk) {
+			chunk->release = 1;
+			n_release++;
+		}
+	}
+
+	if (!n_release)
+		goto out;
+
+	/* keeps the order of the remaining free objects */
+	tail = &slab->free;
+	for (obj = slab->free; obj; obj = next_obj) {
+		next_obj = *(void **)obj;
+		if (td_slab_find_chunk(slab, v, n, obj)->release)
+			continue;
+		*tail = obj;
+		tail  = obj;
+	}
+	*tail = NULL;
+
+	for (i = 0; i < n; i++)
+		if (v[i]->release)
+			td_slab_release(slab, v[i]);
+
+	slab->stats.shrinks++;
+
+out:
+	free(v);
+}
+
+void
+td_slab_shrink(td_slab_t *slab, unsigned long keep)
+{
+	struct td_slab_chunk *chunk, *next;
+	int n_keep, i;
+	char *obj;
+
+	ASSERT(slab);
+
+	n_keep = (keep + slab->per_chunk - 1) / slab->per_chunk;
+	if (slab->n_chunks <= n_keep)
+		return;
+
+	if (slab->n_free != slab->n_objs) {
+		td_slab_shrink_busy(slab, n_keep);
+		return;
+	}
+
+	/* nothing is in use, so the free list can be rebuilt from scratch */
+	slab->free = NULL;
+	i = 0;
+	list_for_each_entry_safe(chunk, next, &slab->chunks, entry) {
+		if (i++ >= n_keep) {
+			td_slab_release(slab, chunk);
+			continue;
+		}
+
+		obj = (char *)chunk->base + slab->per_chunk * slab->size;
+		while (obj != chunk->base) {
+			obj -= slab->size;
+			*(void **)obj = slab->free;
+			slab->free = obj;
+		}
+	}
+
+	slab->stats.shrinks++;
+}
+
+int
+td_arena_init(td_arena_t *arena, const char *name, int min_shift,
+	      int max_shift, int flags)
+{
+	size_t page = sysconf(_SC_PAGE_SIZE);
+	int i, err;
+
+	ASSERT(arena);
+	ASSERT(min_shift <= max_shift);
+	ASSERT(max_shift - min_shift < TD_ARENA_CLASSES);
+
+	memset(arena, 0, sizeof(*arena));
+	arena->min_shift = min_shift;
+
+	for (i = 0; i <= max_shift - min_shift; i++) {
+		size_t size = 1UL << (min_shift + i);
+
+		err = td_slab_init(&arena->classes[i], name, size,
+				   size < page ? size : page,
+				   TD_ARENA_CHUNK_SIZE / size ? : 1, flags);
+		if (err) {
+			td_arena_destroy(arena);
+			return err;
+		}
+		arena->n_classes++;
+	}
+
+	return 0;
+}
+
+void
+td_arena_destroy(td_arena_t *arena)
+{
+	int i;
+
+	ASSERT(arena);
+
+	for (i = 0; i < arena->n_classes; i++)
+		td_slab_destroy(&arena->classes[i]);
+
+	arena->n_classes = 0;
+}
+
+static inline int
+td_arena_class(td_arena_t *arena, size_t size)
+{
+	int c = 0;
+
+	while ((1UL << (arena->min_shift + c)) < size && c < arena->n_classes)
+		c++;
+
+	return c;
+}
+
+void *
+td_arena_alloc(td_arena_t *arena, size_t size)
+{
+	int c = td_arena_class(arena, size);
+	void *buf;
+
+	if (likely(c < arena->n_classes))
+		return td_slab_alloc(&arena->classes[c]);
+
+	if (posix_memalign(&buf, sysconf(_SC_PAGE_SIZE), size))
+		return NULL;
+
+	return buf;
+}
+
+void
+td_arena_free(td_arena_t *arena, void *buf, size_t size)
+{
+	int c = td_arena_class(arena, size);
+
+	if (likely(c < arena->n_classes))
+		td_slab_free(&arena->classes[c], buf);
+	else
+		free(buf);
+}
+
+void
+td_arena_shrink(td_arena_t *arena)
+{
+	int i;
+
+	ASSERT(arena);
+
+	for (i = 0; i < arena->n_classes; i++)
+		td_slab_shrink(&arena->classes[i], 0);
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TAPDISK_SLAB_H_
+#define _TAPDISK_SLAB_H_
+
+#include <stddef.h>
+#include "list.h"
+
+/*
+ * Slabs hand out fixed-size objects carved from large anonymous mappings
+ * (chunks). Once a slab has grown to its working set, allocating and
+ * freeing is a pointer swap on a free list threaded through the objects.
+ *
+ * Slabs are not thread-safe: each one belongs to the event loop of its
+ * owner (a ring, an NBD client, a block cache).
+ */
+
+/*
+ * Chunks are sized for one huge page, unless the objects are larger.
+ */
+#define TD_SLAB_CHUNK_SHIFT     21
+#define TD_SLAB_CHUNK_SIZE      (1UL << TD_SLAB_CHUNK_SHIFT)
+
+#define TD_SLAB_HUGEPAGE        0x1 /* back chunks with huge pages if we can */
+#define TD_SLAB_SHARED          0x2 /* MAP_SHARED chunks */
+
+/*
+ * Preferred NUMA node for all slabs, unset means no preference.
+ */
+#define TD_SLAB_NUMA_NODE_ENV   "TAPDISK_NUMA_NODE"
+
+typedef struct td_slab {
+	const char             *name;
+	size_t                  size;       /* object size */
+	size_t                  chunk_size; /* bytes per chunk */
+	int                     per_chunk;  /* objects per chunk */
+	int                     flags;
+	int                     node;
+
+	void                   *free;
+	struct list_head        chunks;
+	int                     n_chunks;
+
+	unsigned long           n_objs;
+	unsigned long           n_free;
+
+	struct {
+		unsigned long long  allocs;
+		unsigned long long  grows;
+		unsigned long long  shrinks;
+		unsigned long long  huge;
+	} stats;
+} td_slab_t;
+
+/*
+ * Sets up an empty slab of @size-byte objects aligned to @align (a power
+ * of two no larger than a page). @per_chunk is the number of objects
+ * mapped at a time, 0 for as many as fit in TD_SLAB_CHUNK_SIZE.
+ */
+int td_slab_init(td_slab_t *, const char *name, size_t size, size_t align,
+		int per_chunk, int flags);
+
+/*
+ * Unmaps everything. All objects must have been freed.
+ */
+void td_slab_destroy(td_slab_t *);
+
+/*
+ * Grows the slab to hold at least @n objects, so that the first @n
+ * allocations don't need to map memory.
+ */
+int td_slab_reserve(td_slab_t *, unsigned long n);
+
+/*
+ * Returns an object, mapping a new chunk if there are no free ones.
+ * Returns NULL and sets errno on failure.
+ */
+void *td_slab_alloc(td_slab_t *);
+
+void td_slab_free(td_slab_t *, void *);
+
+/*
+ * Unmaps chunks with no object in use, as long as enough chunks remain
+ * to hold @keep objects.
+ */
+void td_slab_shrink(td_slab_t *, unsigned long keep);
+
+/*
+ * Arenas are sets of slabs in power-of-two size classes, for buffers of
+ * varying size. Objects are aligned to their class size, up to a page.
+ * Sizes above the largest class are passed to posix_memalign(3).
+ */
+#define TD_ARENA_CLASSES        16
+
+/*
+ * Arena chunks are kept small: a class may only ever see a handful of
+ * buffers, and an mlocked process pins whatever it maps.
+ */
+#define TD_ARENA_CHUNK_SIZE     (256UL << 10)
+
+typedef struct td_arena {
+	int                     min_shift;
+	int                     n_classes;
+	td_slab_t               classes[TD_ARENA_CLASSES];
+} td_arena_t;
+
+int td_arena_init(td_arena_t *, const char *name, int min_shift,
+		int max_shift, int flags);
+void td_arena_destroy(td_arena_t *);
+void *td_arena_alloc(td_arena_t *, size_t size);
+
+/*
+ * @size must be the size the buffer was allocated with.
+ */
+void td_arena_free(td_arena_t *, void *buf, size_t size);
+void td_arena_shrink(td_arena_t *);
+
+#endif
@@ -312,8 +312,8 @@ tapdisk_syslog_vsprintf(char *buf, size_t size,
  * In summary, no attempts to mask service blackouts in here.
  */
 
-int
-tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+static int
+__tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
 {
 	struct timeval now;
 	size_t len;
@@ -369,6 +369,18 @@ fail:
 	return err;
 }
 
+int
+tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+{
+	int err;
+
+	pthread_mutex_lock(&log->lock);
+	err = __tapdisk_vsyslog(log, prio, fmt, ap);
+	pthread_mutex_unlock(&log->lock);
+
+	return err;
+}
+
 int
 tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
 {
@@ -401,10 +413,14 @@ tapdisk_syslog_sock_event(event_id_t id, char mode, void *private)
 {
 	td_syslog_t *log = private;
 
+	pthread_mutex_lock(&log->lock);
+
 	tapdisk_syslog_ring_dispatch(log);
 
 	if (log->cons == log->prod)
 		tapdisk_syslog_sock_mask(log);
+
+	pthread_mutex_unlock(&log->lock);
 }
 
 static void
@@ -488,16 +504,48 @@ tapdisk_syslog_sock_mask(td_syslog_t *log)
 	tapdisk_server_mask_event(log->event_id, 1);
 }
 
+/*
+ * The socket event belongs to the main thread. Worker threads have
+ * it unmasked there; there is one log, hence one work item.
+ */
+static td_syslog_t *unmask_log;
+static int unmask_pending;
+
+static void
+tapdisk_syslog_sock_unmask_work(struct tapdisk_work *work)
+{
+	td_syslog_t *log = unmask_log;
+
+	__atomic_store_n(&unmask_pending, 0, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&log->lock);
+	if (log->event_id >= 0)
+		tapdisk_server_mask_event(log->event_id, 0);
+	pthread_mutex_unlock(&log->lock);
+}
+
+static struct tapdisk_work unmask_work = {
+	.fn = tapdisk_syslog_sock_unmask_work,
+};
+
 static void
 tapdisk_syslog_sock_unmask(td_syslog_t *log)
 {
-	tapdisk_server_mask_event(log->event_id, 0);
+	if (!tapdisk_server_on_worker()) {
+		tapdisk_server_mask_event(log->event_id, 0);
+		return;
+	}
+
+	unmask_log = log;
+	if (!__atomic_exchange_n(&unmask_pending, 1, __ATOMIC_SEQ_CST))
+		tapdisk_server_post(-1, &unmask_work);
 }
 
 void
 __tapdisk_syslog_init(td_syslog_t *log)
 {
 	memset(log, 0, sizeof(td_syslog_t));
+	pthread_mutex_init(&log->lock, NULL);
 	__tapdisk_syslog_sock_init(log);
 	__tapdisk_syslog_ring_init(log);
 }
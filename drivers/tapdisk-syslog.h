@@ -20,6 +20,7 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "scheduler.h"
 
 typedef struct _td_syslog td_syslog_t;
@@ -55,6 +56,9 @@ struct _td_syslog {
 	int              oom;
 	struct timeval   oom_tv;
 
+	/* against worker threads logging, and the socket event */
+	pthread_mutex_t  lock;
+
 	struct _td_syslog_stats stats;
 };
 
@@ -287,6 +287,29 @@ uint64_t ntohll(uint64_t a) {
 #endif
 #define htonll ntohll
 
+char *
+tapdisk_zeroes(void)
+{
+	static char *zeroes;
+	char *buf;
+
+	if (likely(zeroes))
+		return zeroes;
+
+	buf = mmap(NULL, TD_ZEROES_SIZE, PROT_READ,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		EPRINTF("failed to map zeroes: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	/* workers may race us here */
+	if (!__sync_bool_compare_and_swap(&zeroes, NULL, buf))
+		munmap(buf, TD_ZEROES_SIZE);
+
+	return zeroes;
+}
+
 
 /**
  * Simplified version of snprintf that return 0 if everything has gone OK and
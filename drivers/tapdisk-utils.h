@@ -40,6 +40,13 @@ int tapdisk_linux_version(void);
 uint64_t ntohll(uint64_t);
 #define htonll ntohll
 
+/**
+ * A shared, read-only buffer of TD_ZEROES_SIZE zero bytes, for use as the
+ * source of zero-writes. Returns NULL if it cannot be mapped.
+ */
+#define TD_ZEROES_SIZE (4 << 20)
+char *tapdisk_zeroes(void);
+
 
 /**
  * Simplified version of snprintf that returns 0 if everything has gone OK and
@@ -87,6 +87,7 @@ tapdisk_vbd_create(uint16_t uuid)
 
 	vbd->uuid        = uuid;
 	vbd->req_timeout = TD_VBD_REQUEST_TIMEOUT;
+	vbd->bitmap_cache.limit = TD_VBD_BITMAP_CACHE;
 
 	INIT_LIST_HEAD(&vbd->images);
 	INIT_LIST_HEAD(&vbd->new_requests);
@@ -228,6 +229,19 @@ out:
     return -err;
 }
 
+/*
+ * A parent shared with another VBD may outlive this one, so no image
+ * keeps a reference to the budget past close.
+ */
+static void
+tapdisk_vbd_put_bitmap_cache(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		td_set_cache_budget(image, NULL);
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
@@ -244,6 +258,8 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
         EPRINTF("failed to destroy stats file: %s\n", strerror(-err));
     }
 
+	tapdisk_vbd_free_chain_map(vbd);
+	tapdisk_vbd_put_bitmap_cache(vbd);
 	tapdisk_image_close_chain(&vbd->images);
 
 	if (vbd->secondary &&
@@ -614,6 +630,8 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
     err = td_metrics_vdi_start(vbd->tap->minor, &vbd->vdi_stats);
     if (err)
         goto fail;
+
+	tapdisk_vbd_set_bitmap_cache(vbd, vbd->bitmap_cache.limit);
 	if (tmp != vbd->name)
 		free(tmp);
 
@@ -640,6 +658,23 @@ tapdisk_vbd_set_quantum(td_vbd_t *vbd)
 			      vbd->xlvhd_alloc_quantum);
 }
 
+int
+tapdisk_vbd_set_bitmap_cache(td_vbd_t *vbd, uint64_t bytes)
+{
+	td_image_t *image, *tmp;
+	int err;
+
+	vbd->bitmap_cache.limit = bytes;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		err = td_set_cache_budget(image, &vbd->bitmap_cache);
+		if (err && err != -EOPNOTSUPP)
+			return err;
+	}
+
+	return 0;
+}
+
 void
 tapdisk_vbd_detach(td_vbd_t *vbd)
 {
@@ -722,7 +757,7 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 {
 	int new, pending, failed, completed;
 
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) || vbd->status_waits)
 		return -EAGAIN;
 
 	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
@@ -752,7 +787,7 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	/*
 	 * don't close if any requests are pending in the aio layer
 	 */
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) || vbd->status_waits)
 		goto fail;
 
 	/* 
@@ -844,7 +879,7 @@ tapdisk_vbd_lock(td_vbd_t *vbd)
 int
 tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
-	if (!list_empty(&vbd->pending_requests)) {
+	if (!list_empty(&vbd->pending_requests) || vbd->status_waits) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
 		return -EAGAIN;
 	}
@@ -1154,11 +1189,64 @@ tapdisk_vbd_produce_rrds(td_vbd_t *vbd) {
 	return msync(buf, vbd->rrd.shm.size, MS_ASYNC);
 }
 
+/*
+ * Refreshes the binary metrics page. Unlike the RRDs, this is cheap
+ * enough to do on every pass.
+ */
+static void
+tapdisk_vbd_update_metrics(td_vbd_t *vbd)
+{
+	struct td_metrics_page *page = vbd->vdi_stats.page;
+	struct td_metrics_hists *hists = vbd->vdi_stats.hists;
+	struct stats *st = vbd->vdi_stats.stats;
+	uint64_t *v, samples;
+	struct timespec now;
+	int i;
+
+	if (!page)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	td_metrics_page_begin(page);
+
+	v = page->values;
+	v[TD_METRICS_TIMESTAMP_US]         = now.tv_sec * 1000000ULL +
+					     now.tv_nsec / 1000;
+	v[TD_METRICS_READ_REQS_SUBMITTED]  = st->read_reqs_submitted;
+	v[TD_METRICS_READ_REQS_COMPLETED]  = st->read_reqs_completed;
+	v[TD_METRICS_READ_SECTORS]         = st->read_sectors;
+	v[TD_METRICS_READ_TOTAL_TICKS]     = st->read_total_ticks;
+	v[TD_METRICS_WRITE_REQS_SUBMITTED] = st->write_reqs_submitted;
+	v[TD_METRICS_WRITE_REQS_COMPLETED] = st->write_reqs_completed;
+	v[TD_METRICS_WRITE_SECTORS]        = st->write_sectors;
+	v[TD_METRICS_WRITE_TOTAL_TICKS]    = st->write_total_ticks;
+	v[TD_METRICS_REQS_RECEIVED]        = vbd->received;
+	v[TD_METRICS_REQS_RETURNED]        = vbd->returned;
+	v[TD_METRICS_SECS_PENDING]         = vbd->secs_pending;
+	v[TD_METRICS_RETRIES]              = vbd->retries;
+	v[TD_METRICS_IO_ERRORS]            = vbd->errors;
+	v[TD_METRICS_VBD_STATE]            = vbd->state;
+
+	for (i = 0, samples = 0; i < TD_METRICS_NR_HISTS; i++)
+		samples += vbd->latency[i].count;
+
+	if (samples != vbd->latency_synced) {
+		for (i = 0; i < TD_METRICS_NR_HISTS; i++)
+			memcpy(hists->counts[i], vbd->latency[i].buckets,
+			       sizeof(hists->counts[i]));
+		vbd->latency_synced = samples;
+	}
+
+	td_metrics_page_end(page);
+}
+
 void
 tapdisk_vbd_check_state(td_vbd_t *vbd)
 {
     struct td_xenblkif *blkif;
 
+	tapdisk_vbd_update_metrics(vbd);
 	tapdisk_vbd_produce_rrds(vbd);
 
     /*
@@ -1251,15 +1339,19 @@ tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		if (vreq->error &&
 		    tapdisk_vbd_request_should_retry(vbd, vreq))
 			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-		else
+		else {
+			td_histogram_add(&vbd->latency[td_op_write(vreq->op)],
+					 timeval_to_us(&vbd->ts) -
+					 timeval_to_us(&vreq->ts));
 			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+		}
 	}
 }
 
 static void
 FIXME_maybe_count_enospc_redirect(td_vbd_t *vbd, td_request_t treq)
 {
-	int write = treq.op == TD_OP_WRITE;
+	int write = td_op_write(treq.op);
 	if (write &&
 	    treq.image == tapdisk_vbd_first_image(vbd) &&
 	    vbd->FIXME_enospc_redirect_count_enabled)
@@ -1280,11 +1372,14 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	vreq->secs_pending -= treq.secs;
 
 	if (err != -EBUSY) {
-		int write = treq.op == TD_OP_WRITE;
+		int write = td_op_write(treq.op);
 		td_sector_count_add(&image->stats.hits, treq.secs, write);
 		if (err)
 			td_sector_count_add(&image->stats.fail,
 					    treq.secs, write);
+		td_histogram_add(&image->stats.latency[write],
+				 timeval_to_us(&vbd->ts) -
+				 timeval_to_us(&vreq->last_try));
 
 		FIXME_maybe_count_enospc_redirect(vbd, treq);
 	}
@@ -1296,7 +1391,7 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				tlog_drv_error(image->driver, err,
 					       "req %s: %s 0x%04x secs @ 0x%08"PRIx64" - %s",
 					       vreq->name,
-					       (treq.op == TD_OP_WRITE ? "write" : "read"),
+					       (td_op_write(treq.op) ? "write" : "read"),
 					       treq.secs, treq.sec, strerror(abs(err)));
 			vbd->errors++;
 		}
@@ -1318,10 +1413,206 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
 }
 
+void
+tapdisk_vbd_free_chain_map(td_vbd_t *vbd)
+{
+	struct td_vbd_chain_map *map = vbd->chain_map;
+
+	if (map) {
+		free(map->owners);
+		free(map);
+		vbd->chain_map = NULL;
+	}
+
+	vbd->chain_map_failed = 0;
+}
+
+static int
+tapdisk_vbd_chain_map_add(struct td_vbd_chain_map *map, int idx)
+{
+	td_image_t *image = map->images[idx];
+	const struct tap_disk *ops = image->driver->ops;
+	uint64_t blk, nr_blocks;
+	uint32_t block_secs;
+	uint8_t *bits;
+	int err;
+
+	err = -EOPNOTSUPP;
+	if (ops->td_get_block_map)
+		err = ops->td_get_block_map(image->driver,
+					    &block_secs, &nr_blocks, &bits);
+	if (err == -EOPNOTSUPP) {
+		/* may hold anything */
+		for (blk = 0; blk < map->nr_blocks; blk++)
+			map->owners[blk] |= 1ULL << idx;
+		return 0;
+	}
+	if (err)
+		return err;
+
+	if (block_secs != map->block_secs) {
+		free(bits);
+		return -EINVAL;
+	}
+
+	nr_blocks = MIN(nr_blocks, map->nr_blocks);
+	for (blk = 0; blk < nr_blocks; blk++)
+		if (bits[blk >> 3] & (1 << (blk & 7)))
+			map->owners[blk] |= 1ULL << idx;
+
+	free(bits);
+	return 0;
+}
+
+static int
+tapdisk_vbd_build_chain_map(td_vbd_t *vbd)
+{
+	struct td_vbd_chain_map *map;
+	td_image_t *image, *next;
+	uint64_t nr_blocks;
+	uint32_t block_secs;
+	uint8_t *bits;
+	int i, err;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+
+	/* the read-only tail, up to TD_VBD_CHAIN_MAP_MAX images */
+	tapdisk_vbd_for_each_image(vbd, image, next) {
+		if (!td_flag_test(image->flags, TD_OPEN_RDONLY)) {
+			map->nr_images = 0;
+			map->end       = NULL;
+			continue;
+		}
+
+		if (map->nr_images == TD_VBD_CHAIN_MAP_MAX) {
+			if (!map->end)
+				map->end = image;
+			continue;
+		}
+
+		map->images[map->nr_images++] = image;
+	}
+
+	err = -ENOENT;
+	if (!map->nr_images)
+		goto fail;
+
+	/* the first image which knows its block map sets the geometry */
+	map->size = map->images[0]->info.size;
+	for (i = 0; i < map->nr_images; i++) {
+		image = map->images[i];
+		map->size = MIN(map->size, image->info.size);
+
+		if (map->block_secs || !image->driver->ops->td_get_block_map)
+			continue;
+
+		err = image->driver->ops->td_get_block_map(image->driver,
+							   &block_secs,
+							   &nr_blocks, &bits);
+		if (err == -EOPNOTSUPP)
+			continue;
+		if (err)
+			goto fail;
+
+		free(bits);
+		map->block_secs = block_secs;
+	}
+
+	err = -EOPNOTSUPP;
+	if (!map->block_secs)
+		goto fail;
+
+	map->nr_blocks = (map->size + map->block_secs - 1) / map->block_secs;
+	map->owners    = calloc(map->nr_blocks, sizeof(uint64_t));
+	if (!map->owners) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < map->nr_images; i++) {
+		err = tapdisk_vbd_chain_map_add(map, i);
+		if (err)
+			goto fail;
+	}
+
+	vbd->chain_map = map;
+
+	DPRINTF("%s: chain map of %d images, %"PRIu64" blocks of %u secs\n",
+		vbd->name, map->nr_images, map->nr_blocks, map->block_secs);
+
+	return 0;
+
+fail:
+	if (map)
+		free(map->owners);
+	free(map);
+	return err;
+}
+
+static struct td_vbd_chain_map *
+tapdisk_vbd_chain_map(td_vbd_t *vbd)
+{
+	int err;
+
+	if (vbd->chain_map || vbd->chain_map_failed)
+		return vbd->chain_map;
+
+	err = tapdisk_vbd_build_chain_map(vbd);
+	if (err) {
+		if (err != -ENOENT && err != -EOPNOTSUPP)
+			EPRINTF("%s: no chain map: %s\n",
+				vbd->name, strerror(-err));
+		vbd->chain_map_failed = 1;
+	}
+
+	return vbd->chain_map;
+}
+
+/*
+ * The image a read forwarded by @image should go to: @parent, or the
+ * first mapped image past @image which may hold any of its blocks.
+ * NULL if none of the (remaining) chain does.
+ */
+static td_image_t *
+tapdisk_vbd_chain_map_next(struct td_vbd_chain_map *map, td_image_t *image,
+			   td_image_t *parent, td_request_t treq)
+{
+	uint64_t owners, blk, last;
+	int i;
+
+	if (treq.sec + treq.secs > map->size)
+		return parent;
+
+	if (parent == map->images[0])
+		i = 0;
+	else {
+		for (i = 0; i < map->nr_images; i++)
+			if (map->images[i] == image)
+				break;
+		if (++i >= map->nr_images)
+			return parent;
+	}
+
+	blk    = treq.sec / map->block_secs;
+	last   = (treq.sec + treq.secs - 1) / map->block_secs;
+	owners = 0;
+	for (; blk <= last; blk++)
+		owners |= map->owners[blk];
+
+	owners &= ~0ULL << i;
+	if (!owners)
+		return map->end;
+
+	return map->images[__builtin_ctzll(owners)];
+}
+
 static void
 __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 				 td_image_t *image, td_request_t treq)
 {
+	struct td_vbd_chain_map *map;
 	td_image_t *parent;
 	td_vbd_request_t *vreq;
 
@@ -1336,7 +1627,21 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 		goto done;
 	}
 
-	parent     = tapdisk_vbd_next_image(image);
+	parent = tapdisk_vbd_next_image(image);
+
+	if (treq.op == TD_OP_READ) {
+		map = tapdisk_vbd_chain_map(vbd);
+		if (map) {
+			parent = tapdisk_vbd_chain_map_next(map, image,
+							    parent, treq);
+			if (!parent) {
+				memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+				td_complete_request(treq, 0);
+				goto done;
+			}
+		}
+	}
+
 	treq.image = parent;
 
 	/* return zeros for requests that extend beyond end of parent image */
@@ -1361,6 +1666,7 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	switch (treq.op) {
 	case TD_OP_WRITE:
+	case TD_OP_WRITE_ZEROES:
 		td_queue_write(parent, treq);
 		break;
 
@@ -1425,6 +1731,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 			signal_enospc(vbd);
 		}
+		tapdisk_vbd_free_chain_map(vbd);
 	}
 
 	if (res != 0 && image->type == DISK_TYPE_NBD && 
@@ -1438,6 +1745,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 		/* It was the secondary that timed out - disable secondary */
 		list_del_init(&image->next);
 		vbd->retired = image;
+		tapdisk_vbd_free_chain_map(vbd);
 		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
 			vbd->secondary = NULL;
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
@@ -1456,6 +1764,7 @@ static inline void
 queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 {
 	clone.image = vbd->secondary;
+	clone.op    = TD_OP_WRITE;
 	td_queue_write(vbd->secondary, clone);
 }
 
@@ -1505,14 +1814,18 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		vreq->secs_pending += iov->secs;
 		vbd->secs_pending  += iov->secs;
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
-		    vreq->op == TD_OP_WRITE) {
+		    td_op_write(vreq->op)) {
 			vreq->secs_pending += iov->secs;
 			vbd->secs_pending  += iov->secs;
 		}
 
 		switch (vreq->op) {
 		case TD_OP_WRITE:
-			treq.op = TD_OP_WRITE;
+		case TD_OP_WRITE_ZEROES:
+			treq.op = vreq->op;
+			if (treq.op == TD_OP_WRITE_ZEROES &&
+			    !tapdisk_vbd_can_zero(vbd, treq.sec, treq.secs))
+				treq.op = TD_OP_WRITE;
                         vbd->vdi_stats.stats->write_reqs_submitted++;
 			/*
 			 * it's important to queue the mirror request before 
@@ -1614,7 +1927,7 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	struct td_iovec *iov;
 	int write;
 
-	write = vreq->op == TD_OP_WRITE;
+	write = td_op_write(vreq->op);
 
 	for (iov = &vreq->iov[0]; iov < &vreq->iov[vreq->iovcnt]; iov++)
 		td_sector_count_add(&vbd->secs, iov->secs, write);
@@ -1749,6 +2062,114 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 	}
 }
 
+static int
+__tapdisk_vbd_block_status(td_vbd_t *vbd, td_image_t *image,
+			   td_sector_t sec, uint32_t *secs, td_request_t *wait)
+{
+	const struct tap_disk *ops;
+	uint32_t n;
+	int err;
+
+	for (;; image = tapdisk_vbd_next_image(image)) {
+		/* parents may be smaller than their children */
+		if (sec >= image->info.size)
+			goto next;
+
+		*secs = MIN(*secs, image->info.size - sec);
+
+		ops = image->driver->ops;
+		if (!ops->td_get_block_status)
+			return 1;
+
+		n   = *secs;
+		err = ops->td_get_block_status(image->driver, sec, &n, wait);
+		if (err == -EOPNOTSUPP)
+			return 1;
+		if (err < 0)
+			return err;
+
+		*secs = n;
+		if (err)
+			return 1;
+	next:
+		if (tapdisk_vbd_is_last_image(vbd, image))
+			break;
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_vbd_status_wait_done(td_request_t treq, int err)
+{
+	td_vbd_status_wait_t *wait = treq.cb_data;
+
+	wait->vbd->status_waits--;
+	wait->cb(wait, err);
+}
+
+int
+tapdisk_vbd_block_status(td_vbd_t *vbd, td_sector_t sec, uint32_t *secs,
+			 td_vbd_status_wait_t *wait)
+{
+	td_request_t treq;
+	int err;
+
+	if (list_empty(&vbd->images))
+		return -ENODEV;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.cb      = tapdisk_vbd_status_wait_done;
+	treq.cb_data = wait;
+	wait->vbd    = vbd;
+
+	err = __tapdisk_vbd_block_status(vbd, tapdisk_vbd_first_image(vbd),
+					 sec, secs, &treq);
+	if (err == -EAGAIN)
+		vbd->status_waits++;
+
+	return err;
+}
+
+int
+tapdisk_vbd_handles_zeroes(td_vbd_t *vbd)
+{
+	td_image_t *leaf;
+
+	if (list_empty(&vbd->images))
+		return 0;
+
+	leaf = tapdisk_vbd_first_image(vbd);
+	return td_flag_test(leaf->driver->ops->flags, TD_DISK_WRITE_ZEROES);
+}
+
+int
+tapdisk_vbd_can_zero(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs)
+{
+	td_image_t *leaf;
+	uint32_t n;
+
+	if (!tapdisk_vbd_handles_zeroes(vbd))
+		return 0;
+
+	leaf = tapdisk_vbd_first_image(vbd);
+
+	if (tapdisk_vbd_is_last_image(vbd, leaf))
+		return 1;
+
+	while (secs) {
+		n = MIN(secs, UINT32_MAX);
+		if (__tapdisk_vbd_block_status(vbd,
+					       tapdisk_vbd_next_image(leaf),
+					       sec, &n, NULL))
+			return 0;
+		sec  += n;
+		secs -= n;
+	}
+
+	return 1;
+}
+
 int
 tapdisk_vbd_start_nbdserver(td_vbd_t *vbd)
 {
@@ -1813,6 +2234,12 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 		tapdisk_image_stats(image, st);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "latency", "{");
+	td_histogram_stats(st, "read", &vbd->latency[TD_METRICS_HIST_READ]);
+	td_histogram_stats(st, "write", &vbd->latency[TD_METRICS_HIST_WRITE]);
+	td_histogram_stats(st, "flush", &vbd->latency[TD_METRICS_HIST_FLUSH]);
+	tapdisk_stats_leave(st, '}');
+
 	if (vbd->tap) {
 		tapdisk_stats_field(st, "tap", "{");
 		tapdisk_blktap_stats(vbd->tap, st);
@@ -29,6 +29,7 @@
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
+#define TD_VBD_BITMAP_CACHE         (4 << 20) /* default, bytes */
 
 /*
  * VBD states
@@ -48,8 +49,27 @@
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
 
+#define TD_VBD_CHAIN_MAP_MAX        64
+
 struct td_nbdserver;
 
+/*
+ * Which images of the read-only tail of the chain may hold data for a
+ * given block, so a forwarded read skips straight to the first image
+ * that can serve it.
+ */
+struct td_vbd_chain_map {
+	int                         nr_images;
+	td_image_t                 *images[TD_VBD_CHAIN_MAP_MAX];
+	td_image_t                 *end;        /* next unmapped image */
+
+	uint32_t                    block_secs;
+	uint64_t                    nr_blocks;
+	td_sector_t                 size;       /* of the smallest image */
+
+	uint64_t                   *owners;     /* bit i: images[i] */
+};
+
 struct td_vbd_rrd {
 
     struct shm shm;
@@ -122,6 +142,9 @@ struct td_vbd_handle {
 	struct list_head            failed_requests;
 	struct list_head            completed_requests;
 
+	/* block status queries waiting for image metadata */
+	int                         status_waits;
+
 	td_vbd_request_t            request_list[MAX_REQUESTS]; /* XXX */
 
 	struct list_head            next;
@@ -147,7 +170,25 @@ struct td_vbd_handle {
 
     struct td_vbd_rrd           rrd;
     stats_t vdi_stats;
+
+	/*
+	 * Request latency by enum td_metrics_hist, and the number of
+	 * samples last copied to the metrics page.
+	 */
+	struct td_histogram         latency[TD_METRICS_NR_HISTS];
+	uint64_t                    latency_synced;
+
+	/*
+	 * Built on the first forwarded read, dropped with the chain.
+	 */
+	struct td_vbd_chain_map    *chain_map;
+	int                         chain_map_failed;
 	int                         xlvhd_alloc_quantum;
+
+	/*
+	 * Shared by the bitmap caches of all the images in the chain.
+	 */
+	td_cache_budget_t           bitmap_cache;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -188,6 +229,12 @@ int tapdisk_vbd_close(td_vbd_t *);
 int tapdisk_vbd_open_vdi(td_vbd_t * vbd, const char *params, td_flag_t flags,
         int prt_devnum);
 int tapdisk_vbd_set_quantum(td_vbd_t *vbd);
+
+/**
+ * Sets how much memory, in bytes, the images of the VBD may spend on
+ * cached bitmaps in total. Takes effect at once, and over reopens.
+ */
+int tapdisk_vbd_set_bitmap_cache(td_vbd_t *vbd, uint64_t bytes);
 void tapdisk_vbd_close_vdi(td_vbd_t *);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
@@ -219,6 +266,41 @@ void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
 int tapdisk_vbd_start_nbdserver(td_vbd_t *);
 void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
+void tapdisk_vbd_free_chain_map(td_vbd_t *);
+
+/**
+ * A block status query waiting for image metadata to be read in.
+ */
+typedef struct td_vbd_status_wait td_vbd_status_wait_t;
+
+struct td_vbd_status_wait {
+	td_vbd_t                   *vbd;
+	void                      (*cb)(td_vbd_status_wait_t *, int error);
+};
+
+/**
+ * Tells whether any image in the chain holds data for the first *secs
+ * sectors at @sec (1) or none does (0), shortening *secs to the length
+ * of that run. Returns -errno on failure, and -EAGAIN if the answer
+ * needs image metadata not read in yet: @wait->cb is then called once
+ * it is, and the query may be retried. The VBD won't close meanwhile.
+ */
+int tapdisk_vbd_block_status(td_vbd_t *, td_sector_t sec, uint32_t *secs,
+			     td_vbd_status_wait_t *wait);
+
+/**
+ * Tells whether the leaf image handles TD_OP_WRITE_ZEROES at all, and so
+ * whether spotting zero-writes is worth scanning their data.
+ */
+int tapdisk_vbd_handles_zeroes(td_vbd_t *);
+
+/**
+ * Tells whether a zero-write of @secs sectors at @sec can be passed down
+ * as TD_OP_WRITE_ZEROES: the leaf image handles zero-writes and nothing
+ * beneath it holds data in that range. Never waits for metadata: what
+ * isn't known yet counts as data.
+ */
+int tapdisk_vbd_can_zero(td_vbd_t *, td_sector_t sec, td_sector_t secs);
 
 /**
  * Tells whether the VBD contains at least one dead ring.
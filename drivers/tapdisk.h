@@ -74,6 +74,14 @@ extern unsigned int PAGE_SHIFT;
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_WRITE_ZEROES           2 /* buf holds zeroes; the range may
+					  be left unallocated */
+
+#define td_op_write(op)              ((op) == TD_OP_WRITE || \
+				      (op) == TD_OP_WRITE_ZEROES)
+
+/* struct tap_disk flags */
+#define TD_DISK_WRITE_ZEROES         0x00001 /* handles TD_OP_WRITE_ZEROES */
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -109,6 +117,7 @@ typedef struct td_image_handle       td_image_t;
 typedef struct td_sector_count       td_sector_count_t;
 typedef struct td_vbd_request        td_vbd_request_t;
 typedef struct td_vbd_handle         td_vbd_t;
+typedef struct td_cache_budget       td_cache_budget_t;
 
 /* 
  * Prototype of the callback to activate as requests complete.
@@ -184,6 +193,13 @@ struct tap_disk {
 	int (*td_open)               (td_driver_t *, const char *, td_flag_t);
 	int (*td_close)              (td_driver_t *);
 	int (*td_set_quantum)        (td_driver_t *, int);
+
+	/**
+	 * Optional. Charges the image's metadata cache to @budget, shared
+	 * with the other images of the VBD, and shrinks the cache if the
+	 * budget is exceeded. NULL detaches the image from its budget.
+	 */
+	int (*td_set_cache_budget)   (td_driver_t *, td_cache_budget_t *);
 	int (*td_get_parent_id)      (td_driver_t *, td_disk_id_t *);
 	int (*td_validate_parent)    (td_driver_t *, td_driver_t *, td_flag_t);
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
@@ -191,6 +207,24 @@ struct tap_disk {
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
 
+	/**
+	 * Optional. Returns a bitmap of 1 bit per block of *block_secs
+	 * sectors, clear where the image holds no data and would forward
+	 * every read. The caller frees *map.
+	 */
+	int (*td_get_block_map)      (td_driver_t *, uint32_t *block_secs,
+				      uint64_t *nr_blocks, uint8_t **map);
+
+	/**
+	 * Optional. Returns 1 if the image holds data for the first *secs
+	 * sectors at @sector, 0 if it holds none, and shortens *secs to
+	 * the length of that run. Never blocks: returns -EAGAIN if that
+	 * takes metadata not read in yet. Unless @wait is NULL, the read
+	 * is then started and @wait->cb called once it is done.
+	 */
+	int (*td_get_block_status)   (td_driver_t *, td_sector_t sector,
+				      uint32_t *secs, td_request_t *wait);
+
     /**
      * Callback to produce RRD output.
 	 *
@@ -206,6 +240,14 @@ struct td_sector_count {
 	td_sector_t wr;
 };
 
+/*
+ * Memory, in bytes, the images of a VBD may spend on cached metadata.
+ */
+struct td_cache_budget {
+	uint64_t                     limit;
+	uint64_t                     used;
+};
+
 static inline void
 td_sector_count_add(td_sector_count_t *s, td_sector_t v, int write)
 {
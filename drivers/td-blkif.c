@@ -24,14 +24,17 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <zlib.h>
+#include <sys/time.h>
 
 #include "debug.h"
 #include "blktap3.h"
 #include "tapdisk.h"
 #include "tapdisk-log.h"
+#include "tapdisk-utils.h"
 #include "util.h"
 #include "tapdisk-server.h"
 #include "tapdisk-metrics.h"
+#include "tapdisk-message.h"
 #include "timeout-math.h"
 
 #include "td-blkif.h"
@@ -56,6 +59,26 @@ tapdisk_xenblkif_find(const domid_t domid, const int devid)
 }
 
 
+static struct td_xenblkif *
+tapdisk_xenblkif_find_ring(const domid_t domid, const int devid,
+        const int queue)
+{
+    struct td_xenblkif *blkif = NULL;
+    struct td_xenio_ctx *ctx;
+
+    tapdisk_xenio_for_each_ctx(ctx) {
+        tapdisk_xenio_ctx_find_blkif(ctx, blkif,
+                                     blkif->domid == domid &&
+                                     blkif->devid == devid &&
+                                     blkif->queue == queue);
+        if (blkif)
+            return blkif;
+    }
+
+    return NULL;
+}
+
+
 /**
  * Returns 0 on success, -errno on failure.
  */
@@ -193,6 +216,37 @@ out:
 }
 
 
+/*
+ * Drops the ring's reference to the stats of queue 0, releasing them with the
+ * last one.
+ */
+static void
+tapdisk_xenblkif_stats_put(struct td_xenblkif *blkif)
+{
+    struct td_xenblkif *owner = blkif->stats_owner;
+    int err;
+
+    if (!owner)
+        return;
+
+    blkif->stats_owner = NULL;
+    if (--owner->stats_refs)
+        return;
+
+    err = td_metrics_vbd_stop(&owner->vbd_stats);
+    if (unlikely(err))
+        EPRINTF("failed to destroy blkfront stats file: %s\n", strerror(-err));
+
+    err = tapdisk_xenblkif_stats_destroy(owner);
+    if (unlikely(err))
+        EPRINTF("failed to clean up ring stats file: %s (error ignored)\n",
+                strerror(-err));
+
+    if (owner != blkif && owner->destroyed)
+        free(owner);
+}
+
+
 int
 tapdisk_xenblkif_destroy(struct td_xenblkif * blkif)
 {
@@ -214,6 +268,8 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif)
 
     tapdisk_xenblkif_reqs_free(blkif);
 
+    td_gntcache_destroy(&blkif->gntcache);
+
     if (blkif->ctx) {
         if (blkif->port >= 0)
             xc_evtchn_unbind(blkif->ctx->xce_handle, blkif->port);
@@ -235,20 +291,21 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif)
         list_del(&blkif->entry);
         tapdisk_xenio_ctx_put(blkif->ctx);
     }
-    err = td_metrics_vbd_stop(&blkif->vbd_stats);
-    if (unlikely(err))
-        EPRINTF("failed to destroy blkfront stats file: %s\n", strerror(-err));
 
-    err = tapdisk_xenblkif_stats_destroy(blkif);
-    if (unlikely(err)) {
-        EPRINTF("failed to clean up ring stats file: %s (error ignored)\n",
-                strerror(-err));
-        err = 0;
+    tapdisk_xenblkif_stats_put(blkif);
+
+    /*
+     * The other queues still account into our stats, the last one to go
+     * frees us.
+     */
+    if (blkif->stats_refs) {
+        blkif->destroyed = true;
+        return 0;
     }
 
     free(blkif);
 
-    return err;
+    return 0;
 }
 
 
@@ -271,6 +328,24 @@ tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
     if (!blkif)
         return -ENODEV;
 
+    /*
+     * Dead rings are skipped by the look-up, so this visits each ring once.
+     */
+    do {
+        err = tapdisk_xenblkif_disconnect_ring(blkif);
+        if (err)
+            break;
+    } while ((blkif = tapdisk_xenblkif_find(domid, devid)));
+
+    return err;
+}
+
+
+int
+tapdisk_xenblkif_disconnect_ring(struct td_xenblkif *blkif)
+{
+    ASSERT(blkif);
+
     if (tapdisk_xenblkif_reqs_pending(blkif)) {
         RING_DEBUG(blkif, "disconnect from ring with %d pending requests\n",
                 blkif->ring_size - blkif->n_reqs_free);
@@ -285,14 +360,10 @@ tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
             blkif->port = -1;
         }
 
-        err = td_metrics_vbd_stop(&blkif->vbd_stats);
-        if (unlikely(err))
-            EPRINTF("failed to destroy blkfront stats file: %s\n", strerror(-err));
-
-        err = tapdisk_xenblkif_stats_destroy(blkif);
-        if (unlikely(err))
-            EPRINTF("failed to clean up ring stats file: %s (error ignored)\n",
-                    strerror(-err));
+        /*
+         * Dead rings don't account into the stats, the live queues may.
+         */
+        tapdisk_xenblkif_stats_put(blkif);
 
         /*
          * FIXME shall we unmap the ring or will that lead to some fatal error
@@ -313,7 +384,8 @@ tapdisk_xenblkif_sched_stoppolling(const struct td_xenblkif *blkif)
 	ASSERT(blkif);
 
 	err = tapdisk_server_event_set_timeout(
-		tapdisk_xenblkif_stoppolling_event_id(blkif), TV_USECS(blkif->poll_duration));
+		tapdisk_xenblkif_stoppolling_event_id(blkif),
+		TV_USECS(blkif->poll.duration));
 	ASSERT(!err);
 }
 
@@ -347,6 +419,96 @@ tapdisk_start_polling(struct td_xenblkif *blkif)
     }
 }
 
+/*
+ * Weight of a new sample in the running means, as a shift (1/8).
+ */
+#define TD_POLL_EWMA_SHIFT 3
+
+/*
+ * Shortest poll window worth arming, in microseconds.
+ */
+#define TD_POLL_MIN_US 5
+
+/*
+ * Polling saves a notification round trip per request. When service time
+ * exceeds the poll cap by this factor, the saving is lost in the noise
+ * and not worth the CPU.
+ */
+#define TD_POLL_SVC_RATIO 16
+
+static inline void
+tapdisk_xenblkif_poll_avg(long long *avg, long long sample)
+{
+	if (!*avg)
+		*avg = sample;
+	else
+		*avg += (sample - *avg) >> TD_POLL_EWMA_SHIFT;
+}
+
+/*
+ * Like hybrid polling: poll long enough to catch the next request at
+ * the observed arrival rate, and not at all when requests arrive too
+ * slowly or take too long to serve for polling to pay off.
+ */
+static void
+tapdisk_xenblkif_poll_tune(struct td_xenblkif *blkif)
+{
+	long long duration = 2 * blkif->poll.gap;
+
+	if (blkif->poll.gap > blkif->poll_duration ||
+	    blkif->poll.svc > (long long)TD_POLL_SVC_RATIO * blkif->poll_duration)
+		duration = 0;
+	else if (duration < TD_POLL_MIN_US)
+		duration = TD_POLL_MIN_US;
+	else if (duration > blkif->poll_duration)
+		duration = blkif->poll_duration;
+
+	blkif->poll.duration = duration;
+}
+
+void
+tapdisk_xenblkif_poll_arrival(struct td_xenblkif *blkif, bool polled)
+{
+	struct timeval now;
+	long long us, gap;
+
+	ASSERT(blkif);
+
+	if (!blkif->poll_duration)
+		return;
+
+	if (polled)
+		blkif->poll.hits++;
+
+	gettimeofday(&now, NULL);
+	us = timeval_to_us(&now);
+
+	/*
+	 * Any gap longer than the cap means "too slow to poll"; clamp it so
+	 * an idle period does not hide the next burst.
+	 */
+	if (blkif->poll.last) {
+		gap = us - blkif->poll.last;
+		if (gap > 2LL * blkif->poll_duration)
+			gap = 2LL * blkif->poll_duration;
+		tapdisk_xenblkif_poll_avg(&blkif->poll.gap, gap);
+	}
+	blkif->poll.last = us;
+
+	tapdisk_xenblkif_poll_tune(blkif);
+}
+
+void
+tapdisk_xenblkif_poll_service(struct td_xenblkif *blkif, long long us)
+{
+	ASSERT(blkif);
+
+	if (!blkif->poll_duration)
+		return;
+
+	tapdisk_xenblkif_poll_avg(&blkif->poll.svc, us);
+}
+
 static inline void
 tapdisk_xenblkif_cb_stoppolling(event_id_t id __attribute__((unused)),
         char mode __attribute__((unused)), void *private)
@@ -359,6 +521,7 @@ tapdisk_xenblkif_cb_stoppolling(event_id_t id __attribute__((unused)),
     if (!tapdisk_xenio_ctx_process_ring(blkif, blkif->ctx, 1)) {
         /* If there were no new requests this time, then stop polling */
         blkif->in_polling = false;
+        blkif->poll.misses++;
 
         /* Stop obsessively checking the ring */
         tapdisk_xenblkif_unsched_chkrng(blkif);
@@ -413,12 +576,36 @@ tapdisk_xenblkif_cb_chkrng(event_id_t id __attribute__((unused)),
 }
 
 
+static void *
+tapdisk_xenblkif_map_grant(void *data, uint32_t ref)
+{
+    struct td_xenblkif *blkif = data;
+
+    return xc_gnttab_map_grant_ref(blkif->ctx->xcg_handle, blkif->domid, ref,
+            PROT_READ | PROT_WRITE);
+}
+
+static int
+tapdisk_xenblkif_unmap_grant(void *data, void *page)
+{
+    struct td_xenblkif *blkif = data;
+
+    return xc_gnttab_munmap(blkif->ctx->xcg_handle, page, 1);
+}
+
+static const struct td_gntcache_ops tapdisk_xenblkif_gntcache_ops = {
+    .map   = tapdisk_xenblkif_map_grant,
+    .unmap = tapdisk_xenblkif_unmap_grant,
+};
+
 int
-tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
-        int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd)
+tapdisk_xenblkif_connect(domid_t domid, int devid, int queue, int nr_queues,
+        const grant_ref_t * grefs, int order, evtchn_port_t port, int proto,
+        int poll_duration, int poll_idle_threshold, bool persistent,
+        int max_indirect_segments, const char *pool, td_vbd_t * vbd)
 {
     struct td_xenblkif *td_blkif = NULL; /* TODO rename to blkif */
+    struct td_xenblkif *first = NULL;
     struct td_xenio_ctx *td_ctx;
     int err;
     unsigned int i;
@@ -428,14 +615,35 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
     ASSERT(grefs);
     ASSERT(vbd);
 
+    if (!nr_queues)
+        nr_queues = 1;
+    if (nr_queues > TAPDISK_MAX_QUEUES || queue < 0 || queue >= nr_queues) {
+        EPRINTF("%d/%d: invalid queue %d of %d\n", domid, devid, queue,
+                nr_queues);
+        return -EINVAL;
+    }
+
     /*
      * Already connected?
      */
-    if (tapdisk_xenblkif_find(domid, devid)) {
+    if (tapdisk_xenblkif_find_ring(domid, devid, queue)) {
         /* TODO log error */
         return -EALREADY;
     }
 
+    /*
+     * The other queues account into the stats of the first one, so it has
+     * to be there already.
+     */
+    if (queue) {
+        first = tapdisk_xenblkif_find_ring(domid, devid, 0);
+        if (!first || first->vbd != vbd || first->nr_queues != nr_queues) {
+            EPRINTF("%d/%d: queue %d connected before queue 0\n", domid,
+                    devid, queue);
+            return -EINVAL;
+        }
+    }
+
     err = tapdisk_xenio_ctx_get(pool, &td_ctx);
     if (err) {
         /* TODO log error */
@@ -451,6 +659,8 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 
     td_blkif->domid = domid;
     td_blkif->devid = devid;
+    td_blkif->queue = queue;
+    td_blkif->nr_queues = nr_queues;
     td_blkif->vbd = vbd;
     td_blkif->ctx = td_ctx;
     td_blkif->proto = proto;
@@ -460,6 +670,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 	td_blkif->in_polling = false;
 	td_blkif->poll_duration = poll_duration;
 	td_blkif->poll_idle_threshold = poll_idle_threshold;
+	td_blkif->poll.duration = poll_duration;
 	td_blkif->barrier.msg = NULL;
 	td_blkif->barrier.io_done = false;
 	td_blkif->barrier.io_err = 0;
@@ -470,6 +681,9 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 
     memset(&td_blkif->stats, 0, sizeof(td_blkif->stats));
 
+    td_blkif->stats_owner = first ? : td_blkif;
+    td_blkif->stats_owner->stats_refs++;
+
     INIT_LIST_HEAD(&td_blkif->entry_ctx);
     INIT_LIST_HEAD(&td_blkif->entry);
 
@@ -553,12 +767,40 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
+    if (max_indirect_segments < 0 ||
+            max_indirect_segments > TAPDISK_MAX_INDIRECT_SEGMENTS) {
+        RING_ERR(td_blkif, "invalid maximum indirect segments %d\n",
+                max_indirect_segments);
+        err = -EINVAL;
+        goto fail;
+    }
+    td_blkif->max_indirect_segments = max_indirect_segments;
+    td_blkif->max_segments = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    if (max_indirect_segments > td_blkif->max_segments)
+        td_blkif->max_segments = max_indirect_segments;
+
     err = tapdisk_xenblkif_reqs_init(td_blkif);
     if (err) {
         /* TODO log error */
         goto fail;
     }
 
+    /*
+     * The front-end never uses more grants than fit in a full ring, so a
+     * well-behaved one never needs evictions.
+     */
+    if (persistent) {
+        err = td_gntcache_init(&td_blkif->gntcache,
+                td_blkif->ring_size * td_blkif->max_segments,
+                &tapdisk_xenblkif_gntcache_ops, td_blkif);
+        if (err) {
+            RING_ERR(td_blkif, "failed to create grant cache: %s\n",
+                    strerror(-err));
+            goto fail;
+        }
+        td_blkif->persistent = true;
+    }
+
 	td_blkif->chkrng_event = tapdisk_server_register_event(
 			SCHEDULER_POLL_TIMEOUT,	-1, TV_INF,
 			tapdisk_xenblkif_cb_chkrng, td_blkif);
@@ -568,9 +810,14 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
-    err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid, &td_blkif->vbd_stats);
-    if (unlikely(err))
-        goto fail;
+    if (!first) {
+        err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid,
+                &td_blkif->vbd_stats);
+        if (unlikely(err))
+            goto fail;
+    } else {
+        td_blkif->vbd_stats.stats = first->vbd_stats.stats;
+    }
 
 	td_blkif->stoppolling_event = tapdisk_server_register_event(
 			SCHEDULER_POLL_TIMEOUT,	-1, TV_INF,
@@ -581,14 +828,19 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
-    err = tapdisk_xenblkif_stats_create(td_blkif);
-    if (unlikely(err))
-        goto fail;
+    if (!first) {
+        err = tapdisk_xenblkif_stats_create(td_blkif);
+        if (unlikely(err))
+            goto fail;
+    } else {
+        td_blkif->stats.xenvbd = first->stats.xenvbd;
+    }
 
     list_add_tail(&td_blkif->entry, &vbd->rings);
 	list_add_tail(&td_blkif->entry_ctx, &td_ctx->blkifs);
 
-    DPRINTF("ring %p connected\n", td_blkif);
+    DPRINTF("ring %p connected (queue %d of %d)\n", td_blkif, queue,
+            nr_queues);
 
     return 0;
 
@@ -643,7 +895,11 @@ tapdisk_xenblkif_ring_stats_update(struct td_xenblkif *blkif)
 	if (!ring->sring)
         return 0;
 
-    ASSERT(blkif->xenvbd_stats.io_ring.mem);
+    /*
+     * Only the first ring of a multi-queue VBD has a ring stats file.
+     */
+    if (!blkif->xenvbd_stats.io_ring.mem)
+        return 0;
 
     /*
      * Update the ring stats once every five seconds.
@@ -34,6 +34,8 @@
 #include "tapdisk-vbd.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-metrics.h"
+#include "td-gntcache.h"
+#include "tapdisk-slab.h"
 
 struct td_xenio_ctx;
 struct td_vbd_handle;
@@ -51,6 +53,24 @@ struct td_xenblkif {
      */
     int devid;
 
+    /**
+     * Index of this ring among the rings of the VBD, and the number of
+     * rings the front-end uses (multi-queue). Queue 0 owns the VBD's stats
+     * files, the other queues account into them.
+     */
+    int queue;
+    int nr_queues;
+
+    /**
+     * The ring owning the stats this ring accounts into (queue 0), and on
+     * queue 0 the number of rings holding them. The stats are released with
+     * the last reference; if queue 0 is destroyed before that, it stays
+     * allocated (destroyed) and the last queue frees it.
+     */
+    struct td_xenblkif *stats_owner;
+    int stats_refs;
+    bool destroyed;
+
 
     /**
 	 * Pointer to the context this block interface belongs to.
@@ -153,8 +173,7 @@ struct td_xenblkif {
     /**
      * Request buffer cache.
      */
-    void **reqs_bufcache;
-    unsigned n_reqs_bufcache_free;
+    td_slab_t reqs_bufs;
     event_id_t reqs_bufcache_evtid;
 
 	bool dead;
@@ -183,6 +202,34 @@ struct td_xenblkif {
 	bool in_polling;
 	int poll_duration; /* microseconds; 0 means no polling. */
 	int poll_idle_threshold;
+
+	/**
+	 * Adaptive polling: the poll window follows the observed request
+	 * inter-arrival and service times, capped by poll_duration.
+	 */
+	struct {
+		int duration;        /* current poll window, us */
+		long long last;      /* time of the last arrival, us */
+		long long gap;       /* mean inter-arrival time, us */
+		long long svc;       /* mean service time, us */
+		unsigned long long hits;   /* polls that found requests */
+		unsigned long long misses; /* polls that expired idle */
+	} poll;
+
+	/**
+	 * Tells whether the front-end reuses grants (feature-persistent), in
+	 * which case they are mapped once and kept in gntcache instead of
+	 * being grant-copied for every request.
+	 */
+	bool persistent;
+	struct td_gntcache gntcache;
+
+	/**
+	 * Maximum number of segments of an indirect request, 0 if indirect
+	 * requests are not supported, and of any request.
+	 */
+	int max_indirect_segments;
+	int max_segments;
 };
 
 #define RING_DEBUG(blkif, fmt, args...)                                     \
@@ -194,14 +241,17 @@ struct td_xenblkif {
         ##args);
 
 /* TODO rename from xenio */
+/* contexts are per event loop, see tapdisk_server_xenio_ctxs */
 #define tapdisk_xenio_for_each_ctx(_ctx) \
-	list_for_each_entry(_ctx, &_td_xenio_ctxs, entry)
+	list_for_each_entry(_ctx, tapdisk_server_xenio_ctxs(), entry)
 
 /**
  * Connects the tapdisk to the shared ring.
  *
  * @param domid the ID of the guest domain
  * @param devid the device ID
+ * @param queue index of the ring
+ * @param nr_queues number of rings of the VBD
  * @param grefs the grant references
  * @param order number of grant references
  * @param port event channel port of the guest domain to use for ring
@@ -209,17 +259,21 @@ struct td_xenblkif {
  * @param proto protocol (native, x86, or x64)
  * @param poll_duration polling duration (microseconds; 0 means no polling)
  * @param poll_idle_threshold CPU threshold above which we permit polling
+ * @param persistent the front-end supports persistent grants
+ * @param max_indirect_segments maximum number of segments of an indirect
+ * request (0 means no indirect requests)
  * @param pool name of the context
  * @param vbd the VBD
  * @returns 0 on success
  */
 int
-tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
-        int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd);
+tapdisk_xenblkif_connect(domid_t domid, int devid, int queue, int nr_queues,
+        const grant_ref_t * grefs, int order, evtchn_port_t port, int proto,
+        int poll_duration, int poll_idle_threshold, bool persistent,
+        int max_indirect_segments, const char *pool, td_vbd_t * vbd);
 
 /**
- * Disconnects the tapdisk from the shared ring.
+ * Disconnects the tapdisk from all the shared rings of the VBD.
  *
  * @param domid the domain ID of the guest domain
  * @param devid the device ID of the VBD
@@ -232,6 +286,14 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 int
 tapdisk_xenblkif_disconnect(const domid_t domid, const int devid);
 
+/**
+ * Disconnects the tapdisk from a single shared ring. If there are pending
+ * requests the ring is moved to the VBD's dead rings and destroyed when they
+ * complete.
+ */
+int
+tapdisk_xenblkif_disconnect_ring(struct td_xenblkif *blkif);
+
 /**
  * Destroys a XEN block interface.
  *
@@ -243,7 +305,7 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif);
 /**
  * Searches all block interfaces in all contexts for a block interface
  * having the specified domain and device ID. Dead block interfaces are
- * ignored.
+ * ignored. For a multi-queue VBD, any of its rings may be returned.
  *
  * @param domid the domain ID
  * @param devid the device ID
@@ -317,6 +379,18 @@ tapdisk_xenblkif_unsched_stoppolling(const struct td_xenblkif *blkif);
 void
 tapdisk_start_polling(struct td_xenblkif *blkif);
 
+/**
+ * Feeds the polling controller with requests just found in the ring.
+ */
+void
+tapdisk_xenblkif_poll_arrival(struct td_xenblkif *blkif, bool polled);
+
+/**
+ * Feeds the polling controller with the service time of a request.
+ */
+void
+tapdisk_xenblkif_poll_service(struct td_xenblkif *blkif, long long us);
+
 /**
  * Schedules a ring check.
  */
@@ -34,7 +34,11 @@
 
 #define ERROR(_f, _a...)           tlog_syslog(TLOG_WARN, "td-ctx: " _f, ##_a)
 
-LIST_HEAD(_td_xenio_ctxs);
+/*
+ * Requests taken from one ring of a multi-queue VBD before the other rings
+ * get a turn.
+ */
+#define TD_XENBLKIF_MQ_BATCH 16
 
 /**
  * TODO releases a pool?
@@ -126,6 +130,25 @@ xenio_pending_blkif(struct td_xenio_ctx * const ctx)
         dst->seg[i] = src->seg[i];              \
 }
 
+/*
+ * Indirect requests have a layout of their own, copy them to the native
+ * indirect layout. The segments are fetched from the indirect pages later.
+ */
+#define blkif_get_req_indirect(dst, src)                                \
+{                                                                       \
+    int i, n = BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST;                    \
+    blkif_request_indirect_t *__dst = (blkif_request_indirect_t *)dst;  \
+    __dst->operation = BLKIF_OP_INDIRECT;                               \
+    __dst->indirect_op = src->indirect_op;                              \
+    __dst->nr_segments = src->nr_segments;                              \
+    __dst->id = src->id;                                                \
+    __dst->sector_number = src->sector_number;                          \
+    __dst->handle = src->handle;                                        \
+    xen_rmb();                                                          \
+    for (i = 0; i < n; i++)                                             \
+        __dst->indirect_grefs[i] = src->indirect_grefs[i];              \
+}
+
 /**
  * Utility function that retrieves a request using @idx as the ring index,
  * copying it to the @dst in a H/W independent way.
@@ -158,7 +181,12 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_32_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_32, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_x86_32_request_indirect_t *isrc =
+                        (blkif_x86_32_request_indirect_t *)src;
+                    blkif_get_req_indirect(dst, isrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -166,7 +194,12 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_64_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_64, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_x86_64_request_indirect_t *isrc =
+                        (blkif_x86_64_request_indirect_t *)src;
+                    blkif_get_req_indirect(dst, isrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -282,6 +315,7 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
     int start;
     blkif_request_t **reqs;
     int limit;
+    bool batched = false;
 
     start = blkif->n_reqs_free;
 
@@ -300,6 +334,15 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
     else
 	    limit = blkif->n_reqs_free;
 
+    /*
+     * Don't let a busy ring hog the event loop while the other rings of the
+     * VBD wait: take a batch and come back to it once they had a go.
+     */
+    if (blkif->nr_queues > 1 && limit > TD_XENBLKIF_MQ_BATCH) {
+        limit = TD_XENBLKIF_MQ_BATCH;
+        batched = true;
+    }
+
     do {
         reqs = &blkif->reqs_free[blkif->ring_size - blkif->n_reqs_free];
 
@@ -328,6 +371,12 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
 
     n_reqs = start - blkif->n_reqs_free;
 
+    if (batched && !limit && !blkif->barrier.msg &&
+            RING_HAS_UNCONSUMED_REQUESTS(&blkif->rings.common)) {
+        blkif->stats.yields++;
+        tapdisk_xenblkif_sched_chkrng(blkif);
+    }
+
     if (!n_reqs)
 		/*
 		 * We got a notification but the ring is empty. This is because we had
@@ -340,10 +389,12 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
 		 */
 		return 0;
 
+    tapdisk_xenblkif_poll_arrival(blkif, blkif->in_polling);
+
     if (blkif->in_polling)
         /* We found at least one request, so keep polling some more */
         tapdisk_xenblkif_sched_stoppolling(blkif);
-    else if (blkif->poll_duration)
+    else if (blkif->poll.duration)
         /* We weren't polling, but polling is enabled, so let's start now */
         tapdisk_start_polling(blkif);
 
@@ -415,7 +466,7 @@ tapdisk_xenio_ctx_open(const char *pool)
     ctx->gntdev_fd = -1;
     ctx->pool = TD_XENBLKIF_DEFAULT_POOL;
 	INIT_LIST_HEAD(&ctx->blkifs);
-    list_add(&ctx->entry, &_td_xenio_ctxs);
+    list_add(&ctx->entry, tapdisk_server_xenio_ctxs());
 
     ctx->gntdev_fd = open("/dev/xen/gntdev", O_NONBLOCK);
     if (ctx->gntdev_fd == -1) {
@@ -92,11 +92,6 @@ int
 tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
 		struct td_xenio_ctx *ctx, int final);
 
-/**
- * List of contexts.
- */
-extern struct list_head _td_xenio_ctxs;
-
 /**
  * For each block interface of this context...
  */
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2012      Citrix Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "debug.h"
+#include "tapdisk-log.h"
+#include "td-gntcache.h"
+
+static inline struct list_head *
+td_gntcache_bucket(struct td_gntcache *cache, uint32_t ref)
+{
+	return &cache->buckets[(ref * 2654435761U) & (cache->n_buckets - 1)];
+}
+
+static void
+td_gntcache_drop(struct td_gntcache *cache, struct td_gnt *gnt)
+{
+	int err;
+
+	ASSERT(!gnt->users);
+
+	err = cache->ops->unmap(cache->data, gnt->page);
+	if (err)
+		EPRINTF("failed to unmap grant %u: %s\n", gnt->ref, strerror(errno));
+
+	list_del(&gnt->hash);
+	list_del(&gnt->lru);
+	cache->n_gnts--;
+	free(gnt);
+}
+
+int
+td_gntcache_init(struct td_gntcache *cache, int max,
+		const struct td_gntcache_ops *ops, void *data)
+{
+	int i;
+
+	ASSERT(cache);
+	ASSERT(max > 0);
+	ASSERT(ops);
+
+	memset(cache, 0, sizeof(*cache));
+
+	cache->n_buckets = 1;
+	while (cache->n_buckets < max / 2)
+		cache->n_buckets <<= 1;
+
+	cache->buckets = malloc(cache->n_buckets * sizeof(*cache->buckets));
+	if (!cache->buckets)
+		return -errno;
+
+	for (i = 0; i < cache->n_buckets; i++)
+		INIT_LIST_HEAD(&cache->buckets[i]);
+
+	INIT_LIST_HEAD(&cache->lru);
+	cache->max_gnts = max;
+	cache->ops = ops;
+	cache->data = data;
+
+	return 0;
+}
+
+void
+td_gntcache_destroy(struct td_gntcache *cache)
+{
+	struct td_gnt *gnt, *next;
+
+	ASSERT(cache);
+
+	if (!cache->buckets)
+		return;
+
+	list_for_each_entry_safe(gnt, next, &cache->lru, lru)
+		td_gntcache_drop(cache, gnt);
+
+	if (cache->n_gnts)
+		EPRINTF("%d grants still in use\n", cache->n_gnts);
+
+	free(cache->buckets);
+	cache->buckets = NULL;
+}
+
+struct td_gnt *
+td_gntcache_get(struct td_gntcache *cache, uint32_t ref)
+{
+	struct list_head *bucket;
+	struct td_gnt *gnt;
+
+	ASSERT(cache);
+
+	bucket = td_gntcache_bucket(cache, ref);
+
+	list_for_each_entry(gnt, bucket, hash) {
+		if (gnt->ref == ref) {
+			if (!gnt->users++)
+				list_del_init(&gnt->lru);
+			cache->stats.hits++;
+			return gnt;
+		}
+	}
+
+	cache->stats.misses++;
+
+	if (cache->n_gnts >= cache->max_gnts) {
+		if (list_empty(&cache->lru)) {
+			cache->stats.full++;
+			errno = ENOSPC;
+			return NULL;
+		}
+		gnt = list_entry(cache->lru.next, struct td_gnt, lru);
+		td_gntcache_drop(cache, gnt);
+		cache->stats.evictions++;
+	}
+
+	gnt = malloc(sizeof(*gnt));
+	if (!gnt)
+		return NULL;
+
+	gnt->page = cache->ops->map(cache->data, ref);
+	if (!gnt->page) {
+		int err = errno;
+		free(gnt);
+		errno = err;
+		return NULL;
+	}
+
+	gnt->ref = ref;
+	gnt->users = 1;
+	INIT_LIST_HEAD(&gnt->lru);
+	list_add(&gnt->hash, bucket);
+	cache->n_gnts++;
+
+	return gnt;
+}
+
+void
+td_gntcache_put(struct td_gntcache *cache, struct td_gnt *gnt)
+{
+	ASSERT(cache);
+	ASSERT(gnt);
+	ASSERT(gnt->users > 0);
+
+	if (!--gnt->users)
+		list_add_tail(&gnt->lru, &cache->lru);
+}
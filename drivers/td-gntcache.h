@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2012      Citrix Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#ifndef __TD_GNTCACHE_H__
+#define __TD_GNTCACHE_H__
+
+#include <stdint.h>
+#include "list.h"
+
+/**
+ * Maps and unmaps a single grant page. The block interface implements these
+ * on top of the grant table device, tests with plain memory.
+ */
+struct td_gntcache_ops {
+	void *(*map)(void *data, uint32_t ref);
+	int (*unmap)(void *data, void *page);
+};
+
+/**
+ * A mapped grant.
+ */
+struct td_gnt {
+	uint32_t ref;
+	void *page;
+
+	/**
+	 * Requests using the mapping. Unused mappings sit on the LRU list and
+	 * may be unmapped to make room.
+	 */
+	int users;
+
+	struct list_head hash;
+	struct list_head lru;
+};
+
+/**
+ * Persistent grant mappings of a block interface, looked up by grant
+ * reference.
+ */
+struct td_gntcache {
+	int n_gnts;
+	int max_gnts;
+
+	struct list_head *buckets;
+	int n_buckets;
+
+	/**
+	 * Unused mappings, least recently used first.
+	 */
+	struct list_head lru;
+
+	const struct td_gntcache_ops *ops;
+	void *data;
+
+	struct {
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long evictions;
+		unsigned long long full;
+	} stats;
+};
+
+/**
+ * Initialises an empty cache holding up to @max mappings.
+ *
+ * @returns 0 on success, -errno on failure
+ */
+int
+td_gntcache_init(struct td_gntcache *cache, int max,
+		const struct td_gntcache_ops *ops, void *data);
+
+/**
+ * Unmaps everything. All mappings must have been released.
+ */
+void
+td_gntcache_destroy(struct td_gntcache *cache);
+
+/**
+ * Returns the mapping of @ref, mapping it if necessary. If the cache is full
+ * the least recently used idle mapping is dropped.
+ *
+ * @returns the mapping, NULL on failure with errno set (ENOSPC when the cache
+ * is full of mappings in use)
+ */
+struct td_gnt *
+td_gntcache_get(struct td_gntcache *cache, uint32_t ref);
+
+/**
+ * Releases a mapping returned by td_gntcache_get. The mapping stays cached.
+ */
+void
+td_gntcache_put(struct td_gntcache *cache, struct td_gnt *gnt);
+
+#endif /* __TD_GNTCACHE_H__ */
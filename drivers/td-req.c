@@ -48,6 +48,11 @@
 
 #define TD_REQS_BUFCACHE_EXPIRE 3 // time in seconds
 #define TD_REQS_BUFCACHE_MIN    1 // buffers to always keep in the cache
+#define TD_REQS_BUFCACHE_CHUNK(_ring_size) /* buffers mapped at a time */ \
+    ((_ring_size) >= 4 ? (_ring_size) / 4 : 1)
+
+#define TD_SEGS_PER_INDIRECT_FRAME \
+    (XC_PAGE_SIZE / sizeof(struct blkif_request_segment))
 
 static void
 td_xenblkif_bufcache_free(struct td_xenblkif * const blkif);
@@ -104,10 +109,7 @@ td_xenblkif_bufcache_free(struct td_xenblkif * const blkif)
 {
     ASSERT(blkif);
 
-    while (blkif->n_reqs_bufcache_free > TD_REQS_BUFCACHE_MIN){
-        munmap(blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free],
-               BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT);
-    }
+    td_slab_shrink(&blkif->reqs_bufs, TD_REQS_BUFCACHE_MIN);
 }
 
 /**
@@ -122,13 +124,7 @@ td_xenblkif_bufcache_get(struct td_xenblkif * const blkif)
 
     ASSERT(blkif);
 
-    if (!blkif->n_reqs_bufcache_free) {
-        buf = mmap(NULL, BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT,
-                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-        if (unlikely(buf == MAP_FAILED))
-            buf = NULL;
-    } else
-        buf = blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free];
+    buf = td_slab_alloc(&blkif->reqs_bufs);
 
     // If we just got a request, we cancel the cache expire timer
     td_xenblkif_bufcache_evt_unreg(blkif);
@@ -144,16 +140,7 @@ td_xenblkif_bufcache_put(struct td_xenblkif * const blkif, void *buf)
     if (unlikely(!buf))
         return;
 
-#ifdef DEBUG
-	{
-		int i;
-
-		for (i = 0; i < blkif->n_reqs_bufcache_free; i++)
-			ASSERT(blkif->reqs_bufcache[i] != buf);
-	}
-#endif
-
-    blkif->reqs_bufcache[blkif->n_reqs_bufcache_free++] = buf;
+    td_slab_free(&blkif->reqs_bufs, buf);
 
     /* If we're in low memory mode, prune the bufcache immediately. */
     if (tapdisk_server_mem_mode() == LOW_MEMORY_MODE) {
@@ -165,6 +152,47 @@ td_xenblkif_bufcache_put(struct td_xenblkif * const blkif, void *buf)
     }
 }
 
+/**
+ * Releases the persistent grant mappings of a request.
+ */
+static void
+tapdisk_xenblkif_put_grants(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq)
+{
+    int i;
+
+    for (i = 0; i < tapreq->n_gnts; i++)
+        td_gntcache_put(&blkif->gntcache, tapreq->gnts[i]);
+
+    tapreq->n_gnts = 0;
+}
+
+/**
+ * Maps all segments of a request through the persistent grant cache. On
+ * failure nothing is held, and the request can fall back to grant copy.
+ */
+static int
+tapdisk_xenblkif_get_grants(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq)
+{
+    int i, err;
+
+    for (i = 0; i < tapreq->nr_segments; i++) {
+        tapreq->gnts[i] = td_gntcache_get(&blkif->gntcache,
+                tapreq->segs[i].gref);
+        if (unlikely(!tapreq->gnts[i])) {
+            err = -errno;
+            tapreq->n_gnts = i;
+            tapdisk_xenblkif_put_grants(blkif, tapreq);
+            return err;
+        }
+    }
+
+    tapreq->n_gnts = i;
+
+    return 0;
+}
+
 /**
  * Puts the request back to the free list of this block interface.
  *
@@ -185,8 +213,10 @@ tapdisk_xenblkif_free_request(struct td_xenblkif * const blkif,
 
     blkif->reqs_free[blkif->ring_size - (++blkif->n_reqs_free)] = &tapreq->msg;
 
-	if (likely(tapreq->msg.nr_segments))
+	if (likely(tapreq->nr_segments)) {
 	    td_xenblkif_bufcache_put(blkif, tapreq->vma);
+	    tapdisk_xenblkif_put_grants(blkif, tapreq);
+	}
 }
 
 /**
@@ -350,11 +380,11 @@ guest_copy2(struct td_xenblkif * const blkif,
     ASSERT(blkif->ctx);
     ASSERT(tapreq);
     ASSERT(blkif_rq_data(&tapreq->msg));
-	ASSERT(tapreq->msg.nr_segments > 0);
-	ASSERT(tapreq->msg.nr_segments <= ARRAY_SIZE(tapreq->gcopy_segs));
+	ASSERT(tapreq->nr_segments > 0);
+	ASSERT(tapreq->nr_segments <= blkif->max_segments);
 
-    for (i = 0; i < tapreq->msg.nr_segments; i++) {
-        struct blkif_request_segment *blkif_seg = &tapreq->msg.seg[i];
+    for (i = 0; i < tapreq->nr_segments; i++) {
+        struct blkif_request_segment *blkif_seg = &tapreq->segs[i];
         struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
         gcopy_seg->iov.iov_base = tapreq->vma + (i << PAGE_SHIFT)
             + (blkif_seg->first_sect << SECTOR_SHIFT);
@@ -368,7 +398,7 @@ guest_copy2(struct td_xenblkif * const blkif,
 
     gcopy.dir = blkif_rq_wr(&tapreq->msg);
     gcopy.domid = blkif->domid;
-    gcopy.count = tapreq->msg.nr_segments;
+    gcopy.count = tapreq->nr_segments;
 	gcopy.segments = tapreq->gcopy_segs;
 
     err = -ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy);
@@ -376,11 +406,11 @@ guest_copy2(struct td_xenblkif * const blkif,
         err = -errno;
         RING_ERR(blkif, "failed to grant-copy request %"PRIu64" "
                 "(%d segments): %s\n", tapreq->msg.id,
-                tapreq->msg.nr_segments, strerror(-err));
+                tapreq->nr_segments, strerror(-err));
         goto out;
     }
 
-	for (i = 0; i < tapreq->msg.nr_segments; i++) {
+	for (i = 0; i < tapreq->nr_segments; i++) {
 		struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
 		if (gcopy_seg->status != GNTST_okay) {
 			/*
@@ -440,7 +470,7 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 	 */
 	if (unlikely(processing_barrier_message)) {
 		ASSERT(blkif->barrier.msg == &tapreq->msg);
-		if (tapreq->msg.nr_segments && !blkif->barrier.io_done) {
+		if (tapreq->nr_segments && !blkif->barrier.io_done) {
 			blkif->barrier.io_err = err;
 			blkif->barrier.io_done = true;
 		}
@@ -459,7 +489,7 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 			max = &blkif->stats.xenvbd->st_rd_max_usecs;
                         blkif->vbd_stats.stats->read_reqs_completed++;
                         ticks = &blkif->vbd_stats.stats->read_total_ticks;
-			if (likely(!err)) {
+			if (likely(!err) && !tapreq->n_gnts) {
 				_err = guest_copy2(blkif, tapreq);
 				if (unlikely(_err)) {
 					err = _err;
@@ -475,17 +505,27 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
                         ticks = &blkif->vbd_stats.stats->write_total_ticks;
 		}
 
-		if (likely(cnt)) {
+		if (likely(cnt) || unlikely(processing_barrier_message)) {
 			struct timeval now;
 			long long interval;
 			gettimeofday(&now, NULL);
 			interval = timeval_to_us(&now) - timeval_to_us(&tapreq->ts);
-                       *ticks += interval;
-			if (interval > *max)
-				*max = interval;
 
-			*sum += interval;
-			*cnt += 1;
+			tapdisk_xenblkif_poll_service(blkif, interval);
+
+			if (unlikely(processing_barrier_message))
+				td_histogram_add(
+					&blkif->vbd->latency[TD_METRICS_HIST_FLUSH],
+					interval);
+
+			if (likely(cnt)) {
+				*ticks += interval;
+				if (interval > *max)
+					*max = interval;
+
+				*sum += interval;
+				*cnt += 1;
+			}
 		}
 
 		if (likely(err == 0))
@@ -571,6 +611,27 @@ __tapdisk_xenblkif_request_cb(struct td_vbd_request * const vreq,
 }
 
 
+/**
+ * Tells whether the data of a write request is all zeroes, in which case it
+ * can be issued as TD_OP_WRITE_ZEROES and unallocated blocks left alone.
+ */
+static inline bool
+tapdisk_xenblkif_zero_request(const td_vbd_request_t * const vreq)
+{
+    int i;
+
+    for (i = 0; i < vreq->iovcnt; i++) {
+        const char *buf = vreq->iov[i].base;
+        size_t len = vreq->iov[i].secs << SECTOR_SHIFT;
+
+        if (buf[0] || memcmp(buf, buf + 1, len - 1))
+            return false;
+    }
+
+    return true;
+}
+
+
 static inline int
 tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
         struct td_xenblkif_req * const req)
@@ -588,15 +649,8 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     vreq = &req->vreq;
     ASSERT(vreq);
 
-    req->vma = td_xenblkif_bufcache_get(blkif);
-    if (unlikely(!req->vma)) {
-        err = errno;
-        goto out;
-    }
-
-    for (i = 0; i < req->msg.nr_segments; i++) {
-        struct blkif_request_segment *seg = &req->msg.seg[i];
-        req->gref[i] = seg->gref;
+    for (i = 0; i < req->nr_segments; i++) {
+        struct blkif_request_segment *seg = &req->segs[i];
 
         /*
          * Note that first and last may be equal, which means only one sector
@@ -605,7 +659,23 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
         if (seg->last_sect < seg->first_sect) {
             RING_ERR(blkif, "req %lu: invalid sectors %d-%d\n",
                     req->msg.id, seg->first_sect, seg->last_sect);
-            err = EINVAL;
+            err = -EINVAL;
+            goto out;
+        }
+    }
+
+    /*
+     * With persistent grants the request works on the guest pages directly.
+     * Otherwise, or if the grant cache is full, it gets a local buffer and
+     * the data is grant-copied.
+     */
+    if (blkif->persistent)
+        tapdisk_xenblkif_get_grants(blkif, req);
+
+    if (!req->n_gnts) {
+        req->vma = td_xenblkif_bufcache_get(blkif);
+        if (unlikely(!req->vma)) {
+            err = errno;
             goto out;
         }
     }
@@ -621,14 +691,18 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
      */
     iov = req->iov - 1;
     last = NULL;
-    page = req->vma;
 
-    for (i = 0; i < req->msg.nr_segments; i++) { /* for each segment */
-        struct blkif_request_segment *seg = &req->msg.seg[i];
+    for (i = 0; i < req->nr_segments; i++) { /* for each segment */
+        struct blkif_request_segment *seg = &req->segs[i];
         size_t size;
 
         /* TODO check that first_sect/last_sect are within page */
 
+        if (req->n_gnts)
+            page = req->gnts[i]->page;
+        else
+            page = req->vma + (i << XC_PAGE_SHIFT);
+
         next = page + (seg->first_sect << SECTOR_SHIFT);
         size = seg->last_sect - seg->first_sect + 1;
 
@@ -640,7 +714,6 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
             iov->secs += size;
 
         last = iov->base + (iov->secs << SECTOR_SHIFT);
-        page += XC_PAGE_SIZE;
         nr_sect += size;
     }
 
@@ -649,12 +722,17 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     vreq->sec = req->msg.sector_number;
 
     if (blkif_rq_wr(&req->msg)) {
-        err = guest_copy2(blkif, req);
-        if (err) {
-            RING_ERR(blkif, "req %lu: failed to copy from guest: %s\n",
-                    req->msg.id, strerror(-err));
-            goto out;
+        if (!req->n_gnts) {
+            err = guest_copy2(blkif, req);
+            if (err) {
+                RING_ERR(blkif, "req %lu: failed to copy from guest: %s\n",
+                        req->msg.id, strerror(-err));
+                goto out;
+            }
         }
+        if (tapdisk_vbd_handles_zeroes(blkif->vbd) &&
+                tapdisk_xenblkif_zero_request(vreq))
+            vreq->op = TD_OP_WRITE_ZEROES;
         blkif->stats.xenvbd->st_wr_sect += nr_sect;
         blkif->vbd_stats.stats->write_sectors += nr_sect;
     } else {
@@ -678,6 +756,96 @@ out:
 }
 
 
+/**
+ * Fetches the segment descriptors of an indirect request from the pages the
+ * guest granted for them, and turns the request into a plain read or write
+ * with more than BLKIF_MAX_SEGMENTS_PER_REQUEST segments.
+ */
+static int
+tapdisk_xenblkif_get_indirect(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq)
+{
+    blkif_request_indirect_t *msg = (blkif_request_indirect_t *)&tapreq->msg;
+    struct gntdev_grant_copy_segment
+        gcopy_segs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+    struct ioctl_gntdev_grant_copy gcopy;
+    int i, n_pages, nr_segments, op;
+    blkif_vdev_t handle;
+    size_t len;
+    int err;
+
+    op = msg->indirect_op;
+    nr_segments = msg->nr_segments;
+    handle = msg->handle;
+
+    if (unlikely(!blkif->max_indirect_segments)) {
+        RING_ERR(blkif, "req %lu: indirect requests not supported\n",
+                msg->id);
+        return -EOPNOTSUPP;
+    }
+
+    if (unlikely(op != BLKIF_OP_READ && op != BLKIF_OP_WRITE)) {
+        RING_ERR(blkif, "req %lu: invalid indirect request type %d\n",
+                msg->id, op);
+        return -EINVAL;
+    }
+
+    if (unlikely(!nr_segments ||
+                nr_segments > blkif->max_indirect_segments)) {
+        RING_ERR(blkif, "req %lu: bad number of indirect segments (%d)\n",
+                msg->id, nr_segments);
+        return -EINVAL;
+    }
+
+    n_pages = (nr_segments + TD_SEGS_PER_INDIRECT_FRAME - 1)
+        / TD_SEGS_PER_INDIRECT_FRAME;
+    len = nr_segments * sizeof(struct blkif_request_segment);
+
+    for (i = 0; i < n_pages; i++) {
+        struct gntdev_grant_copy_segment *gcopy_seg = &gcopy_segs[i];
+
+        gcopy_seg->iov.iov_base = (void *)tapreq->indirect
+            + (i << XC_PAGE_SHIFT);
+        gcopy_seg->iov.iov_len = len < XC_PAGE_SIZE ? len : XC_PAGE_SIZE;
+        gcopy_seg->ref = msg->indirect_grefs[i];
+        gcopy_seg->offset = 0;
+        len -= gcopy_seg->iov.iov_len;
+    }
+
+    gcopy.dir = 1; /* from the guest */
+    gcopy.domid = blkif->domid;
+    gcopy.count = n_pages;
+    gcopy.segments = gcopy_segs;
+
+    err = -ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy);
+    if (err) {
+        err = -errno;
+        RING_ERR(blkif, "req %lu: failed to grant-copy %d indirect pages: "
+                "%s\n", msg->id, n_pages, strerror(-err));
+        return err;
+    }
+
+    for (i = 0; i < n_pages; i++) {
+        if (gcopy_segs[i].status != GNTST_okay) {
+            RING_ERR(blkif, "req %lu: failed to grant-copy indirect page "
+                    "%d: %d\n", msg->id, i, gcopy_segs[i].status);
+            return -EIO;
+        }
+    }
+
+    /*
+     * The response carries the operation of the indirect request, like
+     * blkback does.
+     */
+    tapreq->msg.operation = op;
+    tapreq->msg.handle = handle;
+    tapreq->segs = tapreq->indirect;
+    tapreq->nr_segments = nr_segments;
+
+    return 0;
+}
+
+
 /**
  * Initialises the standard tapdisk request (td_vbd_request_t) from the
  * intermediate ring request (td_xenblkif_req) in order to prepare it
@@ -703,6 +871,16 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     memset(vreq, 0, sizeof(*vreq));
 
 	tapreq->vma = NULL;
+	tapreq->n_gnts = 0;
+	tapreq->segs = tapreq->msg.seg;
+	tapreq->nr_segments = tapreq->msg.nr_segments;
+
+	if (tapreq->msg.operation == BLKIF_OP_INDIRECT) {
+		err = tapdisk_xenblkif_get_indirect(blkif, tapreq);
+		if (err)
+			goto out;
+	}
+
     switch (tapreq->msg.operation) {
     case BLKIF_OP_READ:
         blkif->stats.xenvbd->st_rd_req++;
@@ -720,7 +898,7 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     default:
         RING_ERR(blkif, "req %lu: invalid request type %d\n",
                 tapreq->msg.id, tapreq->msg.operation);
-        err = EOPNOTSUPP;
+        err = -EOPNOTSUPP;
         goto out;
     }
     /* Timestamp before the requests leave the blkif layer */
@@ -729,16 +907,17 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     /*
      * Check that the number of segments is sane.
      */
-    if (unlikely((tapreq->msg.nr_segments == 0 &&
+    if (unlikely((tapreq->nr_segments == 0 &&
                 tapreq->msg.operation != BLKIF_OP_WRITE_BARRIER) ||
-            tapreq->msg.nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST)) {
+            (tapreq->segs == tapreq->msg.seg &&
+             tapreq->nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST))) {
         RING_ERR(blkif, "req %lu: bad number of segments in request (%d)\n",
-                tapreq->msg.id, tapreq->msg.nr_segments);
-        err = EINVAL;
+                tapreq->msg.id, tapreq->nr_segments);
+        err = -EINVAL;
         goto out;
     }
 
-    if (likely(tapreq->msg.nr_segments))
+    if (likely(tapreq->nr_segments))
         err = tapdisk_xenblkif_parse_request(blkif, tapreq);
     /*
      * If we only got one request from the ring and that was a barrier one,
@@ -788,7 +967,7 @@ tapdisk_xenblkif_queue_request(struct td_xenblkif * const blkif,
         return err;
     }
 
-	if (likely(tapreq->msg.nr_segments)) {
+	if (likely(tapreq->nr_segments)) {
 		err = tapdisk_vbd_queue_request(blkif->vbd, &tapreq->vreq);
 		if (unlikely(err)) {
 			/* TODO log error */
@@ -840,8 +1019,22 @@ tapdisk_xenblkif_reqs_free(struct td_xenblkif * const blkif)
 {
     ASSERT(blkif);
 
-    td_xenblkif_bufcache_free(blkif);
     td_xenblkif_bufcache_evt_unreg(blkif);
+    if (blkif->reqs_bufs.size)
+        td_slab_destroy(&blkif->reqs_bufs);
+
+    if (blkif->reqs) {
+        int i;
+
+        for (i = 0; i < blkif->ring_size; i++) {
+            struct td_xenblkif_req *req = &blkif->reqs[i];
+
+            free(req->iov);
+            free(req->gnts);
+            free(req->gcopy_segs);
+            free(req->indirect);
+        }
+    }
 
     free(blkif->reqs);
     blkif->reqs = NULL;
@@ -851,10 +1044,34 @@ tapdisk_xenblkif_reqs_free(struct td_xenblkif * const blkif)
 
 }
 
+/**
+ * Allocates the per-segment arrays of a request, sized for the largest
+ * request the ring accepts.
+ */
+static int
+tapdisk_xenblkif_req_init(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    const int n = blkif->max_segments;
+
+    req->iov = calloc(n, sizeof(*req->iov));
+    req->gnts = calloc(n, sizeof(*req->gnts));
+    req->gcopy_segs = calloc(n, sizeof(*req->gcopy_segs));
+    if (!req->iov || !req->gnts || !req->gcopy_segs)
+        return -ENOMEM;
+
+    if (blkif->max_indirect_segments) {
+        req->indirect = calloc(n, sizeof(*req->indirect));
+        if (!req->indirect)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
 int
 tapdisk_xenblkif_reqs_init(struct td_xenblkif *td_blkif)
 {
-    void *buf;
     int i = 0;
     int err = 0;
 
@@ -870,6 +1087,12 @@ tapdisk_xenblkif_reqs_init(struct td_xenblkif *td_blkif)
         goto fail;
     }
 
+    for (i = 0; i < td_blkif->ring_size; i++) {
+        err = tapdisk_xenblkif_req_init(td_blkif, &td_blkif->reqs[i]);
+        if (err)
+            goto fail;
+    }
+
     td_blkif->reqs_free =
         malloc(td_blkif->ring_size * sizeof(struct xenio_blkif_req *));
     if (!td_blkif->reqs_free) {
@@ -881,19 +1104,22 @@ tapdisk_xenblkif_reqs_init(struct td_xenblkif *td_blkif)
     for (i = 0; i < td_blkif->ring_size; i++)
         tapdisk_xenblkif_free_request(td_blkif, &td_blkif->reqs[i]);
 
-    // Allocate the buffer cache
-    td_blkif->reqs_bufcache = malloc(sizeof(void*) * td_blkif->ring_size);
-    if (!td_blkif->reqs_bufcache) {
-        err = -errno;
+    /*
+     * Request buffers come from a slab, kept across requests and trimmed
+     * once the ring goes idle. Chunks hold a quarter of the ring, so a
+     * quiet ring pins little memory: tapdisk is mlocked, which also
+     * means huge pages would buy nothing but a 2MB floor per ring.
+     */
+    err = td_slab_init(&td_blkif->reqs_bufs, "blkif-bufs",
+            td_blkif->max_segments << XC_PAGE_SHIFT, XC_PAGE_SIZE,
+            TD_REQS_BUFCACHE_CHUNK(td_blkif->ring_size), TD_SLAB_SHARED);
+    if (err)
         goto fail;
-    }
-    td_blkif->n_reqs_bufcache_free = 0;
     td_blkif->reqs_bufcache_evtid = 0;
 
-    // Populate cache with one buffer
-    buf = td_xenblkif_bufcache_get(td_blkif);
-    td_xenblkif_bufcache_put(td_blkif, buf);
-    td_xenblkif_bufcache_evt_unreg(td_blkif);
+    err = td_slab_reserve(&td_blkif->reqs_bufs, TD_REQS_BUFCACHE_MIN);
+    if (err)
+        goto fail;
 
     return 0;
 
@@ -63,16 +63,33 @@ struct td_xenblkif_req {
 
     struct timeval ts;
 
+    /**
+     * The segments of the request: msg.seg, or for an indirect request the
+     * descriptors fetched from its indirect pages into @indirect.
+     */
+    struct blkif_request_segment *segs;
+    int nr_segments;
+    struct blkif_request_segment *indirect;
+
+    /*
+     * The arrays below hold td_xenblkif.max_segments elements.
+     */
+
     /**
      * The scatter/gather list td_vbd_request_t.iov points to.
      */
-    struct td_iovec iov[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct td_iovec *iov;
 
-    grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     int prot;
 
-	struct gntdev_grant_copy_segment
-		gcopy_segs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    /**
+     * Persistent grant mappings of the segments. When n_gnts is 0 the data
+     * goes through vma and grant copy instead.
+     */
+    struct td_gnt **gnts;
+    int n_gnts;
+
+	struct gntdev_grant_copy_segment *gcopy_segs;
 };
 
 struct td_xenblkif;
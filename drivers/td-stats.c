@@ -35,6 +35,7 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_field(st, "pool", "s", blkif->ctx->pool);
     tapdisk_stats_field(st, "domid", "d", blkif->domid);
     tapdisk_stats_field(st, "devid", "d", blkif->devid);
+    tapdisk_stats_field(st, "queue", "d", blkif->queue);
 
     tapdisk_stats_field(st, "reqs", "[");
     tapdisk_stats_val(st, "llu", blkif->stats.reqs.in);
@@ -46,10 +47,34 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_val(st, "llu", blkif->stats.kicks.out);
     tapdisk_stats_leave(st, ']');
 
+    tapdisk_stats_field(st, "yields", "llu", blkif->stats.yields);
+
     tapdisk_stats_field(st, "errors", "{");
     tapdisk_stats_field(st, "msg", "llu", blkif->stats.errors.msg);
     tapdisk_stats_field(st, "map", "llu", blkif->stats.errors.map);
     tapdisk_stats_field(st, "vbd", "llu", blkif->stats.errors.vbd);
     tapdisk_stats_field(st, "img", "llu", blkif->stats.errors.img);
     tapdisk_stats_leave(st, '}');
+
+    tapdisk_stats_field(st, "poll", "{");
+    tapdisk_stats_field(st, "max", "d", blkif->poll_duration);
+    tapdisk_stats_field(st, "duration", "d", blkif->poll.duration);
+    tapdisk_stats_field(st, "gap", "lld", blkif->poll.gap);
+    tapdisk_stats_field(st, "svc", "lld", blkif->poll.svc);
+    tapdisk_stats_field(st, "hits", "llu", blkif->poll.hits);
+    tapdisk_stats_field(st, "misses", "llu", blkif->poll.misses);
+    tapdisk_stats_leave(st, '}');
+
+    if (blkif->persistent) {
+        struct td_gntcache *cache = &blkif->gntcache;
+
+        tapdisk_stats_field(st, "grants", "{");
+        tapdisk_stats_field(st, "mapped", "d", cache->n_gnts);
+        tapdisk_stats_field(st, "max", "d", cache->max_gnts);
+        tapdisk_stats_field(st, "hits", "llu", cache->stats.hits);
+        tapdisk_stats_field(st, "misses", "llu", cache->stats.misses);
+        tapdisk_stats_field(st, "evictions", "llu", cache->stats.evictions);
+        tapdisk_stats_field(st, "full", "llu", cache->stats.full);
+        tapdisk_stats_leave(st, '}');
+    }
 }
@@ -38,6 +38,12 @@ struct td_xenblkif_stats {
         unsigned long long img;
     } errors;
 
+    /**
+     * Times the ring was left with requests in it to give the other rings
+     * of the VBD a turn.
+     */
+    unsigned long long yields;
+
 	struct blkback_stats *xenvbd;
 };
 
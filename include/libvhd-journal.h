@@ -46,6 +46,7 @@ typedef struct vhd_journal {
 	int                        is_block; /* is jfd a block device */
 	vhd_journal_header_t       header;
 	vhd_context_t              vhd;
+	uint64_t                   checkpoint_seq;
 } vhd_journal_t;
 
 int vhd_journal_create(vhd_journal_t *, const char *file, const char *jfile);
@@ -56,4 +57,16 @@ int vhd_journal_revert(vhd_journal_t *);
 int vhd_journal_close(vhd_journal_t *);
 int vhd_journal_remove(vhd_journal_t *);
 
+/*
+ * Checkpoint journals record how far a long-running operation reading
+ * @vhd got, so that it can be resumed. Unlike undo journals they do not
+ * disable the VHD, and hold no data. checkpoint_get returns -ENOENT if
+ * nothing was recorded yet.
+ */
+int vhd_journal_checkpoint_open(vhd_journal_t *, vhd_context_t *vhd,
+				const char *jfile);
+int vhd_journal_checkpoint_get(vhd_journal_t *, uint64_t *value);
+int vhd_journal_checkpoint_set(vhd_journal_t *, uint64_t value);
+int vhd_journal_checkpoint_close(vhd_journal_t *, int remove);
+
 #endif
@@ -301,6 +301,21 @@ int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_clear(vhd_context_t *, char *, uint32_t);
 
+/*
+ * Sector bitmap runs, over bits [start, end) and in the bit order of
+ * vhd_bitmap_test. The find calls return end if there is no such bit.
+ */
+uint32_t vhd_bitmap_find_set(vhd_context_t *, const char *,
+			     uint32_t start, uint32_t end);
+uint32_t vhd_bitmap_find_clear(vhd_context_t *, const char *,
+			       uint32_t start, uint32_t end);
+uint32_t vhd_bitmap_count(vhd_context_t *, const char *,
+			  uint32_t start, uint32_t end);
+int vhd_bitmap_all_set(vhd_context_t *, const char *,
+		       uint32_t start, uint32_t end);
+int vhd_bitmap_all_clear(vhd_context_t *, const char *,
+			 uint32_t start, uint32_t end);
+
 int vhd_initialize_header_parent_name(vhd_context_t *, const char *);
 int vhd_write_parent_locators(vhd_context_t *, const char *);
 int vhd_parent_locator_count(vhd_context_t *);
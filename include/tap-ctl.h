@@ -138,6 +138,8 @@ int tap_ctl_blk_major(void);
  * ring
  * @param domid the domain ID of the guest VM
  * @param devid the device ID
+ * @param queue index of the ring, for multi-queue front-ends
+ * @param nr_queues number of rings the front-end uses
  * @param poll_duration polling duration (microseconds; 0 means no polling)
  * @param poll_idle_threshold CPU idle threshold above which we poll
  * @param grefs the grant references
@@ -145,6 +147,9 @@ int tap_ctl_blk_major(void);
  * @param port event channel port
  * @param proto the protocol: native (XENIO_BLKIF_PROTO_NATIVE),
  * x86 (XENIO_BLKIF_PROTO_X86_32), or x64 (XENIO_BLKIF_PROTO_X86_64)
+ * @param persistent non-zero if the front-end uses persistent grants
+ * @param max_indirect_segments maximum number of segments in an indirect
+ * request (0 disables indirect requests)
  * @param pool a string used as an identifier to group two or more VBDs
  * beloning to the same tapdisk process. For VBDs with the same pool name, a
  * single event channel is used.
@@ -152,9 +157,11 @@ int tap_ctl_blk_major(void);
  * @returns 0 on success, a negative error code otherwise
  */
 int tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int
-		devid, int poll_duration, int poll_idle_threshold,
+		devid, int queue, int nr_queues, int poll_duration,
+		int poll_idle_threshold,
 		const grant_ref_t * grefs, const int order, const evtchn_port_t
-		port, int proto, const char *pool, const int minor);
+		port, int proto, int persistent, int max_indirect_segments,
+		const char *pool, const int minor);
 
 /**
  * Instructs a tapdisk to disconnect from the shared ring.
@@ -181,6 +188,17 @@ int tap_ctl_disconnect_xenblkif(const pid_t pid, const domid_t domid,
 int tap_ctl_info(pid_t pid, unsigned long long *sectors, unsigned int
 		*sector_size, unsigned int *info, const int minor);
 
+/**
+ * Sets how much memory the images of a VBD may spend on cached VHD
+ * bitmaps, in total. Takes effect at once.
+ *
+ * @param pid the process ID of the tapdisk process
+ * @param minor the minor number of the VBD
+ * @param bitmap_cache_mb the budget, in MB
+ * @returns 0 on success, a negative error code otherwise
+ */
+int tap_ctl_set_cache(pid_t pid, int minor, unsigned int bitmap_cache_mb);
+
 /**
  * Parses a type:/path/to/file string, storing the type and path to the output
  * parameters. Upon successful completion the caller must free @type and @path,
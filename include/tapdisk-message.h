@@ -53,6 +53,7 @@ typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
 typedef struct tapdisk_message_stat      tapdisk_message_stat_t;
+typedef struct tapdisk_message_cache     tapdisk_message_cache_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -99,6 +100,13 @@ struct tapdisk_message_stat {
 	size_t                           length;
 };
 
+struct tapdisk_message_cache {
+	/**
+	 * Memory the VBD's images may spend on cached VHD bitmaps, in MB.
+	 */
+	uint32_t                         bitmap_cache_mb;
+};
+
 /**
  * Tapdisk message containing all the necessary information required for the
  * tapdisk to connect to a guest's blkfront.
@@ -150,8 +158,36 @@ typedef struct tapdisk_message_blkif {
 	 * Idle CPU threshold above which polling is permitted.
 	 */
 	uint32_t poll_idle_threshold;
+
+	/**
+	 * Non-zero if the front-end uses persistent grants.
+	 */
+	uint32_t persistent;
+
+	/**
+	 * Maximum number of segments of an indirect request, up to
+	 * TAPDISK_MAX_INDIRECT_SEGMENTS. 0 means no indirect requests.
+	 */
+	uint32_t max_indirect_segments;
+
+	/**
+	 * Index of this ring among the rings of a multi-queue front-end, and
+	 * the number of rings. 0 rings means a single-queue front-end.
+	 */
+	uint32_t queue;
+	uint32_t nr_queues;
 } tapdisk_message_blkif_t;
 
+/**
+ * 1MB with 4K pages.
+ */
+#define TAPDISK_MAX_INDIRECT_SEGMENTS 256
+
+/**
+ * Maximum number of rings of a multi-queue VBD.
+ */
+#define TAPDISK_MAX_QUEUES 16
+
 /**
  * Contains parameters for resuming a previously paused VBD.
  */
@@ -185,6 +221,7 @@ struct tapdisk_message {
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t     list;
 		tapdisk_message_stat_t     info;
+		tapdisk_message_cache_t    cache;
 		tapdisk_message_blkif_t    blkif;
         tapdisk_message_resume_t   resume;
 	} u;
@@ -221,9 +258,11 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_DISK_INFO,
 	TAPDISK_MESSAGE_DISK_INFO_RSP,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_SET_CACHE,
+	TAPDISK_MESSAGE_SET_CACHE_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_SET_CACHE_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -316,6 +355,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_SET_CACHE:
+		return "set cache";
+
+	case TAPDISK_MESSAGE_SET_CACHE_RSP:
+		return "set cache response";
+
 	default:
 		return "unknown";
 	}
@@ -538,6 +538,19 @@ hotplug_status_changed(vbd_t * const device) {
         if (polling_idle_threshold)
             device->polling_idle_threshold = atoi(polling_idle_threshold);
 
+        /*
+         * Multi-queue front-ends look for this before setting up their rings.
+         */
+        if (device->backend->max_queues > 1) {
+            err = tapback_device_printf(device, XBT_NULL, MQ_MAX_QUEUES,
+                    true, "%d", device->backend->max_queues);
+            if (err) {
+                WARN(device, "failed to write %s: %s\n", MQ_MAX_QUEUES,
+                        strerror(-err));
+                goto out;
+            }
+        }
+
         /*
          * Attempt to connect as everything may be ready and the only thing the
          * back-end is waiting for is this XenStore key to be written.
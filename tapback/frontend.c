@@ -57,6 +57,54 @@ xenbus_switch_state(vbd_t * const device,
     return err;
 }
 
+/**
+ * Reads the grant references and the event channel of a ring from the
+ * front-end directory @dir (empty, or "queue-N/" for multi-queue front-ends).
+ *
+ * @returns 0 on success, a +errno otherwise
+ */
+static int
+read_ring(vbd_t * const device, const char * const dir, const int order,
+        grant_ref_t * const gref, evtchn_port_t * const port)
+{
+    /*
+     * +10 is for INT_MAX, +1 for NULL termination
+     */
+    char key[sizeof(MQ_QUEUE_DIR) + 10 + sizeof(RING_REF) + 10 + 1];
+    int i;
+
+    for (i = 0; i < 1 << order; i++) {
+        int len;
+
+        if (order)
+            len = snprintf(key, sizeof(key), "%s%s%d", dir, RING_REF, i);
+        else
+            len = snprintf(key, sizeof(key), "%s%s", dir, RING_REF);
+        if (len >= (int)sizeof(key)) {
+            DBG(device, "error printing to buffer\n");
+            return EINVAL;
+        }
+        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, key,
+                    "%u", &gref[i])) {
+            WARN(device, "failed to read grant ref %s\n", key);
+            return ENOENT;
+        }
+    }
+
+    if (snprintf(key, sizeof(key), "%s%s", dir, EVENT_CHANNEL)
+            >= (int)sizeof(key)) {
+        DBG(device, "error printing to buffer\n");
+        return EINVAL;
+    }
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, key, "%u",
+                port)) {
+        WARN(device, "failed to read event channel %s\n", key);
+        return ENOENT;
+    }
+
+    return 0;
+}
+
 /**
  * Core functions that instructs the tapdisk to connect to the shared ring (if
  * not already connected).
@@ -79,6 +127,7 @@ connect_tap(vbd_t * const device)
     char *proto_str = NULL;
     char *persistent_grants_str = NULL;
     int nr_pages = 0, proto = 0, order = 0;
+    int i, nr_queues = 1;
     bool persistent_grants = false;
 
     ASSERT(device);
@@ -117,45 +166,15 @@ connect_tap(vbd_t * const device)
     }
 
     /*
-     * Read the grant references.
-     */
-    if (order) {
-        int i = 0;
-        /*
-         * +10 is for INT_MAX, +1 for NULL termination
-         */
-
-        static const size_t len = sizeof(RING_REF) + 10 + 1;
-        char ring_ref[len];
-        for (i = 0; i < nr_pages; i++) {
-            if (snprintf(ring_ref, len, "%s%d", RING_REF, i) >= (int)len) {
-                DBG(device, "error printing to buffer\n");
-                err = EINVAL;
-                goto out;
-            }
-            if (1 != tapback_device_scanf_otherend(device, XBT_NULL, ring_ref,
-                        "%u", &gref[i])) {
-                WARN(device, "failed to read grant ref 0x%x\n", i);
-                err = ENOENT;
-                goto out;
-            }
-        }
-    } else {
-        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, RING_REF,
-                    "%u", &gref[0])) {
-            WARN(device, "failed to read grant ref\n");
-            err = ENOENT;
-            goto out;
-        }
-    }
-
-    /*
-     * Read the event channel.
+     * How many rings does the front-end use?
      */
-    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, EVENT_CHANNEL,
-                "%u", &port)) {
-        WARN(device, "failed to read event channel\n");
-        err = ENOENT;
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, MQ_NUM_QUEUES,
+                "%d", &nr_queues))
+        nr_queues = 1;
+    if (nr_queues < 1 || nr_queues > device->backend->max_queues) {
+        WARN(device, "invalid number of queues %d (max %d)\n", nr_queues,
+                device->backend->max_queues);
+        err = EINVAL;
         goto out;
     }
 
@@ -199,36 +218,51 @@ connect_tap(vbd_t * const device)
         DBG(device, "front-end doesn't support persistent grants\n");
 
     /*
-     * persistent grants are not yet supported
+     * Only use them if we offered them too.
      */
-    if (persistent_grants)
-        WARN(device, "front-end supports persistent grants but we don't\n");
+    persistent_grants = persistent_grants && device->backend->persistent;
 
     /*
-     * Create the shared ring and ask the tapdisk to connect to it.
+     * Create the shared rings and ask the tapdisk to connect to them. A
+     * multi-queue front-end keeps the nodes of each ring in queue-N/.
      */
-    if ((err = -tap_ctl_connect_xenblkif(device->tap->pid, device->domid,
-                    device->devid, device->polling_duration, device->polling_idle_threshold,
-		    gref, order, port, proto, NULL,
-                    device->minor))) {
-        /*
-         * This happens if the tapback dameon gets restarted while there are
-         * active VBDs.
-         */
-        if (err == EALREADY) {
-            INFO(device, "tapdisk[%d] minor=%d already connected to the "
-					"shared ring\n", device->tap->pid, device->tap->minor);
-            err = 0;
-        } else {
-            WARN(device, "tapdisk[%d] failed to connect to the shared "
-                    "ring: %s\n", device->tap->pid, strerror(err));
+    for (i = 0; i < nr_queues; i++) {
+        char dir[sizeof(MQ_QUEUE_DIR) + 10 + 1] = "";
+
+        if (nr_queues > 1)
+            snprintf(dir, sizeof(dir), "%s%d/", MQ_QUEUE_DIR, i);
+
+        err = read_ring(device, dir, order, gref, &port);
+        if (err)
             goto out;
+
+        if ((err = -tap_ctl_connect_xenblkif(device->tap->pid, device->domid,
+                        device->devid, i, nr_queues, device->polling_duration,
+                        device->polling_idle_threshold, gref, order, port,
+                        proto, persistent_grants,
+                        device->backend->max_indirect_segments, NULL,
+                        device->minor))) {
+            /*
+             * This happens if the tapback dameon gets restarted while there
+             * are active VBDs.
+             */
+            if (err == EALREADY) {
+                INFO(device, "tapdisk[%d] minor=%d already connected to the "
+                        "shared ring %d\n", device->tap->pid,
+                        device->tap->minor, i);
+                err = 0;
+            } else {
+                WARN(device, "tapdisk[%d] failed to connect to the shared "
+                        "ring %d: %s\n", device->tap->pid, i, strerror(err));
+                goto out;
+            }
         }
-    }
 
-    device->connected = true;
+        device->connected = true;
+    }
 
-    DBG(device, "tapdisk[%d] connected to shared ring\n", device->tap->pid);
+    DBG(device, "tapdisk[%d] connected to %d shared ring(s)\n",
+            device->tap->pid, nr_queues);
 
 out:
     if (err && device->connected) {
@@ -289,6 +323,22 @@ connect_frontend(vbd_t *device) {
             break;
         }
 
+        if ((err = tapback_device_printf(device, xst, FEAT_PERSIST, true,
+                        "%d", device->backend->persistent ? 1 : 0))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_PERSIST,
+                    strerror(-err));
+            break;
+        }
+
+        if (device->backend->max_indirect_segments &&
+                (err = tapback_device_printf(device, xst,
+                        FEAT_MAX_INDIRECT_SEGS, true, "%d",
+                        device->backend->max_indirect_segments))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_MAX_INDIRECT_SEGS,
+                    strerror(-err));
+            break;
+        }
+
         if ((err = tapback_device_printf(device, xst, "sector-size", true,
                         "%u", device->sector_size))) {
             WARN(device, "failed to write sector-size: %s\n", strerror(-err));
@@ -219,7 +219,8 @@ tapback_write_pid(const char *pidfile)
  */
 static inline backend_t *
 tapback_backend_create(const char *name, const char *pidfile,
-        const domid_t domid, const bool barrier)
+        const domid_t domid, const bool barrier, const bool persistent,
+        const int max_indirect_segments, const int max_queues)
 {
     int err;
     int len;
@@ -255,6 +256,9 @@ tapback_backend_create(const char *name, const char *pidfile,
     }
 
 	backend->barrier = barrier;
+	backend->persistent = persistent;
+	backend->max_indirect_segments = max_indirect_segments;
+	backend->max_queues = max_queues;
 
     backend->path = NULL;
 
@@ -502,6 +506,9 @@ usage(FILE * const stream, const char * const prog)
 			"\t[-h|--help]\n"
             "\t[-v|--verbose]\n"
 			"\t[-b]--nobarrier]\n"
+			"\t[-g]--persistent-grants]\n"
+			"\t[-i]--max-indirect-segments <segments>]\n"
+			"\t[-q]--max-queues <queues>]\n"
             "\t[-n|--name]\n", prog);
 }
 
@@ -568,6 +575,9 @@ int main(int argc, char **argv)
 	backend_t *backend = NULL;
     domid_t opt_domid = 0;
 	bool opt_barrier = true;
+	bool opt_persistent = false;
+	int opt_max_indirect_segments = 0;
+	int opt_max_queues = 1;
 
 	if (access("/dev/xen/gntdev", F_OK ) == -1) {
 		WARN(NULL, "grant device does not exist\n");
@@ -595,11 +605,14 @@ int main(int argc, char **argv)
             {"pidfile", 0, NULL, 'p'},
             {"domain", 0, NULL, 'x'},
 			{"nobarrier", 0, NULL, 'b'},
+			{"persistent-grants", 0, NULL, 'g'},
+			{"max-indirect-segments", 1, NULL, 'i'},
+			{"max-queues", 1, NULL, 'q'},
 
         };
         int c;
 
-        c = getopt_long(argc, argv, "hdvn:p:x:b", longopts, NULL);
+        c = getopt_long(argc, argv, "hdvn:p:x:bgi:q:", longopts, NULL);
         if (c < 0)
             break;
 
@@ -639,6 +652,32 @@ int main(int argc, char **argv)
 		case 'b':
 			opt_barrier = false;
 			break;
+		case 'g':
+			opt_persistent = true;
+			break;
+		case 'i':
+			opt_max_indirect_segments = strtoul(optarg, &end, 0);
+			if (*end != 0 || end == optarg ||
+					opt_max_indirect_segments < 0 ||
+					opt_max_indirect_segments >
+					TAPDISK_MAX_INDIRECT_SEGMENTS) {
+				WARN(NULL, "invalid maximum number of indirect segments %s "
+						"(at most %d)\n", optarg,
+						TAPDISK_MAX_INDIRECT_SEGMENTS);
+				err = EINVAL;
+				goto fail;
+			}
+			break;
+		case 'q':
+			opt_max_queues = strtoul(optarg, &end, 0);
+			if (*end != 0 || end == optarg || opt_max_queues < 1 ||
+					opt_max_queues > TAPDISK_MAX_QUEUES) {
+				WARN(NULL, "invalid maximum number of queues %s "
+						"(1 to %d)\n", optarg, TAPDISK_MAX_QUEUES);
+				err = EINVAL;
+				goto fail;
+			}
+			break;
         case '?':
             goto usage;
         }
@@ -673,7 +712,8 @@ int main(int argc, char **argv)
     }
 
 	backend = tapback_backend_create(opt_name, opt_pidfile, opt_domid,
-			opt_barrier);
+			opt_barrier, opt_persistent, opt_max_indirect_segments,
+			opt_max_queues);
 	if (!backend) {
 		err = errno;
         WARN(NULL, "error creating back-end: %s\n", strerror(err));
@@ -109,6 +109,10 @@ int pretty_time(char *buf, unsigned char buf_len);
 #define RING_PAGE_ORDER         "ring-page-order"
 #define EVENT_CHANNEL           "event-channel"
 #define FEAT_PERSIST            "feature-persistent"
+#define FEAT_MAX_INDIRECT_SEGS  "feature-max-indirect-segments"
+#define MQ_MAX_QUEUES           "multi-queue-max-queues"
+#define MQ_NUM_QUEUES           "multi-queue-num-queues"
+#define MQ_QUEUE_DIR            "queue-"
 #define PROTO                   "protocol"
 #define FRONTEND_KEY            "frontend"
 
@@ -197,6 +201,22 @@ typedef struct backend {
 	 * Tells whether we support write I/O barriers.
 	 */
 	bool barrier;
+
+	/**
+	 * Tells whether we offer persistent grants.
+	 */
+	bool persistent;
+
+	/**
+	 * Maximum number of segments in an indirect request we accept, 0 if we
+	 * don't offer indirect requests.
+	 */
+	int max_indirect_segments;
+
+	/**
+	 * Maximum number of rings per VBD we offer to multi-queue front-ends.
+	 */
+	int max_queues;
 } backend_t;
 
 /**
@@ -9,8 +9,12 @@
 #include <assert.h>
 #include <uuid/uuid.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "drivers/tapdisk-nbdserver.h"
+#include "drivers/tapdisk-slab.h"
 
 #include "mock_tapdisk-log.h"
 #include "mock_tapdisk-server.h"
@@ -30,6 +34,8 @@ void setUp(void) {
 
 	memset(&server, 0, sizeof server);
 	INIT_LIST_HEAD(&server.clients);
+	INIT_LIST_HEAD(&server.writes);
+	INIT_LIST_HEAD(&server.flushes);
 
 	/*
 	 * XXX We leak client as it is complicated to deallocate it in tearDown():
@@ -86,3 +92,206 @@ void test_nbdserver_client_pending_req(void)
 		"NBD client marked dead should be freed when last request completes");
 }
 
+
+static void
+send_option(int fd, uint32_t option, const void *data, uint32_t len)
+{
+	struct nbd_option opt;
+
+	opt.magic  = htonll(NBD_OPTS_MAGIC);
+	opt.option = htonl(option);
+	opt.length = htonl(len);
+
+	assert(send(fd, &opt, sizeof(opt), 0) == sizeof(opt));
+	if (len)
+		assert(send(fd, data, len, 0) == len);
+}
+
+static uint32_t
+recv_option_reply(int fd, uint32_t option)
+{
+	struct nbd_option_reply reply;
+
+	assert(recv(fd, &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply));
+	TEST_ASSERT_EQUAL_UINT32(option, ntohl(reply.option));
+	TEST_ASSERT_EQUAL_UINT32(0, ntohl(reply.length));
+
+	return ntohl(reply.type);
+}
+
+void test_nbdserver_newstyle_options(void)
+{
+	uint32_t flags = htonl(NBD_FLAG_C_FIXED_NEWSTYLE);
+	int fds[2];
+
+	ntohll_IgnoreAndReturn(NBD_OPTS_MAGIC);
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	client->client_fd = fds[1];
+	client->newstyle  = true;
+	client->phase     = TD_NBDSERVER_CLIENT_FLAGS;
+
+	assert(send(fds[0], &flags, sizeof(flags), 0) == sizeof(flags));
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	TEST_ASSERT_EQUAL(TD_NBDSERVER_OPTIONS, client->phase);
+
+	send_option(fds[0], NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	TEST_ASSERT_EQUAL_UINT32(NBD_REP_ACK,
+			recv_option_reply(fds[0], NBD_OPT_STRUCTURED_REPLY));
+	TEST_ASSERT_TRUE_MESSAGE(client->structured,
+			"Structured replies should be enabled once acknowledged");
+
+	send_option(fds[0], NBD_OPT_STARTTLS, NULL, 0);
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	TEST_ASSERT_EQUAL_UINT32(NBD_REP_ERR_UNSUP,
+			recv_option_reply(fds[0], NBD_OPT_STARTTLS));
+	TEST_ASSERT_EQUAL(TD_NBDSERVER_OPTIONS, client->phase);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void test_nbdserver_newstyle_disc_closes(void)
+{
+	struct nbd_request request;
+	char c;
+	int fds[2];
+
+	ntohll_IgnoreAndReturn(0);
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	client->client_fd = fds[1];
+	client->newstyle  = true;
+
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	request.type  = htonl(NBD_CMD_DISC);
+
+	assert(send(fds[0], &request, sizeof(request), 0) == sizeof(request));
+	tapdisk_nbdserver_clientcb(0, 0, client);
+
+	TEST_ASSERT_EQUAL_MESSAGE(0, recv(fds[0], &c, 1, 0),
+			"A newstyle client should be disconnected, not greeted again");
+
+	close(fds[0]);
+}
+
+void test_nbdserver_flush_no_writes(void)
+{
+	struct nbd_request request;
+	struct nbd_reply reply;
+	int fds[2];
+
+	ntohll_IgnoreAndReturn(0);
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	client->client_fd = fds[1];
+
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	request.type  = htonl(NBD_CMD_FLUSH);
+	memcpy(request.handle, "flush001", sizeof(request.handle));
+
+	assert(send(fds[0], &request, sizeof(request), 0) == sizeof(request));
+	tapdisk_nbdserver_clientcb(0, 0, client);
+
+	assert(recv(fds[0], &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply));
+	TEST_ASSERT_EQUAL_UINT32(NBD_REPLY_MAGIC, ntohl(reply.magic));
+	TEST_ASSERT_EQUAL_UINT32(0, reply.error);
+	TEST_ASSERT_EQUAL_MEMORY("flush001", reply.handle, sizeof(reply.handle));
+	TEST_ASSERT_EQUAL_MESSAGE(0, tapdisk_nbdserver_reqs_pending(client),
+			"A flush with no writes in flight should complete at once");
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void test_nbdserver_client_throttled(void)
+{
+	td_nbdserver_req_t *req = NULL;
+	int n_reqs = client->n_reqs;
+
+	tapdisk_server_register_event_IgnoreAndReturn(1);
+
+	/* no room left for the pool to grow */
+	server.n_reqs += 1 << 20;
+	client->client_fd = 0;
+
+	while (client->n_reqs_free)
+		req = tapdisk_nbdserver_alloc_request(client);
+	assert(req);
+
+	tapdisk_nbdserver_clientcb(0, 0, client);
+	TEST_ASSERT_TRUE_MESSAGE(client->throttled,
+			"A client out of requests should stop being read from");
+	TEST_ASSERT_FALSE_MESSAGE(client->dead,
+			"A client out of requests should not be dropped");
+	TEST_ASSERT_EQUAL(n_reqs, client->n_reqs);
+
+	tapdisk_nbdserver_free_request(client, req);
+	TEST_ASSERT_FALSE_MESSAGE(client->throttled,
+			"A throttled client should resume once a request is freed");
+}
+
+void test_nbdserver_oversized_read_rejected(void)
+{
+	struct nbd_request request;
+	struct nbd_reply reply;
+	int fds[2];
+
+	ntohll_IgnoreAndReturn(0);
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	client->client_fd = fds[1];
+
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	request.type  = htonl(NBD_CMD_READ);
+	request.len   = htonl(64 << 20);
+	memcpy(request.handle, "read0001", sizeof(request.handle));
+
+	assert(send(fds[0], &request, sizeof(request), 0) == sizeof(request));
+	tapdisk_nbdserver_clientcb(0, 0, client);
+
+	assert(recv(fds[0], &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply));
+	TEST_ASSERT_EQUAL_UINT32(EOVERFLOW, ntohl(reply.error));
+	TEST_ASSERT_EQUAL_MEMORY("read0001", reply.handle, sizeof(reply.handle));
+	TEST_ASSERT_EQUAL_MESSAGE(0, tapdisk_nbdserver_reqs_pending(client),
+			"A rejected read should not hold a request");
+	TEST_ASSERT_FALSE_MESSAGE(client->dead,
+			"A rejected read should not cost the client its connection");
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void test_nbdserver_misaligned_write_drops_client(void)
+{
+	struct nbd_request request;
+	struct nbd_reply reply;
+	int fds[2];
+
+	ntohll_IgnoreAndReturn(0);
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	client->client_fd = fds[1];
+
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	request.type  = htonl(NBD_CMD_WRITE);
+	request.len   = htonl(1000);
+	memcpy(request.handle, "write001", sizeof(request.handle));
+
+	assert(send(fds[0], &request, sizeof(request), 0) == sizeof(request));
+	tapdisk_nbdserver_clientcb(0, 0, client);
+
+	assert(recv(fds[0], &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply));
+	TEST_ASSERT_EQUAL_UINT32(EINVAL, ntohl(reply.error));
+	TEST_ASSERT_FALSE_MESSAGE(
+			tapdisk_nbdserver_contains_client(&server, client),
+			"A client whose write payload can't be consumed should be dropped");
+
+	close(fds[0]);
+	close(fds[1]);
+}
@@ -0,0 +1,163 @@
+#include "unity.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "drivers/tapdisk-slab.h"
+
+#include "mock_tapdisk-log.h"
+
+static td_slab_t slab;
+
+void setUp(void)
+{
+	tlog_syslog_Ignore();
+
+	TEST_ASSERT_EQUAL(0, td_slab_init(&slab, "test", 100, 64, 4, 0));
+}
+
+void tearDown(void)
+{
+	td_slab_destroy(&slab);
+}
+
+void test_slab_rounds_objects_to_alignment(void)
+{
+	void *a, *b;
+
+	a = td_slab_alloc(&slab);
+	b = td_slab_alloc(&slab);
+	TEST_ASSERT_NOT_NULL(a);
+	TEST_ASSERT_NOT_NULL(b);
+
+	TEST_ASSERT_EQUAL(128, slab.size);
+	TEST_ASSERT_EQUAL(0, (uintptr_t)a % 64);
+	TEST_ASSERT_EQUAL(128, (char *)b - (char *)a);
+
+	td_slab_free(&slab, a);
+	td_slab_free(&slab, b);
+}
+
+void test_slab_grows_a_chunk_at_a_time(void)
+{
+	void *objs[5];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		objs[i] = td_slab_alloc(&slab);
+	TEST_ASSERT_EQUAL(1, slab.n_chunks);
+	TEST_ASSERT_EQUAL(0, slab.n_free);
+
+	objs[4] = td_slab_alloc(&slab);
+	TEST_ASSERT_NOT_NULL(objs[4]);
+	TEST_ASSERT_EQUAL(2, slab.n_chunks);
+	TEST_ASSERT_EQUAL(3, slab.n_free);
+
+	for (i = 0; i < 5; i++)
+		td_slab_free(&slab, objs[i]);
+}
+
+void test_slab_reuses_freed_objects(void)
+{
+	void *a, *b;
+
+	a = td_slab_alloc(&slab);
+	memset(a, 0xff, slab.size);
+	td_slab_free(&slab, a);
+
+	b = td_slab_alloc(&slab);
+	TEST_ASSERT_EQUAL_PTR(a, b);
+	TEST_ASSERT_EQUAL(1, slab.stats.grows);
+
+	td_slab_free(&slab, b);
+}
+
+void test_slab_reserve_preallocates(void)
+{
+	TEST_ASSERT_EQUAL(0, td_slab_reserve(&slab, 6));
+	TEST_ASSERT_EQUAL(2, slab.n_chunks);
+	TEST_ASSERT_EQUAL(8, slab.n_free);
+}
+
+void test_slab_shrink_releases_free_chunks(void)
+{
+	void *objs[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		objs[i] = td_slab_alloc(&slab);
+	for (i = 1; i < 8; i++)
+		td_slab_free(&slab, objs[i]);
+
+	/* the second chunk is free, the first one is still in use */
+	td_slab_shrink(&slab, 0);
+	TEST_ASSERT_EQUAL(1, slab.n_chunks);
+	TEST_ASSERT_EQUAL(3, slab.n_free);
+
+	/* the free list only holds objects of the remaining chunk */
+	for (i = 1; i < 4; i++)
+		objs[i] = td_slab_alloc(&slab);
+	TEST_ASSERT_EQUAL(1, slab.n_chunks);
+	TEST_ASSERT_EQUAL(0, slab.n_free);
+	for (i = 0; i < 4; i++)
+		td_slab_free(&slab, objs[i]);
+
+	td_slab_shrink(&slab, 1);
+	TEST_ASSERT_EQUAL(1, slab.n_chunks);
+	TEST_ASSERT_EQUAL(4, slab.n_free);
+
+	td_slab_shrink(&slab, 0);
+	TEST_ASSERT_EQUAL(0, slab.n_chunks);
+}
+
+void test_slab_shrink_keeps_chunks_in_use(void)
+{
+	void *objs[12];
+	int i;
+
+	for (i = 0; i < 12; i++)
+		objs[i] = td_slab_alloc(&slab);
+	TEST_ASSERT_EQUAL(3, slab.n_chunks);
+
+	/* only the middle chunk has nothing in use */
+	for (i = 0; i < 12; i++)
+		if (i != 0 && i != 11)
+			td_slab_free(&slab, objs[i]);
+
+	td_slab_shrink(&slab, 0);
+	TEST_ASSERT_EQUAL(2, slab.n_chunks);
+	TEST_ASSERT_EQUAL(6, slab.n_free);
+
+	td_slab_free(&slab, objs[0]);
+	td_slab_free(&slab, objs[11]);
+}
+
+void test_arena_size_classes(void)
+{
+	td_arena_t arena;
+	void *small, *page, *big;
+
+	TEST_ASSERT_EQUAL(0, td_arena_init(&arena, "test", 9, 12, 0));
+
+	small = td_arena_alloc(&arena, 1536);
+	page  = td_arena_alloc(&arena, 4096);
+	big   = td_arena_alloc(&arena, 8192);
+	TEST_ASSERT_NOT_NULL(small);
+	TEST_ASSERT_NOT_NULL(page);
+	TEST_ASSERT_NOT_NULL(big);
+
+	TEST_ASSERT_EQUAL(0, (uintptr_t)small % 2048);
+	TEST_ASSERT_EQUAL(0, (uintptr_t)page % 4096);
+	TEST_ASSERT_EQUAL(1, arena.classes[2].n_objs - arena.classes[2].n_free);
+	TEST_ASSERT_EQUAL(1, arena.classes[3].n_objs - arena.classes[3].n_free);
+
+	td_arena_free(&arena, small, 1536);
+	td_arena_free(&arena, page, 4096);
+	td_arena_free(&arena, big, 8192);
+
+	td_arena_shrink(&arena);
+	TEST_ASSERT_EQUAL(0, arena.classes[2].n_chunks);
+
+	td_arena_destroy(&arena);
+}
@@ -0,0 +1,147 @@
+#include "unity.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "drivers/td-gntcache.h"
+
+#include "mock_tapdisk-log.h"
+
+/*
+ * Fake grant table: a grant maps to a freshly allocated page holding its
+ * reference, so tests can tell mappings apart and spot leaks.
+ */
+static int n_mapped, n_maps, n_unmaps;
+
+static void *
+fake_map(void *data, uint32_t ref)
+{
+	uint32_t *page;
+
+	if (ref == (uint32_t)-1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	page = malloc(4096);
+	*page = ref;
+	n_mapped++;
+	n_maps++;
+
+	return page;
+}
+
+static int
+fake_unmap(void *data, void *page)
+{
+	free(page);
+	n_mapped--;
+	n_unmaps++;
+
+	return 0;
+}
+
+static const struct td_gntcache_ops fake_ops = {
+	.map   = fake_map,
+	.unmap = fake_unmap,
+};
+
+static struct td_gntcache cache;
+
+void setUp(void)
+{
+	tlog_syslog_Ignore();
+
+	n_mapped = n_maps = n_unmaps = 0;
+	TEST_ASSERT_EQUAL(0, td_gntcache_init(&cache, 4, &fake_ops, NULL));
+}
+
+void tearDown(void)
+{
+	td_gntcache_destroy(&cache);
+	TEST_ASSERT_EQUAL_MESSAGE(0, n_mapped, "All grants should be unmapped");
+}
+
+void test_gntcache_maps_once(void)
+{
+	struct td_gnt *a, *b;
+
+	a = td_gntcache_get(&cache, 7);
+	TEST_ASSERT_NOT_NULL(a);
+	TEST_ASSERT_EQUAL(7, *(uint32_t *)a->page);
+	td_gntcache_put(&cache, a);
+
+	b = td_gntcache_get(&cache, 7);
+	TEST_ASSERT_EQUAL_PTR(a, b);
+	td_gntcache_put(&cache, b);
+
+	TEST_ASSERT_EQUAL(1, n_maps);
+	TEST_ASSERT_EQUAL(1, cache.stats.hits);
+	TEST_ASSERT_EQUAL(1, cache.stats.misses);
+}
+
+void test_gntcache_shared_by_requests(void)
+{
+	struct td_gnt *a, *b;
+
+	a = td_gntcache_get(&cache, 7);
+	b = td_gntcache_get(&cache, 7);
+	TEST_ASSERT_EQUAL_PTR(a, b);
+	TEST_ASSERT_EQUAL(2, a->users);
+
+	td_gntcache_put(&cache, a);
+	td_gntcache_put(&cache, b);
+	TEST_ASSERT_EQUAL(0, a->users);
+}
+
+void test_gntcache_evicts_least_recently_used(void)
+{
+	struct td_gnt *gnts[4], *gnt;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		gnts[i] = td_gntcache_get(&cache, i);
+
+	/* Release 2 first, then the others: 2 is the oldest idle mapping */
+	td_gntcache_put(&cache, gnts[2]);
+	td_gntcache_put(&cache, gnts[0]);
+	td_gntcache_put(&cache, gnts[3]);
+
+	gnt = td_gntcache_get(&cache, 100);
+	TEST_ASSERT_NOT_NULL(gnt);
+	TEST_ASSERT_EQUAL(1, cache.stats.evictions);
+	TEST_ASSERT_EQUAL(4, cache.n_gnts);
+
+	/* 0 and 3 are still mapped, 2 was dropped */
+	td_gntcache_put(&cache, td_gntcache_get(&cache, 0));
+	td_gntcache_put(&cache, td_gntcache_get(&cache, 3));
+	TEST_ASSERT_EQUAL(5, n_maps);
+
+	td_gntcache_put(&cache, gnt);
+	td_gntcache_put(&cache, gnts[1]);
+}
+
+void test_gntcache_full_of_busy_grants(void)
+{
+	struct td_gnt *gnts[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		gnts[i] = td_gntcache_get(&cache, i);
+
+	errno = 0;
+	TEST_ASSERT_NULL(td_gntcache_get(&cache, 4));
+	TEST_ASSERT_EQUAL(ENOSPC, errno);
+	TEST_ASSERT_EQUAL(1, cache.stats.full);
+
+	for (i = 0; i < 4; i++)
+		td_gntcache_put(&cache, gnts[i]);
+}
+
+void test_gntcache_map_failure(void)
+{
+	errno = 0;
+	TEST_ASSERT_NULL(td_gntcache_get(&cache, (uint32_t)-1));
+	TEST_ASSERT_EQUAL(EINVAL, errno);
+	TEST_ASSERT_EQUAL(0, cache.n_gnts);
+}
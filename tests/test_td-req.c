@@ -5,6 +5,7 @@
 #include <xenctrl.h>
 #include "drivers/td-req.h"
 #include "drivers/tapdisk-utils.h"
+#include "drivers/tapdisk-slab.h"
 #include "mock_td-ctx.h"
 #include "mock_td-blkif.h"
 #include "mock_tapdisk-server.h"
@@ -34,8 +35,7 @@ struct td_xenblkif* create_dead_blkif(void) {
     blkif = malloc(sizeof(struct td_xenblkif));
     free_requests = malloc(RING_SIZE * sizeof(blkif_request_t));
 
-    blkif->reqs_bufcache = malloc(RING_SIZE * sizeof(void*));
-    blkif->n_reqs_bufcache_free = 0;
+    td_slab_init(&blkif->reqs_bufs, "test", 4096, 4096, 0, 0);
 
     blkif->dead = 1;
     blkif->n_reqs_free = 10;
@@ -51,6 +51,7 @@ void test_comptetion_of_non_last_req_on_dead_ring_does_not_destroy_ring(void)
     struct td_xenblkif_req request;
     struct td_xenblkif* blkif;
 
+    memset(&request, 0, sizeof(request));
     blkif = create_dead_blkif();
 
     /* We report that we still have pending requests */
@@ -70,6 +71,7 @@ void test_completion_of_last_req_on_dead_ring_destroys_ring(void)
     struct td_xenblkif_req request;
     struct td_xenblkif* blkif;
 
+    memset(&request, 0, sizeof(request));
     blkif = create_dead_blkif();
 
     /* We report that this is the last request */
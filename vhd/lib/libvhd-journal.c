@@ -37,6 +37,7 @@
 #define VHD_JOURNAL_ENTRY_TYPE_BATMAP_H  6
 #define VHD_JOURNAL_ENTRY_TYPE_BATMAP_M  7
 #define VHD_JOURNAL_ENTRY_TYPE_DATA      8
+#define VHD_JOURNAL_ENTRY_TYPE_CHECKPOINT 9
 
 typedef struct vhd_journal_entry {
 	uint64_t                         cookie;
@@ -46,6 +47,20 @@ typedef struct vhd_journal_entry {
 	uint32_t                         checksum;
 } vhd_journal_entry_t;
 
+/*
+ * Checkpoints alternate between two slots after the journal header, so a
+ * torn write never loses the previous one.
+ */
+typedef struct vhd_journal_checkpoint {
+	uint64_t                         seq;
+	uint64_t                         value;
+	char                             pad[VHD_SECTOR_SIZE - 16];
+} vhd_journal_checkpoint_t;
+
+#define VHD_JOURNAL_CHECKPOINT_SLOTS     2
+#define VHD_JOURNAL_CHECKPOINT_SLOT_SIZE \
+	(sizeof(vhd_journal_entry_t) + sizeof(vhd_journal_checkpoint_t))
+
 static inline int
 vhd_journal_seek(vhd_journal_t *j, off64_t offset, int whence)
 {
@@ -1525,3 +1540,230 @@ vhd_journal_revert(vhd_journal_t *j)
 
 	return vhd_journal_sync(j);
 }
+
+static int
+vhd_journal_read_checkpoint(vhd_journal_t *j, int slot,
+			    vhd_journal_checkpoint_t *ckpt)
+{
+	int err;
+	vhd_journal_entry_t entry;
+
+	err = vhd_journal_seek(j, sizeof(vhd_journal_header_t) +
+			       slot * VHD_JOURNAL_CHECKPOINT_SLOT_SIZE,
+			       SEEK_SET);
+	if (err)
+		return err;
+
+	err = vhd_journal_read_entry(j, &entry);
+	if (err)
+		return err;
+
+	if (entry.type != VHD_JOURNAL_ENTRY_TYPE_CHECKPOINT ||
+	    entry.size != sizeof(*ckpt))
+		return -EINVAL;
+
+	err = vhd_journal_read(j, ckpt, sizeof(*ckpt));
+	if (err)
+		return err;
+
+	err = vhd_journal_validate_entry_data(&entry, (char *)ckpt);
+	if (err)
+		return err;
+
+	BE64_IN(&ckpt->seq);
+	BE64_IN(&ckpt->value);
+
+	return 0;
+}
+
+static int
+vhd_journal_write_checkpoint(vhd_journal_t *j, int slot,
+			     vhd_journal_checkpoint_t *ckpt)
+{
+	int err;
+	vhd_journal_entry_t entry;
+	vhd_journal_checkpoint_t c;
+
+	memcpy(&c, ckpt, sizeof(c));
+	BE64_OUT(&c.seq);
+	BE64_OUT(&c.value);
+
+	entry.type     = VHD_JOURNAL_ENTRY_TYPE_CHECKPOINT;
+	entry.size     = sizeof(c);
+	entry.offset   = 0;
+	entry.cookie   = VHD_JOURNAL_ENTRY_COOKIE;
+	entry.checksum = vhd_journal_checksum_entry(&entry, (char *)&c,
+						    sizeof(c));
+
+	err = vhd_journal_seek(j, sizeof(vhd_journal_header_t) +
+			       slot * VHD_JOURNAL_CHECKPOINT_SLOT_SIZE,
+			       SEEK_SET);
+	if (err)
+		return err;
+
+	err = vhd_journal_write_entry(j, &entry);
+	if (err)
+		return err;
+
+	err = vhd_journal_write(j, &c, sizeof(c));
+	if (err)
+		return err;
+
+	return vhd_journal_sync(j);
+}
+
+static int
+vhd_journal_add_checkpoint_header(vhd_journal_t *j, vhd_context_t *vhd)
+{
+	int err;
+	off64_t off;
+
+	off = lseek64(vhd->fd, 0, SEEK_END);
+	if (off == (off64_t)-1)
+		return -errno;
+
+	memset(&j->header, 0, sizeof(vhd_journal_header_t));
+	uuid_copy(j->header.uuid, vhd->footer.uuid);
+	memcpy(j->header.cookie,
+	       VHD_JOURNAL_HEADER_COOKIE, sizeof(j->header.cookie));
+	j->header.vhd_footer_offset = off - sizeof(vhd_footer_t);
+	j->header.journal_eof = sizeof(vhd_journal_header_t) +
+		VHD_JOURNAL_CHECKPOINT_SLOTS * VHD_JOURNAL_CHECKPOINT_SLOT_SIZE;
+
+	if (!j->is_block) {
+		err = vhd_journal_truncate(j, j->header.journal_eof);
+		if (err)
+			return err;
+	}
+
+	err = vhd_journal_write_header(j, &j->header);
+	if (err)
+		return err;
+
+	return vhd_journal_sync(j);
+}
+
+int
+vhd_journal_checkpoint_open(vhd_journal_t *j, vhd_context_t *vhd,
+			    const char *jfile)
+{
+	int err, created;
+
+	memset(j, 0, sizeof(vhd_journal_t));
+	created = 0;
+
+	j->jname = strdup(jfile);
+	if (j->jname == NULL)
+		return -ENOMEM;
+
+	j->jfd = open(j->jname, O_LARGEFILE | O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (j->jfd != -1)
+		created = 1;
+	else if (errno == EEXIST)
+		j->jfd = open(j->jname, O_LARGEFILE | O_RDWR);
+	if (j->jfd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = vhd_test_file_fixed(j->jname, &j->is_block);
+	if (err)
+		goto fail;
+
+	if (!created) {
+		err = vhd_journal_read_journal_header(j, &j->header);
+		/* the journal of some other VHD */
+		if (!err && uuid_compare(j->header.uuid, vhd->footer.uuid))
+			err = -EINVAL;
+		/* block devices come with garbage, not an empty file */
+		if (err == -EINVAL && j->is_block &&
+		    memcmp(j->header.cookie, VHD_JOURNAL_HEADER_COOKIE,
+			   sizeof(j->header.cookie)))
+			created = 1;
+		else if (err)
+			goto fail;
+	}
+
+	if (created) {
+		err = vhd_journal_add_checkpoint_header(j, vhd);
+		if (err)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (created && !j->is_block)
+		unlink(j->jname);
+	vhd_journal_checkpoint_close(j, 0);
+	return err;
+}
+
+int
+vhd_journal_checkpoint_get(vhd_journal_t *j, uint64_t *value)
+{
+	int i, found;
+	vhd_journal_checkpoint_t ckpt;
+
+	found = 0;
+
+	for (i = 0; i < VHD_JOURNAL_CHECKPOINT_SLOTS; i++) {
+		if (vhd_journal_read_checkpoint(j, i, &ckpt))
+			continue;
+
+		if (!found || ckpt.seq > j->checkpoint_seq) {
+			j->checkpoint_seq = ckpt.seq;
+			*value = ckpt.value;
+			found = 1;
+		}
+	}
+
+	return found ? 0 : -ENOENT;
+}
+
+int
+vhd_journal_checkpoint_set(vhd_journal_t *j, uint64_t value)
+{
+	int err;
+	vhd_journal_checkpoint_t ckpt;
+
+	memset(&ckpt, 0, sizeof(ckpt));
+	ckpt.seq   = j->checkpoint_seq + 1;
+	ckpt.value = value;
+
+	err = vhd_journal_write_checkpoint(j,
+			ckpt.seq % VHD_JOURNAL_CHECKPOINT_SLOTS, &ckpt);
+	if (err)
+		return err;
+
+	j->checkpoint_seq = ckpt.seq;
+	return 0;
+}
+
+/*
+ * @remove once the operation completed: the journal has nothing left to
+ * resume.
+ */
+int
+vhd_journal_checkpoint_close(vhd_journal_t *j, int remove)
+{
+	char zero[VHD_SECTOR_SIZE];
+
+	if (j->jfd > 0) {
+		/* a block device can't go away, so wipe its header instead */
+		if (remove && j->is_block) {
+			memset(zero, 0, sizeof(zero));
+			if (!vhd_journal_seek(j, 0, SEEK_SET) &&
+			    !vhd_journal_write(j, zero, sizeof(zero)))
+				vhd_journal_sync(j);
+		}
+		close(j->jfd);
+		if (remove && !j->is_block)
+			unlink(j->jname);
+	}
+
+	free(j->jname);
+	memset(j, 0, sizeof(vhd_journal_t));
+
+	return 0;
+}
@@ -31,6 +31,7 @@
 #include <libgen.h>
 #include <iconv.h>
 #include <limits.h>
+#include <endian.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -596,6 +597,122 @@ vhd_bitmap_clear(vhd_context_t *ctx, char *map, uint32_t block)
 	return clear_bit(map, block);
 }
 
+/*
+ * Run scanning works on 64 bits of the map at a time. Bit n of a word
+ * is the MSB-first nth bit for the standard layout (test_bit), and the
+ * LSB-first nth bit for the old tapdisk layout (old_test_bit).
+ */
+static inline int
+vhd_bitmap_old(vhd_context_t *ctx)
+{
+	return vhd_creator_tapdisk(ctx) && ctx->footer.crtr_ver == 0x00000001;
+}
+
+/* never reads past the byte holding bit @end - 1 */
+static inline uint64_t
+vhd_bitmap_word(const char *map, uint32_t bit, uint32_t end, int old)
+{
+	size_t off, len;
+	uint64_t word;
+
+	off  = (size_t)(bit >> 6) << 3;
+	len  = (((size_t)end + 7) >> 3) - off;
+	word = 0;
+
+	memcpy(&word, map + off, MIN(len, sizeof(word)));
+
+	return old ? le64toh(word) : be64toh(word);
+}
+
+/* bits n..63 of a word */
+static inline uint64_t
+vhd_bitmap_mask_from(uint32_t n, int old)
+{
+	return old ? ~0ULL << n : ~0ULL >> n;
+}
+
+static inline uint32_t
+vhd_bitmap_first(uint64_t word, int old)
+{
+	return old ? __builtin_ctzll(word) : __builtin_clzll(word);
+}
+
+static uint32_t
+vhd_bitmap_find(vhd_context_t *ctx, const char *map,
+		uint32_t start, uint32_t end, int set)
+{
+	int old;
+	uint32_t bit;
+	uint64_t word;
+
+	old = vhd_bitmap_old(ctx);
+
+	for (bit = start; bit < end; bit = (bit | 63) + 1) {
+		word = vhd_bitmap_word(map, bit, end, old);
+		if (!set)
+			word = ~word;
+
+		word &= vhd_bitmap_mask_from(bit & 63, old);
+		if (word)
+			return MIN((bit & ~63) + vhd_bitmap_first(word, old),
+				   end);
+	}
+
+	return end;
+}
+
+uint32_t
+vhd_bitmap_find_set(vhd_context_t *ctx, const char *map,
+		    uint32_t start, uint32_t end)
+{
+	return vhd_bitmap_find(ctx, map, start, end, 1);
+}
+
+uint32_t
+vhd_bitmap_find_clear(vhd_context_t *ctx, const char *map,
+		      uint32_t start, uint32_t end)
+{
+	return vhd_bitmap_find(ctx, map, start, end, 0);
+}
+
+uint32_t
+vhd_bitmap_count(vhd_context_t *ctx, const char *map,
+		 uint32_t start, uint32_t end)
+{
+	int old;
+	uint32_t bit, count;
+	uint64_t word;
+
+	old   = vhd_bitmap_old(ctx);
+	count = 0;
+
+	for (bit = start & ~63; bit < end; bit += 64) {
+		word = vhd_bitmap_word(map, bit, end, old);
+		if (bit < start)
+			word &= vhd_bitmap_mask_from(start & 63, old);
+		if (end - bit < 64)
+			word &= ~vhd_bitmap_mask_from(end - bit, old);
+
+		count += __builtin_popcountll(word);
+	}
+
+	return count;
+}
+
+int
+vhd_bitmap_all_set(vhd_context_t *ctx, const char *map,
+		   uint32_t start, uint32_t end)
+{
+	return vhd_bitmap_find_clear(ctx, map, start, end) == end;
+}
+
+int
+vhd_bitmap_all_clear(vhd_context_t *ctx, const char *map,
+		     uint32_t start, uint32_t end)
+{
+	return vhd_bitmap_find_set(ctx, map, start, end) == end;
+}
+
 /*
  * returns absolute offset of the first 
  * byte of the file which is not vhd metadata
@@ -689,7 +689,8 @@ static int
 vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		      vhd_context_t *vhd, uint32_t block)
 {
-	int err, i;
+	int err;
+	uint32_t i, end;
 	uint64_t sector;
 	char *bitmap, *data;
 
@@ -711,19 +712,27 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		}
 	}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (ctx->opts.collect_stats &&
-		    vhd_bitmap_test(vhd, bitmap, i)) {
-			ctx_cur_stats(ctx)->secs_written++;
-			set_bit_u64(ctx_cur_stats(ctx)->bitmap, sector + i);
+	if (ctx->opts.collect_stats) {
+		for (i = vhd_bitmap_find_set(vhd, bitmap, 0, vhd->spb);
+		     i < vhd->spb;
+		     i = vhd_bitmap_find_set(vhd, bitmap, end, vhd->spb)) {
+			end = vhd_bitmap_find_clear(vhd, bitmap, i, vhd->spb);
+
+			ctx_cur_stats(ctx)->secs_written += end - i;
+			for (; i < end; i++)
+				set_bit_u64(ctx_cur_stats(ctx)->bitmap,
+					    sector + i);
 		}
+	}
 
-		if (ctx->opts.check_data) {
+	if (ctx->opts.check_data) {
+		/* only sectors the bitmap leaves clear can be wrong */
+		for (i = vhd_bitmap_find_clear(vhd, bitmap, 0, vhd->spb);
+		     i < vhd->spb;
+		     i = vhd_bitmap_find_clear(vhd, bitmap, i + 1, vhd->spb)) {
 			char *buf = data + (i << VHD_SECTOR_SHIFT);
-			int set   = vhd_util_check_zeros(buf, VHD_SECTOR_SIZE);
-			int map   = vhd_bitmap_test(vhd, bitmap, i);
 
-			if (set && !map) {
+			if (vhd_util_check_zeros(buf, VHD_SECTOR_SIZE)) {
 				printf("sector 0x%x of block 0x%x has data "
 				       "where bitmap is clear\n", i, block);
 				err = -EINVAL;
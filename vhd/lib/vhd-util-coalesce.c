@@ -25,8 +25,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "libvhd.h"
+#include "libvhd-journal.h"
 #include "canonpath.h"
 
 static int
@@ -53,80 +57,409 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 }
 
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * Coalescing keeps up to @depth child blocks in flight. The child is only
+ * read, so reader threads pread(2) each block's bitmap and data in one go
+ * straight from its fd. Writes to the parent stay on the calling thread
+ * and go in block order, so parent block allocation and BAT and bitmap
+ * updates happen exactly as they would one block at a time.
  */
+#define VHD_COALESCE_DEPTH_DEFAULT   8
+#define VHD_COALESCE_DEPTH_MAX       64
+
+/*
+ * With a checkpoint journal, the first block not known to be on disk is
+ * recorded every VHD_COALESCE_CHECKPOINT_BLOCKS blocks. An interrupted
+ * coalesce restarted with the same journal skips the blocks before it;
+ * rewriting the few after it is harmless.
+ */
+#define VHD_COALESCE_CHECKPOINT_BLOCKS 128
+
+struct vhd_coalesce_opts {
+	int                depth;
+	unsigned long      rate;          /* MiB/s read from the child, 0 = unlimited */
+	int                progress;
+
+	const char        *jname;
+	vhd_journal_t      journal;
+	int                journaled;
+};
+
+struct vhd_coalesce_slot {
+	char              *buf;           /* bitmap, then block data */
+	int                err;
+	int                ready;
+};
+
+struct vhd_coalesce_pipe {
+	vhd_context_t     *vhd;
+	off64_t            eof;
+	size_t             size;
+
+	uint32_t          *blocks;        /* allocated child blocks */
+	uint64_t           n_blocks;
+
+	int                depth;
+	struct vhd_coalesce_slot *slots;
+	pthread_t         *threads;
+	int                n_threads;
+
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;
+	uint64_t           issued;
+	uint64_t           consumed;
+	int                stop;
+
+	unsigned long      rate;
+	struct timespec    start;
+	uint64_t           bytes;
+};
+
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-			int parent_fd, uint64_t block)
+vhd_util_coalesce_read(struct vhd_coalesce_pipe *pipe, uint32_t block,
+		       char *buf)
+{
+	vhd_context_t *vhd = pipe->vhd;
+	size_t size;
+	off64_t off;
+	ssize_t ret;
+
+	off  = vhd_sectors_to_bytes(vhd->bat.bat[block]);
+	size = pipe->size;
+
+	/* the last block may be cut short by the footer */
+	if (off + size > pipe->eof) {
+		if (off >= pipe->eof)
+			return -EIO;
+		size = pipe->eof - off;
+		memset(buf + size, 0, pipe->size - size);
+	}
+
+	while (size) {
+		ret = pread(vhd->fd, buf, size, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+
+		buf  += ret;
+		off  += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static void *
+vhd_util_coalesce_reader(void *arg)
+{
+	struct vhd_coalesce_pipe *pipe = arg;
+	struct vhd_coalesce_slot *slot;
+	uint64_t seq;
+	int err;
+
+	pthread_mutex_lock(&pipe->lock);
+
+	for (;;) {
+		while (!pipe->stop && pipe->issued < pipe->n_blocks &&
+		       pipe->issued - pipe->consumed >= pipe->depth)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+		if (pipe->stop || pipe->issued >= pipe->n_blocks)
+			break;
+
+		seq  = pipe->issued++;
+		slot = &pipe->slots[seq % pipe->depth];
+		pthread_mutex_unlock(&pipe->lock);
+
+		err = vhd_util_coalesce_read(pipe, pipe->blocks[seq], slot->buf);
+
+		pthread_mutex_lock(&pipe->lock);
+		slot->err   = err;
+		slot->ready = 1;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+static void
+vhd_util_coalesce_pipe_stop(struct vhd_coalesce_pipe *pipe)
+{
+	int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->stop = 1;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	for (i = 0; i < pipe->n_threads; i++)
+		pthread_join(pipe->threads[i], NULL);
+	pipe->n_threads = 0;
+}
+
+static void
+vhd_util_coalesce_pipe_free(struct vhd_coalesce_pipe *pipe)
+{
+	int i;
+
+	vhd_util_coalesce_pipe_stop(pipe);
+
+	if (pipe->slots)
+		for (i = 0; i < pipe->depth; i++)
+			free(pipe->slots[i].buf);
+
+	free(pipe->slots);
+	free(pipe->threads);
+	free(pipe->blocks);
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+}
+
+static int
+vhd_util_coalesce_pipe_init(struct vhd_coalesce_pipe *pipe,
+			    vhd_context_t *vhd, uint64_t start,
+			    const struct vhd_coalesce_opts *opts)
 {
 	int i, err;
-	void *buf;
-	char *map;
-	uint64_t sec, secs;
+	uint64_t b;
+
+	memset(pipe, 0, sizeof(*pipe));
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+
+	pipe->vhd   = vhd;
+	pipe->size  = vhd_sectors_to_bytes(vhd->bm_secs) +
+		vhd->header.block_size;
+	pipe->depth = opts->depth;
+	pipe->rate  = opts->rate;
+	clock_gettime(CLOCK_MONOTONIC, &pipe->start);
+
+	/* readers must not move the file offset, so look for the end now */
+	pipe->eof = lseek64(vhd->fd, 0, SEEK_END);
+	if (pipe->eof == (off64_t)-1) {
+		err = -errno;
+		goto fail;
+	}
+	pipe->eof -= sizeof(vhd_footer_t);
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	pipe->blocks = malloc(vhd->bat.entries * sizeof(*pipe->blocks));
+	if (!pipe->blocks) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (b = start; b < vhd->bat.entries; b++)
+		if (vhd->bat.bat[b] != DD_BLK_UNUSED)
+			pipe->blocks[pipe->n_blocks++] = b;
+
+	if (pipe->depth > pipe->n_blocks)
+		pipe->depth = pipe->n_blocks ? : 1;
+
+	pipe->slots   = calloc(pipe->depth, sizeof(*pipe->slots));
+	pipe->threads = calloc(pipe->depth, sizeof(*pipe->threads));
+	if (!pipe->slots || !pipe->threads) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < pipe->depth; i++) {
+		err = posix_memalign((void **)&pipe->slots[i].buf, 4096,
+				     pipe->size);
+		if (err) {
+			pipe->slots[i].buf = NULL;
+			err = -err;
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < pipe->depth; i++) {
+		err = pthread_create(&pipe->threads[i], NULL,
+				     vhd_util_coalesce_reader, pipe);
+		if (err)
+			break;
+		pipe->n_threads++;
+	}
+
+	if (!pipe->n_threads) {
+		err = -err;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	vhd_util_coalesce_pipe_free(pipe);
+	return err;
+}
+
+/*
+ * Waits for the next block in order. Returns its buffer in @buf.
+ */
+static int
+vhd_util_coalesce_pipe_next(struct vhd_coalesce_pipe *pipe, char **buf)
+{
+	struct vhd_coalesce_slot *slot;
+	int err;
+
+	slot = &pipe->slots[pipe->consumed % pipe->depth];
+
+	pthread_mutex_lock(&pipe->lock);
+	while (!slot->ready)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	err = slot->err;
+	pthread_mutex_unlock(&pipe->lock);
+
+	*buf = slot->buf;
+	return err;
+}
+
+static void
+vhd_util_coalesce_pipe_put(struct vhd_coalesce_pipe *pipe)
+{
+	struct vhd_coalesce_slot *slot;
+	struct timespec now;
+	uint64_t due, elapsed;
+
+	slot = &pipe->slots[pipe->consumed % pipe->depth];
+
+	pthread_mutex_lock(&pipe->lock);
+	slot->ready = 0;
+	pipe->consumed++;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	if (!pipe->rate)
+		return;
+
+	/* hold the writer back, and with it the readers, to @rate */
+	pipe->bytes += pipe->size;
+	due = pipe->bytes * 1000000ULL / (pipe->rate << 20);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - pipe->start.tv_sec) * 1000000ULL +
+		(now.tv_nsec - pipe->start.tv_nsec) / 1000;
+
+	if (due > elapsed)
+		usleep(due - elapsed);
+}
+
+/*
+ * Opens the checkpoint journal of @vhd, if one was asked for, and
+ * returns where the last run stopped in @start.
+ */
+static int
+vhd_util_coalesce_checkpoint_open(struct vhd_coalesce_opts *opts,
+				  vhd_context_t *vhd, uint64_t *start)
+{
+	int err;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	*start = 0;
+
+	if (!opts->jname)
 		return 0;
 
-	err = posix_memalign(&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	err = vhd_journal_checkpoint_open(&opts->journal, vhd, opts->jname);
+	if (err) {
+		printf("error opening journal %s: %d\n", opts->jname, err);
+		return err;
+	}
+	opts->journaled = 1;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+	err = vhd_journal_checkpoint_get(&opts->journal, start);
+	if (err == -ENOENT)
+		return 0;
+	if (err) {
+		printf("error reading journal %s: %d\n", opts->jname, err);
+		return err;
+	}
+
+	if (*start)
+		printf("resuming from block %"PRIu64"\n", *start);
+
+	return 0;
+}
+
+/*
+ * Records that all blocks before @block are on disk, after making sure
+ * they are. @fd is what they were written to.
+ */
+static int
+vhd_util_coalesce_checkpoint(struct vhd_coalesce_opts *opts, int fd,
+			     uint64_t block)
+{
+	if (!opts->journaled)
+		return 0;
+
+	if (fsync(fd))
+		return -errno;
+
+	return vhd_journal_checkpoint_set(&opts->journal, block);
+}
+
+static void
+vhd_util_coalesce_checkpoint_close(struct vhd_coalesce_opts *opts, int done)
+{
+	if (!opts->journaled)
+		return;
+
+	vhd_journal_checkpoint_close(&opts->journal, done);
+	opts->journaled = 0;
+}
+
+/*
+ * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw.
+ * @buf holds the child's bitmap for @block, followed by its data.
+ */
+static int
+vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
+			int parent_fd, uint64_t block, char *buf)
+{
+	int i, err;
+	char *map, *data;
+	uint64_t sec, secs;
+
+	sec  = block * vhd->spb;
+	map  = buf;
+	data = buf + vhd_sectors_to_bytes(vhd->bm_secs);
 
 	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
 		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+			return vhd_io_write(parent, data, sec, vhd->spb);
+		return __raw_io_write(parent_fd, data, sec, vhd->spb);
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
-
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
-
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
+	for (i = vhd_bitmap_find_set(vhd, map, 0, vhd->spb); i < vhd->spb;
+	     i = vhd_bitmap_find_set(vhd, map, i + secs, vhd->spb)) {
+		secs = vhd_bitmap_find_clear(vhd, map, i, vhd->spb) - i;
 
 		if (parent->file)
 			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
+					   data + vhd_sectors_to_bytes(i),
 					   sec + i, secs);
 		else
 			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
+					     data + vhd_sectors_to_bytes(i),
 					     sec + i, secs);
 		if (err)
-			goto done;
-
-		i += secs;
+			return err;
 	}
 
-	err = 0;
-
-done:
-	free(buf);
-	free(map);
-	return err;
+	return 0;
 }
 
 static int
-vhd_util_coalesce_onto(vhd_context_t *from,
-		       vhd_context_t *to, int to_fd, int progress)
+vhd_util_coalesce_onto(vhd_context_t *from, vhd_context_t *to, int to_fd,
+		       struct vhd_coalesce_opts *opts)
 {
-	int err;
-	uint64_t i;
+	int err, fd;
+	uint64_t i, start;
+	char *buf;
+	struct vhd_coalesce_pipe pipe;
 
 	err = vhd_get_bat(from);
 	if (err)
@@ -138,20 +471,53 @@ vhd_util_coalesce_onto(vhd_context_t *from,
 			goto out;
 	}
 
-	for (i = 0; i < from->bat.entries; i++) {
-		if (progress) {
-			printf("\r%6.2f%%",
-			       ((float)i / (float)from->bat.entries) * 100.00);
+	err = vhd_util_coalesce_checkpoint_open(opts, from, &start);
+	if (err)
+		goto out;
+
+	/* the whole child went in, only the caller's own work was left */
+	if (start >= from->bat.entries)
+		goto out;
+
+	fd = to->file ? to->fd : to_fd;
+
+	err = vhd_util_coalesce_pipe_init(&pipe, from, start, opts);
+	if (err)
+		goto out;
+
+	for (i = 0; i < pipe.n_blocks; i++) {
+		if (opts->progress) {
+			printf("\r%6.2f%%", ((float)pipe.blocks[i] /
+					     (float)from->bat.entries) * 100.00);
 			fflush(stdout);
 		}
-		err = vhd_util_coalesce_block(from, to, to_fd, i);
+
+		err = vhd_util_coalesce_pipe_next(&pipe, &buf);
+		if (!err)
+			err = vhd_util_coalesce_block(from, to, to_fd,
+						      pipe.blocks[i], buf);
 		if (err)
-			goto out;
+			break;
+
+		vhd_util_coalesce_pipe_put(&pipe);
+
+		if (!((i + 1) % VHD_COALESCE_CHECKPOINT_BLOCKS)) {
+			err = vhd_util_coalesce_checkpoint(opts, fd,
+							   pipe.blocks[i] + 1);
+			if (err)
+				break;
+		}
 	}
 
-	err = 0;
+	vhd_util_coalesce_pipe_free(&pipe);
+	if (err)
+		goto out;
+
+	err = vhd_util_coalesce_checkpoint(opts, fd, from->bat.entries);
+	if (err)
+		goto out;
 
-	if (progress)
+	if (opts->progress)
 		printf("\r100.00%%\n");
 
 out:
@@ -159,8 +525,9 @@ out:
 }
 
 static int
-vhd_util_coalesce_parent(const char *name, int sparse, int progress,
-        const char *step_parent)
+vhd_util_coalesce_parent(const char *name, int sparse,
+			 struct vhd_coalesce_opts *opts,
+			 const char *step_parent)
 {
 	char *pname;
 	int err, parent_fd;
@@ -218,7 +585,8 @@ vhd_util_coalesce_parent(const char *name, int sparse, int progress,
 		}
 	}
 
-	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, progress);
+	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, opts);
+	vhd_util_coalesce_checkpoint_close(opts, !err);
 
 	free(pname);
 	vhd_close(&vhd);
@@ -405,7 +773,8 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 			       vhd_context_t *ancestor, const uint64_t block)
 {
 	char *amap = NULL;
-	int i, dirty, err;
+	int dirty, err;
+	uint32_t i, end;
 
 	if (child->spb != ancestor->spb) {
 		err = -EINVAL;
@@ -422,13 +791,19 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 	if (err)
 		goto out;
 
-	for (i = 0; i < child->spb; i++) {
-		if (vhd_bitmap_test(child, cmap, i)) {
-			if (vhd_bitmap_test(ancestor, amap, i)) {
-				dirty = 1;
-				vhd_bitmap_clear(ancestor, amap, i);
-			}
+	dirty = 0;
+	i     = vhd_bitmap_find_set(child, cmap, 0, child->spb);
+
+	while (i < child->spb) {
+		end = vhd_bitmap_find_clear(child, cmap, i, child->spb);
+
+		for (i = vhd_bitmap_find_set(ancestor, amap, i, end); i < end;
+		     i = vhd_bitmap_find_set(ancestor, amap, i + 1, end)) {
+			dirty = 1;
+			vhd_bitmap_clear(ancestor, amap, i);
 		}
+
+		i = vhd_bitmap_find_set(child, cmap, end, child->spb);
 	}
 
 	if (dirty) {
@@ -488,8 +863,8 @@ out:
 }
 
 static int
-vhd_util_coalesce_ancestor(const char *cname,
-			   const char *aname, int sparse, int progress)
+vhd_util_coalesce_ancestor(const char *cname, const char *aname, int sparse,
+			   struct vhd_coalesce_opts *opts)
 {
 	uint64_t i;
 	int err, raw_fd;
@@ -519,7 +894,7 @@ vhd_util_coalesce_ancestor(const char *cname,
 		goto out;
 	}
 
-	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, progress);
+	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, opts);
 	if (err)
 		goto out;
 
@@ -531,18 +906,32 @@ vhd_util_coalesce_ancestor(const char *cname,
 	}
 
 out:
+	vhd_util_coalesce_checkpoint_close(opts, !err);
 	vhd_util_coalesce_free_chain(&chain);
 	return err;
 }
 
+/*
+ * Creates @name, or with @resume opens what an interrupted run left.
+ */
 static int
-vhd_util_coalesce_open_output(vhd_context_t *dst,
-			      vhd_context_t *src, const char *name, int flags)
+vhd_util_coalesce_open_output(vhd_context_t *dst, vhd_context_t *src,
+			      const char *name, int flags, int resume)
 {
 	int err;
 
 	err = access(name, F_OK);
-	if (!err) {
+	if (!err && resume) {
+		err = vhd_open(dst, name, VHD_OPEN_RDWR | flags);
+		if (err || dst->header.block_size != src->header.block_size ||
+		    dst->footer.curr_size != src->footer.curr_size) {
+			printf("error reopening %s: %d\n", name, (err ? : EINVAL));
+			if (!err)
+				vhd_close(dst);
+			return err ? : -EINVAL;
+		}
+		return 0;
+	} else if (!err) {
 		printf("%s already exists\n", name);
 		return -EEXIST;
 	} else if (errno != ENOENT) {
@@ -603,9 +992,9 @@ done:
 
 static int
 vhd_util_coalesce_out(const char *src_name, const char *dst_name,
-		      int sparse, int progress)
+		      int sparse, struct vhd_coalesce_opts *opts)
 {
-	uint64_t i;
+	uint64_t i, start;
 	int err, flags;
 	vhd_context_t src, dst;
 
@@ -613,9 +1002,22 @@ vhd_util_coalesce_out(const char *src_name, const char *dst_name,
 	if (err)
 		return err;
 
+	err = vhd_util_coalesce_checkpoint_open(opts, &src, &start);
+	if (err) {
+		vhd_close(&src);
+		return err;
+	}
+
+	if (start && access(dst_name, F_OK)) {
+		printf("%s is gone, starting over\n", dst_name);
+		start = 0;
+	}
+
 	flags = (sparse ? VHD_OPEN_IO_WRITE_SPARSE : 0);
-	err = vhd_util_coalesce_open_output(&dst, &src, dst_name, flags);
+	err = vhd_util_coalesce_open_output(&dst, &src, dst_name, flags,
+					    start > 0);
 	if (err) {
+		vhd_util_coalesce_checkpoint_close(opts, 0);
 		vhd_close(&src);
 		return err;
 	}
@@ -630,8 +1032,8 @@ vhd_util_coalesce_out(const char *src_name, const char *dst_name,
 			goto done;
 	}
 
-	for (i = 0; i < src.bat.entries; i++) {
-		if (progress) {
+	for (i = start; i < src.bat.entries; i++) {
+		if (opts->progress) {
 			printf("\r%6.2f%%",
 			       ((float)i / (float)src.bat.entries) * 100.0);
 			fflush(stdout);
@@ -639,16 +1041,24 @@ vhd_util_coalesce_out(const char *src_name, const char *dst_name,
 		err = vhd_util_coalesce_block_out(&dst, &src, i);
 		if (err)
 			goto done;
+
+		if (!((i + 1) % VHD_COALESCE_CHECKPOINT_BLOCKS)) {
+			err = vhd_util_coalesce_checkpoint(opts, dst.fd, i + 1);
+			if (err)
+				goto done;
+		}
 	}
 
 	err = 0;
 
-	if (progress)
+	if (opts->progress)
 		printf("\r100.00%%\n");
 
 done:
-	if (err)
+	/* keep the output of a journaled run for the next attempt */
+	if (err && !opts->journaled)
 		unlink(dst.file);
+	vhd_util_coalesce_checkpoint_close(opts, !err);
 	vhd_close(&src);
 	vhd_close(&dst);
 	return err;
@@ -658,6 +1068,7 @@ int
 vhd_util_coalesce(int argc, char **argv)
 {
 	char *name, *oname, *ancestor, *step_parent;
+	struct vhd_coalesce_opts opts;
 	int err, c, progress, sparse;
 
 	name        = NULL;
@@ -667,11 +1078,14 @@ vhd_util_coalesce(int argc, char **argv)
 	sparse      = 0;
 	progress    = 0;
 
+	memset(&opts, 0, sizeof(opts));
+	opts.depth  = VHD_COALESCE_DEPTH_DEFAULT;
+
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:o:a:x:sph")) != -1) {
+	while ((c = getopt(argc, argv, "n:o:a:x:j:r:c:sph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -691,6 +1105,17 @@ vhd_util_coalesce(int argc, char **argv)
 		case 'x':
 			step_parent = optarg;
 			break;
+		case 'j':
+			opts.depth = strtol(optarg, NULL, 10);
+			if (opts.depth < 1 || opts.depth > VHD_COALESCE_DEPTH_MAX)
+				goto usage;
+			break;
+		case 'r':
+			opts.rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			opts.jname = optarg;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -703,13 +1128,15 @@ vhd_util_coalesce(int argc, char **argv)
 	if (oname && ancestor)
 		goto usage;
 
+	opts.progress = progress;
+
 	if (oname)
-		err = vhd_util_coalesce_out(name, oname, sparse, progress);
+		err = vhd_util_coalesce_out(name, oname, sparse, &opts);
 	else if (ancestor)
 		err = vhd_util_coalesce_ancestor(name, ancestor,
-						 sparse, progress);
+						 sparse, &opts);
 	else
-		err = vhd_util_coalesce_parent(name, sparse, progress, step_parent);
+		err = vhd_util_coalesce_parent(name, sparse, &opts, step_parent);
 
 	if (err)
 		printf("error coalescing: %d\n", err);
@@ -719,6 +1146,8 @@ vhd_util_coalesce(int argc, char **argv)
 usage:
 	printf("options: <-n name> [-a ancestor] "
 	       "[-o output] [-s sparse] [-p progress] [-x custom parent] "
-	       "[-h help]\n");
+	       "[-j blocks in flight (default %d)] [-r max MiB/s read] "
+	       "[-c checkpoint journal, to resume an interrupted run] "
+	       "[-h help]\n", VHD_COALESCE_DEPTH_DEFAULT);
 	return -EINVAL;
 }
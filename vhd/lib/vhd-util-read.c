@@ -504,9 +504,9 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 			 int hex)
 {
 	char *buf;
-	uint64_t cur;
-	int i, err, bit;
-	uint32_t blk, bm_blk, sec;
+	int err;
+	uint64_t cur, last;
+	uint32_t blk, bm_blk, sec, end, i, set, clear;
 	int64_t s, r;
 
 	if (vhd_sectors_to_bytes(sector + count) > vhd->footer.curr_size) {
@@ -519,10 +519,12 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 	s = -1;
 	r = 0;
 
-	for (i = 0; i < count; i++) {
-		cur = sector + i;
+	/* runs are carried over from one block to the next */
+	for (cur = sector, last = sector + count; cur < last;
+	     cur += end - sec) {
 		blk = cur / vhd->spb;
 		sec = cur % vhd->spb;
+		end = MIN(vhd->spb, sec + (last - cur));
 
 		if (blk != bm_blk) {
 			bm_blk = blk;
@@ -536,21 +538,22 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 			}
 		}
 
-		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
-			bit = 0;
-		else
-			bit = vhd_bitmap_test(vhd, buf, sec);
+		for (i = sec; i < end; i = clear) {
+			set = (buf ? vhd_bitmap_find_set(vhd, buf, i, end) : end);
 
-		if (bit) {
-			if (r == 0)
-				s = cur;
-			r++;
-		} else {
-			if (r > 0) {
+			if (set != i && r > 0) {
 				printf("%s ", conv(hex, s));
 				printf("%s\n", conv(hex, r));
+				r = 0;
 			}
-			r = 0;
+
+			if (set == end)
+				break;
+
+			clear = vhd_bitmap_find_clear(vhd, buf, set, end);
+			if (r == 0)
+				s = (uint64_t)blk * vhd->spb + set;
+			r += clear - set;
 		}
 	}
 	if (r > 0) {
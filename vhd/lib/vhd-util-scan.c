@@ -30,6 +30,8 @@
 #include <limits.h>
 #include <libgen.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -45,12 +47,30 @@
 #define VHD_SCAN_VERBOSE     0x10
 #define VHD_SCAN_PARENTS     0x20
 #define VHD_SCAN_MARKERS     0x40
+#define VHD_SCAN_CACHE       0x80
 
 #define VHD_TYPE_RAW_FILE    0x01
 #define VHD_TYPE_VHD_FILE    0x02
 #define VHD_TYPE_RAW_VOLUME  0x04
 #define VHD_TYPE_VHD_VOLUME  0x08
 
+/*
+ * Targets are probed by a pool of threads, a window at a time. Results
+ * are printed, and parents queued, in target order, as they would be
+ * scanning one target at a time. The window bounds open descriptors.
+ */
+#define VHD_SCAN_THREADS_DEFAULT  8
+#define VHD_SCAN_THREADS_MAX      64
+#define VHD_SCAN_WINDOW           256
+
+/*
+ * With -C, what was read from each VHD is kept in a file for the next
+ * scan. A file is not opened while its inode, size and timestamps are
+ * unchanged. LVs have no such change counter: their footer and header
+ * are still read, and the parent is reused while those hash the same.
+ */
+#define VHD_SCAN_CACHE_MAGIC      "vhd-util-scan-cache 1"
+
 #define EPRINTF(_f, _a...)					\
 	do {							\
 		syslog(LOG_INFO, "%s: " _f, __func__, ##_a);	\
@@ -75,6 +95,12 @@ struct target {
 	uint64_t             start;
 	uint64_t             end;
 	uint8_t              type;
+
+	/* file targets: what the scan cache checks */
+	uint64_t             dev;
+	uint64_t             ino;
+	uint64_t             mtime;
+	uint64_t             ctime;
 };
 
 struct iterator {
@@ -91,6 +117,8 @@ struct vhd_image {
 	off64_t              size;
 	uint8_t              hidden;
 	char                 marker;
+	uint8_t              parent_raw;
+	uint64_t             hash;
 	int                  error;
 	char                *message;
 
@@ -112,9 +140,57 @@ struct vhd_scan {
 	struct vhd_image   **lists;
 };
 
+struct vhd_scan_job {
+	struct target        target;
+	vhd_context_t        vhd;
+	struct vhd_image     image;
+	int                  err;
+};
+
+struct vhd_scan_cache_entry {
+	char                *name;
+	char                *device;
+	char                *parent;
+	uint8_t              type;
+	uint8_t              fast;
+	uint8_t              hidden;
+	uint8_t              parent_raw;
+	int                  marker;      /* -1 if it wasn't read */
+	uint64_t             start;
+	uint64_t             size;
+	uint64_t             dev;
+	uint64_t             ino;
+	uint64_t             mtime;
+	uint64_t             ctime;
+	uint64_t             hash;
+	uint64_t             capacity;
+};
+
+struct vhd_scan_cache {
+	const char          *path;
+
+	/* loaded entries, sorted by name, read by the scan threads */
+	int                  cnt;
+	struct vhd_scan_cache_entry *entries;
+
+	/* entries of this scan, written back at the end */
+	int                  fresh_cnt;
+	int                  fresh_size;
+	struct vhd_scan_cache_entry *fresh;
+};
+
+struct vhd_scan_pool {
+	struct vhd_scan_job *jobs;
+	int                  cnt;
+	int                  next;
+	pthread_mutex_t      lock;
+};
+
 static int flags;
+static int threads = VHD_SCAN_THREADS_DEFAULT;
 static struct vg vg;
 static struct vhd_scan scan;
+static struct vhd_scan_cache cache;
 
 static int
 vhd_util_scan_pretty_allocate_list(int cnt)
@@ -437,6 +513,18 @@ vhd_util_scan_get_parent_locator(vhd_context_t *vhd)
 	return loc;
 }
 
+static inline uint64_t
+hash_bytes(uint64_t hash, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	/* FNV-1a */
+	while (size--)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+
+	return hash;
+}
+
 static inline int
 copy_name(char *dst, const char *src)
 {
@@ -695,6 +783,11 @@ vhd_util_scan_read_volume_headers(vhd_context_t *vhd, struct vhd_image *image)
 		vhd->bm_secs = secs_round_up_no_zero(vhd->spb >> 3);
 	}
 
+	image->hash = hash_bytes(0xcbf29ce484222325ULL,
+				 &vhd->footer, sizeof(vhd->footer));
+	image->hash = hash_bytes(image->hash,
+				 &vhd->header, sizeof(vhd->header));
+
 out:
 	free(buf);
 	return image->error;
@@ -739,7 +832,7 @@ vhd_util_scan_open_volume(vhd_context_t *vhd, struct vhd_image *image)
 }
 
 static int
-vhd_util_scan_open(vhd_context_t *vhd, struct vhd_image *image)
+vhd_util_scan_open_name(struct vhd_image *image)
 {
 	struct target *target;
 
@@ -761,7 +854,19 @@ vhd_util_scan_open(vhd_context_t *vhd, struct vhd_image *image)
 		}
 	}
 
-	if (target_volume(target->type))
+	return 0;
+}
+
+static int
+vhd_util_scan_open(vhd_context_t *vhd, struct vhd_image *image)
+{
+	int err;
+
+	err = vhd_util_scan_open_name(image);
+	if (err)
+		return err;
+
+	if (target_volume(image->target->type))
 		return vhd_util_scan_open_volume(vhd, image);
 	else
 		return vhd_util_scan_open_file(vhd, image);
@@ -790,6 +895,12 @@ vhd_util_scan_init_file_target(struct target *target,
 	target->start = 0;
 	target->size  = stats.st_size;
 	target->end   = stats.st_size;
+	target->dev   = stats.st_dev;
+	target->ino   = stats.st_ino;
+	target->mtime = stats.st_mtim.tv_sec * 1000000000ULL +
+		stats.st_mtim.tv_nsec;
+	target->ctime = stats.st_ctim.tv_sec * 1000000000ULL +
+		stats.st_ctim.tv_nsec;
 
 	return 0;
 }
@@ -944,13 +1055,12 @@ iterator_free(struct iterator *itr)
 }
 
 static void
-vhd_util_scan_add_parent(struct iterator *itr,
-			 vhd_context_t *vhd, struct vhd_image *image)
+vhd_util_scan_add_parent(struct iterator *itr, struct vhd_image *image)
 {
 	int err;
 	uint8_t type;
 
-	if (vhd_parent_raw(vhd))
+	if (image->parent_raw)
 		type = target_volume(image->target->type) ? 
 			VHD_TYPE_RAW_VOLUME : VHD_TYPE_RAW_FILE;
 	else
@@ -963,86 +1073,508 @@ vhd_util_scan_add_parent(struct iterator *itr,
 }
 
 static int
-vhd_util_scan_targets(int cnt, struct target *targets)
+vhd_util_scan_cache_compare(const void *lhs, const void *rhs)
+{
+	const struct vhd_scan_cache_entry *l = lhs, *r = rhs;
+
+	return strcmp(l->name, r->name);
+}
+
+static void
+vhd_util_scan_cache_free_entries(struct vhd_scan_cache_entry *entries,
+				 int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		free(entries[i].name);
+		free(entries[i].device);
+		free(entries[i].parent);
+	}
+
+	free(entries);
+}
+
+static void
+vhd_util_scan_cache_free(void)
+{
+	vhd_util_scan_cache_free_entries(cache.entries, cache.cnt);
+	vhd_util_scan_cache_free_entries(cache.fresh, cache.fresh_cnt);
+	memset(&cache, 0, sizeof(cache));
+}
+
+/*
+ * One entry per line: numeric fields, then name, device and parent
+ * separated by tabs.
+ */
+static int
+vhd_util_scan_cache_parse(struct vhd_scan_cache_entry *entry, char *line)
+{
+	int n;
+	char *name, *device, *parent;
+	unsigned int type, fast, hidden, parent_raw;
+
+	memset(entry, 0, sizeof(*entry));
+
+	n = 0;
+	if (sscanf(line, "%u %u %u %u %d %"SCNu64" %"SCNu64" %"SCNu64
+		   " %"SCNu64" %"SCNu64" %"SCNu64" %"SCNx64" %"SCNu64"%n",
+		   &type, &fast, &hidden, &parent_raw, &entry->marker,
+		   &entry->start, &entry->size, &entry->dev, &entry->ino,
+		   &entry->mtime, &entry->ctime, &entry->hash,
+		   &entry->capacity, &n) != 13 || line[n] != '\t')
+		return -EINVAL;
+
+	name   = line + n + 1;
+	device = strchr(name, '\t');
+	if (!device)
+		return -EINVAL;
+	*device++ = '\0';
+
+	parent = strchr(device, '\t');
+	if (!parent)
+		return -EINVAL;
+	*parent++ = '\0';
+	parent[strcspn(parent, "\n")] = '\0';
+
+	entry->type       = type;
+	entry->fast       = fast;
+	entry->hidden     = hidden;
+	entry->parent_raw = parent_raw;
+
+	entry->name   = strdup(name);
+	entry->device = strdup(device);
+	if (*parent)
+		entry->parent = strdup(parent);
+
+	if (!entry->name || !entry->device || (*parent && !entry->parent)) {
+		free(entry->name);
+		free(entry->device);
+		free(entry->parent);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * A missing or unreadable cache is not an error, the scan just starts
+ * from scratch.
+ */
+static int
+vhd_util_scan_cache_load(const char *path)
+{
+	FILE *f;
+	char *line;
+	size_t len;
+	int err, size;
+	struct vhd_scan_cache_entry *entries;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.path = path;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			EPRINTF("ignoring scan cache %s: %d\n", path, -errno);
+		return 0;
+	}
+
+	err  = 0;
+	size = 0;
+	line = NULL;
+	len  = 0;
+
+	if (getline(&line, &len, f) == -1 ||
+	    strcmp(line, VHD_SCAN_CACHE_MAGIC "\n")) {
+		EPRINTF("ignoring scan cache %s: bad header\n", path);
+		goto out;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		if (cache.cnt == size) {
+			size    = size ? size * 2 : 256;
+			entries = realloc(cache.entries,
+					  size * sizeof(*entries));
+			if (!entries) {
+				err = -ENOMEM;
+				goto out;
+			}
+			cache.entries = entries;
+		}
+
+		err = vhd_util_scan_cache_parse(cache.entries + cache.cnt,
+						line);
+		if (err == -ENOMEM)
+			goto out;
+		if (!err)
+			cache.cnt++;
+	}
+
+	err = 0;
+	qsort(cache.entries, cache.cnt, sizeof(*cache.entries),
+	      vhd_util_scan_cache_compare);
+
+out:
+	free(line);
+	fclose(f);
+	if (err)
+		vhd_util_scan_cache_free();
+	return err;
+}
+
+/*
+ * Returns the entry recorded for @target if it still applies.
+ */
+static struct vhd_scan_cache_entry *
+vhd_util_scan_cache_find(struct target *target)
+{
+	struct vhd_scan_cache_entry key, *entry;
+
+	if (!cache.cnt)
+		return NULL;
+
+	key.name = target->name;
+	entry = bsearch(&key, cache.entries, cache.cnt,
+			sizeof(*cache.entries), vhd_util_scan_cache_compare);
+	if (!entry)
+		return NULL;
+
+	if (entry->type != target->type ||
+	    entry->fast != !!(flags & VHD_SCAN_FAST) ||
+	    entry->start != target->start ||
+	    entry->size != target->size ||
+	    strcmp(entry->device, target->device))
+		return NULL;
+
+	if (target_volume(target->type))
+		return entry;
+
+	if (entry->dev != target->dev ||
+	    entry->ino != target->ino ||
+	    entry->mtime != target->mtime ||
+	    entry->ctime != target->ctime)
+		return NULL;
+
+	if ((flags & VHD_SCAN_MARKERS) && entry->marker < 0)
+		return NULL;
+
+	return entry;
+}
+
+static int
+vhd_util_scan_cache_hit(struct vhd_image *image,
+			struct vhd_scan_cache_entry *entry)
+{
+	int err;
+
+	err = vhd_util_scan_open_name(image);
+	if (err)
+		return err;
+
+	image->size       = image->target->size;
+	image->capacity   = entry->capacity;
+	image->hidden     = entry->hidden;
+	image->marker     = (flags & VHD_SCAN_MARKERS) ? entry->marker : 0;
+	image->parent_raw = entry->parent_raw;
+
+	if (entry->parent) {
+		image->parent = strdup(entry->parent);
+		if (!image->parent) {
+			image->message = "allocating parent";
+			image->error   = -ENOMEM;
+			return image->error;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Records a successfully scanned VHD. Runs on the main thread.
+ */
+static void
+vhd_util_scan_cache_add(struct vhd_image *image)
 {
-	int ret, err;
-	vhd_context_t vhd;
-	struct iterator itr;
 	struct target *target;
-	struct vhd_image image;
+	struct vhd_scan_cache_entry *entry;
+
+	target = image->target;
+
+	if (!target_vhd(target->type))
+		return;
+
+	/* names can't be stored if they contain field separators */
+	if (strpbrk(target->name, "\t\n") ||
+	    strpbrk(target->device, "\t\n") ||
+	    (image->parent && strpbrk(image->parent, "\t\n")))
+		return;
+
+	if (cache.fresh_cnt == cache.fresh_size) {
+		int size = cache.fresh_size ? cache.fresh_size * 2 : 256;
+
+		entry = realloc(cache.fresh, size * sizeof(*entry));
+		if (!entry)
+			return;
+
+		cache.fresh      = entry;
+		cache.fresh_size = size;
+	}
+
+	entry = cache.fresh + cache.fresh_cnt;
+	memset(entry, 0, sizeof(*entry));
+
+	entry->name   = strdup(target->name);
+	entry->device = strdup(target->device);
+	if (image->parent)
+		entry->parent = strdup(image->parent);
+
+	if (!entry->name || !entry->device ||
+	    (image->parent && !entry->parent)) {
+		free(entry->name);
+		free(entry->device);
+		free(entry->parent);
+		return;
+	}
+
+	entry->type       = target->type;
+	entry->fast       = !!(flags & VHD_SCAN_FAST);
+	entry->hidden     = image->hidden;
+	entry->parent_raw = image->parent_raw;
+	entry->marker     = (flags & VHD_SCAN_MARKERS) ? image->marker : -1;
+	entry->start      = target->start;
+	entry->size       = target->size;
+	entry->dev        = target->dev;
+	entry->ino        = target->ino;
+	entry->mtime      = target->mtime;
+	entry->ctime      = target->ctime;
+	entry->hash       = image->hash;
+	entry->capacity   = image->capacity;
+
+	cache.fresh_cnt++;
+}
+
+/*
+ * Replaces the cache with the entries of this scan. The file is renamed
+ * into place, so concurrent scans only ever see a complete cache.
+ */
+static int
+vhd_util_scan_cache_save(void)
+{
+	int i, err;
+	FILE *f;
+	char tmp[PATH_MAX];
+	struct vhd_scan_cache_entry *entry;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", cache.path, getpid()) >=
+	    sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	f = fopen(tmp, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, VHD_SCAN_CACHE_MAGIC "\n");
+
+	for (i = 0; i < cache.fresh_cnt; i++) {
+		entry = cache.fresh + i;
+		fprintf(f, "%u %u %u %u %d %"PRIu64" %"PRIu64" %"PRIu64
+			" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIx64" %"PRIu64
+			"\t%s\t%s\t%s\n",
+			entry->type, entry->fast, entry->hidden,
+			entry->parent_raw, entry->marker, entry->start,
+			entry->size, entry->dev, entry->ino, entry->mtime,
+			entry->ctime, entry->hash, entry->capacity,
+			entry->name, entry->device,
+			entry->parent ? : "");
+	}
 
-	ret = 0;
 	err = 0;
+	if (fflush(f) || fsync(fileno(f)))
+		err = -errno;
+	if (fclose(f) && !err)
+		err = -errno;
+	if (!err && rename(tmp, cache.path))
+		err = -errno;
+	if (err)
+		unlink(tmp);
 
-	err = iterator_init(&itr, cnt, targets);
+	return err;
+}
+
+/*
+ * Reads everything printed about @image. Runs on the scan threads.
+ */
+static int
+vhd_util_scan_target(vhd_context_t *vhd, struct vhd_image *image)
+{
+	int err;
+	struct vhd_scan_cache_entry *entry;
+
+	entry = vhd_util_scan_cache_find(image->target);
+	if (entry && !target_volume(image->target->type))
+		return vhd_util_scan_cache_hit(image, entry);
+
+	err = vhd_util_scan_open(vhd, image);
 	if (err)
 		return err;
 
-	while ((target = iterator_next(&itr))) {
-		memset(&vhd, 0, sizeof(vhd));
-		memset(&image, 0, sizeof(image));
+	err = vhd_util_scan_get_size(vhd, image);
+	if (err) {
+		image->message = "getting physical size";
+		image->error   = err;
+		return err;
+	}
 
-		image.target = target;
+	err = vhd_util_scan_get_hidden(vhd, image);
+	if (err) {
+		image->message = "checking 'hidden' field";
+		image->error   = err;
+		return err;
+	}
 
-		err = vhd_util_scan_open(&vhd, &image);
+	if (flags & VHD_SCAN_MARKERS) {
+		err = vhd_util_scan_get_marker(vhd, image);
 		if (err) {
-			ret = -EAGAIN;
-			goto end;
+			image->message = "checking marker";
+			image->error   = err;
+			return err;
 		}
+	}
 
-		err = vhd_util_scan_get_size(&vhd, &image);
+	if (vhd->footer.type == HD_TYPE_DIFF) {
+		if (entry && entry->hash == image->hash && entry->parent) {
+			image->parent = strdup(entry->parent);
+			err = image->parent ? 0 : -ENOMEM;
+		} else
+			err = vhd_util_scan_get_parent(vhd, image);
 		if (err) {
-			ret           = -EAGAIN;
-			image.message = "getting physical size";
-			image.error   = err;
-			goto end;
+			image->message = "getting parent";
+			image->error   = err;
+			return err;
 		}
+		image->parent_raw = vhd_parent_raw(vhd);
+	}
 
-		err = vhd_util_scan_get_hidden(&vhd, &image);
-		if (err) {
-			ret           = -EAGAIN;
-			image.message = "checking 'hidden' field";
-			image.error   = err;
-			goto end;
-		}
+	return 0;
+}
 
-		if (flags & VHD_SCAN_MARKERS) {
-			err = vhd_util_scan_get_marker(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "checking marker";
-				image.error   = err;
-				goto end;
-			}
-		}
+static void *
+vhd_util_scan_worker(void *arg)
+{
+	struct vhd_scan_pool *pool = arg;
+	struct vhd_scan_job *job;
 
-		if (vhd.footer.type == HD_TYPE_DIFF) {
-			err = vhd_util_scan_get_parent(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "getting parent";
-				image.error   = err;
-				goto end;
-			}
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		job = (pool->next < pool->cnt ? pool->jobs + pool->next++ : NULL);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!job)
+			break;
+
+		job->err = vhd_util_scan_target(&job->vhd, &job->image);
+	}
+
+	return NULL;
+}
+
+/*
+ * Probes @cnt jobs on up to @threads threads, this one included.
+ */
+static void
+vhd_util_scan_run(struct vhd_scan_job *jobs, int cnt)
+{
+	int i, n;
+	pthread_t tids[VHD_SCAN_THREADS_MAX];
+	struct vhd_scan_pool pool;
+
+	pool.jobs = jobs;
+	pool.cnt  = cnt;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	for (n = 0; n < MIN(threads, cnt) - 1; n++)
+		if (pthread_create(&tids[n], NULL, vhd_util_scan_worker, &pool))
+			break;
+
+	vhd_util_scan_worker(&pool);
+
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+}
+
+static int
+vhd_util_scan_targets(int cnt, struct target *targets)
+{
+	int i, n, ret, err;
+	struct iterator itr;
+	struct target *target;
+	struct vhd_scan_job *jobs, *job;
+
+	ret = 0;
+	err = 0;
+
+	jobs = calloc(VHD_SCAN_WINDOW, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	err = iterator_init(&itr, cnt, targets);
+	if (err) {
+		free(jobs);
+		return err;
+	}
+
+	for (;;) {
+		/* jobs keep their own copy: adding parents moves targets */
+		for (n = 0; n < VHD_SCAN_WINDOW; n++) {
+			target = iterator_next(&itr);
+			if (!target)
+				break;
+
+			job = jobs + n;
+			memset(job, 0, sizeof(*job));
+			job->target       = *target;
+			job->image.target = &job->target;
 		}
 
-	end:
-		vhd_util_scan_print_image(&image);
+		if (!n)
+			break;
+
+		vhd_util_scan_run(jobs, n);
 
-		if (flags & VHD_SCAN_PARENTS && image.parent)
-			vhd_util_scan_add_parent(&itr, &vhd, &image);
+		for (i = 0; i < n; i++) {
+			job = jobs + i;
 
-		if (vhd.file)
-			vhd_close(&vhd);
-		if (image.name != target->name)
-			free(image.name);
-		free(image.parent);
+			if (!err || (flags & VHD_SCAN_NOFAIL)) {
+				err = job->err;
+				if (err)
+					ret = -EAGAIN;
+
+				vhd_util_scan_print_image(&job->image);
+
+				if (!job->err && (flags & VHD_SCAN_CACHE))
+					vhd_util_scan_cache_add(&job->image);
+
+				if (flags & VHD_SCAN_PARENTS && job->image.parent)
+					vhd_util_scan_add_parent(&itr, &job->image);
+			}
+
+			if (job->vhd.file)
+				vhd_close(&job->vhd);
+			if (job->image.name != job->target.name)
+				free(job->image.name);
+			free(job->image.parent);
+		}
 
 		if (err && !(flags & VHD_SCAN_NOFAIL))
 			break;
 	}
 
 	iterator_free(&itr);
+	free(jobs);
 
 	if (flags & VHD_SCAN_NOFAIL)
 		return ret;
@@ -1281,18 +1813,20 @@ int
 vhd_util_scan(int argc, char **argv)
 {
 	int c, err, cnt;
-	char *filter, *volume;
+	char *filter, *volume, *cache_path;
 	struct target *targets;
 
-	cnt     = 0;
-	err     = 0;
-	flags   = 0;
-	filter  = NULL;
-	volume  = NULL;
-	targets = NULL;
+	cnt        = 0;
+	err        = 0;
+	flags      = 0;
+	threads    = VHD_SCAN_THREADS_DEFAULT;
+	filter     = NULL;
+	volume     = NULL;
+	targets    = NULL;
+	cache_path = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "m:fcl:pavMh")) != -1) {
+	while ((c = getopt(argc, argv, "m:fcl:pavMj:C:h")) != -1) {
 		switch (c) {
 		case 'm':
 			filter = optarg;
@@ -1319,6 +1853,17 @@ vhd_util_scan(int argc, char **argv)
 		case 'M':
 			flags |= VHD_SCAN_MARKERS;
 			break;
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			if (threads < 1 || threads > VHD_SCAN_THREADS_MAX) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
+		case 'C':
+			cache_path = optarg;
+			flags |= VHD_SCAN_CACHE;
+			break;
 		case 'h':
 			goto usage;
 		default:
@@ -1345,11 +1890,29 @@ vhd_util_scan(int argc, char **argv)
 	if (!cnt)
 		return 0;
 
+	if (flags & VHD_SCAN_CACHE) {
+		err = vhd_util_scan_cache_load(cache_path);
+		if (err) {
+			printf("scan failed: %d\n", err);
+			free(targets);
+			lvm_free_vg(&vg);
+			return err;
+		}
+	}
+
 	if (flags & VHD_SCAN_PRETTY)
 		err = vhd_util_scan_targets_pretty(cnt, targets);
 	else
 		err = vhd_util_scan_targets(cnt, targets);
 
+	if (flags & VHD_SCAN_CACHE) {
+		int cerr = vhd_util_scan_cache_save();
+		if (cerr)
+			EPRINTF("failed to write scan cache %s: %d\n",
+				cache_path, cerr);
+		vhd_util_scan_cache_free();
+	}
+
 	free(targets);
 	lvm_free_vg(&vg);
 
@@ -1359,6 +1922,8 @@ usage:
 	printf("usage: [OPTIONS] FILES\n"
 	       "options: [-m match filter] [-f fast] [-c continue on failure] "
 	       "[-l LVM volume] [-p pretty print] [-a scan parents] "
-	       "[-v verbose] [-h help] [-M show markers]\n");
+	       "[-v verbose] [-h help] [-M show markers] "
+	       "[-j threads (default %d)] [-C metadata cache file]\n",
+	       VHD_SCAN_THREADS_DEFAULT);
 	return err;
 }